@@ -83,7 +83,7 @@ arrow_left_fill (char *buf, size_t len, char fill)
     }
 }
 
-static int __saved_errno = 0;
+static __thread int __saved_errno = 0;
 
 void
 arrow_push_errno (void)
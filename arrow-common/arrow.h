@@ -106,6 +106,7 @@ void arrow_pop_errno(void);
 #define arrow_id_cmp(i1,i2) (memcmp (i1, i2, sizeof (arrow_id_t)))
 
 #define MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
 
 int arrow_popen (const char *cmd, char * const argv[], pid_t *pid, FILE **out, FILE **in);
 pid_t arrow_pclose (pid_t pid, FILE *out, FILE *in, int *status);
@@ -0,0 +1,424 @@
+/* blake3.c -- the BLAKE3 hash function
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+#include "blake3.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <smmintrin.h>
+#endif
+
+#define CHUNK_START 1
+#define CHUNK_END   2
+#define PARENT      4
+#define ROOT        8
+
+static const uint32_t blake3_iv[8] =
+  {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+  };
+
+/* The message word order for each of the seven rounds. */
+static const uint8_t blake3_schedule[7][16] =
+  {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    {  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+    {  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+    { 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+    { 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+    {  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+    { 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 }
+  };
+
+/*
+ * Compress one block into out[16]; the first eight words are the new
+ * chaining value, all sixteen are root output.
+ */
+typedef void (*blake3_compress_fn) (const uint32_t cv[8], const uint8_t *block,
+                                    uint8_t block_len, uint64_t counter,
+                                    uint8_t flags, uint32_t out[16]);
+
+static blake3_compress_fn blake3_compress_impl = NULL;
+
+inline static uint32_t
+load32 (const uint8_t *p)
+{
+  return ((uint32_t) p[0]) | ((uint32_t) p[1] << 8)
+    | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+inline static void
+store32 (uint8_t *p, uint32_t w)
+{
+  p[0] = (uint8_t) w;
+  p[1] = (uint8_t) (w >> 8);
+  p[2] = (uint8_t) (w >> 16);
+  p[3] = (uint8_t) (w >> 24);
+}
+
+inline static uint32_t
+rotr32 (uint32_t w, int c)
+{
+  return (w >> c) | (w << (32 - c));
+}
+
+#define G(a,b,c,d,x,y) do {                     \
+    s[a] = s[a] + s[b] + (x);                   \
+    s[d] = rotr32 (s[d] ^ s[a], 16);            \
+    s[c] = s[c] + s[d];                         \
+    s[b] = rotr32 (s[b] ^ s[c], 12);            \
+    s[a] = s[a] + s[b] + (y);                   \
+    s[d] = rotr32 (s[d] ^ s[a], 8);             \
+    s[c] = s[c] + s[d];                         \
+    s[b] = rotr32 (s[b] ^ s[c], 7);             \
+  } while (0)
+
+static void
+blake3_compress_portable (const uint32_t cv[8], const uint8_t *block,
+                          uint8_t block_len, uint64_t counter, uint8_t flags,
+                          uint32_t out[16])
+{
+  uint32_t m[16], s[16];
+  int i, r;
+
+  for (i = 0; i < 16; i++)
+    m[i] = load32 (block + 4 * i);
+  for (i = 0; i < 8; i++)
+    s[i] = cv[i];
+  for (i = 0; i < 4; i++)
+    s[i + 8] = blake3_iv[i];
+  s[12] = (uint32_t) counter;
+  s[13] = (uint32_t) (counter >> 32);
+  s[14] = block_len;
+  s[15] = flags;
+
+  for (r = 0; r < 7; r++)
+    {
+      const uint8_t *o = blake3_schedule[r];
+      G (0, 4,  8, 12, m[o[ 0]], m[o[ 1]]);
+      G (1, 5,  9, 13, m[o[ 2]], m[o[ 3]]);
+      G (2, 6, 10, 14, m[o[ 4]], m[o[ 5]]);
+      G (3, 7, 11, 15, m[o[ 6]], m[o[ 7]]);
+      G (0, 5, 10, 15, m[o[ 8]], m[o[ 9]]);
+      G (1, 6, 11, 12, m[o[10]], m[o[11]]);
+      G (2, 7,  8, 13, m[o[12]], m[o[13]]);
+      G (3, 4,  9, 14, m[o[14]], m[o[15]]);
+    }
+
+  for (i = 0; i < 8; i++)
+    {
+      out[i] = s[i] ^ s[i + 8];
+      out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+#if defined(__x86_64__)
+/*
+ * The same, with each row of the state in an SSE register, so that the
+ * four column (then diagonal) mixes run side by side.
+ */
+#define ROT16(x) _mm_shuffle_epi8 ((x), rot16)
+#define ROT12(x) _mm_or_si128 (_mm_srli_epi32 ((x), 12), _mm_slli_epi32 ((x), 20))
+#define ROT8(x)  _mm_shuffle_epi8 ((x), rot8)
+#define ROT7(x)  _mm_or_si128 (_mm_srli_epi32 ((x), 7), _mm_slli_epi32 ((x), 25))
+
+#define G4(x,y) do {                                            \
+    row0 = _mm_add_epi32 (_mm_add_epi32 (row0, row1), (x));     \
+    row3 = ROT16 (_mm_xor_si128 (row3, row0));                  \
+    row2 = _mm_add_epi32 (row2, row3);                          \
+    row1 = ROT12 (_mm_xor_si128 (row1, row2));                  \
+    row0 = _mm_add_epi32 (_mm_add_epi32 (row0, row1), (y));     \
+    row3 = ROT8 (_mm_xor_si128 (row3, row0));                   \
+    row2 = _mm_add_epi32 (row2, row3);                          \
+    row1 = ROT7 (_mm_xor_si128 (row1, row2));                   \
+  } while (0)
+
+__attribute__((target ("sse4.1")))
+static void
+blake3_compress_sse41 (const uint32_t cv[8], const uint8_t *block,
+                       uint8_t block_len, uint64_t counter, uint8_t flags,
+                       uint32_t out[16])
+{
+  const __m128i rot16 = _mm_setr_epi8 (2, 3, 0, 1, 6, 7, 4, 5,
+                                       10, 11, 8, 9, 14, 15, 12, 13);
+  const __m128i rot8 = _mm_setr_epi8 (1, 2, 3, 0, 5, 6, 7, 4,
+                                      9, 10, 11, 8, 13, 14, 15, 12);
+  __m128i row0, row1, row2, row3, cv0, cv1;
+  uint32_t m[16];
+  int r;
+
+  /* x86 is little-endian, as BLAKE3's words are. */
+  memcpy (m, block, sizeof (m));
+  cv0 = _mm_loadu_si128 ((const __m128i *) &cv[0]);
+  cv1 = _mm_loadu_si128 ((const __m128i *) &cv[4]);
+  row0 = cv0;
+  row1 = cv1;
+  row2 = _mm_loadu_si128 ((const __m128i *) blake3_iv);
+  row3 = _mm_setr_epi32 ((int) (uint32_t) counter, (int) (uint32_t) (counter >> 32),
+                         block_len, flags);
+
+  for (r = 0; r < 7; r++)
+    {
+      const uint8_t *o = blake3_schedule[r];
+      G4 (_mm_setr_epi32 (m[o[ 0]], m[o[ 2]], m[o[ 4]], m[o[ 6]]),
+          _mm_setr_epi32 (m[o[ 1]], m[o[ 3]], m[o[ 5]], m[o[ 7]]));
+      /* Line the diagonals up as columns. */
+      row1 = _mm_shuffle_epi32 (row1, _MM_SHUFFLE (0, 3, 2, 1));
+      row2 = _mm_shuffle_epi32 (row2, _MM_SHUFFLE (1, 0, 3, 2));
+      row3 = _mm_shuffle_epi32 (row3, _MM_SHUFFLE (2, 1, 0, 3));
+      G4 (_mm_setr_epi32 (m[o[ 8]], m[o[10]], m[o[12]], m[o[14]]),
+          _mm_setr_epi32 (m[o[ 9]], m[o[11]], m[o[13]], m[o[15]]));
+      row1 = _mm_shuffle_epi32 (row1, _MM_SHUFFLE (2, 1, 0, 3));
+      row2 = _mm_shuffle_epi32 (row2, _MM_SHUFFLE (1, 0, 3, 2));
+      row3 = _mm_shuffle_epi32 (row3, _MM_SHUFFLE (0, 3, 2, 1));
+    }
+
+  _mm_storeu_si128 ((__m128i *) &out[0], _mm_xor_si128 (row0, row2));
+  _mm_storeu_si128 ((__m128i *) &out[4], _mm_xor_si128 (row1, row3));
+  _mm_storeu_si128 ((__m128i *) &out[8], _mm_xor_si128 (row2, cv0));
+  _mm_storeu_si128 ((__m128i *) &out[12], _mm_xor_si128 (row3, cv1));
+}
+#endif
+
+static void
+blake3_setup (void)
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse4.1"))
+    {
+      blake3_compress_impl = blake3_compress_sse41;
+      return;
+    }
+#endif
+  blake3_compress_impl = blake3_compress_portable;
+}
+
+static void
+chunk_init (blake3_chunk_state_t *chunk, uint64_t counter)
+{
+  memcpy (chunk->cv, blake3_iv, sizeof (chunk->cv));
+  chunk->chunk_counter = counter;
+  chunk->block_len = 0;
+  chunk->blocks_compressed = 0;
+}
+
+inline static size_t
+chunk_len (const blake3_chunk_state_t *chunk)
+{
+  return BLAKE3_BLOCK_LEN * (size_t) chunk->blocks_compressed + chunk->block_len;
+}
+
+inline static uint8_t
+chunk_start_flag (const blake3_chunk_state_t *chunk)
+{
+  return chunk->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void
+chunk_compress (blake3_chunk_state_t *chunk, const uint8_t *block)
+{
+  uint32_t out[16];
+
+  blake3_compress_impl (chunk->cv, block, BLAKE3_BLOCK_LEN, chunk->chunk_counter,
+                        chunk_start_flag (chunk), out);
+  memcpy (chunk->cv, out, sizeof (chunk->cv));
+  chunk->blocks_compressed++;
+}
+
+/*
+ * Add input to a chunk; never more than fills it. The last block is
+ * kept back, as it's compressed differently once we know it's last.
+ */
+static void
+chunk_update (blake3_chunk_state_t *chunk, const uint8_t *p, size_t len)
+{
+  while (len > 0)
+    {
+      size_t take;
+
+      if (chunk->block_len == BLAKE3_BLOCK_LEN)
+        {
+          chunk_compress (chunk, chunk->block);
+          chunk->block_len = 0;
+        }
+      if (chunk->block_len == 0 && len > BLAKE3_BLOCK_LEN)
+        {
+          /* Straight from the input, without copying. */
+          chunk_compress (chunk, p);
+          p += BLAKE3_BLOCK_LEN;
+          len -= BLAKE3_BLOCK_LEN;
+          continue;
+        }
+      take = BLAKE3_BLOCK_LEN - chunk->block_len;
+      if (take > len)
+        take = len;
+      memcpy (chunk->block + chunk->block_len, p, take);
+      chunk->block_len += take;
+      p += take;
+      len -= take;
+    }
+}
+
+/* What's left to compress to finish a node: a block, and how. */
+typedef struct blake3_output_s
+{
+  uint32_t cv[8];
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint64_t counter;
+  uint8_t block_len;
+  uint8_t flags;
+} blake3_output_t;
+
+static void
+chunk_output (const blake3_chunk_state_t *chunk, blake3_output_t *output)
+{
+  memcpy (output->cv, chunk->cv, sizeof (output->cv));
+  memset (output->block, 0, BLAKE3_BLOCK_LEN);
+  memcpy (output->block, chunk->block, chunk->block_len);
+  output->counter = chunk->chunk_counter;
+  output->block_len = chunk->block_len;
+  output->flags = chunk_start_flag (chunk) | CHUNK_END;
+}
+
+static void
+parent_output (const uint32_t left[8], const uint32_t right[8], blake3_output_t *output)
+{
+  int i;
+
+  memcpy (output->cv, blake3_iv, sizeof (output->cv));
+  for (i = 0; i < 8; i++)
+    {
+      store32 (output->block + 4 * i, left[i]);
+      store32 (output->block + 32 + 4 * i, right[i]);
+    }
+  output->counter = 0;
+  output->block_len = BLAKE3_BLOCK_LEN;
+  output->flags = PARENT;
+}
+
+static void
+output_cv (const blake3_output_t *output, uint32_t cv[8])
+{
+  uint32_t out[16];
+
+  blake3_compress_impl (output->cv, output->block, output->block_len,
+                        output->counter, output->flags, out);
+  memcpy (cv, out, 8 * sizeof (uint32_t));
+}
+
+void
+blake3_init (blake3_hasher_t *hasher)
+{
+  /* Racing threads all pick the same function, so this needs no lock. */
+  if (blake3_compress_impl == NULL)
+    blake3_setup ();
+  chunk_init (&hasher->chunk, 0);
+  hasher->cv_stack_len = 0;
+}
+
+/*
+ * Push a finished chunk's chaining value, first merging it with the
+ * subtrees it completes: as many as there are trailing zero bits in
+ * the number of chunks so far.
+ */
+static void
+push_chunk_cv (blake3_hasher_t *hasher, uint32_t cv[8], uint64_t total_chunks)
+{
+  blake3_output_t output;
+
+  while ((total_chunks & 1) == 0)
+    {
+      hasher->cv_stack_len--;
+      parent_output (hasher->cv_stack[hasher->cv_stack_len], cv, &output);
+      output_cv (&output, cv);
+      total_chunks >>= 1;
+    }
+  memcpy (hasher->cv_stack[hasher->cv_stack_len], cv, 8 * sizeof (uint32_t));
+  hasher->cv_stack_len++;
+}
+
+void
+blake3_update (blake3_hasher_t *hasher, const void *buf, size_t len)
+{
+  const uint8_t *p = (const uint8_t *) buf;
+
+  while (len > 0)
+    {
+      size_t take;
+
+      /* Only finish a chunk once there's more input after it; the
+         last chunk is finished differently. */
+      if (chunk_len (&hasher->chunk) == BLAKE3_CHUNK_LEN)
+        {
+          blake3_output_t output;
+          uint32_t cv[8];
+          uint64_t total = hasher->chunk.chunk_counter + 1;
+
+          chunk_output (&hasher->chunk, &output);
+          output_cv (&output, cv);
+          push_chunk_cv (hasher, cv, total);
+          chunk_init (&hasher->chunk, total);
+        }
+      take = BLAKE3_CHUNK_LEN - chunk_len (&hasher->chunk);
+      if (take > len)
+        take = len;
+      chunk_update (&hasher->chunk, p, take);
+      p += take;
+      len -= take;
+    }
+}
+
+void
+blake3_final (const blake3_hasher_t *hasher, uint8_t *out, size_t outlen)
+{
+  blake3_output_t output;
+  uint32_t words[16];
+  uint64_t counter = 0;
+  int i, remaining;
+
+  chunk_output (&hasher->chunk, &output);
+  for (remaining = hasher->cv_stack_len; remaining > 0; remaining--)
+    {
+      uint32_t cv[8];
+      output_cv (&output, cv);
+      parent_output (hasher->cv_stack[remaining - 1], cv, &output);
+    }
+
+  /* Root output, a block at a time. */
+  while (outlen > 0)
+    {
+      uint8_t block[BLAKE3_BLOCK_LEN];
+      size_t take = outlen < BLAKE3_BLOCK_LEN ? outlen : BLAKE3_BLOCK_LEN;
+
+      blake3_compress_impl (output.cv, output.block, output.block_len, counter,
+                            output.flags | ROOT, words);
+      for (i = 0; i < 16; i++)
+        store32 (block + 4 * i, words[i]);
+      memcpy (out, block, take);
+      out += take;
+      outlen -= take;
+      counter++;
+    }
+}
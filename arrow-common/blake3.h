@@ -0,0 +1,62 @@
+/* blake3.h -- the BLAKE3 hash function
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+
+#ifndef __BLAKE3_H__
+#define __BLAKE3_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+typedef struct blake3_chunk_state_s
+{
+  uint32_t cv[8];
+  uint64_t chunk_counter;
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint8_t block_len;
+  uint8_t blocks_compressed;
+} blake3_chunk_state_t;
+
+typedef struct blake3_hasher_s
+{
+  blake3_chunk_state_t chunk;
+  uint8_t cv_stack_len;
+  uint32_t cv_stack[BLAKE3_MAX_DEPTH][8]; /**< Subtrees not yet merged. */
+} blake3_hasher_t;
+
+/**
+ * Hash with BLAKE3 (unkeyed), incrementally. The compression function
+ * uses SSE4.1 when the CPU has it, and plain C otherwise; both give the
+ * same result. Any output length is allowed; shorter outputs are
+ * prefixes of longer ones.
+ */
+void blake3_init (blake3_hasher_t *hasher);
+void blake3_update (blake3_hasher_t *hasher, const void *buf, size_t len);
+void blake3_final (const blake3_hasher_t *hasher, uint8_t *out, size_t outlen);
+
+#endif /* __BLAKE3_H__ */
@@ -57,4 +57,16 @@ int cbuf_alloc (circular_buffer_t * cbuf, size_t size);
 	MD5_Final ((digest), (md5));										\
   } while (0)
 
+/**
+ * Digest a circular buffer with the given strong hash (see hash.h).
+ */
+#define cbuf_hash(buf,ctx,hash,digest) do {								\
+	arrow_hash_init ((ctx), (hash));									\
+	arrow_hash_update ((ctx), &((buf)->buffer[(buf)->idx]),				\
+					   (buf)->size - (buf)->idx);						\
+	if ((buf)->idx != 0)												\
+	  arrow_hash_update ((ctx), (buf)->buffer, (buf)->idx);				\
+	arrow_hash_final ((ctx), (digest));									\
+  } while (0)
+
 #endif /* __CBUF_H__ */
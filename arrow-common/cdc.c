@@ -0,0 +1,93 @@
+/* cdc.c -- content-defined chunking
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#include "cdc.h"
+
+/*
+ * This is FastCDC's cut-point search. The Gear hash is
+ * h = (h << 1) + gear[byte], so bit k of h depends only on the last
+ * k + 1 bytes, and the top bits see a 64 byte window. Hashing starts
+ * CDC_MIN_CHUNK_SIZE bytes in, since no cut can come before that. Up
+ * to the average size a cut needs two more zero bits than the average
+ * calls for, and after it two fewer ("normalized chunking"), which
+ * pulls chunk sizes in towards the average.
+ */
+#define CDC_AVG_BITS (__builtin_ctz (CDC_AVG_CHUNK_SIZE))
+#define CDC_MASK(bits) (~UINT64_C (0) << (64 - (bits)))
+
+static uint64_t gear[256];
+static int gear_ready = 0;
+
+/* The table is fixed forever: changing it moves every cut, and no
+   chunk would match one cut before the change. So it's generated
+   from a constant seed (with splitmix64) rather than at random. */
+static void
+gear_setup (void)
+{
+  uint64_t x = UINT64_C (0x6172726f77636463);  /* "arrowcdc" */
+  int i;
+
+  for (i = 0; i < 256; i++)
+    {
+      uint64_t z = (x += UINT64_C (0x9e3779b97f4a7c15));
+      z = (z ^ (z >> 30)) * UINT64_C (0xbf58476d1ce4e5b9);
+      z = (z ^ (z >> 27)) * UINT64_C (0x94d049bb133111eb);
+      gear[i] = z ^ (z >> 31);
+    }
+  /* Racing threads fill in the same table; see crc32c. */
+  __sync_synchronize ();
+  gear_ready = 1;
+}
+
+size_t
+cdc_cut (const uint8_t *buf, size_t len)
+{
+  const uint64_t mask_s = CDC_MASK (CDC_AVG_BITS + 2);
+  const uint64_t mask_l = CDC_MASK (CDC_AVG_BITS - 2);
+  size_t normal = CDC_AVG_CHUNK_SIZE;
+  size_t i = CDC_MIN_CHUNK_SIZE;
+  uint64_t h = 0;
+
+  if (len <= CDC_MIN_CHUNK_SIZE)
+    return len;
+  if (len > CDC_MAX_CHUNK_SIZE)
+    len = CDC_MAX_CHUNK_SIZE;
+  if (normal > len)
+    normal = len;
+  if (!gear_ready)
+    gear_setup ();
+
+  for (; i < normal; i++)
+    {
+      h = (h << 1) + gear[buf[i]];
+      if ((h & mask_s) == 0)
+        return i + 1;
+    }
+  for (; i < len; i++)
+    {
+      h = (h << 1) + gear[buf[i]];
+      if ((h & mask_l) == 0)
+        return i + 1;
+    }
+  return len;
+}
@@ -0,0 +1,51 @@
+/* cdc.h -- content-defined chunking
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+
+
+#ifndef __CDC_H__
+#define __CDC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Chunk size bounds for content-defined chunking. Cuts fall where a
+ * Gear hash of the preceding 64 bytes has enough zero bits, so they
+ * move with the data when bytes are inserted or removed, and the
+ * chunks after an edit are the same chunks as before it. The average
+ * must be a power of two.
+ */
+#define CDC_MIN_CHUNK_SIZE 512
+#define CDC_AVG_CHUNK_SIZE 2048
+#define CDC_MAX_CHUNK_SIZE 8192
+
+/**
+ * Return the length of the first chunk of the len bytes at buf, which
+ * is len itself if len is at most CDC_MIN_CHUNK_SIZE. If len is less
+ * than CDC_MAX_CHUNK_SIZE the buffer must hold the rest of the input,
+ * or the cut may land early.
+ */
+size_t cdc_cut (const uint8_t *buf, size_t len);
+
+#endif /* __CDC_H__ */
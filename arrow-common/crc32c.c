@@ -0,0 +1,103 @@
+/* crc32c.c -- CRC-32C (Castagnoli) checksums
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78  /* Reversed Castagnoli polynomial. */
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_impl) (uint32_t, const uint8_t *, size_t) = NULL;
+
+static uint32_t
+crc32c_sw (uint32_t crc, const uint8_t *p, size_t len)
+{
+  while (len--)
+    crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target ("sse4.2")))
+static uint32_t
+crc32c_sse42 (uint32_t crc, const uint8_t *p, size_t len)
+{
+  uint64_t c = crc;
+
+  while (len > 0 && ((uintptr_t) p & 7) != 0)
+    {
+      c = _mm_crc32_u8 ((uint32_t) c, *p++);
+      len--;
+    }
+  while (len >= 8)
+    {
+      c = _mm_crc32_u64 (c, *(const uint64_t *) p);
+      p += 8;
+      len -= 8;
+    }
+  while (len > 0)
+    {
+      c = _mm_crc32_u8 ((uint32_t) c, *p++);
+      len--;
+    }
+  return (uint32_t) c;
+}
+#endif
+
+static void
+crc32c_setup (void)
+{
+  uint32_t i, j, c;
+
+  for (i = 0; i < 256; i++)
+    {
+      c = i;
+      for (j = 0; j < 8; j++)
+        c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      crc32c_table[i] = c;
+    }
+
+#if defined(__x86_64__)
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse4.2"))
+    {
+      crc32c_impl = crc32c_sse42;
+      return;
+    }
+#endif
+  crc32c_impl = crc32c_sw;
+}
+
+uint32_t
+crc32c (uint32_t crc, const void *buf, size_t len)
+{
+  /* Racing threads all compute the same table and pick the same
+     function, so the setup needs no lock. */
+  if (crc32c_impl == NULL)
+    crc32c_setup ();
+  return ~crc32c_impl (~crc, (const uint8_t *) buf, len);
+}
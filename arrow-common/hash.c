@@ -0,0 +1,180 @@
+/* hash.c -- strong hashes for chunk keys
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+#include "hash.h"
+#include "md5mb.h"
+#include "rollsum.h"
+
+#include <string.h>
+
+static const char *hash_names[ARROW_HASH_MAX + 1] = { "md5", "sha256", "blake3" };
+
+const char *
+arrow_hash_name (arrow_hash_t hash)
+{
+  if ((unsigned) hash > ARROW_HASH_MAX)
+    return NULL;
+  return hash_names[hash];
+}
+
+int
+arrow_hash_by_name (const char *name, arrow_hash_t *hash)
+{
+  int i;
+
+  for (i = 0; i <= ARROW_HASH_MAX; i++)
+    {
+      if (strcasecmp (name, hash_names[i]) == 0)
+        {
+          *hash = (arrow_hash_t) i;
+          return 0;
+        }
+    }
+  return -1;
+}
+
+void
+arrow_hash_init (arrow_hash_ctx_t *ctx, arrow_hash_t hash)
+{
+  ctx->hash = hash;
+  switch (hash)
+    {
+    case ARROW_HASH_SHA256:
+      SHA256_Init (&ctx->u.sha256);
+      break;
+    case ARROW_HASH_BLAKE3:
+      blake3_init (&ctx->u.blake3);
+      break;
+    default:
+      MD5_Init (&ctx->u.md5);
+      break;
+    }
+}
+
+void
+arrow_hash_update (arrow_hash_ctx_t *ctx, const void *buf, size_t len)
+{
+  switch (ctx->hash)
+    {
+    case ARROW_HASH_SHA256:
+      SHA256_Update (&ctx->u.sha256, buf, len);
+      break;
+    case ARROW_HASH_BLAKE3:
+      blake3_update (&ctx->u.blake3, buf, len);
+      break;
+    default:
+      MD5_Update (&ctx->u.md5, buf, len);
+      break;
+    }
+}
+
+void
+arrow_hash_final (arrow_hash_ctx_t *ctx, arrow_key_t digest)
+{
+  uint8_t full[SHA256_DIGEST_LENGTH];
+
+  switch (ctx->hash)
+    {
+    case ARROW_HASH_SHA256:
+      SHA256_Final (full, &ctx->u.sha256);
+      memcpy (digest, full, sizeof (arrow_key_t));
+      break;
+    case ARROW_HASH_BLAKE3:
+      blake3_final (&ctx->u.blake3, digest, sizeof (arrow_key_t));
+      break;
+    default:
+      MD5_Final (digest, &ctx->u.md5);
+      break;
+    }
+}
+
+void
+arrow_hash (arrow_hash_t hash, const void *buf, size_t len, arrow_key_t digest)
+{
+  uint8_t full[SHA256_DIGEST_LENGTH];
+  blake3_hasher_t blake3;
+
+  switch (hash)
+    {
+    case ARROW_HASH_SHA256:
+      SHA256 (buf, len, full);
+      memcpy (digest, full, sizeof (arrow_key_t));
+      break;
+    case ARROW_HASH_BLAKE3:
+      blake3_init (&blake3);
+      blake3_update (&blake3, buf, len);
+      blake3_final (&blake3, digest, sizeof (arrow_key_t));
+      break;
+    default:
+      MD5 (buf, len, digest);
+      break;
+    }
+}
+
+void
+arrow_compute_key_with (arrow_hash_t hash, arrow_id_t *id, const void *data,
+                        size_t length)
+{
+  Rollsum rs;
+  RollsumInit (&rs);
+  RollsumUpdate (&rs, data, (unsigned int) length);
+  id->weak = RollsumDigest (&rs);
+  arrow_hash (hash, data, length, id->strong);
+}
+
+void
+arrow_hash_many (arrow_hash_t hash, const void *const *bufs, const size_t *lens,
+                 size_t count, arrow_key_t *digests)
+{
+  size_t i;
+
+  if (hash == ARROW_HASH_MD5)
+    {
+      arrow_md5_many (bufs, lens, count, digests);
+      return;
+    }
+  for (i = 0; i < count; i++)
+    arrow_hash (hash, bufs[i], lens[i], digests[i]);
+}
+
+void
+arrow_compute_keys_with (arrow_hash_t hash, arrow_id_t *ids, const void *const *bufs,
+                         const size_t *lens, size_t count)
+{
+  arrow_key_t digests[ARROW_MD5_LANES * 4];
+  unsigned long weak[ARROW_MD5_LANES * 4];
+  size_t i, done, n;
+
+  for (done = 0; done < count; done += n)
+    {
+      n = count - done;
+      if (n > ARROW_MD5_LANES * 4)
+        n = ARROW_MD5_LANES * 4;
+      RollsumDigestMany (bufs + done, lens + done, n, weak);
+      arrow_hash_many (hash, bufs + done, lens + done, n, digests);
+      for (i = 0; i < n; i++)
+        {
+          ids[done + i].weak = weak[i];
+          memcpy (ids[done + i].strong, digests[i], sizeof (arrow_key_t));
+        }
+    }
+}
@@ -0,0 +1,91 @@
+/* hash.h -- strong hashes for chunk keys
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <arrow.h>
+#include <blake3.h>
+#include <openssl/sha.h>
+
+/**
+ * The strong hash a store keys its chunks with. Whatever the hash,
+ * keys keep their 16 bytes (arrow_key_t), so longer digests are cut
+ * short; block, pack and wire formats are the same for all of them.
+ */
+typedef enum arrow_hash_e
+{
+  ARROW_HASH_MD5 = 0,     /**< MD5. Stores made before there was a
+                               choice all use it. */
+  ARROW_HASH_SHA256 = 1,  /**< SHA-256, first 128 bits. OpenSSL uses
+                               the SHA extensions when the CPU has them. */
+  ARROW_HASH_BLAKE3 = 2   /**< BLAKE3, 128 bits of output. */
+} arrow_hash_t;
+
+#define ARROW_HASH_MAX ARROW_HASH_BLAKE3
+
+typedef struct arrow_hash_ctx_s
+{
+  arrow_hash_t hash;
+  union
+  {
+    MD5_CTX md5;
+    SHA256_CTX sha256;
+    blake3_hasher_t blake3;
+  } u;
+} arrow_hash_ctx_t;
+
+/** The hash's name ("md5", "sha256", "blake3"), or NULL. */
+const char *arrow_hash_name (arrow_hash_t hash);
+
+/** Look a hash up by name. Returns -1 if there's no such hash. */
+int arrow_hash_by_name (const char *name, arrow_hash_t *hash);
+
+void arrow_hash_init (arrow_hash_ctx_t *ctx, arrow_hash_t hash);
+void arrow_hash_update (arrow_hash_ctx_t *ctx, const void *buf, size_t len);
+void arrow_hash_final (arrow_hash_ctx_t *ctx, arrow_key_t digest);
+
+/** Hash len bytes of buf in one go. */
+void arrow_hash (arrow_hash_t hash, const void *buf, size_t len, arrow_key_t digest);
+
+/**
+ * Like arrow_compute_key, but with the given strong hash. With
+ * ARROW_HASH_MD5 the two are the same.
+ */
+void arrow_compute_key_with (arrow_hash_t hash, arrow_id_t *id, const void *data,
+                             size_t len);
+
+/**
+ * Hash count independent buffers. MD5 hashes them side by side (see
+ * arrow_md5_many), so batches of chunks go much faster than one
+ * arrow_hash at a time.
+ */
+void arrow_hash_many (arrow_hash_t hash, const void *const *bufs, const size_t *lens,
+                      size_t count, arrow_key_t *digests);
+
+/** Compute the keys of count chunks, with arrow_hash_many. */
+void arrow_compute_keys_with (arrow_hash_t hash, arrow_id_t *ids, const void *const *bufs,
+                              const size_t *lens, size_t count);
+
+#endif /* __HASH_H__ */
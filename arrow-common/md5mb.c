@@ -0,0 +1,291 @@
+/* md5mb.c -- multi-buffer MD5
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+#include "md5mb.h"
+
+#include <string.h>
+
+/*
+ * The state is kept one word per lane, in GCC vectors as wide as all
+ * the lanes together. The compiler splits those into whatever
+ * registers the target has, so the one compression function below is
+ * built three times, for AVX-512, AVX2 and plain SSE2, and the widest
+ * the CPU can run is picked at startup.
+ */
+typedef uint32_t md5_vec_t __attribute__ ((vector_size (ARROW_MD5_LANES * 4)));
+
+typedef void (*md5mb_compress_fn) (uint32_t state[4][ARROW_MD5_LANES],
+                                   const uint32_t w[16][ARROW_MD5_LANES]);
+
+static md5mb_compress_fn md5mb_compress_impl = NULL;
+
+static const uint32_t md5_k[64] =
+  {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+  };
+
+static const uint32_t md5_iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+#define ROTL(x,s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+#define STEP(f,a,b,c,d,i,g,s) do {                                      \
+    (a) = (b) + ROTL ((a) + f ((b), (c), (d)) + md5_k[i] + w[g], (s));  \
+  } while (0)
+
+#define F(b,c,d) ((d) ^ ((b) & ((c) ^ (d))))
+#define G(b,c,d) ((c) ^ ((d) & ((b) ^ (c))))
+#define H(b,c,d) ((b) ^ (c) ^ (d))
+#define I(b,c,d) ((c) ^ ((b) | ~(d)))
+
+/* Four steps of one round, rotating the roles of a, b, c and d. */
+#define QUAD(f,i,g0,g1,g2,g3,s0,s1,s2,s3) do {  \
+    STEP (f, a, b, c, d, (i),     (g0), (s0));  \
+    STEP (f, d, a, b, c, (i) + 1, (g1), (s1));  \
+    STEP (f, c, d, a, b, (i) + 2, (g2), (s2));  \
+    STEP (f, b, c, d, a, (i) + 3, (g3), (s3));  \
+  } while (0)
+
+inline static __attribute__ ((always_inline)) void
+md5mb_compress_lanes (uint32_t state[4][ARROW_MD5_LANES],
+                      const uint32_t words[16][ARROW_MD5_LANES])
+{
+  md5_vec_t a, b, c, d, a0, b0, c0, d0, w[16];
+  int j;
+
+  memcpy (&a, state[0], sizeof (a));
+  memcpy (&b, state[1], sizeof (b));
+  memcpy (&c, state[2], sizeof (c));
+  memcpy (&d, state[3], sizeof (d));
+  for (j = 0; j < 16; j++)
+    memcpy (&w[j], words[j], sizeof (w[j]));
+  a0 = a; b0 = b; c0 = c; d0 = d;
+
+  QUAD (F,  0,  0,  1,  2,  3, 7, 12, 17, 22);
+  QUAD (F,  4,  4,  5,  6,  7, 7, 12, 17, 22);
+  QUAD (F,  8,  8,  9, 10, 11, 7, 12, 17, 22);
+  QUAD (F, 12, 12, 13, 14, 15, 7, 12, 17, 22);
+
+  QUAD (G, 16,  1,  6, 11,  0, 5,  9, 14, 20);
+  QUAD (G, 20,  5, 10, 15,  4, 5,  9, 14, 20);
+  QUAD (G, 24,  9, 14,  3,  8, 5,  9, 14, 20);
+  QUAD (G, 28, 13,  2,  7, 12, 5,  9, 14, 20);
+
+  QUAD (H, 32,  5,  8, 11, 14, 4, 11, 16, 23);
+  QUAD (H, 36,  1,  4,  7, 10, 4, 11, 16, 23);
+  QUAD (H, 40, 13,  0,  3,  6, 4, 11, 16, 23);
+  QUAD (H, 44,  9, 12, 15,  2, 4, 11, 16, 23);
+
+  QUAD (I, 48,  0,  7, 14,  5, 6, 10, 15, 21);
+  QUAD (I, 52, 12,  3, 10,  1, 6, 10, 15, 21);
+  QUAD (I, 56,  8, 15,  6, 13, 6, 10, 15, 21);
+  QUAD (I, 60,  4, 11,  2,  9, 6, 10, 15, 21);
+
+  a += a0; b += b0; c += c0; d += d0;
+  memcpy (state[0], &a, sizeof (a));
+  memcpy (state[1], &b, sizeof (b));
+  memcpy (state[2], &c, sizeof (c));
+  memcpy (state[3], &d, sizeof (d));
+}
+
+static void
+md5mb_compress_sse2 (uint32_t state[4][ARROW_MD5_LANES],
+                     const uint32_t words[16][ARROW_MD5_LANES])
+{
+  md5mb_compress_lanes (state, words);
+}
+
+#if defined(__x86_64__)
+__attribute__ ((target ("avx2")))
+static void
+md5mb_compress_avx2 (uint32_t state[4][ARROW_MD5_LANES],
+                     const uint32_t words[16][ARROW_MD5_LANES])
+{
+  md5mb_compress_lanes (state, words);
+}
+
+__attribute__ ((target ("avx512f")))
+static void
+md5mb_compress_avx512 (uint32_t state[4][ARROW_MD5_LANES],
+                       const uint32_t words[16][ARROW_MD5_LANES])
+{
+  md5mb_compress_lanes (state, words);
+}
+#endif
+
+static void
+md5mb_setup (void)
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx512f"))
+    {
+      md5mb_compress_impl = md5mb_compress_avx512;
+      return;
+    }
+  if (__builtin_cpu_supports ("avx2"))
+    {
+      md5mb_compress_impl = md5mb_compress_avx2;
+      return;
+    }
+#endif
+  md5mb_compress_impl = md5mb_compress_sse2;
+}
+
+inline static uint32_t
+load32 (const uint8_t *p)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint32_t w;
+  memcpy (&w, p, 4);
+  return w;
+#else
+  return ((uint32_t) p[0]) | ((uint32_t) p[1] << 8)
+    | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+#endif
+}
+
+/* Where one lane is in its buffer. */
+typedef struct md5mb_lane_s
+{
+  const uint8_t *p;     /**< The next whole block of the buffer. */
+  size_t blocks;        /**< Whole blocks left from p. */
+  uint8_t tail[128];    /**< The rest of the buffer, padded. */
+  int tail_blocks;      /**< One or two. */
+  int tail_next;        /**< Tail blocks done. */
+  size_t job;           /**< Which buffer; count if the lane is idle. */
+} md5mb_lane_t;
+
+static void
+lane_start (md5mb_lane_t *lane, uint32_t state[4][ARROW_MD5_LANES], int l,
+            const uint8_t *buf, size_t len, size_t job)
+{
+  size_t rest = len % 64;
+  uint64_t bits = (uint64_t) len * 8;
+  int i;
+
+  lane->p = buf;
+  lane->blocks = len / 64;
+  lane->tail_blocks = rest + 9 <= 64 ? 1 : 2;
+  lane->tail_next = 0;
+  lane->job = job;
+  memset (lane->tail, 0, sizeof (lane->tail));
+  memcpy (lane->tail, buf + (len - rest), rest);
+  lane->tail[rest] = 0x80;
+  for (i = 0; i < 8; i++)
+    lane->tail[lane->tail_blocks * 64 - 8 + i] = (uint8_t) (bits >> (8 * i));
+  for (i = 0; i < 4; i++)
+    state[i][l] = md5_iv[i];
+}
+
+void
+arrow_md5_many (const void *const *bufs, const size_t *lens, size_t count,
+                arrow_key_t *digests)
+{
+  md5mb_lane_t lanes[ARROW_MD5_LANES];
+  uint32_t state[4][ARROW_MD5_LANES] __attribute__ ((aligned (64)));
+  uint32_t words[16][ARROW_MD5_LANES] __attribute__ ((aligned (64)));
+  static const uint8_t idle[64];
+  size_t next = 0;
+  int l, j, active = 0;
+
+  if (md5mb_compress_impl == NULL)
+    md5mb_setup ();
+
+  /* Not enough to fill the lanes worth the while. */
+  if (count < ARROW_MD5_LANES / 4)
+    {
+      for (next = 0; next < count; next++)
+        MD5 ((const unsigned char *) bufs[next], lens[next], digests[next]);
+      return;
+    }
+
+  memset (state, 0, sizeof (state));
+  for (l = 0; l < ARROW_MD5_LANES; l++)
+    {
+      if (next < count)
+        {
+          lane_start (&lanes[l], state, l, (const uint8_t *) bufs[next], lens[next], next);
+          next++;
+          active++;
+        }
+      else
+        lanes[l].job = count;
+    }
+
+  while (active > 0)
+    {
+      /* Gather a block from each lane, word by word. */
+      for (l = 0; l < ARROW_MD5_LANES; l++)
+        {
+          md5mb_lane_t *lane = &lanes[l];
+          const uint8_t *block;
+
+          if (lane->job == count)
+            block = idle;
+          else if (lane->blocks > 0)
+            block = lane->p;
+          else
+            block = lane->tail + 64 * lane->tail_next;
+          for (j = 0; j < 16; j++)
+            words[j][l] = load32 (block + 4 * j);
+        }
+
+      md5mb_compress_impl (state, words);
+
+      for (l = 0; l < ARROW_MD5_LANES; l++)
+        {
+          md5mb_lane_t *lane = &lanes[l];
+
+          if (lane->job == count)
+            continue;
+          if (lane->blocks > 0)
+            {
+              lane->p += 64;
+              lane->blocks--;
+              continue;
+            }
+          if (++lane->tail_next < lane->tail_blocks)
+            continue;
+
+          /* Done; put out the digest and take the next buffer. */
+          for (j = 0; j < 16; j++)
+            digests[lane->job][j] = (uint8_t) (state[j / 4][l] >> (8 * (j % 4)));
+          if (next < count)
+            {
+              lane_start (lane, state, l, (const uint8_t *) bufs[next], lens[next], next);
+              next++;
+            }
+          else
+            {
+              lane->job = count;
+              active--;
+            }
+        }
+    }
+}
@@ -0,0 +1,46 @@
+/* md5mb.h -- multi-buffer MD5
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+
+#ifndef __MD5MB_H__
+#define __MD5MB_H__
+
+#include <arrow.h>
+
+/**
+ * Buffers hashed side by side. Every lane works on a different buffer,
+ * and a lane that finishes picks up the next one.
+ */
+#define ARROW_MD5_LANES 16
+
+/**
+ * Compute the MD5 of count independent buffers, several at once in
+ * SIMD lanes: AVX-512, AVX2 or SSE2, whichever the CPU has. The
+ * digests are the same as MD5 () gives; the batch just goes through
+ * faster, best when there are at least ARROW_MD5_LANES buffers of
+ * roughly the same length.
+ */
+void arrow_md5_many (const void *const *bufs, const size_t *lens, size_t count,
+                     arrow_key_t *digests);
+
+#endif /* __MD5MB_H__ */
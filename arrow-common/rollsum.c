@@ -22,6 +22,12 @@
  */
 #include "rollsum.h"
 
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #define DO1(buf,i)  {s1 += buf[i]; s2 += s1;}
 #define DO2(buf,i)  DO1(buf,i); DO1(buf,i+1);
 #define DO4(buf,i)  DO2(buf,i); DO2(buf,i+2);
@@ -29,7 +35,22 @@
 #define DO16(buf)   DO8(buf,0); DO8(buf,8);
 #define OF16(off)  {s1 += 16*off; s2 += 136*off;}
 
-void RollsumUpdate(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+/* The vector versions sum at most this many vectors in 32-bit lanes
+ * before folding them into s1 and s2; any more and the lanes could
+ * overflow. */
+#define ROLLSUM_VEC_BLOCKS 1024
+
+/* Fold a run of n bytes, whose plain byte sum is b and whose sum of
+ * bytes weighted n, n-1, ..., 1 is w, into s1 and s2. This is exactly
+ * what rolling the bytes in one at a time does, modulo 2^64. */
+#define FOLD(n,b,w) { \
+    s2 += (n)*s1 + (w) + ROLLSUM_CHAR_OFFSET*((n)*((n)+1)/2); \
+    s1 += (b) + ROLLSUM_CHAR_OFFSET*(n); \
+}
+
+static void (*RollsumUpdateImpl)(Rollsum *,const unsigned char *,unsigned int) = 0;
+
+static void RollsumUpdateScalar(Rollsum *sum,const unsigned char *buf,unsigned int len) {
     /* ANSI C says no overflow for unsigned. 
      zlib's adler 32 goes to extra effort to avoid overflow*/
     unsigned long s1 = sum->s1;
@@ -50,3 +71,137 @@ void RollsumUpdate(Rollsum *sum,const unsigned char *buf,unsigned int len) {
     sum->s1=s1;
     sum->s2=s2;
 }
+
+#if defined(__x86_64__)
+/* Sixteen bytes at a time: psadbw gives the byte sum, and pmaddubsw
+ * then pmaddwd the sum weighted 16..1. A running total of the byte
+ * sums of earlier vectors supplies the rest of each byte's weight. */
+__attribute__((target ("ssse3")))
+static void RollsumUpdateSSSE3(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+    const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                          8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned long s1 = sum->s1;
+    unsigned long s2 = sum->s2;
+
+    sum->count+=len;
+    while (len >= 16) {
+        unsigned long blocks = len / 16;
+        unsigned long n, b, w;
+        __m128i vs = zero, vp = zero, vw = zero;
+        uint32_t t[4];
+
+        if (blocks > ROLLSUM_VEC_BLOCKS)
+            blocks = ROLLSUM_VEC_BLOCKS;
+        n = blocks * 16;
+        len -= n;
+        while (blocks--) {
+            __m128i v = _mm_loadu_si128((const __m128i *) buf);
+            vp = _mm_add_epi32(vp, vs);
+            vs = _mm_add_epi32(vs, _mm_sad_epu8(v, zero));
+            vw = _mm_add_epi32(vw, _mm_madd_epi16(_mm_maddubs_epi16(v, weights), ones));
+            buf += 16;
+        }
+        _mm_storeu_si128((__m128i *) t, vs);
+        b = (unsigned long) t[0] + t[1] + t[2] + t[3];
+        _mm_storeu_si128((__m128i *) t, vp);
+        w = 16 * ((unsigned long) t[0] + t[1] + t[2] + t[3]);
+        _mm_storeu_si128((__m128i *) t, vw);
+        w += (unsigned long) t[0] + t[1] + t[2] + t[3];
+        FOLD(n, b, w);
+    }
+    sum->s1=s1;
+    sum->s2=s2;
+    sum->count-=len;
+    /* Fewer than 16 bytes left. */
+    RollsumUpdateScalar(sum, buf, len);
+}
+
+/* The same, thirty-two bytes at a time. */
+__attribute__((target ("avx2")))
+static void RollsumUpdateAVX2(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+    const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                             24, 23, 22, 21, 20, 19, 18, 17,
+                                             16, 15, 14, 13, 12, 11, 10, 9,
+                                             8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned long s1 = sum->s1;
+    unsigned long s2 = sum->s2;
+
+    sum->count+=len;
+    while (len >= 32) {
+        unsigned long blocks = len / 32;
+        unsigned long n, b, w;
+        __m256i vs = zero, vp = zero, vw = zero;
+        uint32_t t[8];
+        int i;
+
+        if (blocks > ROLLSUM_VEC_BLOCKS)
+            blocks = ROLLSUM_VEC_BLOCKS;
+        n = blocks * 32;
+        len -= n;
+        while (blocks--) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) buf);
+            vp = _mm256_add_epi32(vp, vs);
+            vs = _mm256_add_epi32(vs, _mm256_sad_epu8(v, zero));
+            vw = _mm256_add_epi32(vw, _mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), ones));
+            buf += 32;
+        }
+        b = w = 0;
+        _mm256_storeu_si256((__m256i *) t, vs);
+        for (i = 0; i < 8; i++)
+            b += t[i];
+        _mm256_storeu_si256((__m256i *) t, vp);
+        for (i = 0; i < 8; i++)
+            w += t[i];
+        w *= 32;
+        _mm256_storeu_si256((__m256i *) t, vw);
+        for (i = 0; i < 8; i++)
+            w += t[i];
+        FOLD(n, b, w);
+    }
+    sum->s1=s1;
+    sum->s2=s2;
+    sum->count-=len;
+    /* Fewer than 32 bytes left. */
+    RollsumUpdateScalar(sum, buf, len);
+}
+#endif
+
+static void RollsumSetup(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        RollsumUpdateImpl = RollsumUpdateAVX2;
+        return;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        RollsumUpdateImpl = RollsumUpdateSSSE3;
+        return;
+    }
+#endif
+    RollsumUpdateImpl = RollsumUpdateScalar;
+}
+
+void RollsumUpdate(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+    /* Racing threads pick the same function; no lock needed. */
+    if (RollsumUpdateImpl == 0)
+        RollsumSetup();
+    RollsumUpdateImpl(sum, buf, len);
+}
+
+void RollsumDigestMany(const void *const *bufs,const size_t *lens,size_t count,
+                       unsigned long *digests) {
+    Rollsum rs;
+    size_t i;
+
+    if (RollsumUpdateImpl == 0)
+        RollsumSetup();
+    for (i = 0; i < count; i++) {
+        RollsumInit(&rs);
+        RollsumUpdateImpl(&rs, (const unsigned char *) bufs[i], (unsigned int) lens[i]);
+        digests[i] = RollsumDigest(&rs);
+    }
+}
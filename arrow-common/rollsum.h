@@ -23,6 +23,8 @@
 #ifndef _ROLLSUM_H_
 #define _ROLLSUM_H_
 
+#include <stddef.h>
+
 /* We should make this something other than zero to improve the
  * checksum algorithm: tridge suggests a prime number. */
 #define ROLLSUM_CHAR_OFFSET 31
@@ -34,7 +36,13 @@ typedef struct _Rollsum {
     unsigned long s2;                  /* s2 part of sum */
 } Rollsum;
 
+/* Uses AVX2 or SSSE3 when the CPU has them; every version gives the
+ * same sums as rolling the bytes in one at a time. */
 void RollsumUpdate(Rollsum *sum,const unsigned char *buf,unsigned int len);
+/* Set digests[i] to the RollsumDigest of the count buffers bufs[i],
+ * each lens[i] bytes long, as if each were summed from RollsumInit. */
+void RollsumDigestMany(const void *const *bufs,const size_t *lens,size_t count,
+                       unsigned long *digests);
 /* The following are implemented as macros.
 void RollsumInit(Rollsum *sum);
 void RollsumRotate(Rollsum *sum,unsigned char out, unsigned char in);
@@ -41,10 +41,35 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 
 #define BACKUP_TRACE 1
 
+/* Default basis_versions and basis_siblings. */
+#define BASIS_VERSIONS 3
+#define BASIS_SIBLINGS 2
+
+/* Directories with more entries than this aren't searched for siblings. */
+#define SIBLING_SCAN 4096
+
 #define backup_log(lvl,fmt,args...) if ((lvl & BACKUP_DEBUG) != 0) fprintf (stderr, "%s (%s:%d): " fmt "\n", __FUNCTION__, __FILE__, __LINE__, ##args)
 
 int BACKUP_DEBUG = 0;
 
+static const sync_batch_callbacks_t local_batch_cb =
+{
+  sync_store_contains_many,
+  sync_store_put_blocks,
+  sync_store_add_refs,
+  sync_store_emit_chunks,
+  NULL
+};
+
+static const sync_batch_callbacks_t remote_batch_cb =
+{
+  rpc_client_contains_many,
+  rpc_client_put_chunks,
+  rpc_client_add_refs,
+  rpc_client_emit_chunks,
+  NULL
+};
+
 int
 file_init_local (file_backup_t *state, const char *rootdir, const char *source_root)
 {
@@ -81,8 +106,21 @@ file_init_local (file_backup_t *state, const char *rootdir, const char *source_r
   state->sync_cb.put_block = sync_store_put_block;
   state->sync_cb.store_contains = sync_store_contains;
   state->sync_cb.emit_chunk = sync_store_emit_chunk;
+  state->sync_cb.probe_weak = sync_store_probe_weak;
+  state->sync_cb.batch = &local_batch_cb;
+  state->sync_cb.hash = store_hash (state->store);
+  state->sync_cb.chunking = FILE_CHUNKING_FIXED;
+  state->sync_cb.threads = MIN (sysconf (_SC_NPROCESSORS_ONLN), SYNC_THREADS_MAX);
   state->sync_cb.state = malloc (sizeof (sync_store_state_t));
   ((sync_store_state_t *) state->sync_cb.state)->store = state->store;
+  ((sync_store_state_t *) state->sync_cb.state)->chunks_fd = -1;
+  ((sync_store_state_t *) state->sync_cb.state)->npending = 0;
+  sync_ctx_init (&state->sync_ctx);
+  state->basis_versions = BASIS_VERSIONS;
+  state->basis_siblings = BASIS_SIBLINGS;
+  state->sibling_dir = NULL;
+  state->linkpath = NULL;
+  state->linkpath_size = 0;
   state->type = LOCAL;
   state->stats.files = 0;
   return 0;
@@ -107,12 +145,55 @@ file_init_remote (file_backup_t *state, FILE *in, FILE *out)
   state->sync_cb.put_block = rpc_client_put_chunk;
   state->sync_cb.store_contains = rpc_client_contains;
   state->sync_cb.emit_chunk = rpc_client_emit_chunk;
+  state->sync_cb.probe_weak = NULL;
+  state->sync_cb.batch = &remote_batch_cb;
+  state->sync_cb.chunking = FILE_CHUNKING_FIXED;
+  state->sync_cb.threads = MIN (sysconf (_SC_NPROCESSORS_ONLN), SYNC_THREADS_MAX);
   state->sync_cb.state = state->rpcclient;
+  sync_ctx_init (&state->sync_ctx);
   state->type = REMOTE;
   state->stats.files = 0;
+
+  /* New chunks are keyed the way the server's store keys them. */
+  if (rpc_client_store_hash (state->rpcclient, &state->sync_cb.hash) != 0)
+	{
+	  arrow_push_errno ();
+	  file_destroy (state);
+	  arrow_pop_errno ();
+	  return -1;
+	}
   return 0;
 }
 
+/*
+ * Free what file_init_local or file_init_remote set up. The remote
+ * streams belong to the caller, and stay open.
+ */
+void
+file_destroy (file_backup_t *state)
+{
+  sync_ctx_destroy (&state->sync_ctx);
+  filer_destroy (&state->filer);
+  if (state->type == LOCAL)
+	{
+	  free (state->sync_cb.state);
+	  store_destroy (state->store);
+	  free (state->source_root);
+	  free (state->tree_root);
+	  if (state->sibling_dir != NULL)
+		{
+		  file_free_dirlist (&state->siblings);
+		  free (state->sibling_dir);
+		}
+	  free (state->linkpath);
+	}
+  else
+	{
+	  free (state->rpcclient->stats);
+	  free (state->rpcclient);
+	}
+}
+
 int
 file_reset_local_sourcedir (file_backup_t *state, const char *sourcepath)
 {
@@ -146,18 +227,170 @@ file_reset_local_sourcedir (file_backup_t *state, const char *sourcepath)
   return 0;
 }
 
+/* Length of name up to its first dot, past any leading one. */
+static size_t
+name_stem (const char *name)
+{
+  const char *dot = strchr (name + (name[0] == '.'), '.');
+  return dot != NULL ? (size_t) (dot - name) : strlen (name);
+}
+
+/* name's extension, from its last dot, or NULL. */
+static const char *
+name_ext (const char *name)
+{
+  const char *dot = strrchr (name, '.');
+  return (dot == NULL || dot == name) ? NULL : dot;
+}
+
+/*
+ * Whether name is like mine: the same up to the first dot (foo.log
+ * and foo.log.1), or if by_ext, with the same extension.
+ */
+static int
+name_similar (const char *name, const char *mine, int by_ext)
+{
+  size_t stem = name_stem (mine);
+  const char *ext = name_ext (mine);
+  const char *theirs = name_ext (name);
+
+  if (by_ext)
+	return ext != NULL && theirs != NULL && strcmp (theirs, ext) == 0;
+  return name_stem (name) == stem && strncmp (name, mine, stem) == 0;
+}
+
+static int
+basis_has (const file_t *basis, int n, const uuid_t uuid)
+{
+  int i;
+  for (i = 0; i < n; i++)
+	if (uuid_equal (basis[i].uuid, uuid))
+	  return 1;
+  return 0;
+}
+
+/*
+ * List linkpath's directory in the tree, keeping the list for the
+ * next file in the same directory. Links made since aren't listed,
+ * which only means those files aren't picked as siblings. Returns
+ * NULL if there's no list, or it's too long to search.
+ */
+static dirlist_t *
+list_siblings (file_backup_t *state, const char *linkpath)
+{
+  size_t len = strlen (linkpath) + 1;
+  char *dir = (char *) malloc (len);
+
+  if (dir == NULL)
+	return NULL;
+  file_dirname (linkpath, dir, len);
+  if (state->sibling_dir != NULL && strcmp (dir, state->sibling_dir) == 0)
+	free (dir);
+  else
+	{
+	  if (state->sibling_dir != NULL)
+		{
+		  file_free_dirlist (&state->siblings);
+		  free (state->sibling_dir);
+		  state->sibling_dir = NULL;
+		}
+	  if (file_listdir (dir, &state->siblings) != 0)
+		{
+		  free (dir);
+		  return NULL;
+		}
+	  state->sibling_dir = dir;
+	}
+  if (state->siblings.length > SIBLING_SCAN)
+	return NULL;
+  return &state->siblings;
+}
+
+/*
+ * basis[0] is the version of a file that linkpath links to. Open more
+ * versions to sync its next one against: the ones before it, up to
+ * basis_versions in all, then up to basis_siblings of the files
+ * beside it with the same name or, failing that, the same extension;
+ * reverted edits match older versions, and copies and rotated logs
+ * match their neighbours. Files that can't be opened are passed over.
+ * Returns how many files basis holds.
+ */
+static int
+open_basis (file_backup_t *state, const char *linkpath, file_t *basis)
+{
+  static const uuid_t none;
+  const char *mine = file_basename (linkpath);
+  dirlist_t *list;
+  int n = 1, siblings = 0;
+  int by_ext;
+  size_t i;
+
+  while (n < state->basis_versions && n < BACKUP_MAX_BASIS
+		 && !uuid_equal (basis[n - 1].file->previous, none))
+	{
+	  uuid_copy (basis[n].uuid, basis[n - 1].file->previous);
+	  if (file_open (&state->filer, &basis[n], 0) != 0)
+		break;
+	  n++;
+	}
+
+  if (state->basis_siblings <= 0
+	  || (list = list_siblings (state, linkpath)) == NULL)
+	return n;
+  for (by_ext = 0; by_ext < 2; by_ext++)
+	for (i = 0; i < list->length; i++)
+	  {
+		const char *name = list->paths[i];
+		char *path;
+		int ret;
+
+		if (siblings == state->basis_siblings || n == BACKUP_MAX_BASIS)
+		  return n;
+		if (strcmp (name, mine) == 0 || strcmp (name, ".") == 0
+			|| strcmp (name, "..") == 0
+			|| !name_similar (name, mine, by_ext)
+			|| (by_ext && name_similar (name, mine, 0)))
+		  continue;
+		path = path_join (state->sibling_dir, name);
+		ret = read_link_file (path, basis[n].uuid);
+		free (path);
+		if (ret != 0 || basis_has (basis, n, basis[n].uuid)
+			|| file_open (&state->filer, &basis[n], 0) != 0)
+		  continue;
+		backup_log (BACKUP_TRACE, "sibling %s is a basis too", name);
+		n++;
+		siblings++;
+	  }
+  return n;
+}
+
+static void
+close_basis (file_backup_t *state, file_t *basis, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+	file_close (&state->filer, &basis[i]);
+}
+
 static int
 local_file_backup_file (file_backup_t *state, const char *path)
 {
   size_t pathlen = (strlen(state->tree_root) + strlen(path)
 					- strlen(state->source_root)) + 2;
+  sync_store_state_t *sync_state = (sync_store_state_t *) state->sync_cb.state;
   char *linkpath;
 
   backup_log (BACKUP_TRACE, "%p %s", state, path);
 
-  linkpath = (char *) malloc (pathlen);
-  if (linkpath == NULL)
-	return -1;
+  if (pathlen > state->linkpath_size)
+	{
+	  linkpath = (char *) realloc (state->linkpath, pathlen);
+	  if (linkpath == NULL)
+		return -1;
+	  state->linkpath = linkpath;
+	  state->linkpath_size = pathlen;
+	}
+  linkpath = state->linkpath;
   snprintf (linkpath, pathlen, "%s/%s", state->tree_root,
 			path + strlen(state->source_root));
 
@@ -166,12 +399,10 @@ local_file_backup_file (file_backup_t *state, const char *path)
   if (!file_exists (linkpath))
 	{
 	  FILE *infile;
-	  FILE *out;
 	  file_t newfile;
 	  uuid_generate (newfile.uuid);
 	  if (file_open (&(state->filer), &newfile, 1) != 0)
 		{
-		  free (linkpath);
 		  return -1;
 		}
 
@@ -184,27 +415,16 @@ local_file_backup_file (file_backup_t *state, const char *path)
 		{
 		  file_close (&(state->filer), &newfile);
 		  file_delete (&(state->filer), &newfile);
-		  free (linkpath);
-		  return -1;
-		}
-	  out = fdopen (dup(newfile.data.fd), "w");
-	  if (out == NULL)
-		{
-		  file_close (&(state->filer), &newfile);
-		  file_delete (&(state->filer), &newfile);
-		  fclose (infile);
-		  free (linkpath);
 		  return -1;
 		}
-	  fseek (out, sizeof (file_info_t), SEEK_SET);
-	  ((sync_store_state_t *) state->sync_cb.state)->chunks_out = out;
-	  if (sync_generate (&newfile, infile, &(state->sync_cb)) != 0)
+	  sync_state->chunks_fd = newfile.data.fd;
+	  sync_state->chunks_off = sizeof (file_info_t);
+	  sync_state->npending = 0;
+	  if (sync_generate (&state->sync_ctx, &newfile, infile, &(state->sync_cb)) != 0)
 		{
 		  file_close (&(state->filer), &newfile);
 		  file_delete (&(state->filer), &newfile);
 		  fclose (infile);
-		  fclose (out);
-		  free (linkpath);
 		  return -1;
 		}
 	  char xxx[24];
@@ -213,7 +433,6 @@ local_file_backup_file (file_backup_t *state, const char *path)
 	  int ret = make_link_file (linkpath, newfile.uuid);
 	  file_close (&(state->filer), &newfile);
 	  fclose (infile);
-	  fclose (out);
 	  state->stats.files++;
 	  return ret;
 	}
@@ -221,10 +440,10 @@ local_file_backup_file (file_backup_t *state, const char *path)
 	{
 	  char uuidbuf[24];
 	  file_t newfile;
-	  file_t basis;
+	  file_t basis[BACKUP_MAX_BASIS];
+	  int nbasis;
 	  ssize_t len;
 	  FILE *infile;
-	  FILE *out;
 	  int hash_match = 1;
 	  int ret = 0;
 
@@ -235,61 +454,51 @@ local_file_backup_file (file_backup_t *state, const char *path)
 				  arrow_bytes_to_long ((uint8_t *) newfile.uuid),
 				  arrow_bytes_to_long ((uint8_t *) newfile.uuid + 8));
 	  
-	  if (read_link_file (linkpath, basis.uuid) != 0)
+	  if (read_link_file (linkpath, basis[0].uuid) != 0)
 		return -1;
 	  backup_log (BACKUP_TRACE, "existing file %016llx-%016llx",
-				  arrow_bytes_to_long ((uint8_t *) basis.uuid),
-				  arrow_bytes_to_long ((uint8_t *) basis.uuid + 8));
-	  if (file_open (&state->filer, &basis, 0) != 0)
+				  arrow_bytes_to_long ((uint8_t *) basis[0].uuid),
+				  arrow_bytes_to_long ((uint8_t *) basis[0].uuid + 8));
+	  if (file_open (&state->filer, &basis[0], 0) != 0)
 		return -1;
-	  backup_log (BACKUP_TRACE, "opened basis file");
+	  nbasis = open_basis (state, linkpath, basis);
+	  backup_log (BACKUP_TRACE, "opened %d basis files", nbasis);
 	  infile = fopen (path, "r");
 	  if (infile == NULL)
 		{
 		  backup_log (BACKUP_TRACE, "%s: %s\n", path, strerror (errno));
-		  file_close (&state->filer, &basis);
+		  close_basis (state, basis, nbasis);
 		  return -1;
 		}
 	  if (file_open (&state->filer, &newfile, 1) != 0)
 		{
 		  fclose (infile);
-		  file_close (&state->filer, &basis);
-		  return -1;
-		}
-	  out = fdopen (dup(newfile.data.fd), "w");
-	  if (out == NULL)
-		{
-		  backup_log (BACKUP_TRACE, "%d: %s\n", newfile.data.fd, strerror (errno));
-		  file_close (&(state->filer), &newfile);
-		  file_delete (&(state->filer), &newfile);
-		  fclose (infile);
-		  free (linkpath);
+		  close_basis (state, basis, nbasis);
 		  return -1;
 		}
-	  fseek (out, sizeof (file_info_t), SEEK_SET);
-	  ((sync_store_state_t *) state->sync_cb.state)->chunks_out = out;
-	  if (sync_file (&basis, &newfile, infile, &(state->sync_cb), &hash_match) != 0)
+	  sync_state->chunks_fd = newfile.data.fd;
+	  sync_state->chunks_off = sizeof (file_info_t);
+	  sync_state->npending = 0;
+	  if (sync_file (&state->sync_ctx, basis, nbasis, &newfile, infile,
+					 &(state->sync_cb), &hash_match) != 0)
 		{
 		  file_close (&(state->filer), &newfile);
 		  file_delete (&(state->filer), &newfile);
-		  file_close (&(state->filer), &basis);
+		  close_basis (state, basis, nbasis);
 		  fclose (infile);
-		  fclose (out);
-		  free (linkpath);
 		  return -1;
 		}
 	  backup_log (BACKUP_TRACE, "sync_file done; hash_match: %d", hash_match);
 	  file_close (&(state->filer), &newfile);
 	  if (hash_match)
 		file_delete (&(state->filer), &newfile);
-	  file_close (&(state->filer), &basis);
+	  close_basis (state, basis, nbasis);
 
 	  if (!hash_match)
 		{
 		  ret = make_link_file (linkpath, newfile.uuid);		  
 		  state->stats.files++;
 		}
-	  fclose (out);
 	  fclose (infile);
 	  return ret;
 	}
@@ -334,7 +543,7 @@ remote_file_backup_file (file_backup_t *state, const char *path)
 		  fclose (infile);
 		  return -1;
 		}
-	  if (sync_generate (&newfile, infile, &(state->sync_cb)) != 0)
+	  if (sync_generate (&state->sync_ctx, &newfile, infile, &(state->sync_cb)) != 0)
 		{
 		  rpc_client_close_file (state->rpcclient, &newfile, 1);
 		  fclose (infile);
@@ -405,7 +614,7 @@ remote_file_backup_file (file_backup_t *state, const char *path)
 		  fclose (infile);
 		  return -1;
 		}
-	  if (sync_file (&basis, &newfile, infile, &state->sync_cb, NULL) != 0)
+	  if (sync_file (&state->sync_ctx, &basis, 1, &newfile, infile, &state->sync_cb, NULL) != 0)
 		{
 		  rpc_client_close_file (state->rpcclient, &newfile, 1);
 		  file_close (&state->filer, &basis);
@@ -25,6 +25,7 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 #define __BACKUP_H__
 
 #include "fileinfo.h"
+#include "helpers.h"
 #include <client.h>
 #include <store.h>
 #include <sync.h>
@@ -35,6 +36,10 @@ typedef struct backup_stats_s
   size_t files;
 } backup_stats_t;
 
+/* The most files a new version is synced against; see
+   basis_versions and basis_siblings. */
+#define BACKUP_MAX_BASIS 8
+
 typedef struct file_backup_s
 {
   enum { LOCAL, REMOTE } type;
@@ -43,6 +48,15 @@ typedef struct file_backup_s
   filer_state_t filer;
   store_state_t *store;
   sync_callbacks_t sync_cb;
+  sync_ctx_t sync_ctx;   /**< Reused for every file backed up. */
+  int basis_versions;    /**< How many of a file's last versions to sync
+                            a new one against (local backups only). */
+  int basis_siblings;    /**< How many files beside it with the same name
+                            or extension to sync against, too. */
+  char *sibling_dir;     /**< The tree directory siblings lists. */
+  dirlist_t siblings;
+  char *linkpath;        /**< Where local backups build link paths. */
+  size_t linkpath_size;
   backup_stats_t stats;
   rpc_t *rpcclient;
   char tmpdir[256];
@@ -50,6 +64,7 @@ typedef struct file_backup_s
 
 int file_init_local (file_backup_t *state, const char *rootdir, const char *sourcedir);
 int file_init_remote (file_backup_t *state, FILE *in, FILE *out);
+void file_destroy (file_backup_t *state);
 int file_reset_local_sourcedir (file_backup_t *state, const char *sourcedir);
 int file_backup_file (file_backup_t *state, const char *path);
 int file_recursive_backup (file_backup_t *state, const char *path);
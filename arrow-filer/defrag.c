@@ -0,0 +1,391 @@
+/* defrag.c -- Reorder store blocks by how files reference them
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <base64.h>
+#include <store.h>
+#include "defrag.h"
+#include "helpers.h"
+
+#define DEFRAG_TRACE 1
+
+#define defrag_log(lvl,fmt,args...) if ((lvl & DEFRAG_DEBUG) != 0) fprintf (stderr, "%s (%s:%d): " fmt "\n", __FUNCTION__, __FILE__, __LINE__, ##args)
+
+int DEFRAG_DEBUG = 0;
+
+typedef struct version_file_s
+{
+  char *path;
+  time_t mtime;
+} version_file_t;
+
+/* One reference to a chunk: which bucket it's in, and when we saw it. */
+typedef struct defrag_ref_s
+{
+  arrow_id_t id;
+  uint64_t bucket;
+  uint64_t seq;
+} defrag_ref_t;
+
+typedef struct defrag_refs_s
+{
+  defrag_ref_t *refs;
+  size_t count;
+  size_t max;
+} defrag_refs_t;
+
+typedef struct defrag_work_s
+{
+  store_state_t *store;
+  defrag_ref_t *refs;
+  size_t count;
+  size_t next;                  /**< Start of the next bucket to do. */
+  pthread_mutex_t lock;
+  int failed;
+} defrag_work_t;
+
+static int
+version_file_cmp (const void *a, const void *b)
+{
+  const version_file_t *f1 = (const version_file_t *) a;
+  const version_file_t *f2 = (const version_file_t *) b;
+  if (f1->mtime != f2->mtime)
+    return f1->mtime > f2->mtime ? -1 : 1;  /* Newest first. */
+  return strcmp (f1->path, f2->path);
+}
+
+/* Sort by bucket and ID, earliest reference first. */
+static int
+ref_id_cmp (const void *a, const void *b)
+{
+  const defrag_ref_t *r1 = (const defrag_ref_t *) a;
+  const defrag_ref_t *r2 = (const defrag_ref_t *) b;
+  int c;
+  if (r1->bucket != r2->bucket)
+    return r1->bucket < r2->bucket ? -1 : 1;
+  c = arrow_id_cmp (&r1->id, &r2->id);
+  if (c != 0)
+    return c;
+  return r1->seq < r2->seq ? -1 : (r1->seq > r2->seq ? 1 : 0);
+}
+
+/* Sort by bucket, then by first reference. */
+static int
+ref_seq_cmp (const void *a, const void *b)
+{
+  const defrag_ref_t *r1 = (const defrag_ref_t *) a;
+  const defrag_ref_t *r2 = (const defrag_ref_t *) b;
+  if (r1->bucket != r2->bucket)
+    return r1->bucket < r2->bucket ? -1 : 1;
+  return r1->seq < r2->seq ? -1 : (r1->seq > r2->seq ? 1 : 0);
+}
+
+/* Keep only the first reference to each chunk. */
+static void
+refs_dedup (defrag_refs_t *refs)
+{
+  size_t i, out = 0;
+
+  qsort (refs->refs, refs->count, sizeof (defrag_ref_t), ref_id_cmp);
+  for (i = 0; i < refs->count; i++)
+    {
+      if (out > 0 && refs->refs[out-1].bucket == refs->refs[i].bucket
+          && arrow_id_cmp (&refs->refs[out-1].id, &refs->refs[i].id) == 0)
+        continue;
+      refs->refs[out++] = refs->refs[i];
+    }
+  refs->count = out;
+}
+
+static int
+list_version_files (filer_state_t *filer, version_file_t **files, size_t *count)
+{
+  dirlist_t top, sub;
+  version_file_t *list = NULL;
+  size_t n = 0, cap = 0;
+  struct stat st;
+  size_t i, j;
+
+  if (file_listdir (filer->rootdir, &top) != 0)
+    return -1;
+  for (i = 0; i < top.length; i++)
+    {
+      char *dir;
+      if (top.paths[i][0] == '.')
+        continue;
+      dir = path_join (filer->rootdir, top.paths[i]);
+      if (!file_isdir (dir) || file_listdir (dir, &sub) != 0)
+        {
+          free (dir);
+          continue;
+        }
+      for (j = 0; j < sub.length; j++)
+        {
+          char *path;
+          if (sub.paths[j][0] == '.')
+            continue;
+          path = path_join (dir, sub.paths[j]);
+          if (stat (path, &st) != 0 || !S_ISREG (st.st_mode))
+            {
+              free (path);
+              continue;
+            }
+          if (n == cap)
+            {
+              size_t newcap = cap == 0 ? 256 : cap * 2;
+              version_file_t *l = (version_file_t *)
+                realloc (list, newcap * sizeof (version_file_t));
+              if (l == NULL)
+                {
+                  free (path);
+                  file_free_dirlist (&sub);
+                  free (dir);
+                  file_free_dirlist (&top);
+                  while (n > 0)
+                    free (list[--n].path);
+                  free (list);
+                  errno = ENOMEM;
+                  return -1;
+                }
+              list = l;
+              cap = newcap;
+            }
+          list[n].path = path;
+          list[n].mtime = st.st_mtime;
+          n++;
+        }
+      file_free_dirlist (&sub);
+      free (dir);
+    }
+  file_free_dirlist (&top);
+
+  if (n > 0)
+    qsort (list, n, sizeof (version_file_t), version_file_cmp);
+  *files = list;
+  *count = n;
+  return 0;
+}
+
+/*
+ * Read every version file, recording references to chunks in buckets
+ * [first, last), numbered in the order we see them across all files.
+ * Returns -1 if a version file can't be read.
+ */
+static int
+collect_refs (store_state_t *store, version_file_t *files, size_t nfiles,
+              uint64_t first, uint64_t last, defrag_refs_t *refs)
+{
+  char id[STORE_ID_LEN + 1];
+  file_chunk_t chunk;
+  uint64_t seq = 0, bucket;
+  size_t i;
+  FILE *f;
+
+  for (i = 0; i < nfiles; i++)
+    {
+      f = fopen (files[i].path, "r");
+      if (f == NULL)
+        {
+          defrag_log (DEFRAG_TRACE, "%s: %s", files[i].path, strerror (errno));
+          return -1;
+        }
+      if (fseek (f, sizeof (file_info_t), SEEK_SET) != 0)
+        {
+          arrow_push_errno ();
+          fclose (f);
+          arrow_pop_errno ();
+          return -1;
+        }
+      while (fread (&chunk, sizeof (file_chunk_t), 1, f) == 1
+             && chunk.type != END_OF_CHUNKS)
+        {
+          seq++;
+          if (chunk.type != REFERENCE)
+            continue;
+          store_map_key (store, &chunk.chunk.ref.ref, id);
+          if (b64_decode (id, &bucket) != 0 || bucket < first || bucket >= last)
+            continue;
+          if (refs->count == refs->max)
+            {
+              /* Usually it's repeats that filled us up. If not, the
+                 blocks in this batch have grown past their initial
+                 size; the chunks we miss keep their current place,
+                 after the ones we saw. */
+              refs_dedup (refs);
+              if (refs->count == refs->max)
+                continue;
+            }
+          refs->refs[refs->count].id = chunk.chunk.ref.ref;
+          refs->refs[refs->count].bucket = bucket;
+          refs->refs[refs->count].seq = seq;
+          refs->count++;
+        }
+      if (ferror (f))
+        {
+          defrag_log (DEFRAG_TRACE, "%s: read error", files[i].path);
+          fclose (f);
+          errno = EIO;
+          return -1;
+        }
+      fclose (f);
+    }
+  return 0;
+}
+
+static void *
+defrag_worker (void *arg)
+{
+  defrag_work_t *work = (defrag_work_t *) arg;
+  arrow_id_t *order = NULL;
+  size_t maxorder = 0;
+
+  for (;;)
+    {
+      size_t begin, end, i;
+      uint64_t bucket;
+
+      pthread_mutex_lock (&work->lock);
+      begin = work->next;
+      if (begin >= work->count || work->failed)
+        {
+          pthread_mutex_unlock (&work->lock);
+          break;
+        }
+      bucket = work->refs[begin].bucket;
+      for (end = begin; end < work->count && work->refs[end].bucket == bucket; end++)
+        ;
+      work->next = end;
+      pthread_mutex_unlock (&work->lock);
+
+      if (end - begin > maxorder)
+        {
+          arrow_id_t *o = (arrow_id_t *) realloc (order, (end - begin) * sizeof (arrow_id_t));
+          if (o == NULL)
+            {
+              pthread_mutex_lock (&work->lock);
+              work->failed = 1;
+              pthread_mutex_unlock (&work->lock);
+              break;
+            }
+          order = o;
+          maxorder = end - begin;
+        }
+      for (i = begin; i < end; i++)
+        order[i - begin] = work->refs[i].id;
+
+      if (store_reorder (work->store, bucket, order, end - begin) != 0)
+        {
+          defrag_log (DEFRAG_TRACE, "reordering bucket %llu: %s", (unsigned long long) bucket, strerror (errno));
+          pthread_mutex_lock (&work->lock);
+          work->failed = 1;
+          pthread_mutex_unlock (&work->lock);
+          break;
+        }
+    }
+  free (order);
+  return NULL;
+}
+
+int
+filer_defragment (filer_state_t *filer, store_state_t *store,
+                  int threads, size_t max_memory)
+{
+  version_file_t *files;
+  size_t nfiles, i;
+  uint64_t buckets, per_batch, first;
+  defrag_refs_t refs;
+  defrag_work_t work;
+  pthread_t *tids;
+  int t, ret = 0;
+
+  if (threads < 1)
+    threads = 1;
+  if (list_version_files (filer, &files, &nfiles) != 0)
+    return -1;
+
+  /* Size batches so that one of each chunk in them fits. */
+  refs.max = max_memory / sizeof (defrag_ref_t);
+  if (refs.max < ARROW_BLOCK_INITIAL_COUNT)
+    refs.max = ARROW_BLOCK_INITIAL_COUNT;
+  per_batch = refs.max / ARROW_BLOCK_INITIAL_COUNT;
+  refs.refs = (defrag_ref_t *) malloc (refs.max * sizeof (defrag_ref_t));
+  tids = (pthread_t *) malloc (threads * sizeof (pthread_t));
+  if (refs.refs == NULL || tids == NULL)
+    {
+      free (refs.refs);
+      free (tids);
+      for (i = 0; i < nfiles; i++)
+        free (files[i].path);
+      free (files);
+      return -1;
+    }
+
+  buckets = store_bucket_count (store);
+  defrag_log (DEFRAG_TRACE, "%zu version files, %llu buckets, %llu buckets per batch",
+              nfiles, (unsigned long long) buckets, (unsigned long long) per_batch);
+
+  for (first = 0; first < buckets && ret == 0; first += per_batch)
+    {
+      refs.count = 0;
+      if (collect_refs (store, files, nfiles, first, first + per_batch, &refs) != 0)
+        {
+          ret = -1;
+          break;
+        }
+      refs_dedup (&refs);
+      qsort (refs.refs, refs.count, sizeof (defrag_ref_t), ref_seq_cmp);
+
+      work.store = store;
+      work.refs = refs.refs;
+      work.count = refs.count;
+      work.next = 0;
+      work.failed = 0;
+      pthread_mutex_init (&work.lock, NULL);
+      for (t = 0; t < threads; t++)
+        if (pthread_create (&tids[t], NULL, defrag_worker, &work) != 0)
+          break;
+      if (t == 0)
+        defrag_worker (&work);
+      while (t > 0)
+        pthread_join (tids[--t], NULL);
+      pthread_mutex_destroy (&work.lock);
+      if (work.failed)
+        ret = -1;
+    }
+
+  free (tids);
+  free (refs.refs);
+  for (i = 0; i < nfiles; i++)
+    free (files[i].path);
+  free (files);
+  return ret;
+}
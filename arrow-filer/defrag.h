@@ -0,0 +1,51 @@
+/* defrag.h -- Reorder store blocks by how files reference them
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+
+#ifndef __DEFRAG_H__
+#define __DEFRAG_H__
+
+#include <store.h>
+#include "fileinfo.h"
+
+/**
+ * Rewrite every block in the store so that its chunks are laid out in
+ * the order the filer's version files first reference them, newest
+ * versions first. Restoring a file then reads runs of neighbouring
+ * chunks from each block instead of jumping around in it.
+ *
+ * The store should not be in use by backups while this runs.
+ *
+ * \param filer      The filer whose version files to read.
+ * \param store      The store holding their chunks.
+ * \param threads    How many blocks to rewrite at once.
+ * \param max_memory About how many bytes to use for remembering
+ *                   reference order. Buckets are done in batches
+ *                   small enough to fit; each batch rereads the
+ *                   version files.
+ * \return Zero on success, -1 on error.
+ */
+int filer_defragment (filer_state_t *filer, store_state_t *store,
+                      int threads, size_t max_memory);
+
+#endif /* __DEFRAG_H__ */
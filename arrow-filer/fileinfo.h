@@ -46,6 +46,13 @@ typedef enum file_chunk_type_e
   DIRECT_CHUNK
 } file_chunk_type_t;
 
+/* How a file was cut into chunks. */
+typedef enum file_chunking_e
+{
+  FILE_CHUNKING_FIXED = 0, /**< Every chunk_size bytes. */
+  FILE_CHUNKING_CDC        /**< Content-defined; see cdc.h. */
+} file_chunking_t;
+
 typedef struct filer_state_s
 {
   char *rootdir;
@@ -83,12 +90,22 @@ typedef struct file_info_s
   uuid_t previous; /**< ID of previous version. */
   uint64_t size; /**< File size, in bytes. */
   mode_t mode;   /**< File mode. */
-  uint32_t chunk_size;  /**< How large chunks are. */
+  uint32_t chunk_size;  /**< How large chunks are, and how they were cut;
+                           use file_chunk_size and file_chunking. */
   struct timespec mtime; /**< Data modification time. */
   struct timespec ctime; /**< Status change time. */
   file_chunk_t chunks[0];
 } file_info_t;
 
+/* The chunking mode lives in the top byte of chunk_size, which files
+   written before there was a choice have clear; for CDC files the
+   rest is the average chunk size. */
+#define FILE_CHUNKING_SHIFT 24
+#define file_chunk_size(info) ((info)->chunk_size & ((1 << FILE_CHUNKING_SHIFT) - 1))
+#define file_chunking(info) ((file_chunking_t) ((info)->chunk_size >> FILE_CHUNKING_SHIFT))
+#define file_set_chunking(info,mode,size) \
+  ((info)->chunk_size = ((uint32_t) (mode) << FILE_CHUNKING_SHIFT) | (size))
+
 typedef struct file_direntry_s
 {
   file_type_t type;
@@ -21,6 +21,7 @@ OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
 WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -266,11 +267,22 @@ rpc_client_make_link (rpc_t *client, const char *path, const uuid_t uuid)
   return (int) response;
 }
 
-int
-rpc_client_add_ref (void *baton, const arrow_id_t *id)
+/*
+ * What a reply to an add-ref, put or emit comes to: RPC_DONE or
+ * RPC_EXISTS, as store_put would return them, or -1 for an error.
+ */
+static int
+reply_result (uint16_t response)
+{
+  if (response == RPC_DONE || response == RPC_EXISTS)
+	return (int) response;
+  errno = EIO;
+  return -1;
+}
+
+static int
+send_add_ref (rpc_t *client, const arrow_id_t *id)
 {
-  uint16_t response;
-  rpc_t *client = (rpc_t *) baton;
   rpc_client_log (RPC_CLIENT_TRACE, "%llx %016llx%016llx", id->weak,
 				  arrow_bytes_to_long ((uint8_t *) id->strong),
 				  arrow_bytes_to_long ((uint8_t *) id->strong + 8));
@@ -280,20 +292,13 @@ rpc_client_add_ref (void *baton, const arrow_id_t *id)
 	return -1;
   if (write_value (client, sizeof (arrow_key_t), 1, id->strong) != 1)
 	return -1;
-  fflush (client->out);
-
-  if (read_short (client, &response) != 1)
-	return -1;
-  rpc_client_log (RPC_CLIENT_TRACE, "%d", response);
-  return (int) response;
+  return 0;
 }
 
-int
-rpc_client_put_chunk (void *baton, const arrow_id_t *id, const void *buf, size_t len)
+static int
+send_put_chunk (rpc_t *client, const arrow_id_t *id, const void *buf, size_t len)
 {
-  uint16_t response;
-  rpc_t *client = (rpc_t *) baton;
-  rpc_client_log (RPC_CLIENT_TRACE, "%p %x %llx-%llx %p %d", baton, id->weak,
+  rpc_client_log (RPC_CLIENT_TRACE, "%p %x %llx-%llx %p %d", client, id->weak,
 				  arrow_bytes_to_long (id->strong),
 				  arrow_bytes_to_long (id->strong + 8), buf, len);
 
@@ -307,37 +312,24 @@ rpc_client_put_chunk (void *baton, const arrow_id_t *id, const void *buf, size_t
 	return -1;
   if (write_value (client, 1, len, buf) != len)
 	return -1;
-  fflush (client->out);
-
-  if (read_short (client, &response) != 1)
-	return -1;
-  rpc_client_log (RPC_CLIENT_TRACE, "%d", response);
-  return (int) response;
+  return 0;
 }
 
-int
-rpc_client_contains (void *baton, const arrow_id_t *id)
+static int
+send_contains (rpc_t *client, const arrow_id_t *id)
 {
-  uint16_t response;
-  rpc_t *client = (rpc_t *) baton;
   if (write_short (client, (uint16_t) STORE_BLOCK_EXISTS) != 1)
 	return -1;
   if (write_int (client, id->weak) != 1)
 	return -1;
   if (write_value (client, sizeof (arrow_key_t), 1, id->strong) != 1)
 	return -1;
-  fflush (client->out);
-
-  if (read_short (client, &response) != 1)
-	return -1;
-  return (int) response;
+  return 0;
 }
 
-int
-rpc_client_emit_chunk (void *baton, const file_chunk_t *chunk)
+static int
+send_emit_chunk (rpc_t *client, const file_chunk_t *chunk)
 {
-  uint16_t response;
-  rpc_t *client = (rpc_t *) baton;
   if (write_short (client, (uint16_t) FILE_EMIT_CHUNK) != 1)
 	return -1;
 
@@ -369,13 +361,182 @@ rpc_client_emit_chunk (void *baton, const file_chunk_t *chunk)
 		return -1;
 	  break;
 	}
+  return 0;
+}
+
+/*
+ * Flush what's been sent, and read a reply for each of count
+ * requests. If has is NULL, the replies are to add-refs, puts or
+ * emits, and any that reply_result takes for an error fails the
+ * batch; otherwise has[i] is whether reply i was nonzero.
+ */
+static int
+read_replies (rpc_t *client, size_t count, uint8_t *has)
+{
+  uint16_t response;
+  int ret = 0;
+  size_t i;
+
   fflush (client->out);
-  
+  for (i = 0; i < count; i++)
+	{
+	  if (read_short (client, &response) != 1)
+		return -1;
+	  rpc_client_log (RPC_CLIENT_TRACE, "%d", response);
+	  if (has != NULL)
+		has[i] = response != 0;
+	  else if (reply_result (response) < 0)
+		ret = -1;
+	}
+  return ret;
+}
+
+int
+rpc_client_add_ref (void *baton, const arrow_id_t *id)
+{
+  uint16_t response;
+  rpc_t *client = (rpc_t *) baton;
+  if (send_add_ref (client, id) != 0)
+	return -1;
+  fflush (client->out);
+
+  if (read_short (client, &response) != 1)
+	return -1;
+  rpc_client_log (RPC_CLIENT_TRACE, "%d", response);
+  return reply_result (response);
+}
+
+int
+rpc_client_put_chunk (void *baton, const arrow_id_t *id, const void *buf, size_t len)
+{
+  uint16_t response;
+  rpc_t *client = (rpc_t *) baton;
+  if (send_put_chunk (client, id, buf, len) != 0)
+	return -1;
+  fflush (client->out);
+
+  if (read_short (client, &response) != 1)
+	return -1;
+  rpc_client_log (RPC_CLIENT_TRACE, "%d", response);
+  return reply_result (response);
+}
+
+int
+rpc_client_contains (void *baton, const arrow_id_t *id)
+{
+  uint16_t response;
+  rpc_t *client = (rpc_t *) baton;
+  if (send_contains (client, id) != 0)
+	return -1;
+  fflush (client->out);
+
   if (read_short (client, &response) != 1)
 	return -1;
   return (int) response;
 }
 
+int
+rpc_client_emit_chunk (void *baton, const file_chunk_t *chunk)
+{
+  uint16_t response;
+  rpc_t *client = (rpc_t *) baton;
+  if (send_emit_chunk (client, chunk) != 0)
+	return -1;
+  fflush (client->out);
+  
+  if (read_short (client, &response) != 1)
+	return -1;
+  return reply_result (response);
+}
+
+/*
+ * The batched calls send every request before reading any reply, so a
+ * batch costs one round trip rather than one per chunk. Replies are
+ * two bytes each, so a batch's worth can't fill the pipe back and
+ * leave the server stuck while we're still writing.
+ */
+
+int
+rpc_client_contains_many (void *baton, const arrow_id_t *ids, size_t count, uint8_t *has)
+{
+  rpc_t *client = (rpc_t *) baton;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+	if (send_contains (client, &ids[i]) != 0)
+	  return -1;
+  return read_replies (client, count, has);
+}
+
+int
+rpc_client_put_chunks (void *baton, const arrow_id_t *ids, const void *const *bufs,
+					   const size_t *lens, size_t count)
+{
+  rpc_t *client = (rpc_t *) baton;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+	if (send_put_chunk (client, &ids[i], bufs[i], lens[i]) != 0)
+	  return -1;
+  return read_replies (client, count, NULL);
+}
+
+int
+rpc_client_add_refs (void *baton, const arrow_id_t *ids, size_t count)
+{
+  rpc_t *client = (rpc_t *) baton;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+	if (send_add_ref (client, &ids[i]) != 0)
+	  return -1;
+  return read_replies (client, count, NULL);
+}
+
+int
+rpc_client_emit_chunks (void *baton, const file_chunk_t *chunks, size_t count)
+{
+  rpc_t *client = (rpc_t *) baton;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+	if (send_emit_chunk (client, &chunks[i]) != 0)
+	  return -1;
+  return read_replies (client, count, NULL);
+}
+
+/*
+ * Ask which strong hash the server's store keys chunks with, so that
+ * new chunks can be hashed the same way. A nonzero response, or a
+ * hash we don't know, is an error.
+ */
+int
+rpc_client_store_hash (rpc_t *client, arrow_hash_t *hash)
+{
+  uint16_t response, value;
+  if (write_short (client, (uint16_t) STORE_HASH) != 1)
+	return -1;
+  fflush (client->out);
+
+  if (read_short (client, &response) != 1)
+	return -1;
+  rpc_client_log (RPC_CLIENT_TRACE, "%d", response);
+  if (response != 0)
+	{
+	  errno = EPROTO;
+	  return -1;
+	}
+  if (read_short (client, &value) != 1)
+	return -1;
+  if (value > ARROW_HASH_MAX)
+	{
+	  errno = EPROTO;
+	  return -1;
+	}
+  *hash = (arrow_hash_t) value;
+  return 0;
+}
+
 int
 rpc_client_close_file (rpc_t *client, file_t *file, int abort_file)
 {
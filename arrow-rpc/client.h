@@ -26,6 +26,7 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 
 #include <stdint.h>
 #include <fileinfo.h>
+#include <hash.h>
 #include "rpc.h"
 
 int rpc_client_read_link (rpc_t *client, const char *path, uuid_t uuid);
@@ -37,6 +38,12 @@ int rpc_client_add_ref (void *client, const arrow_id_t *id);
 int rpc_client_put_chunk (void *client, const arrow_id_t *id, const void *buf, size_t len);
 int rpc_client_contains (void *client, const arrow_id_t *id);
 int rpc_client_emit_chunk (void *client, const file_chunk_t *chunk);
+int rpc_client_contains_many (void *client, const arrow_id_t *ids, size_t count, uint8_t *has);
+int rpc_client_put_chunks (void *client, const arrow_id_t *ids, const void *const *bufs,
+                           const size_t *lens, size_t count);
+int rpc_client_add_refs (void *client, const arrow_id_t *ids, size_t count);
+int rpc_client_emit_chunks (void *client, const file_chunk_t *chunks, size_t count);
+int rpc_client_store_hash (rpc_t *client, arrow_hash_t *hash);
 int rpc_client_close_file (rpc_t *client, file_t *file, int abort);
 int rpc_client_goodbye (rpc_t *client);
 
@@ -39,9 +39,18 @@ typedef enum rpc_command_e
   STORE_BLOCK_EXISTS  =  9,
   FILE_EMIT_CHUNK     = 10,
   CLOSE_VERSION_FILE  = 11,
-  GOODBYE             = 12
+  GOODBYE             = 12,
+  STORE_HASH          = 13
 } rpc_command_t;
 
+/* Replies to STORE_ADD_REF, STORE_PUT_CHUNK and FILE_EMIT_CHUNK. Any
+   other reply is an error. */
+typedef enum rpc_reply_e
+{
+  RPC_DONE   = 0,
+  RPC_EXISTS = 1   /* The store already had the chunk; not a failure. */
+} rpc_reply_t;
+
 typedef struct rpc_stats_s
 {
   uint64_t bytes_in;
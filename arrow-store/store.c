@@ -26,15 +26,22 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <openssl/md5.h>
+#include <zlib.h>
 #include <base64.h>
+#include <crc32c.h>
 #include <rollsum.h>
 #include <fail.h>
 /* #include "../rslib/rs.h" */
@@ -87,19 +94,151 @@ int STORE_DEBUG = 0;
 #define store_trace(fmt, args...) store_log(STORE_TRACE, fmt, ##args)
 #define store_perror(fmt, args...) store_log(STORE_TRACE, fmt, ##args)
 
-#define STORE_CACHE_SIZE 128
+/*
+ * Blocks are guarded by a fixed set of lock stripes; block N belongs
+ * to stripe N % STORE_LOCK_STRIPES. Each stripe also owns its own
+ * slice of the open-block cache, so looking up or opening a block
+ * never contends with threads working on blocks in other stripes.
+ *
+ * Writers take the stripe lock. Lookups (store_get, store_get_len,
+ * store_contains) take no bucket lock at all: they read the block
+ * optimistically and start over if the stripe's sequence shows that
+ * chunks were moved around while they looked, the way read-only
+ * processes already check the superblock generation. This stands in
+ * for RCU or epochs; a block's mapping is only unmapped once nobody
+ * holds it open, so readers never need to defer a free, only to
+ * notice a move. Cache hits share the cache lock, and only misses
+ * take it exclusively.
+ */
+#define STORE_LOCK_STRIPES 32
+#define STORE_CACHE_WAYS 4
+#define STORE_CACHE_SIZE (STORE_LOCK_STRIPES * STORE_CACHE_WAYS)
 
 typedef struct store_cached_entry_s
 {
   store_t entry;
-  uint32_t refs;
+  uint32_t refs;        /**< Changed atomically under a shared cache_lock. */
 } store_cached_entry_t;
 
+typedef struct store_stripe_s
+{
+  pthread_rwlock_t lock;        /**< Guards the contents of this stripe's blocks. */
+  volatile uint32_t seq;        /**< Odd while chunks in them are being moved. */
+  pthread_rwlock_t cache_lock;  /**< Guards the cache slots below. */
+  store_cached_entry_t cache[STORE_CACHE_WAYS]; /**< Blocks kept open. */
+} store_stripe_t;
+
+/*
+ * Deferred reference count changes. Entries are appended as they come
+ * in and applied a block at a time by store_commit_refs.
+ */
+#define STORE_JOURNAL_LIMIT 65536
+
+typedef struct store_ref_delta_s
+{
+  arrow_id_t id;
+  int32_t delta;
+  uint64_t bucket;     /**< Filled in at commit time. */
+} store_ref_delta_t;
+
+/*
+ * The hot chunk cache pins the most referenced chunks in memory: their
+ * IDs, where they were last seen and, while they fit in the byte
+ * budget, their contents. Chunks are never removed from a store and
+ * never change, so a hit answers store_contains and store_get outright.
+ * The location is only a hint, checked against the block before
+ * store_addref trusts it. Entries are grouped into sets by key hash,
+ * and a chunk is only let into a full set if it has more references
+ * than the set's least referenced entry.
+ */
+#define STORE_HOT_SETS 1024
+#define STORE_HOT_WAYS 4
+#define STORE_HOT_MIN_REFS 8
+#define STORE_HOT_DATA_LIMIT (8 * 1024 * 1024)
+#define STORE_HOT_FILE ".hot"
+
+typedef struct store_hot_entry_s
+{
+  arrow_id_t id;
+  uint64_t bucket;      /**< The bucket the chunk was last seen in, */
+  uint32_t slot;        /**< and its key there. */
+  uint32_t length;
+  uint32_t references;  /**< The reference count it had then. */
+  int valid;
+  void *data;           /**< The chunk's contents, or NULL. */
+} store_hot_entry_t;
+
+/*
+ * The hot set is saved when a writer closes the store, so the next
+ * store_init can warm the cache without looking at every block.
+ */
+typedef struct store_hot_file_s
+{
+  char header[4];
+  uint32_t count;
+  arrow_id_t ids[0];
+} store_hot_file_t;
+
+/*
+ * The weak index records the weak sum and length of every chunk in
+ * the store, so sync can tell cheaply whether a window of a file might
+ * be a chunk the store already has. It is a hash table of cache line
+ * sized buckets, each holding up to eight (length, weak sum) pairs; a
+ * probe looks at one bucket, and only at the next if that one is full.
+ * Only presence is recorded, and a probe can give false positives (two
+ * chunks may share a weak sum), so callers check the strong sum.
+ */
+#define STORE_WEAK_FILE ".weak"
+#define STORE_WEAK_VERSION 1
+#define STORE_WEAK_WAYS 8
+#define STORE_WEAK_INITIAL_BUCKETS 4096
+#define STORE_WEAK_MAX_LOAD 0.70
+
+typedef struct store_weak_bucket_s
+{
+  uint32_t length[STORE_WEAK_WAYS];  /**< Zero for an empty way. */
+  uint32_t weak[STORE_WEAK_WAYS];
+} store_weak_bucket_t;
+
+typedef struct store_weak_index_s
+{
+  char header[4];
+  uint32_t version;
+  uint64_t buckets;     /**< A power of two. */
+  uint64_t count;
+  uint8_t pad[40];      /**< Align the buckets to a cache line. */
+  store_weak_bucket_t table[0];
+} store_weak_index_t;
+
 struct store_state_s
 {
   char *rootdir;
   mapped_file_t data; /**< The memory-mapped superblock. */
-  store_cached_entry_t cache[STORE_CACHE_SIZE]; /**< Cache of stores kept open. */
+  store_stripe_t stripes[STORE_LOCK_STRIPES];
+  pthread_mutex_t split_lock;   /**< Serializes splits. */
+  volatile uint32_t map_seq;    /**< Odd while a split is changing i and n. */
+  int unstable;                 /**< Splits or rewrites in progress;
+                                     guarded by split_lock. */
+  int readonly;                 /**< Opened with store_init_readonly. */
+  mapped_file_t dirdata;        /**< The directory, for extendible hashing. */
+  struct store_dir_s *dir;
+  pthread_mutex_t journal_lock; /**< Guards the fields below. */
+  store_ref_delta_t *journal;   /**< Pending reference count changes. */
+  size_t journal_len;
+  size_t journal_cap;
+  size_t journal_limit;         /**< Commit once this many are pending. */
+  store_hot_entry_t *hot;       /**< STORE_HOT_SETS * STORE_HOT_WAYS entries. */
+  pthread_rwlock_t hot_locks[STORE_LOCK_STRIPES]; /**< Guard the hot sets. */
+  size_t hot_bytes;             /**< Chunk bytes in the hot cache. */
+  size_t hot_limit;             /**< Most it may hold. */
+  uint32_t hot_saved_keys;      /**< Keys hot_warm read from the saved set, */
+  uint64_t hot_scanned_blocks;  /**< or blocks it scanned instead. */
+  pthread_mutex_t weak_lock;    /**< Serializes changes to the weak index. */
+  store_weak_index_t * volatile weak; /**< The mapped weak index, or NULL. */
+  mapped_file_t weakdata;
+  mapped_file_t *weak_old;      /**< Outgrown mappings, which lock-free
+                                     probes may still be reading. */
+  size_t weak_old_count;
   struct rs_handle *rs;
 };
 
@@ -114,8 +253,34 @@ typedef struct store_sb_s
   uint8_t version;
   uint16_t i;      /**< Linear hash level. */
   uint64_t n;      /**< Linear hash pointer. */
+  uint64_t generation; /**< Odd while a split is moving chunks (version 2). */
+  uint8_t scheme;      /**< A store_scheme_t (version 3). */
+  uint8_t depth;       /**< Extendible hash global depth. */
+  uint64_t buckets;    /**< Extendible hash bucket count. */
+  uint64_t write_generation; /**< Bumped by every change (version 4);
+                                  starts at 1, so 0 means "never". */
+  uint8_t hash;        /**< An arrow_hash_t (version 5). */
 } store_sb_t;
 
+#define STORE_SB_VERSION 5
+
+/*
+ * Stores using extendible hashing keep a directory, mapping the low
+ * `depth' bits of a key to a bucket, alongside the superblock. It is
+ * sized for the largest directory up front (the file is sparse), so
+ * doubling it never has to remap anything.
+ */
+#define STORE_DIRECTORY ".directory"
+#define STORE_EXT_MAX_DEPTH 20
+
+typedef struct store_dir_s
+{
+  char header[4];
+  uint8_t version;
+  uint64_t buckets[1 << STORE_EXT_MAX_DEPTH];    /**< Directory entries. */
+  uint8_t local_depth[1 << STORE_EXT_MAX_DEPTH]; /**< Per bucket. */
+} store_dir_t;
+
 typedef struct block_key_s
 {
   arrow_id_t id;        /**< The block identifier. */
@@ -138,14 +303,64 @@ typedef struct block_header_s
   block_key_t keys[0];
 } block_header_t;
 
+/*
+ * Version 2 blocks follow the keys with an array holding each chunk's
+ * CRC-32C (the first field of a block_key_ext_t), one per key.
+ * Version 3 blocks instead have a block_ext_header_t, 8-byte aligned,
+ * then a whole block_key_ext_t per key. Version 1 blocks have neither.
+ */
+#define BLOCK_VERSION_CRC 2
+#define BLOCK_VERSION_GEN 3
+#define BLOCK_VERSION BLOCK_VERSION_GEN
+
+typedef struct block_key_ext_s
+{
+  uint32_t crc32c;      /**< CRC-32C of the chunk. */
+  uint32_t flags;       /**< BLOCK_KEY_* flags. */
+  uint64_t created;     /**< Write generation the chunk was added in. */
+  uint64_t modified;    /**< Write generation it last changed in. */
+} block_key_ext_t;
+
+/*
+ * A cold chunk has been moved out to a pack under cold/ by store_tier;
+ * its data in the block is a block_forward_t saying where it went, and
+ * the key's length and CRC-32C are those of the forward.
+ */
+#define BLOCK_KEY_COLD 1
+
+typedef struct block_forward_s
+{
+  uint64_t pack;        /**< Which pack: cold/<pack, in hex>.pack. */
+  uint64_t offset;      /**< Where the chunk's store_pack_chunk_t is. */
+  uint32_t length;      /**< The chunk's real length. */
+  uint32_t crc32c;      /**< And its CRC-32C. */
+} block_forward_t;
+
+typedef struct block_ext_header_s
+{
+  uint64_t generation;  /**< Latest write generation of any key. */
+} block_ext_header_t;
+
 static const block_key_t null_key = { { 0, { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } }, 0, 0, 0 };
 
 static const char superblock_header[4] = { 'A', 'R', 'W', 'S' };
 static const char block_header[4] = { 'A', 'R', 'W', 'B' };
+static const char directory_header[4] = { 'A', 'R', 'W', 'D' };
+static const char hot_header[4] = { 'A', 'R', 'W', 'H' };
+static const char weak_header[4] = { 'A', 'R', 'W', 'W' };
 
 static int
 store_put_into_int (store_t *store, const arrow_id_t *id, const void *buf, size_t len,
-                    int gen_rs, struct rs_handle *rs);
+                    int gen_rs, struct rs_handle *rs, uint64_t wgen,
+                    const block_key_ext_t *from);
+static void hot_warm (store_state_t *state);
+static void hot_save (store_state_t *state);
+static void hot_free (store_state_t *state);
+static void weak_open (store_state_t *state);
+static void weak_add (store_state_t *state, uint32_t weak, uint32_t length);
+static void weak_free (store_state_t *state);
+static size_t cold_read (store_state_t *state, const block_forward_t *fwd,
+                         void *out, size_t maxlen);
 
  /* Static functions. */
 
@@ -160,20 +375,34 @@ make_rs_handle (void)
   return NULL;
 }
 
+static uint64_t
+store_key_hash (const arrow_id_t *id)
+{
+  return (((uint64_t) (id->strong[8] & 0xFFULL) << 56)
+          | ((uint64_t) (id->strong[9] & 0xFFULL) << 48)
+          | ((uint64_t) (id->strong[10] & 0xFFULL) << 40)
+          | ((uint64_t) (id->strong[11] & 0xFFULL) << 32)
+          | ((uint64_t) (id->strong[12] & 0xFFULL) << 24)
+          | ((uint64_t) (id->strong[13] & 0xFFULL) << 16)
+          | ((uint64_t) (id->strong[14] & 0xFFULL) << 8)
+          | ((uint64_t) (id->strong[15] & 0xFFULL)));
+}
+
 static uint64_t
 do_map_key(store_state_t *state, const arrow_id_t *id, uint64_t n)
 {
   uint64_t key = 0, x = 0;
   store_sb_t *sb = (store_sb_t *) state->data.data;
 
-  x = (((uint64_t) (id->strong[8] & 0xFFULL) << 56)
-	   | ((uint64_t) (id->strong[9] & 0xFFULL) << 48)
-	   | ((uint64_t) (id->strong[10] & 0xFFULL) << 40)
-       | ((uint64_t) (id->strong[11] & 0xFFULL) << 32)
-       | ((uint64_t) (id->strong[12] & 0xFFULL) << 24)
-       | ((uint64_t) (id->strong[13] & 0xFFULL) << 16)
-       | ((uint64_t) (id->strong[14] & 0xFFULL) << 8)
-       | ((uint64_t) (id->strong[15] & 0xFFULL)));
+  x = store_key_hash (id);
+  if (sb->scheme == STORE_EXTENDIBLE_HASH)
+    {
+      key = state->dir->buckets[x & ((1ULL << sb->depth) - 1)];
+      store_trace("%llu (depth: %u) -> %llu", (unsigned long long) x, sb->depth,
+                  (unsigned long long) key);
+      return key;
+    }
+
   store_trace("%llu (i: %u, n: %llu)", x, sb->i, sb->n);
   key = x & ((1ULL << sb->i) - 1);
   if (key < n)
@@ -182,11 +411,283 @@ do_map_key(store_state_t *state, const arrow_id_t *id, uint64_t n)
   return key;
 }
 
+/*
+ * Map a key against a consistent snapshot of (i, n). Splits bump
+ * map_seq to an odd value while they rewrite the superblock, so we
+ * retry until we see the same even value before and after.
+ */
+static uint64_t
+map_key_stable (store_state_t *state, const arrow_id_t *id)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  uint32_t seq;
+  uint64_t key;
+
+  do
+    {
+      while ((seq = state->map_seq) & 1)
+        sched_yield ();
+      __sync_synchronize ();
+      key = do_map_key (state, id, sb->n);
+      __sync_synchronize ();
+    }
+  while (seq != state->map_seq);
+
+  return key;
+}
+
+inline static store_stripe_t *
+store_stripe (store_state_t *state, uint64_t bucket)
+{
+  return &state->stripes[bucket % STORE_LOCK_STRIPES];
+}
+
+static store_stripe_t *
+store_stripe_of_id (store_state_t *state, const char *id)
+{
+  uint64_t bucket = 0;
+  b64_decode (id, &bucket);
+  return store_stripe (state, bucket);
+}
+
+static void
+store_lock_bucket (store_state_t *state, uint64_t bucket, int write)
+{
+  store_stripe_t *stripe = store_stripe (state, bucket);
+  if (write)
+    pthread_rwlock_wrlock (&stripe->lock);
+  else
+    pthread_rwlock_rdlock (&stripe->lock);
+}
+
+static void
+store_unlock_bucket (store_state_t *state, uint64_t bucket)
+{
+  pthread_rwlock_unlock (&store_stripe (state, bucket)->lock);
+}
+
+/*
+ * Find the bucket for id and lock its stripe. If a split moved the
+ * key while we were waiting for the lock, drop it and try again.
+ */
+static uint64_t
+store_lock_key (store_state_t *state, const arrow_id_t *id, int write, char *result)
+{
+  uint64_t bucket;
+
+  for (;;)
+    {
+      bucket = map_key_stable (state, id);
+      store_lock_bucket (state, bucket, write);
+      if (map_key_stable (state, id) == bucket)
+        break;
+      store_unlock_bucket (state, bucket);
+    }
+
+  b64_encode (bucket, result);
+  return bucket;
+}
+
+/*
+ * Mark the chunks in the blocks of stripes s1 and s2 (which may be the
+ * same) as moving, and again as done moving, for the lookups that
+ * don't take stripe locks. Called with both stripes write-locked.
+ */
+static void
+store_stripes_moving (store_stripe_t *s1, store_stripe_t *s2)
+{
+  __sync_fetch_and_add (&s1->seq, 1);
+  if (s2 != s1)
+    __sync_fetch_and_add (&s2->seq, 1);
+}
+
+/*
+ * Find the bucket for id without locking it, and note its stripe's
+ * sequence in *seq. The lookup must then check store_lookup_retry, as
+ * a writer may be moving the chunk while we look at it.
+ */
+static uint64_t
+store_lookup_key (store_state_t *state, const arrow_id_t *id, uint32_t *seq,
+                  char *result)
+{
+  store_stripe_t *stripe;
+  uint64_t bucket;
+
+  for (;;)
+    {
+      bucket = map_key_stable (state, id);
+      stripe = store_stripe (state, bucket);
+      while ((*seq = stripe->seq) & 1)
+        sched_yield ();
+      __sync_synchronize ();
+      /* A split that finished before we read the sequence may have
+         moved the key already. */
+      if (map_key_stable (state, id) == bucket)
+        break;
+    }
+
+  b64_encode (bucket, result);
+  return bucket;
+}
+
+static int
+store_lookup_retry (store_state_t *state, uint64_t bucket, uint32_t seq)
+{
+  __sync_synchronize ();
+  return store_stripe (state, bucket)->seq != seq;
+}
+
+/*
+ * Read-only states share the store with a writer in another process
+ * that doesn't see our locks. Lookups there note the superblock
+ * generation first and start over if a split ran while they were
+ * looking at the block.
+ */
+static uint64_t
+store_read_begin (store_state_t *state)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  uint64_t gen;
+
+  if (!state->readonly)
+    return 0;
+  while ((gen = sb->generation) & 1)
+    sched_yield ();
+  __sync_synchronize ();
+  return gen;
+}
+
+static int
+store_read_retry (store_state_t *state, uint64_t gen)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+
+  if (!state->readonly)
+    return 0;
+  __sync_synchronize ();
+  return sb->generation != gen;
+}
+
+/*
+ * Bracket changes that move chunks around inside or between blocks.
+ * The superblock generation stays odd while any are in progress, so
+ * readers in other processes retry. Called with split_lock held.
+ */
+static void
+store_unstable_begin (store_state_t *state)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  if (state->unstable++ == 0)
+    {
+      sb->generation++;
+      __sync_synchronize ();
+    }
+}
+
+static void
+store_unstable_end (store_state_t *state)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  if (--state->unstable == 0)
+    {
+      __sync_synchronize ();
+      sb->generation++;
+    }
+}
+
+/* Where the data after the keys starts, for a block version. */
+inline static size_t
+block_ext_offset (uint8_t version, size_t count)
+{
+  size_t offset = sizeof (block_header_t) + (count * sizeof (block_key_t));
+  if (version >= BLOCK_VERSION_GEN)
+    offset = (offset + 7) & ~((size_t) 7);
+  return offset;
+}
+
+inline static size_t
+block_key_ext_size (uint8_t version)
+{
+  if (version >= BLOCK_VERSION_GEN)
+    return sizeof (block_key_ext_t);
+  if (version >= BLOCK_VERSION_CRC)
+    return sizeof (uint32_t);
+  return 0;
+}
+
+/* The size of everything before the data region. */
+inline static size_t
+block_header_size (uint8_t version, size_t count)
+{
+  size_t size = block_ext_offset (version, count);
+  if (version >= BLOCK_VERSION_GEN)
+    size += sizeof (block_ext_header_t);
+  return size + (count * block_key_ext_size (version));
+}
+
 inline static size_t
 store_header_size (store_t *store)
 {
   block_header_t *header = (block_header_t *) store->data.data;
-  return sizeof (block_header_t) + (header->chunk_count * sizeof (block_key_t));
+  return block_header_size (header->version, header->chunk_count);
+}
+
+/* The block-wide extended info, or NULL before version 3. */
+inline static block_ext_header_t *
+store_block_ext (store_t *store)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  if (header->version < BLOCK_VERSION_GEN)
+    return NULL;
+  return (block_ext_header_t *) (store->data.data
+                                 + block_ext_offset (header->version,
+                                                     header->chunk_count));
+}
+
+/* The extended key info for key i, or NULL for version 1 blocks. Only
+   the CRC is there in version 2 blocks. */
+inline static block_key_ext_t *
+store_key_ext (store_t *store, int i)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  size_t offset;
+  if (header->version < BLOCK_VERSION_CRC)
+    return NULL;
+  offset = block_ext_offset (header->version, header->chunk_count);
+  if (header->version >= BLOCK_VERSION_GEN)
+    offset += sizeof (block_ext_header_t);
+  return (block_key_ext_t *) (store->data.data + offset
+                              + (i * block_key_ext_size (header->version)));
+}
+
+/* Record that key i changed in write generation wgen. */
+static void
+stamp_key (store_t *store, int i, uint64_t wgen, int created)
+{
+  block_ext_header_t *bext = store_block_ext (store);
+  block_key_ext_t *ext;
+
+  if (bext == NULL || wgen == 0)
+    return;
+  ext = store_key_ext (store, i);
+  if (created)
+    ext->created = wgen;
+  ext->modified = wgen;
+  if (bext->generation < wgen)
+    bext->generation = wgen;
+}
+
+/* Free key slot i. Its extended info goes with it, so a chunk put in
+   the slot later doesn't inherit a stale forward flag or stamp. */
+static void
+clear_key (store_t *store, int i)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_ext_t *ext = store_key_ext (store, i);
+
+  memset (&header->keys[i], 0, sizeof (block_key_t));
+  if (ext != NULL)
+    memset (ext, 0, block_key_ext_size (header->version));
 }
 
 inline static void *
@@ -215,6 +716,67 @@ store_offset_of_chunk_number (store_t *store, int i)
   return store_header_size (store) + keys[i].offset;
 }
 
+/*
+ * If key i is a forward to a cold chunk, copy the forward to *fwd and
+ * return nonzero.
+ */
+static int
+store_key_forward (store_t *store, int i, block_forward_t *fwd)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *key = &header->keys[i];
+
+  if (header->version < BLOCK_VERSION_GEN
+      || !(store_key_ext (store, i)->flags & BLOCK_KEY_COLD)
+      || key->length != sizeof (block_forward_t)
+      || store_offset_of_chunk (store, key->offset) + key->length > store->data.length)
+    return 0;
+  memcpy (fwd, store_data_base (store) + key->offset, sizeof (block_forward_t));
+  return 1;
+}
+
+/* The length of key i's chunk, wherever it is kept. */
+static uint32_t
+store_key_length (store_t *store, int i)
+{
+  block_forward_t fwd;
+
+  if (store_key_forward (store, i, &fwd))
+    return fwd.length;
+  return ((block_header_t *) store->data.data)->keys[i].length;
+}
+
+uint64_t
+store_bucket_count (store_state_t *state)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  if (sb->scheme == STORE_EXTENDIBLE_HASH)
+    return sb->buckets;
+  return (1ULL << sb->i) + sb->n;
+}
+
+static uint64_t
+store_next_generation (store_state_t *state)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  return __sync_add_and_fetch (&sb->write_generation, 1);
+}
+
+static int
+store_key_index (store_t *store, const arrow_id_t *id)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  int i;
+
+  for (i = 0; i < header->chunk_count; i++)
+    {
+      if (arrow_id_cmp (&keys[i].id, id) == 0)
+        return i;
+    }
+  return -1;
+}
+
 static double
 store_load_factor (store_t *store)
 {
@@ -236,8 +798,7 @@ static void *
 get_parity_bytes (store_t *store, int i)
 {
   block_header_t *header = (block_header_t *) store->data.data;
-  size_t offset = (sizeof (block_header_t) + (header->chunk_count * sizeof (block_key_t))
-                   + (header->alloc_size));
+  size_t offset = store_header_size (store) + header->alloc_size;
 
   offset = align_up (offset, RS_CODEWORD_SIZE);
   return store->data.data + offset + (i * RS_PARITY_SIZE);
@@ -308,12 +869,12 @@ create_new_block (store_state_t *state, uint64_t id)
   struct stat st;
 
   memcpy (header.header, block_header, 4);
-  header.version = ARROW_FILE_VERSION;
+  header.version = BLOCK_VERSION;
   header.chunk_count = ARROW_BLOCK_INITIAL_COUNT;
   header.alloc_size = header.chunk_count * ARROW_CHUNK_SIZE;
 
   /* What's the total size of our file? */
-  total_size = (sizeof (block_header_t) + (header.chunk_count * sizeof (block_key_t))
+  total_size = (block_header_size (header.version, header.chunk_count)
                 + (header.alloc_size));
   total_size = align_up (total_size, RS_CODEWORD_SIZE);
   total_size += (total_size / RS_CODEWORD_SIZE) * RS_PARITY_SIZE;
@@ -392,8 +953,11 @@ compact_block (store_state_t *state, store_t *store)
                        store_data_base (store) + keys[i].offset,
                        keys[i].length);
               memmove (&keys[j], &keys[i], sizeof(block_key_t));
+              if (store_key_ext (store, j) != NULL)
+                memmove (store_key_ext (store, j), store_key_ext (store, i),
+                         block_key_ext_size (header->version));
               keys[j].offset = offset;
-              memset (&keys[i], 0, sizeof (block_key_t));
+              clear_key (store, i);
               last = keys[i].offset + keys[i].length;
               /* Find the next empty slot, which might be slot i. */
               j++;
@@ -448,9 +1012,14 @@ split_next_store (store_state_t *state)
   block_key_t *currkeys;
   int i;
   int count = 0, moved = 0;
-  uint64_t limit = (1ULL << sb->i) - 1;
+  uint64_t limit;
   int begin, end;
   clock_t clk;
+  store_stripe_t *s1, *s2;
+
+  /* Only one split at a time; it locks just the two buckets involved. */
+  pthread_mutex_lock (&state->split_lock);
+  limit = (1ULL << sb->i) - 1;
 
   store_trace ("n: %llu, limit: %llu", sb->n, limit);
 
@@ -459,15 +1028,35 @@ split_next_store (store_state_t *state)
 
   store_log (STORE_SPLIT, "splitting store %llu into %llu", sb->n, next_id);
 
+  s1 = store_stripe (state, sb->n);
+  s2 = store_stripe (state, next_id);
+  if (s2 < s1)
+    {
+      store_stripe_t *tmp = s1;
+      s1 = s2;
+      s2 = tmp;
+    }
+  pthread_rwlock_wrlock (&s1->lock);
+  if (s2 != s1)
+    pthread_rwlock_wrlock (&s2->lock);
+
+  /* Readers in other processes don't take our locks; they retry if
+     the generation changed or is odd while they were reading. */
+  store_unstable_begin (state);
+  store_stripes_moving (s1, s2);
+
   b64_encode (sb->n, curr.id); 
   if (store_open (state, &curr) != 0)
-    return -1;
+    goto fail;
   currhdr = (block_header_t *) curr.data.data;
   currkeys = currhdr->keys;
 
   b64_encode (next_id, next.id);
   if (store_open (state, &next) != 0)
-    return -1;
+    {
+      store_close (state, &curr);
+      goto fail;
+    }
 
   clk = clock();
   for (i = 0; i < currhdr->chunk_count; i++)
@@ -485,9 +1074,10 @@ split_next_store (store_state_t *state)
               assert (x == next_id);
               store_put_into_int (&next, &currkeys[i].id,
                                   store_data_base (&curr) + currkeys[i].offset,
-                                  currkeys[i].length, 0, NULL);
+                                  currkeys[i].length, 0, NULL, 0,
+                                  store_key_ext (&curr, i));
               /* Erase the key from the original block. */
-              memset (&currkeys[i], 0, sizeof (block_key_t));
+              clear_key (&curr, i);
               moved++;
             }
         }
@@ -514,6 +1104,7 @@ split_next_store (store_state_t *state)
   generate_rscode (state->rs, &next, begin, end);
                           
   /* If we've split all 0..2^i-1 stores, increment i and start over. */
+  __sync_fetch_and_add (&state->map_seq, 1);
   if (sb->n == limit)
     {
       store_trace ("incrementing i");
@@ -522,6 +1113,7 @@ split_next_store (store_state_t *state)
     }
   else
     sb->n++;
+  __sync_fetch_and_add (&state->map_seq, 1);
 
   /* Compact the block that we moved entries out of. */
   compact_block (state, &curr);
@@ -533,28 +1125,393 @@ split_next_store (store_state_t *state)
              moved, count, (double) moved / (double) count,
              sb->n, sb->i);
 
+  store_stripes_moving (s1, s2);
+  store_unstable_end (state);
+
+  if (s2 != s1)
+    pthread_rwlock_unlock (&s2->lock);
+  pthread_rwlock_unlock (&s1->lock);
+  pthread_mutex_unlock (&state->split_lock);
   return 0;
+
+ fail:
+  store_stripes_moving (s1, s2);
+  store_unstable_end (state);
+  if (s2 != s1)
+    pthread_rwlock_unlock (&s2->lock);
+  pthread_rwlock_unlock (&s1->lock);
+  pthread_mutex_unlock (&state->split_lock);
+  return -1;
 }
 
-int
-store_init (const char *rootdir, store_state_t **state)
+/*
+ * Extendible hashing: split the given (overflowing) bucket itself,
+ * moving the keys whose next hash bit is set into a new bucket, and
+ * doubling the directory first if the bucket is already as deep as
+ * the directory.
+ */
+static int
+split_bucket (store_state_t *state, uint64_t bucket)
 {
-  struct stat statbuf;
-  char *path;
-  size_t len = strlen (rootdir) + strlen(STORE_SUPERBLOCK) + 2;
-  store_state_t *st = NULL;
-  int create = 0;
-  size_t pagesize = getpagesize();
+  store_sb_t *sb = state->data.data;
+  store_dir_t *dir = state->dir;
+  uint64_t next_id, pattern = 0, mask, j;
+  uint8_t d;
+  store_t next, curr;
+  block_header_t *currhdr;
+  block_key_t *currkeys;
+  int i;
+  int count = 0, moved = 0;
+  store_stripe_t *s1, *s2;
+  clock_t clk;
 
-  *state = NULL;
+  pthread_mutex_lock (&state->split_lock);
+  d = dir->local_depth[bucket];
+  next_id = sb->buckets;
+  if (d >= STORE_EXT_MAX_DEPTH || next_id >= (1ULL << STORE_EXT_MAX_DEPTH))
+    {
+      store_log (STORE_SPLIT, "bucket %llu can't be split any further",
+                 (unsigned long long) bucket);
+      pthread_mutex_unlock (&state->split_lock);
+      errno = ENOSPC;
+      return -1;
+    }
 
-  path = (char *) malloc (len);
-  store_trace ("malloc %ld -> %p", len, path);
-  if (path == NULL)
-    return -1;
-  snprintf (path, len, "%s/%s", rootdir, STORE_SUPERBLOCK);
+  s1 = store_stripe (state, bucket);
+  s2 = store_stripe (state, next_id);
+  if (s2 < s1)
+    {
+      store_stripe_t *tmp = s1;
+      s1 = s2;
+      s2 = tmp;
+    }
+  pthread_rwlock_wrlock (&s1->lock);
+  if (s2 != s1)
+    pthread_rwlock_wrlock (&s2->lock);
 
-  store_trace ("path is %s", path);
+  b64_encode (bucket, curr.id);
+  if (store_open (state, &curr) != 0)
+    goto fail;
+
+  /* Someone else may have split this bucket while we waited. */
+  if (store_load_factor (&curr) <= MAX_LOAD_FACTOR)
+    {
+      store_close (state, &curr);
+      if (s2 != s1)
+        pthread_rwlock_unlock (&s2->lock);
+      pthread_rwlock_unlock (&s1->lock);
+      pthread_mutex_unlock (&state->split_lock);
+      return 0;
+    }
+
+  if (create_new_block (state, next_id) != 0)
+    {
+      store_close (state, &curr);
+      goto fail;
+    }
+  b64_encode (next_id, next.id);
+  if (store_open (state, &next) != 0)
+    {
+      store_close (state, &curr);
+      goto fail;
+    }
+
+  store_log (STORE_SPLIT, "splitting bucket %llu (depth %u) into %llu",
+             (unsigned long long) bucket, d, (unsigned long long) next_id);
+
+  store_unstable_begin (state);
+  store_stripes_moving (s1, s2);
+
+  currhdr = (block_header_t *) curr.data.data;
+  currkeys = currhdr->keys;
+  clk = clock();
+  for (i = 0; i < currhdr->chunk_count; i++)
+    {
+      if (memcmp (&currkeys[i], &null_key, sizeof (block_key_t)) != 0)
+        {
+          uint64_t x = store_key_hash (&currkeys[i].id);
+          pattern = x & ((1ULL << d) - 1);
+          count++;
+          if ((x >> d) & 1)
+            {
+              store_put_into_int (&next, &currkeys[i].id,
+                                  store_data_base (&curr) + currkeys[i].offset,
+                                  currkeys[i].length, 0, NULL, 0,
+                                  store_key_ext (&curr, i));
+              clear_key (&curr, i);
+              moved++;
+            }
+        }
+    }
+  clk = clock() - clk;
+  store_log (STORE_PERF, "moving %d blocks took %f seconds",
+             moved, (double) clk / (double) CLOCKS_PER_SEC);
+
+  /* Point the half of this bucket's directory entries with bit d set
+     at the new bucket. */
+  __sync_fetch_and_add (&state->map_seq, 1);
+  if (d == sb->depth)
+    {
+      memcpy (&dir->buckets[1ULL << sb->depth], dir->buckets,
+              (1ULL << sb->depth) * sizeof (uint64_t));
+      sb->depth++;
+    }
+  mask = 1ULL << d;
+  for (j = pattern | mask; j < (1ULL << sb->depth); j += mask << 1)
+    dir->buckets[j] = next_id;
+  dir->local_depth[bucket] = d + 1;
+  dir->local_depth[next_id] = d + 1;
+  sb->buckets++;
+  __sync_fetch_and_add (&state->map_seq, 1);
+
+  compact_block (state, &curr);
+
+  store_close (state, &curr);
+  store_close (state, &next);
+
+  store_log (STORE_SPLIT, "moved %d out of %d chunks; depth is %u, %llu buckets",
+             moved, count, sb->depth, (unsigned long long) sb->buckets);
+
+  store_stripes_moving (s1, s2);
+  store_unstable_end (state);
+
+  if (s2 != s1)
+    pthread_rwlock_unlock (&s2->lock);
+  pthread_rwlock_unlock (&s1->lock);
+  pthread_mutex_unlock (&state->split_lock);
+  return 0;
+
+ fail:
+  if (s2 != s1)
+    pthread_rwlock_unlock (&s2->lock);
+  pthread_rwlock_unlock (&s1->lock);
+  pthread_mutex_unlock (&state->split_lock);
+  return -1;
+}
+
+static int
+open_directory (store_state_t *state, int create)
+{
+  char *path;
+  size_t len = strlen (state->rootdir) + strlen (STORE_DIRECTORY) + 2;
+  size_t pagesize = getpagesize();
+
+  path = (char *) malloc (len);
+  if (path == NULL)
+    return -1;
+  snprintf (path, len, "%s/%s", state->rootdir, STORE_DIRECTORY);
+
+  if (state->readonly)
+    state->dirdata.fd = open (path, O_RDONLY);
+  else
+    state->dirdata.fd = open (path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+  free (path);
+  if (state->dirdata.fd < 0)
+    return -1;
+
+  if (create && ftruncate (state->dirdata.fd, (off_t) sizeof (store_dir_t)) != 0)
+    {
+      close (state->dirdata.fd);
+      return -1;
+    }
+
+  state->dirdata.length = align_up (sizeof (store_dir_t), pagesize);
+  state->dirdata.data = mmap (NULL, state->dirdata.length,
+                              state->readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+                              MAP_SHARED, state->dirdata.fd, 0);
+  if (state->dirdata.data == (void *) -1)
+    {
+      close (state->dirdata.fd);
+      return -1;
+    }
+  state->dir = (store_dir_t *) state->dirdata.data;
+
+  if (create)
+    {
+      memcpy (state->dir->header, directory_header, 4);
+      state->dir->version = ARROW_FILE_VERSION;
+      state->dir->buckets[0] = 0;
+      state->dir->local_depth[0] = 0;
+    }
+  return 0;
+}
+
+/*
+ * Rewrite a block written before BLOCK_VERSION in the current layout,
+ * moving the data region up to make room for the larger extended key
+ * info. Chunks in an upgraded block have write generation zero.
+ */
+static int
+upgrade_block (store_state_t *state, uint64_t bucket)
+{
+  char id[STORE_ID_LEN + 1];
+  char *path;
+  size_t len = strlen (state->rootdir) + strlen (ARROW_BLOCKS_DIR) + STORE_ID_LEN + 3;
+  block_header_t header;
+  struct stat st;
+  size_t oldhdr, newhdr, extoff, datalen;
+  off_t newsize;
+  uint8_t *base;
+  block_key_t *keys;
+  block_key_ext_t *ext;
+  uint32_t *oldcrc = NULL;
+  int fd, i;
+
+  path = (char *) malloc (len);
+  if (path == NULL)
+    return -1;
+  b64_encode (bucket, id);
+  snprintf (path, len, "%s/%s/%s", state->rootdir, ARROW_BLOCKS_DIR, id);
+  fd = open (path, O_RDWR);
+  free (path);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -1;
+
+  if (fstat (fd, &st) != 0
+      || pread (fd, &header, sizeof (header), 0) != sizeof (header))
+    {
+      close (fd);
+      return -1;
+    }
+  if (header.version >= BLOCK_VERSION)
+    {
+      close (fd);
+      return 0;
+    }
+
+  store_log (STORE_TRACE, "upgrading block %s from version %d", id, header.version);
+  oldhdr = block_header_size (header.version, header.chunk_count);
+  newhdr = block_header_size (BLOCK_VERSION, header.chunk_count);
+  datalen = MIN ((size_t) st.st_size - oldhdr, header.alloc_size);
+  newsize = align_up (newhdr + header.alloc_size, RS_CODEWORD_SIZE);
+  newsize += (newsize / RS_CODEWORD_SIZE) * RS_PARITY_SIZE;
+  if (newsize < st.st_size + (off_t) (newhdr - oldhdr))
+    newsize = st.st_size + (newhdr - oldhdr);
+  if (ftruncate (fd, newsize) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+  base = (uint8_t *) mmap (NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == (void *) -1)
+    {
+      close (fd);
+      return -1;
+    }
+
+  memmove (base + newhdr, base + oldhdr, datalen);
+  memset (base + oldhdr, 0, newhdr - oldhdr);
+
+  /* The old CRCs sit where the new extended info goes; save them. */
+  if (header.version >= BLOCK_VERSION_CRC)
+    {
+      oldcrc = (uint32_t *) malloc (header.chunk_count * sizeof (uint32_t));
+      if (oldcrc == NULL)
+        {
+          munmap (base, newsize);
+          close (fd);
+          return -1;
+        }
+      memcpy (oldcrc, base + block_ext_offset (header.version, header.chunk_count),
+              header.chunk_count * sizeof (uint32_t));
+    }
+
+  extoff = block_ext_offset (BLOCK_VERSION, header.chunk_count);
+  memset (base + extoff, 0, newhdr - extoff);
+  keys = ((block_header_t *) base)->keys;
+  ext = (block_key_ext_t *) (base + extoff + sizeof (block_ext_header_t));
+  for (i = 0; i < header.chunk_count; i++)
+    {
+      if (memcmp (&keys[i], &null_key, sizeof (block_key_t)) == 0)
+        continue;
+      if (oldcrc != NULL)
+        ext[i].crc32c = oldcrc[i];
+      else if (keys[i].offset + keys[i].length <= header.alloc_size)
+        ext[i].crc32c = crc32c (0, base + newhdr + keys[i].offset, keys[i].length);
+    }
+  ((block_header_t *) base)->version = BLOCK_VERSION;
+
+  free (oldcrc);
+  munmap (base, newsize);
+  close (fd);
+  return 0;
+}
+
+/*
+ * Upgrade every block to the current version. Readers in other
+ * processes see the store as being split, and wait, until it's done.
+ */
+static int
+upgrade_blocks (store_state_t *state)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  uint64_t bucket, buckets = store_bucket_count (state);
+  int ret = 0;
+
+  sb->generation++;
+  __sync_synchronize ();
+  for (bucket = 0; bucket < buckets && ret == 0; bucket++)
+    ret = upgrade_block (state, bucket);
+  __sync_synchronize ();
+  sb->generation++;
+  return ret;
+}
+
+/*
+ * Take the single-writer lock on the superblock. We prefer an OFD
+ * lock, which is per open file description rather than per process,
+ * so that two states opened in the same process also exclude each
+ * other; flock() has the same semantics where OFD locks are missing.
+ */
+static int
+store_lock_writer (int fd)
+{
+#ifdef F_OFD_SETLK
+  struct flock fl;
+  memset (&fl, 0, sizeof (fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 1;
+  if (fcntl (fd, F_OFD_SETLK, &fl) == 0)
+    return 0;
+  if (errno != EINVAL)
+    {
+      if (errno == EACCES || errno == EAGAIN)
+        errno = EBUSY;
+      return -1;
+    }
+#endif /* F_OFD_SETLK */
+  if (flock (fd, LOCK_EX | LOCK_NB) != 0)
+    {
+      if (errno == EWOULDBLOCK)
+        errno = EBUSY;
+      return -1;
+    }
+  return 0;
+}
+
+static int
+store_init_int (const char *rootdir, store_state_t **state, int readonly,
+                store_scheme_t scheme, arrow_hash_t hash)
+{
+  struct stat statbuf;
+  char *path;
+  size_t len = strlen (rootdir) + strlen(STORE_SUPERBLOCK) + 2;
+  store_state_t *st = NULL;
+  int create = 0;
+  size_t pagesize = getpagesize();
+  int i;
+
+  *state = NULL;
+
+  path = (char *) malloc (len);
+  store_trace ("malloc %ld -> %p", len, path);
+  if (path == NULL)
+    return -1;
+  snprintf (path, len, "%s/%s", rootdir, STORE_SUPERBLOCK);
+
+  store_trace ("path is %s", path);
 
   st = (store_state_t *) malloc (sizeof (struct store_state_s));
   store_trace ("new store -> %p", st);
@@ -573,15 +1530,43 @@ store_init (const char *rootdir, store_state_t **state)
       return -1;
     }
 
-  memset (st->cache, 0, sizeof (st->cache));
+  for (i = 0; i < STORE_LOCK_STRIPES; i++)
+    {
+      memset (st->stripes[i].cache, 0, sizeof (st->stripes[i].cache));
+      pthread_rwlock_init (&st->stripes[i].lock, NULL);
+      st->stripes[i].seq = 0;
+      pthread_rwlock_init (&st->stripes[i].cache_lock, NULL);
+    }
+  pthread_mutex_init (&st->split_lock, NULL);
+  st->map_seq = 0;
+  st->unstable = 0;
+  st->readonly = readonly;
+  st->dir = NULL;
+  pthread_mutex_init (&st->journal_lock, NULL);
+  st->journal = NULL;
+  st->journal_len = 0;
+  st->journal_cap = 0;
+  st->journal_limit = STORE_JOURNAL_LIMIT;
+  for (i = 0; i < STORE_LOCK_STRIPES; i++)
+    pthread_rwlock_init (&st->hot_locks[i], NULL);
+  st->hot = NULL;
+  st->hot_bytes = 0;
+  st->hot_limit = STORE_HOT_DATA_LIMIT;
+  st->hot_saved_keys = 0;
+  st->hot_scanned_blocks = 0;
+  pthread_mutex_init (&st->weak_lock, NULL);
+  st->weak = NULL;
+  st->weak_old = NULL;
+  st->weak_old_count = 0;
 
   st->rs = make_rs_handle();
 
   if (stat (path, &statbuf) != 0)
 	{
-	  if (errno != ENOENT)
+	  if (errno != ENOENT || readonly)
         {
           store_perror ("stat");
+          free (st->rootdir);
           free (st);
           free (path);
           return -1;
@@ -591,10 +1576,14 @@ store_init (const char *rootdir, store_state_t **state)
 
   store_trace ("will create a store? %s", create ? "yes" : "no");
 
-  st->data.fd = open (path, O_RDWR | O_CREAT, 0600);
+  if (readonly)
+    st->data.fd = open (path, O_RDONLY);
+  else
+    st->data.fd = open (path, O_RDWR | O_CREAT, 0600);
   if (st->data.fd < 0)
     {
       store_perror ("open(%s)", path);
+      free (st->rootdir);
       free (st);
       free (path);
       return -1;
@@ -602,23 +1591,41 @@ store_init (const char *rootdir, store_state_t **state)
 
   free (path);
 
-  if (create)
-	{
-	  if (ftruncate (st->data.fd, (off_t) sizeof (struct store_sb_s)) != 0)
-		{
-		  free (st);
-		  close (st->data.fd);
-		  return -1;
-		}
+  if (!readonly)
+    {
+      if (store_lock_writer (st->data.fd) != 0)
+        {
+          store_perror ("another writer has the store open");
+          arrow_push_errno ();
+          close (st->data.fd);
+          free (st->rootdir);
+          free (st);
+          arrow_pop_errno ();
+          return -1;
+        }
+
+      /* Version 1 superblocks are shorter; grow them in place. */
+      if (create || statbuf.st_size < (off_t) sizeof (struct store_sb_s))
+        {
+          if (ftruncate (st->data.fd, (off_t) sizeof (struct store_sb_s)) != 0)
+            {
+              close (st->data.fd);
+              free (st->rootdir);
+              free (st);
+              return -1;
+            }
+        }
 	}
 
   st->data.length = align_up (sizeof (struct store_sb_s), pagesize);
-  st->data.data = mmap (NULL, st->data.length, PROT_READ | PROT_WRITE,
+  st->data.data = mmap (NULL, st->data.length,
+                        readonly ? PROT_READ : PROT_READ | PROT_WRITE,
 						MAP_SHARED, st->data.fd, 0);
   if (st->data.data == (void *) -1)
     {
       store_perror ("mmap(%d, %ld)", st->data.fd, st->data.length);
       close (st->data.fd);
+      free (st->rootdir);
       free (st);
       return -1;
     }
@@ -627,37 +1634,177 @@ store_init (const char *rootdir, store_state_t **state)
 	{
 	  store_sb_t *sb = (store_sb_t *) st->data.data;
 	  memcpy (sb->header, superblock_header, 4);
-	  sb->version = 1;
+	  sb->version = STORE_SB_VERSION;
 	  sb->i = 0;
 	  sb->n = 0;
-
+      sb->generation = 0;
+      sb->write_generation = 1;
+      sb->scheme = scheme;
+      sb->depth = 0;
+      sb->buckets = 1;
+      sb->hash = hash;
+
+      if (scheme == STORE_EXTENDIBLE_HASH && open_directory (st, 1) != 0)
+        {
+          store_perror ("creating directory");
+          store_destroy (st);
+          return -1;
+        }
       create_new_block (st, 0);
 	}
+  else if (!readonly)
+    {
+      store_sb_t *sb = (store_sb_t *) st->data.data;
+      if (sb->version < 2)
+        sb->generation = 0;
+      if (sb->generation & 1)
+        {
+          /* A writer died in the middle of a split. There is nothing
+             we can roll back, but let readers make progress again. */
+          sb->generation++;
+        }
+      if (sb->version < 4)
+        {
+          if (upgrade_blocks (st) != 0)
+            {
+              store_perror ("upgrading blocks");
+              store_destroy (st);
+              return -1;
+            }
+          sb->write_generation = 1;
+        }
+      if (sb->version < 5)
+        sb->hash = ARROW_HASH_MD5;
+      sb->version = STORE_SB_VERSION;
+    }
 
   {
     store_sb_t *sb = (store_sb_t *) st->data.data;
+    if (sb->scheme == STORE_EXTENDIBLE_HASH && st->dir == NULL
+        && open_directory (st, 0) != 0)
+      {
+        store_perror ("opening directory");
+        store_destroy (st);
+        return -1;
+      }
     store_trace ("created store i:%d n:%llu", sb->i, sb->n);
   }
 
+  hot_warm (st);
+  weak_open (st);
   *state = st;
   return 0;
 }
 
+int
+store_init (const char *rootdir, store_state_t **state)
+{
+  return store_init_int (rootdir, state, 0, STORE_LINEAR_HASH, ARROW_HASH_MD5);
+}
+
+int
+store_init_scheme (const char *rootdir, store_scheme_t scheme, store_state_t **state)
+{
+  return store_init_int (rootdir, state, 0, scheme, ARROW_HASH_MD5);
+}
+
+int
+store_init_hash (const char *rootdir, store_scheme_t scheme, arrow_hash_t hash,
+                 store_state_t **state)
+{
+  if ((unsigned) hash > ARROW_HASH_MAX)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  return store_init_int (rootdir, state, 0, scheme, hash);
+}
+
+arrow_hash_t
+store_hash (store_state_t *state)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  /* Read-only states don't upgrade the superblock; before version 5,
+     every store used MD5. */
+  return sb->version >= 5 ? (arrow_hash_t) sb->hash : ARROW_HASH_MD5;
+}
+
+int
+store_init_readonly (const char *rootdir, store_state_t **state)
+{
+  return store_init_int (rootdir, state, 1, STORE_LINEAR_HASH, ARROW_HASH_MD5);
+}
+
 void
 store_destroy (store_state_t *state)
 {
+  int i, j;
+
   store_trace ("%p", state);
   if (state)
     {
+      if (state->journal_len > 0)
+        store_commit_refs (state);
+      if (!state->readonly)
+        hot_save (state);
+      hot_free (state);
+      weak_free (state);
+      free (state->journal);
+      pthread_mutex_destroy (&state->journal_lock);
+      for (i = 0; i < STORE_LOCK_STRIPES; i++)
+        {
+          store_stripe_t *stripe = &state->stripes[i];
+          for (j = 0; j < STORE_CACHE_WAYS; j++)
+            {
+              if (stripe->cache[j].entry.data.data != NULL)
+                munmap (stripe->cache[j].entry.data.data,
+                        stripe->cache[j].entry.data.length);
+              if (stripe->cache[j].entry.data.fd > 0)
+                close (stripe->cache[j].entry.data.fd);
+            }
+          pthread_rwlock_destroy (&stripe->lock);
+          pthread_rwlock_destroy (&stripe->cache_lock);
+        }
+      pthread_mutex_destroy (&state->split_lock);
+      if (state->dir != NULL)
+        {
+          munmap (state->dirdata.data, state->dirdata.length);
+          close (state->dirdata.fd);
+        }
       store_trace ("munmap (%p, %ld)", state->data.data, state->data.length);
       munmap (state->data.data, state->data.length);
       store_trace ("close (%d)", state->data.fd);
       close (state->data.fd);
       rslib_free_rs (state->rs);
+      free (state->rootdir);
       free (state);
     }
 }
 
+/*
+ * Look for store's block in its stripe's slice of the open-block cache,
+ * and take a reference to it if it's there. Called with the cache
+ * lock held, shared or not.
+ */
+static int
+store_cache_find (store_cached_entry_t *cache, store_t *store)
+{
+  int i;
+
+  for (i = 0; i < STORE_CACHE_WAYS; i++)
+    {
+      if (strcmp (store->id, cache[i].entry.id) == 0)
+        {
+          __sync_fetch_and_add (&cache[i].refs, 1);
+          store->data.fd = cache[i].entry.data.fd;
+          store->data.data = cache[i].entry.data.data;
+          store->data.length = cache[i].entry.data.length;
+          return 1;
+        }
+    }
+  return 0;
+}
+
 int
 store_open (store_state_t *state, store_t *store)
 {
@@ -665,31 +1812,41 @@ store_open (store_state_t *state, store_t *store)
   char *path;
   int len = strlen(state->rootdir) + strlen (ARROW_BLOCKS_DIR) + STORE_ID_LEN + 3;
   size_t pagesize = getpagesize();
-  int i;
-  int added_to_cache = 0;
+  store_stripe_t *stripe = store_stripe_of_id (state, store->id);
+  store_cached_entry_t *cache = stripe->cache;
+  int i, found;
+
+  store->hash = store_hash (state);
+
+  /* Most opens find the block already mapped, and only need to share
+     the cache with other lookups. */
+  pthread_rwlock_rdlock (&stripe->cache_lock);
+  found = store_cache_find (cache, store);
+  pthread_rwlock_unlock (&stripe->cache_lock);
+  if (found)
+    return 0;
 
-  for (i = 0; i < STORE_CACHE_SIZE; i++)
+  pthread_rwlock_wrlock (&stripe->cache_lock);
+  if (store_cache_find (cache, store))
     {
-      if (strcmp (store->id, state->cache[i].entry.id) == 0)
-        {
-          state->cache[i].refs++;
-          store->data.fd = state->cache[i].entry.data.fd;
-          store->data.data = state->cache[i].entry.data.data;
-          store->data.length = state->cache[i].entry.data.length;
-          return 0;
-        }
+      pthread_rwlock_unlock (&stripe->cache_lock);
+      return 0;
     }
 
   path = (char *) malloc (len);
   if (path == NULL)
-    return -1;
+    {
+      pthread_rwlock_unlock (&stripe->cache_lock);
+      return -1;
+    }
 
   snprintf (path, len, "%s/%s/%s", state->rootdir, ARROW_BLOCKS_DIR, store->id);
 
-  store->data.fd = open (path, O_RDWR);
+  store->data.fd = open (path, state->readonly ? O_RDONLY : O_RDWR);
   if (store->data.fd < 0)
     {
       free (path);
+      pthread_rwlock_unlock (&stripe->cache_lock);
       return -1;
     }
 
@@ -697,29 +1854,33 @@ store_open (store_state_t *state, store_t *store)
   if (fstat (store->data.fd, &st) != 0)
     {
       close (store->data.fd);
+      pthread_rwlock_unlock (&stripe->cache_lock);
       return -1;
     }
 
   store->data.length = align_up ((size_t) st.st_size, pagesize);
-  store->data.data = mmap (NULL, store->data.length, PROT_READ | PROT_WRITE,
+  store->data.data = mmap (NULL, store->data.length,
+                           state->readonly ? PROT_READ : PROT_READ | PROT_WRITE,
 						   MAP_SHARED, store->data.fd, 0);
   if (store->data.data == (void *) -1)
 	{
 	  close(store->data.fd);
+      pthread_rwlock_unlock (&stripe->cache_lock);
 	  return -1;
 	}
 
-  for (i = 0; i < STORE_CACHE_SIZE; i++)
+  for (i = 0; i < STORE_CACHE_WAYS; i++)
     {
-      if (state->cache[i].refs == 0)
+      if (cache[i].refs == 0)
         {
-          if (strlen (state->cache[i].entry.id) == 0)
+          if (strlen (cache[i].entry.id) == 0)
             {
-              strcpy (state->cache[i].entry.id, store->id);
-              state->cache[i].entry.data.fd = store->data.fd;
-              state->cache[i].entry.data.data = store->data.data;
-              state->cache[i].entry.data.length = store->data.length;
-              state->cache[i].refs = 1;
+              strcpy (cache[i].entry.id, store->id);
+              cache[i].entry.data.fd = store->data.fd;
+              cache[i].entry.data.data = store->data.data;
+              cache[i].entry.data.length = store->data.length;
+              cache[i].refs = 1;
+              pthread_rwlock_unlock (&stripe->cache_lock);
               return 0;
             }
         }
@@ -727,509 +1888,2030 @@ store_open (store_state_t *state, store_t *store)
 
   /* FIXME - should do LRU or something. */
 
-  for (i = 0; i < STORE_CACHE_SIZE; i++)
+  for (i = 0; i < STORE_CACHE_WAYS; i++)
     {
-      if (state->cache[i].refs == 0) /* empty cache slot */
+      if (cache[i].refs == 0) /* empty cache slot */
         {
-          if (state->cache[i].entry.data.data != NULL) /* Valid cache entry, no refs. */
+          if (cache[i].entry.data.data != NULL) /* Valid cache entry, no refs. */
             {
-              munmap (state->cache[i].entry.data.data, state->cache[i].entry.data.length);
-              state->cache[i].entry.data.data = NULL;
-              if (state->cache[i].entry.data.fd != -1)
-                close (state->cache[i].entry.data.fd);
+              munmap (cache[i].entry.data.data, cache[i].entry.data.length);
+              cache[i].entry.data.data = NULL;
+              if (cache[i].entry.data.fd != -1)
+                close (cache[i].entry.data.fd);
             }
-          strcpy (state->cache[i].entry.id, store->id);
-          state->cache[i].entry.data.fd = store->data.fd;
-          state->cache[i].entry.data.data = store->data.data;
-          state->cache[i].entry.data.length = store->data.length;
-          state->cache[i].refs = 1;
-          close (state->cache[i].entry.data.fd);
-          state->cache[i].entry.data.fd = -1;
+          strcpy (cache[i].entry.id, store->id);
+          cache[i].entry.data.fd = store->data.fd;
+          cache[i].entry.data.data = store->data.data;
+          cache[i].entry.data.length = store->data.length;
+          cache[i].refs = 1;
+          close (cache[i].entry.data.fd);
+          cache[i].entry.data.fd = -1;
+          pthread_rwlock_unlock (&stripe->cache_lock);
           return 0;
         }
     }
 
+  pthread_rwlock_unlock (&stripe->cache_lock);
   return 0;
 }
 
 int
 store_close (store_state_t *state, store_t *store)
 {
+  store_stripe_t *stripe = store_stripe_of_id (state, store->id);
+  store_cached_entry_t *cache = stripe->cache;
   int i;
 
-  for (i = 0; i < STORE_CACHE_SIZE; i++)
+  /* Entries are only replaced with the lock held exclusively, and only
+     once nobody holds them, so dropping a reference can share it. */
+  pthread_rwlock_rdlock (&stripe->cache_lock);
+  for (i = 0; i < STORE_CACHE_WAYS; i++)
     {
-      if (strcmp (store->id, state->cache[i].entry.id) == 0)
+      if (strcmp (store->id, cache[i].entry.id) == 0)
         {
-          state->cache[i].refs--;
+          __sync_fetch_and_sub (&cache[i].refs, 1);
+          pthread_rwlock_unlock (&stripe->cache_lock);
           return 0;
         }
     }
-  if (store)
-	{
-	  munmap (store->data.data, store->data.length);
-      store->data.data = NULL;
-      if (store->data.fd != -1)
-        close (store->data.fd);
-	}
+  pthread_rwlock_unlock (&stripe->cache_lock);
+
+  munmap (store->data.data, store->data.length);
+  store->data.data = NULL;
+  if (store->data.fd != -1)
+    close (store->data.fd);
   return 0;
 }
 
-void
-store_map_key (store_state_t *state, const arrow_id_t *id, char *result)
+inline static size_t
+hot_set (const arrow_id_t *id)
 {
-  store_sb_t *sb = (store_sb_t *) state->data.data;
-  uint64_t key = do_map_key (state, id, sb->n);
-  b64_encode (key, result);
+  /* The low bits pick the bucket; use the high ones. */
+  return (store_key_hash (id) >> 32) % STORE_HOT_SETS;
 }
 
-int
-store_put (store_state_t *state, const arrow_id_t *id, const void *buf, size_t len)
+inline static pthread_rwlock_t *
+hot_lock (store_state_t *state, size_t set)
 {
-  store_t store;
-  int ret;
-  double loadfactor;
+  return &state->hot_locks[set % STORE_LOCK_STRIPES];
+}
 
-  store_map_key (state, id, store.id);
-  store_log (STORE_TRACE, "mapped key %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x to %s",
-             id->strong[ 8], id->strong[ 9], id->strong[10], id->strong[11],
-             id->strong[12], id->strong[13], id->strong[14], id->strong[15],
-             store.id);
+/* Find id in its set. Called with the set's lock held. */
+static store_hot_entry_t *
+hot_find (store_state_t *state, size_t set, const arrow_id_t *id)
+{
+  store_hot_entry_t *ways = &state->hot[set * STORE_HOT_WAYS];
+  int i;
 
-  if (store_open (state, &store) != 0)
+  for (i = 0; i < STORE_HOT_WAYS; i++)
     {
-      store_perror ("store_open");
-      return -1;
+      if (ways[i].valid && arrow_id_cmp (&ways[i].id, id) == 0)
+        return &ways[i];
     }
-
-  ret = store_put_into_int (&store, id, buf, len, 1, state->rs);
-  if (ret < 0)
-    return ret;
-
-  loadfactor = store_load_factor (&store);
-  store_trace ("load factor now %f", loadfactor);
-
-  store_close (state, &store);
-  if (loadfactor > MAX_LOAD_FACTOR)
-    split_next_store (state);
-
-  return ret;
+  return NULL;
 }
 
-int
-store_addref (store_state_t *state, const arrow_id_t *id)
+static void
+hot_drop_data (store_state_t *state, store_hot_entry_t *entry)
 {
-  store_t store;
-  int ret;
-  double loadfactor;
-
-  store_map_key (state, id, store.id);
-  store_trace ("mapped key %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x to %s",
-               id->strong[ 8], id->strong[ 9], id->strong[10], id->strong[11],
-               id->strong[12], id->strong[13], id->strong[14], id->strong[15],
-               store.id);
+  if (entry->data != NULL)
+    {
+      free (entry->data);
+      entry->data = NULL;
+      __sync_sub_and_fetch (&state->hot_bytes, entry->length);
+    }
+}
 
-  if (store_open (state, &store) != 0)
+static void
+hot_add_data (store_state_t *state, store_hot_entry_t *entry, const void *data)
+{
+  if (data == NULL || entry->data != NULL)
+    return;
+  if (__sync_add_and_fetch (&state->hot_bytes, entry->length) > state->hot_limit)
     {
-      store_perror ("store_open");
-      return -1;
+      __sync_sub_and_fetch (&state->hot_bytes, entry->length);
+      return;
+    }
+  entry->data = malloc (entry->length);
+  if (entry->data == NULL)
+    {
+      __sync_sub_and_fetch (&state->hot_bytes, entry->length);
+      return;
     }
+  memcpy (entry->data, data, entry->length);
+}
 
-  ret = store_addref_to (&store, id);
-  if (ret < 0)
-    return ret;
+/*
+ * Offer a chunk to the hot cache, having seen it with the given
+ * reference count in key `slot' of `bucket'. Called with the bucket
+ * locked, so data (which may be NULL) is stable.
+ */
+static void
+hot_admit (store_state_t *state, const arrow_id_t *id, uint64_t bucket,
+           uint32_t slot, uint32_t references, const void *data, uint32_t length)
+{
+  store_hot_entry_t *entry, *ways;
+  size_t set;
+  int i;
 
-  store_close (state, &store);
+  if (state->hot == NULL || references < STORE_HOT_MIN_REFS)
+    return;
 
-  return ret;
+  set = hot_set (id);
+  ways = &state->hot[set * STORE_HOT_WAYS];
+  pthread_rwlock_wrlock (hot_lock (state, set));
+  entry = hot_find (state, set, id);
+  if (entry == NULL)
+    {
+      /* Take a free way, or the least referenced one if it is less
+         referenced than this chunk. */
+      entry = &ways[0];
+      for (i = 0; i < STORE_HOT_WAYS; i++)
+        {
+          if (!ways[i].valid)
+            {
+              entry = &ways[i];
+              break;
+            }
+          if (ways[i].references < entry->references)
+            entry = &ways[i];
+        }
+      if (entry->valid && entry->references >= references)
+        {
+          pthread_rwlock_unlock (hot_lock (state, set));
+          return;
+        }
+      hot_drop_data (state, entry);
+      entry->id = *id;
+      entry->length = length;
+      entry->valid = 1;
+    }
+  entry->bucket = bucket;
+  entry->slot = slot;
+  entry->references = references;
+  hot_add_data (state, entry, data);
+  pthread_rwlock_unlock (hot_lock (state, set));
 }
 
-size_t
-store_get (store_state_t *state, const arrow_id_t *id, void *out, size_t maxlen)
+/* Offer key i of an open, locked block. */
+static void
+hot_admit_key (store_state_t *state, store_t *store, uint64_t bucket, int i)
 {
-  store_t store;
-  size_t size;
-
-  store_map_key (state, id, store.id);
-  store_trace ("mapped key %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x to %s",
-               id->strong[ 8], id->strong[ 9], id->strong[10], id->strong[11],
-               id->strong[12], id->strong[13], id->strong[14], id->strong[15],
-               store.id);
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *key = &header->keys[i];
+  const void *data = NULL;
 
-  if (store_open (state, &store) != 0)
-    return -1;
+  block_forward_t fwd;
 
-  size = store_get_from (&store, id, out, maxlen);
-  store_trace ("get_from result %ld", size);
-  store_close (state, &store);
-  return size;
+  if (key->references < STORE_HOT_MIN_REFS)
+    return;
+  if (store_key_forward (store, i, &fwd))
+    {
+      hot_admit (state, &key->id, bucket, i, key->references, NULL, fwd.length);
+      return;
+    }
+  if (store_offset_of_chunk (store, key->offset) + key->length <= store->data.length)
+    data = store_data_base (store) + key->offset;
+  hot_admit (state, &key->id, bucket, i, key->references, data, key->length);
 }
 
-size_t
-store_get_len (store_state_t *state, const arrow_id_t *id)
+/*
+ * Whether hot_admit would take a chunk seen with the given reference
+ * count, or its contents if the cache has its ID already. Lookups that
+ * don't lock the bucket ask this before finding the chunk again, the
+ * locked way, with hot_refresh.
+ */
+static int
+hot_wanted (store_state_t *state, const arrow_id_t *id, uint32_t references,
+            size_t length)
 {
-  store_t store;
-  size_t size;
-
-  store_map_key (state, id, store.id);
-  if (store_open (state, &store) != 0)
-    return -1;
+  store_hot_entry_t *entry, *ways;
+  size_t set;
+  int i, wanted = 0;
 
-  size = store_get_len_from (&store, id);
-  store_close (state, &store);
-  return size;
+  if (state->hot == NULL || references < STORE_HOT_MIN_REFS)
+    return 0;
+  set = hot_set (id);
+  ways = &state->hot[set * STORE_HOT_WAYS];
+  pthread_rwlock_rdlock (hot_lock (state, set));
+  entry = hot_find (state, set, id);
+  if (entry != NULL)
+    wanted = entry->data == NULL && state->hot_bytes + length <= state->hot_limit;
+  else
+    {
+      for (i = 0; i < STORE_HOT_WAYS && !wanted; i++)
+        wanted = !ways[i].valid || ways[i].references < references;
+    }
+  pthread_rwlock_unlock (hot_lock (state, set));
+  return wanted;
 }
 
-int
-store_contains (store_state_t *state, const arrow_id_t *id)
+static int
+hot_contains (store_state_t *state, const arrow_id_t *id)
 {
-  store_t store;
-  block_header_t *header;
-  block_key_t *keys;
-  int i;
+  size_t set;
+  int found;
 
-  store_map_key (state, id, store.id);
-  if (store_open (state, &store) != 0)
+  if (state->hot == NULL)
     return 0;
+  set = hot_set (id);
+  pthread_rwlock_rdlock (hot_lock (state, set));
+  found = hot_find (state, set, id) != NULL;
+  pthread_rwlock_unlock (hot_lock (state, set));
+  return found;
+}
 
-  header = (block_header_t *) store.data.data;
-  keys = header->keys;
+/*
+ * Look id up in the hot cache. Returns zero if it isn't there. If it
+ * is, stores its length in *length, its last location in *bucket and
+ * *slot, and copies its contents to out if we have them and out is not
+ * NULL; the return value is 2 if the contents were copied, 1 if not.
+ */
+static int
+hot_lookup (store_state_t *state, const arrow_id_t *id, void *out, size_t maxlen,
+            size_t *length, uint64_t *bucket, uint32_t *slot)
+{
+  store_hot_entry_t *entry;
+  size_t set;
+  int ret = 0;
 
-  for (i = 0; i < header->chunk_count; i++)
+  if (state->hot == NULL)
+    return 0;
+  set = hot_set (id);
+  pthread_rwlock_rdlock (hot_lock (state, set));
+  entry = hot_find (state, set, id);
+  if (entry != NULL)
     {
-      if (arrow_id_cmp (id, &keys[i]) == 0)
+      ret = 1;
+      *length = entry->length;
+      *bucket = entry->bucket;
+      *slot = entry->slot;
+      if (out != NULL && entry->data != NULL)
         {
-          store_close (state, &store);
-          return 1;
+          memcpy (out, entry->data, entry->length < maxlen ? entry->length : maxlen);
+          ret = 2;
         }
     }
-  store_close (state, &store);
-  return 0;
+  pthread_rwlock_unlock (hot_lock (state, set));
+  return ret;
 }
 
-int
-store_put_into (store_t *store, const arrow_id_t *id, const void *buf, size_t len)
+/* Find a chunk the slow way, and offer it to the hot cache. */
+static void
+hot_refresh (store_state_t *state, const arrow_id_t *id)
 {
-  struct rs_handle *rs = make_rs_handle();
-  return store_put_into_int (store, id, buf, len, 1, rs);
+  store_t store;
+  uint64_t bucket;
+  int i;
+
+  bucket = store_lock_key (state, id, 0, store.id);
+  if (store_open (state, &store) == 0)
+    {
+      i = store_key_index (&store, id);
+      if (i >= 0)
+        hot_admit_key (state, &store, bucket, i);
+      store_close (state, &store);
+    }
+  store_unlock_bucket (state, bucket);
 }
 
-static int
-store_put_into_int (store_t *store, const arrow_id_t *id, const void *buf, size_t len,
-                    int gen_rs, struct rs_handle *rs)
+/*
+ * Fill the hot cache: from the hot set saved by the last writer if
+ * there is one, else by looking for well referenced keys in every
+ * block. Read-only processes come and go while the writer runs, so
+ * they don't scan; their cache fills as lookups find hot chunks.
+ */
+static void
+hot_warm (store_state_t *state)
 {
-  block_header_t *header = (block_header_t *) store->data.data;
-  block_key_t *keys = header->keys;
-  int i = 0;
-  size_t offset = 0; /* Is the point in store->data.data where we *can't* store data. */
+  store_hot_file_t hdr;
+  arrow_id_t id;
+  store_t store;
+  uint64_t bucket, buckets;
+  size_t len = strlen (state->rootdir) + strlen (STORE_HOT_FILE) + 2;
+  char *path;
+  uint32_t n;
+  FILE *f;
+  int i;
 
-  store_trace ("%p %p %p", store, header, keys);
+  state->hot = (store_hot_entry_t *)
+    calloc (STORE_HOT_SETS * STORE_HOT_WAYS, sizeof (store_hot_entry_t));
+  if (state->hot == NULL)
+    return;
 
-  for (i = 0; i < header->chunk_count; i++)
-	{
-	  if (memcmp (&keys[i].id, id, sizeof (arrow_id_t)) == 0)
-		{
-          int begin, end;
-		  /* We believe that it is already there. */
-          keys[i].references++;
-          store_trace ("put again, num references: %d", keys[i].references);
-          if (gen_rs)
-            {
-              find_changed_subblocks(store_offset_of_key (store, i),
-                                     sizeof (block_key_t), &begin, &end);
-              generate_rscode (rs, store, begin, end);
-            }
-		  return 1;
-		}
-	  else if (memcmp (&keys[i], &null_key, sizeof (block_key_t)) == 0)
-		{
-          size_t remain = 0;
-          store_trace ("found a slot at %d", i);
-          if (i < header->chunk_count - 1
-              || memcmp (&keys[i+1], &null_key, sizeof (block_key_t)) == 0)
-            remain = header->alloc_size - store_header_size (store) - offset;
-          else
-            remain = keys[i+1].offset - offset;
+  path = (char *) malloc (len);
+  if (path == NULL)
+    return;
+  snprintf (path, len, "%s/%s", state->rootdir, STORE_HOT_FILE);
+  f = fopen (path, "r");
+  free (path);
+  if (f != NULL)
+    {
+      if (fread (&hdr, sizeof (hdr), 1, f) == 1
+          && memcmp (hdr.header, hot_header, 4) == 0 && hdr.count > 0)
+        {
+          for (n = 0; n < hdr.count && fread (&id, sizeof (id), 1, f) == 1; n++)
+            hot_refresh (state, &id);
+          fclose (f);
+          state->hot_saved_keys = n;
+          store_log (STORE_PERF, "warmed hot cache with %u saved keys", n);
+          return;
+        }
+      fclose (f);
+    }
+  if (state->readonly)
+    return;
 
-          store_trace ("we have %ld bytes in this slot", remain);
+  buckets = store_bucket_count (state);
+  for (bucket = 0; bucket < buckets; bucket++)
+    {
+      block_header_t *header;
 
-          if (remain >= len)
-            {
-              int begin, end;
-              memcpy (&keys[i].id, id, sizeof (arrow_id_t));
-              keys[i].offset = offset;
-              keys[i].length = len;
-              keys[i].references = 1;
-              memcpy (store_data_base (store) + offset, buf, len);
-              store_trace ("placed %ld bytes at %ld", len, offset);
-              if (gen_rs)
-                {
-                  find_changed_subblocks(store_offset_of_key (store, i),
-                                         sizeof (block_key_t), &begin, &end);
-                  generate_rscode (rs, store, begin, end);
-                  find_changed_subblocks(store_offset_of_chunk (store, offset),
-                                         len, &begin, &end);
-                  generate_rscode (rs, store, begin, end);
-                }
-              return 0;
-            }
+      b64_encode (bucket, store.id);
+      store_lock_bucket (state, bucket, 0);
+      if (store_open (state, &store) != 0)
+        {
+          store_unlock_bucket (state, bucket);
+          continue;
         }
-      else
+      header = (block_header_t *) store.data.data;
+      for (i = 0; i < header->chunk_count; i++)
         {
-          offset += keys[i].length;
-          store_trace ("keep looking; offset now %ld", offset);
+          if (header->keys[i].references >= STORE_HOT_MIN_REFS
+              && memcmp (&header->keys[i], &null_key, sizeof (block_key_t)) != 0)
+            hot_admit_key (state, &store, bucket, i);
         }
-	}
-
-  fail ("FIXME - implement growing stores");
-  return -1;
+      store_close (state, &store);
+      store_unlock_bucket (state, bucket);
+    }
+  state->hot_scanned_blocks = buckets;
+  store_log (STORE_PERF, "warmed hot cache from %llu blocks", (unsigned long long) buckets);
 }
 
-int
-store_addref_to (store_t *store, const arrow_id_t *id)
+static void
+hot_save (store_state_t *state)
 {
-  block_header_t *header = (block_header_t *) store->data.data;
-  block_key_t *keys = header->keys;
+  store_hot_file_t hdr;
+  size_t len = strlen (state->rootdir) + strlen (STORE_HOT_FILE) + 6;
+  char *path, *tmp;
+  FILE *f;
   int i;
 
-  for (i = 0; i < header->chunk_count; i++)
+  if (state->hot == NULL)
+    return;
+  path = (char *) malloc (len);
+  tmp = (char *) malloc (len);
+  if (path == NULL || tmp == NULL)
     {
-      if (arrow_id_cmp (&keys[i].id, id) == 0)
-        {
-          keys[i].references++;
-          return 0;
-        }
+      free (path);
+      free (tmp);
+      return;
     }
-  return -1;
+  snprintf (path, len, "%s/%s", state->rootdir, STORE_HOT_FILE);
+  snprintf (tmp, len, "%s.tmp", path);
+
+  memcpy (hdr.header, hot_header, 4);
+  hdr.count = 0;
+  for (i = 0; i < STORE_HOT_SETS * STORE_HOT_WAYS; i++)
+    if (state->hot[i].valid)
+      hdr.count++;
+
+  f = fopen (tmp, "w");
+  if (f != NULL)
+    {
+      fwrite (&hdr, sizeof (hdr), 1, f);
+      for (i = 0; i < STORE_HOT_SETS * STORE_HOT_WAYS; i++)
+        if (state->hot[i].valid)
+          fwrite (&state->hot[i].id, sizeof (arrow_id_t), 1, f);
+      if (fclose (f) == 0)
+        rename (tmp, path);
+      else
+        unlink (tmp);
+    }
+  free (tmp);
+  free (path);
 }
 
-size_t
-store_get_from (store_t *store, const arrow_id_t *id, void *out, size_t maxlen)
+static void
+hot_free (store_state_t *state)
 {
-  block_header_t *header = (block_header_t *) store->data.data;
-  block_key_t *keys = header->keys;
   int i;
 
-  for (i = 0; i < header->chunk_count; i++)
-	{
-	  if (memcmp (&keys[i].id, id, sizeof (arrow_id_t)) == 0)
-		{
-          store_trace ("found key at %d", i);
-		  memcpy (out, store_data_base (store) + keys[i].offset,
-				  keys[i].length < maxlen ? keys[i].length : maxlen);
-		  return keys[i].length;
-		}
-	}
-
-  return -1;
+  if (state->hot != NULL)
+    {
+      for (i = 0; i < STORE_HOT_SETS * STORE_HOT_WAYS; i++)
+        free (state->hot[i].data);
+      free (state->hot);
+      state->hot = NULL;
+    }
+  for (i = 0; i < STORE_LOCK_STRIPES; i++)
+    pthread_rwlock_destroy (&state->hot_locks[i]);
 }
 
-size_t
-store_get_len_from (store_t *store, const arrow_id_t *id)
+void
+store_set_hot_limit (store_state_t *state, size_t bytes)
 {
-  block_header_t *header = (block_header_t *) store->data.data;
-  block_key_t *keys = header->keys;
+  size_t set;
   int i;
 
-  for (i = 0; i < header->chunk_count; i++)
-	{
-	  if (memcmp (&keys[i].id, id, sizeof (struct arrow_id_s)) == 0)
-		return keys[i].length;
-	}
+  state->hot_limit = bytes;
+  if (state->hot == NULL || state->hot_bytes <= bytes)
+    return;
+  /* Over the new limit; let the contents go, and refill as chunks
+     are looked up again. */
+  for (set = 0; set < STORE_HOT_SETS; set++)
+    {
+      pthread_rwlock_wrlock (hot_lock (state, set));
+      for (i = 0; i < STORE_HOT_WAYS; i++)
+        hot_drop_data (state, &state->hot[set * STORE_HOT_WAYS + i]);
+      pthread_rwlock_unlock (hot_lock (state, set));
+    }
+}
+
+inline static uint64_t
+weak_hash (uint32_t weak, uint32_t length)
+{
+  /* Rollsum digests are far from uniform; mix them up. */
+  uint64_t h = ((uint64_t) length << 32) | weak;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * Add a pair to an index. Returns 1 if it was added, 0 if it was there
+ * already, and -1 if the index is full.
+ */
+static int
+weak_insert_into (store_weak_index_t *index, uint32_t weak, uint32_t length)
+{
+  uint64_t mask = index->buckets - 1;
+  uint64_t b = weak_hash (weak, length) & mask;
+  uint64_t n;
+  int i;
 
+  for (n = 0; n < index->buckets; n++, b = (b + 1) & mask)
+    {
+      store_weak_bucket_t *bucket = &index->table[b];
+      for (i = 0; i < STORE_WEAK_WAYS; i++)
+        {
+          if (bucket->length[i] == 0)
+            {
+              /* Probes don't lock; a torn pair only makes a false
+                 positive. */
+              bucket->weak[i] = weak;
+              __sync_synchronize ();
+              bucket->length[i] = length;
+              index->count++;
+              return 1;
+            }
+          if (bucket->length[i] == length && bucket->weak[i] == weak)
+            return 0;
+        }
+    }
   return -1;
 }
 
-int
-store_verify_all (store_state_t *state)
+/* Create an empty index file at path, and map it. */
+static int
+weak_create (const char *path, uint64_t buckets, mapped_file_t *map)
 {
-  size_t pathlen;
-  char *path;
-  DIR *dir;
-  store_t store;
-  struct dirent *dent;
-  int failures = 0;
+  store_weak_index_t *index;
+  size_t size = sizeof (store_weak_index_t) + buckets * sizeof (store_weak_bucket_t);
 
-  pathlen = strlen (state->rootdir) + strlen (ARROW_BLOCKS_DIR) + 2;
-  path = (char *) malloc (pathlen);
-  snprintf (path, pathlen, "%s/%s", state->rootdir, ARROW_BLOCKS_DIR);
+  map->fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (map->fd < 0)
+    return -1;
+  if (ftruncate (map->fd, size) != 0)
+    {
+      arrow_push_errno ();
+      close (map->fd);
+      unlink (path);
+      arrow_pop_errno ();
+      return -1;
+    }
+  map->length = size;
+  map->data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+  if (map->data == (void *) -1)
+    {
+      arrow_push_errno ();
+      close (map->fd);
+      unlink (path);
+      arrow_pop_errno ();
+      return -1;
+    }
+  index = (store_weak_index_t *) map->data;
+  memcpy (index->header, weak_header, 4);
+  index->version = STORE_WEAK_VERSION;
+  index->buckets = buckets;
+  index->count = 0;
+  return 0;
+}
 
-  dir = opendir (path);
-  if (dir == NULL)
+/*
+ * Move the index to a new file with twice the buckets. Called with
+ * weak_lock held. The old mapping stays around until the store is
+ * destroyed, since other threads may be probing it.
+ */
+static int
+weak_grow (store_state_t *state)
+{
+  store_weak_index_t *old = state->weak, *index;
+  mapped_file_t map, *olds;
+  size_t len = strlen (state->rootdir) + strlen (STORE_WEAK_FILE) + 6;
+  char *path, *tmp;
+  uint64_t b;
+  int i;
+
+  olds = (mapped_file_t *) realloc (state->weak_old,
+                                    (state->weak_old_count + 1) * sizeof (mapped_file_t));
+  if (olds == NULL)
+    return -1;
+  state->weak_old = olds;
+
+  path = (char *) malloc (len);
+  tmp = (char *) malloc (len);
+  if (path == NULL || tmp == NULL)
     {
       free (path);
+      free (tmp);
       return -1;
     }
+  snprintf (path, len, "%s/%s", state->rootdir, STORE_WEAK_FILE);
+  snprintf (tmp, len, "%s.tmp", path);
 
-  free (path);
+  if (weak_create (tmp, old->buckets * 2, &map) != 0)
+    {
+      free (path);
+      free (tmp);
+      return -1;
+    }
+  index = (store_weak_index_t *) map.data;
+  for (b = 0; b < old->buckets; b++)
+    for (i = 0; i < STORE_WEAK_WAYS; i++)
+      if (old->table[b].length[i] != 0)
+        weak_insert_into (index, old->table[b].weak[i], old->table[b].length[i]);
 
-  while ((dent = readdir (dir)) != NULL)
+  if (rename (tmp, path) != 0)
     {
-      if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
-        continue;
-      strcpy (store.id, dent->d_name);
-      if (store_open (state, &store) != 0)
-        continue;
-      if (store_verify (&store, NULL) != 0)
-        failures++;
-      store_close (state, &store);
+      arrow_push_errno ();
+      munmap (map.data, map.length);
+      close (map.fd);
+      unlink (tmp);
+      free (path);
+      free (tmp);
+      arrow_pop_errno ();
+      return -1;
     }
-  return failures;
+  free (path);
+  free (tmp);
+
+  state->weak_old[state->weak_old_count++] = state->weakdata;
+  state->weakdata = map;
+  __sync_synchronize ();
+  state->weak = index;
+  store_log (STORE_PERF, "weak index grown to %llu buckets",
+             (unsigned long long) index->buckets);
+  return 0;
 }
 
-/*
-
-  EPIC FAIL WARNING
+static void
+weak_add (store_state_t *state, uint32_t weak, uint32_t length)
+{
+  int ret;
 
-  Our block key might get corrupt in the length or offset field, which
-  will render references to that block useless, so we can't verify the
-  block hash. So, we need to be CAREFUL about 
+  if (state->weak == NULL || state->readonly || length == 0)
+    return;
+  pthread_mutex_lock (&state->weak_lock);
+  if (state->weak->count + 1
+      > state->weak->buckets * STORE_WEAK_WAYS * STORE_WEAK_MAX_LOAD)
+    weak_grow (state);
+  ret = weak_insert_into (state->weak, weak, length);
+  if (ret < 0 && weak_grow (state) == 0)
+    weak_insert_into (state->weak, weak, length);
+  pthread_mutex_unlock (&state->weak_lock);
+}
 
+/*
+ * Map the weak index. A writer builds it from the blocks if there is
+ * none yet; read-only states go without.
  */
-
-static uint32_t
-compute_weak_key (store_t *store, block_key_t *key)
+static void
+weak_open (store_state_t *state)
 {
-  block_header_t *header = (block_header_t *) store->data.data;
-  Rollsum rs;
+  size_t len = strlen (state->rootdir) + strlen (STORE_WEAK_FILE) + 2;
+  store_weak_index_t *index;
+  struct stat st;
+  store_t store;
+  uint64_t bucket, buckets;
+  char *path;
+  int i;
 
-  if (key->offset > header->alloc_size || key->offset + key->length > header->alloc_size)
+  path = (char *) malloc (len);
+  if (path == NULL)
+    return;
+  snprintf (path, len, "%s/%s", state->rootdir, STORE_WEAK_FILE);
+
+  state->weakdata.fd = open (path, state->readonly ? O_RDONLY : O_RDWR);
+  if (state->weakdata.fd >= 0)
     {
-      /* Guaranteed corrupt offset or length field, abort! */
-      return 0;
+      if (fstat (state->weakdata.fd, &st) == 0
+          && st.st_size >= (off_t) sizeof (store_weak_index_t))
+        {
+          state->weakdata.length = st.st_size;
+          state->weakdata.data = mmap (NULL, st.st_size,
+                                       state->readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+                                       MAP_SHARED, state->weakdata.fd, 0);
+          if (state->weakdata.data != (void *) -1)
+            {
+              index = (store_weak_index_t *) state->weakdata.data;
+              if (memcmp (index->header, weak_header, 4) == 0
+                  && index->version == STORE_WEAK_VERSION
+                  && sizeof (store_weak_index_t)
+                     + index->buckets * sizeof (store_weak_bucket_t) <= (size_t) st.st_size)
+                {
+                  state->weak = index;
+                  free (path);
+                  return;
+                }
+              munmap (state->weakdata.data, state->weakdata.length);
+            }
+        }
+      close (state->weakdata.fd);
+    }
+  if (state->readonly)
+    {
+      free (path);
+      return;
     }
 
-  RollsumInit (&rs);
-  RollsumUpdate (&rs, store_data_base (store) + key->offset,
-                 key->length);
-  return RollsumDigest(&rs);
+  /* Build it. */
+  if (weak_create (path, STORE_WEAK_INITIAL_BUCKETS, &state->weakdata) != 0)
+    {
+      store_perror ("creating %s: %s", path, strerror (errno));
+      free (path);
+      return;
+    }
+  free (path);
+  state->weak = (store_weak_index_t *) state->weakdata.data;
+
+  buckets = store_bucket_count (state);
+  for (bucket = 0; bucket < buckets; bucket++)
+    {
+      block_header_t *header;
+
+      b64_encode (bucket, store.id);
+      store_lock_bucket (state, bucket, 0);
+      if (store_open (state, &store) != 0)
+        {
+          store_unlock_bucket (state, bucket);
+          continue;
+        }
+      header = (block_header_t *) store.data.data;
+      for (i = 0; i < header->chunk_count; i++)
+        {
+          if (memcmp (&header->keys[i], &null_key, sizeof (block_key_t)) != 0)
+            weak_add (state, header->keys[i].id.weak, store_key_length (&store, i));
+        }
+      store_close (state, &store);
+      store_unlock_bucket (state, bucket);
+    }
+  store_log (STORE_PERF, "built weak index of %llu chunks",
+             (unsigned long long) state->weak->count);
 }
 
 static void
-compute_strong_key (store_t *store, block_key_t *key, uint8_t *digest)
+weak_free (store_state_t *state)
 {
-  block_header_t *header = (block_header_t *) store->data.data;
+  size_t i;
 
-  if (key->offset > header->alloc_size || key->offset + key->length > header->alloc_size)
+  if (state->weak != NULL)
     {
-      /* Guaranteed corrupt offset or length field, abort! */
-      memset (digest, 0, MD5_DIGEST_LENGTH);
-      return;
+      munmap (state->weakdata.data, state->weakdata.length);
+      close (state->weakdata.fd);
+      state->weak = NULL;
     }
-
-  MD5 (store_data_base (store) + key->offset, key->length, digest);
+  for (i = 0; i < state->weak_old_count; i++)
+    {
+      munmap (state->weak_old[i].data, state->weak_old[i].length);
+      close (state->weak_old[i].fd);
+    }
+  free (state->weak_old);
+  state->weak_old = NULL;
+  state->weak_old_count = 0;
+  pthread_mutex_destroy (&state->weak_lock);
 }
 
-static int
-verify_weak_key (store_t *store, int i)
+int
+store_weak_probe (store_state_t *state, uint32_t weak, uint32_t length)
 {
-  block_header_t *header = (block_header_t *) store->data.data;
-  block_key_t *keys = header->keys;
-  Rollsum rs;
+  store_weak_index_t *index = state->weak;
+  uint64_t mask, b, n;
+  int i;
 
-  RollsumInit (&rs);
-  RollsumUpdate (&rs, store_data_base (store) + keys[i].offset,
-                 keys[i].length);
-  if (keys[i].id.weak != RollsumDigest (&rs))
+  if (index == NULL)
+    return 0;
+  mask = index->buckets - 1;
+  b = weak_hash (weak, length) & mask;
+  for (n = 0; n < index->buckets; n++, b = (b + 1) & mask)
     {
-      store_trace ("weak sum mismatch %u vs. %lu", keys[i].id.weak,
-                   RollsumDigest (&rs));
-      return 0;
+      store_weak_bucket_t *bucket = &index->table[b];
+      for (i = 0; i < STORE_WEAK_WAYS; i++)
+        {
+          if (bucket->length[i] == 0)
+            return 0;
+          if (bucket->weak[i] == weak && bucket->length[i] == length)
+            return 1;
+        }
     }
-  return 1;
+  return 0;
 }
 
-static int
-verify_strong_key (store_t *store, int i)
+void
+store_map_key (store_state_t *state, const arrow_id_t *id, char *result)
 {
-  block_header_t *header = (block_header_t *) store->data.data;
-  block_key_t *keys = header->keys;
-  uint8_t digest[MD5_DIGEST_LENGTH];  
-  MD5 (store_data_base (store) + keys[i].offset,
-       keys[i].length, digest);
-  if (memcmp (keys[i].id.strong, digest, MD5_DIGEST_LENGTH) != 0)
+  uint64_t key = map_key_stable (state, id);
+  b64_encode (key, result);
+}
+
+int
+store_put (store_state_t *state, const arrow_id_t *id, const void *buf, size_t len)
+{
+  store_t store;
+  uint64_t bucket;
+  int ret;
+  double loadfactor;
+
+  if (state->readonly)
     {
-      store_trace ("strong sum mismatch %02x:%02x:%02x:%02x:%02x:%02x:"
-                   "%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x "
-                   "vs. %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:"
-                   "%02x:%02x:%02x:%02x:%02x:%02x:%02x",
-                   keys[i].id.strong[ 0], keys[i].id.strong[ 1],
-                   keys[i].id.strong[ 2], keys[i].id.strong[ 3],
-                   keys[i].id.strong[ 4], keys[i].id.strong[ 5],
-                   keys[i].id.strong[ 6], keys[i].id.strong[ 7],
-                   keys[i].id.strong[ 8], keys[i].id.strong[ 9],
-                   keys[i].id.strong[10], keys[i].id.strong[11],
-                   keys[i].id.strong[12], keys[i].id.strong[13],
-                   keys[i].id.strong[14], keys[i].id.strong[15],
-                   digest[ 0], digest[ 1], digest[ 2], digest[ 3],
-                   digest[ 4], digest[ 5], digest[ 6], digest[ 7],
-                   digest[ 8], digest[ 9], digest[10], digest[11],
-                   digest[12], digest[13], digest[14], digest[15]);
-      return 0;
+      errno = EROFS;
+      return -1;
     }
-  return 1;
+
+  bucket = store_lock_key (state, id, 1, store.id);
+  store_log (STORE_TRACE, "mapped key %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x to %s",
+             id->strong[ 8], id->strong[ 9], id->strong[10], id->strong[11],
+             id->strong[12], id->strong[13], id->strong[14], id->strong[15],
+             store.id);
+
+  if (store_open (state, &store) != 0)
+    {
+      store_perror ("store_open");
+      store_unlock_bucket (state, bucket);
+      return -1;
+    }
+
+  ret = store_put_into_int (&store, id, buf, len, 1, state->rs,
+                            store_next_generation (state), NULL);
+  if (ret < 0)
+    {
+      store_close (state, &store);
+      store_unlock_bucket (state, bucket);
+      return ret;
+    }
+  if (ret == 0)
+    weak_add (state, id->weak, len);
+
+  loadfactor = store_load_factor (&store);
+  store_trace ("load factor now %f", loadfactor);
+
+  store_close (state, &store);
+  store_unlock_bucket (state, bucket);
+  if (loadfactor > MAX_LOAD_FACTOR)
+    {
+      if (((store_sb_t *) state->data.data)->scheme == STORE_EXTENDIBLE_HASH)
+        split_bucket (state, bucket);
+      else
+        split_next_store (state);
+    }
+
+  return ret;
 }
 
 int
-store_verify (store_t *store, store_error_t *errors)
+store_addref (store_state_t *state, const arrow_id_t *id)
 {
-  block_header_t *header = (block_header_t *) store->data.data;
-  block_key_t *keys = header->keys;
-  int i;
-  int found_errors = 0;
-  if (errors != NULL)
+  store_t store;
+  uint64_t bucket;
+  uint32_t slot;
+  size_t length;
+  int ret;
+
+  if (state->readonly)
     {
-      errors->count = 0;
-      errors->keys = NULL;
+      errno = EROFS;
+      return -1;
     }
 
-  for (i = 0; i < header->chunk_count; i++)
+  /* Hot chunks go straight to their key, if it hasn't moved. */
+  if (hot_lookup (state, id, NULL, 0, &length, &bucket, &slot) != 0)
     {
-      if (memcmp (&keys[i], &null_key, sizeof (block_key_t)) != 0)
+      block_header_t *header;
+
+      b64_encode (bucket, store.id);
+      store_lock_bucket (state, bucket, 1);
+      if (store_open (state, &store) == 0)
         {
-          if (!verify_weak_key (store, i))
+          header = (block_header_t *) store.data.data;
+          ret = -1;
+          if (slot < header->chunk_count
+              && arrow_id_cmp (&header->keys[slot].id, id) == 0)
             {
-              found_errors++;
-              if (errors != NULL)
-                {
-                  errors->count++;
-                  if (errors->keys == NULL)
-                    errors->keys = (int *) malloc (sizeof (int));
-                  else
-                    errors->keys = (int *) realloc (errors->keys, sizeof (int) * errors->count);
-                  if (errors->keys != NULL)
-                    errors->keys[errors->count - 1] = i;
-                }
-              continue;
-            }
-          if (!verify_strong_key (store, i))
-            {              
-              found_errors++;
-              if (errors != NULL)
-                {
-                  errors->count++;
-                  if (errors->keys == NULL)
-                    errors->keys = (int *) malloc (sizeof (int));
-                  else
-                    errors->keys = (int *) realloc (errors->keys, sizeof (int) * errors->count);
-                  if (errors->keys != NULL)
-                    errors->keys[errors->count - 1] = i;
-                }
+              header->keys[slot].references++;
+              stamp_key (&store, slot, store_next_generation (state), 0);
+              ret = 0;
             }
+          store_close (state, &store);
+          store_unlock_bucket (state, bucket);
+          if (ret == 0)
+            return 0;
         }
+      else
+        store_unlock_bucket (state, bucket);
     }
-  return found_errors;
-}
 
-typedef uint8_t codeword_t[RS_CODEWORD_SIZE];
+  bucket = store_lock_key (state, id, 1, store.id);
+  store_trace ("mapped key %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x to %s",
+               id->strong[ 8], id->strong[ 9], id->strong[10], id->strong[11],
+               id->strong[12], id->strong[13], id->strong[14], id->strong[15],
+               store.id);
 
-static int
-try_fix_key (store_t *store, int idx)
-{
-  return -1;
-/*   block_header_t *header = (block_header_t *) store->data.data; */
-/*   block_key_t *keys = header->keys; */
-/*   codeword_t *codewords; */
+  if (store_open (state, &store) != 0)
+    {
+      store_perror ("store_open");
+      store_unlock_bucket (state, bucket);
+      return -1;
+    }
+
+  ret = store_key_index (&store, id);
+  if (ret >= 0)
+    {
+      ((block_header_t *) store.data.data)->keys[ret].references++;
+      stamp_key (&store, ret, store_next_generation (state), 0);
+      hot_admit_key (state, &store, bucket, ret);
+      ret = 0;
+    }
+
+  store_close (state, &store);
+  store_unlock_bucket (state, bucket);
+
+  return ret;
+}
+
+static int
+store_journal_append (store_state_t *state, const arrow_id_t *id, int32_t delta)
+{
+  int full;
+
+  if (state->readonly)
+    {
+      errno = EROFS;
+      return -1;
+    }
+
+  pthread_mutex_lock (&state->journal_lock);
+  if (state->journal_len == state->journal_cap)
+    {
+      size_t cap = state->journal_cap == 0 ? 1024 : state->journal_cap * 2;
+      store_ref_delta_t *j = (store_ref_delta_t *)
+        realloc (state->journal, cap * sizeof (store_ref_delta_t));
+      if (j == NULL)
+        {
+          pthread_mutex_unlock (&state->journal_lock);
+          return -1;
+        }
+      state->journal = j;
+      state->journal_cap = cap;
+    }
+  state->journal[state->journal_len].id = *id;
+  state->journal[state->journal_len].delta = delta;
+  state->journal_len++;
+  full = state->journal_len >= state->journal_limit;
+  pthread_mutex_unlock (&state->journal_lock);
+
+  if (full)
+    return store_commit_refs (state);
+  return 0;
+}
+
+int
+store_addref_deferred (store_state_t *state, const arrow_id_t *id)
+{
+  return store_journal_append (state, id, 1);
+}
+
+int
+store_unref_deferred (store_state_t *state, const arrow_id_t *id)
+{
+  return store_journal_append (state, id, -1);
+}
+
+void
+store_set_journal_limit (store_state_t *state, size_t limit)
+{
+  pthread_mutex_lock (&state->journal_lock);
+  state->journal_limit = limit > 0 ? limit : 1;
+  pthread_mutex_unlock (&state->journal_lock);
+}
+
+static int
+ref_delta_cmp (const void *a, const void *b)
+{
+  const store_ref_delta_t *d1 = (const store_ref_delta_t *) a;
+  const store_ref_delta_t *d2 = (const store_ref_delta_t *) b;
+  if (d1->bucket != d2->bucket)
+    return d1->bucket < d2->bucket ? -1 : 1;
+  return arrow_id_cmp (&d1->id, &d2->id);
+}
+
+static int
+ref_delta_id_cmp (const void *key, const void *elem)
+{
+  return arrow_id_cmp ((const arrow_id_t *) key,
+                       &((const store_ref_delta_t *) elem)->id);
+}
+
+/*
+ * Apply the deltas in [first, first+count), which all map to the same
+ * bucket and are sorted by ID, in one pass over the block's keys.
+ * Returns the number of deltas whose key wasn't found.
+ */
+static size_t
+apply_ref_deltas (store_state_t *state, store_ref_delta_t *first, size_t count,
+                  uint64_t wgen)
+{
+  store_t store;
+  block_header_t *header;
+  block_key_t *keys;
+  size_t found = 0;
+  int i;
+
+  b64_encode (first->bucket, store.id);
+  store_lock_bucket (state, first->bucket, 1);
+  if (store_open (state, &store) != 0)
+    {
+      store_perror ("store_open");
+      store_unlock_bucket (state, first->bucket);
+      return count;
+    }
+
+  header = (block_header_t *) store.data.data;
+  keys = header->keys;
+  for (i = 0; i < header->chunk_count && found < count; i++)
+    {
+      store_ref_delta_t *d;
+      int32_t refs;
+
+      if (memcmp (&keys[i], &null_key, sizeof (block_key_t)) == 0)
+        continue;
+      d = (store_ref_delta_t *) bsearch (&keys[i].id, first, count,
+                                         sizeof (store_ref_delta_t),
+                                         ref_delta_id_cmp);
+      if (d == NULL)
+        continue;
+      refs = (int32_t) keys[i].references + d->delta;
+      if (refs < 0)
+        refs = 0;
+      else if (refs > UINT16_MAX)
+        refs = UINT16_MAX;
+      keys[i].references = (uint16_t) refs;
+      stamp_key (&store, i, wgen, 0);
+      hot_admit_key (state, &store, first->bucket, i);
+      found++;
+    }
+
+  store_close (state, &store);
+  store_unlock_bucket (state, first->bucket);
+  return count - found;
+}
+
+int
+store_commit_refs (store_state_t *state)
+{
+  store_ref_delta_t *journal;
+  size_t len, i, j, out, missing = 0;
+  uint64_t wgen;
+  clock_t clk;
+
+  if (state->readonly)
+    {
+      errno = EROFS;
+      return -1;
+    }
+
+  /* Take the whole batch, so other threads can keep appending while
+     we apply it. */
+  pthread_mutex_lock (&state->journal_lock);
+  journal = state->journal;
+  len = state->journal_len;
+  state->journal = NULL;
+  state->journal_len = 0;
+  state->journal_cap = 0;
+  pthread_mutex_unlock (&state->journal_lock);
+
+  if (len == 0)
+    {
+      free (journal);
+      return 0;
+    }
+
+  clk = clock();
+  wgen = store_next_generation (state);
+
+  /* Holding the split lock keeps the key-to-bucket mapping fixed
+     until every delta has been applied. */
+  pthread_mutex_lock (&state->split_lock);
+  for (i = 0; i < len; i++)
+    journal[i].bucket = do_map_key (state, &journal[i].id,
+                                    ((store_sb_t *) state->data.data)->n);
+  qsort (journal, len, sizeof (store_ref_delta_t), ref_delta_cmp);
+
+  /* Fold repeated IDs into one delta. */
+  for (i = 0, out = 0; i < len; i++)
+    {
+      if (out > 0 && journal[out-1].bucket == journal[i].bucket
+          && arrow_id_cmp (&journal[out-1].id, &journal[i].id) == 0)
+        journal[out-1].delta += journal[i].delta;
+      else
+        journal[out++] = journal[i];
+    }
+
+  for (i = 0; i < out; i = j)
+    {
+      for (j = i + 1; j < out && journal[j].bucket == journal[i].bucket; j++)
+        ;
+      missing += apply_ref_deltas (state, &journal[i], j - i, wgen);
+    }
+  pthread_mutex_unlock (&state->split_lock);
+
+  clk = clock() - clk;
+  store_log (STORE_PERF, "applied %zu reference changes (%zu keys) in %f seconds",
+             len, out, (double) clk / (double) CLOCKS_PER_SEC);
+
+  free (journal);
+  if (missing > 0)
+    {
+      store_log (STORE_TRACE, "%zu reference changes were for missing keys", missing);
+      errno = ENOENT;
+      return -1;
+    }
+  return 0;
+}
+
+size_t
+store_get (store_state_t *state, const arrow_id_t *id, void *out, size_t maxlen)
+{
+  store_t store;
+  uint64_t bucket, gen;
+  uint32_t slot, seq, references;
+  size_t size;
+  block_forward_t fwd;
+  int i, cold;
+
+  if (hot_lookup (state, id, out, maxlen, &size, &bucket, &slot) == 2)
+    return size;
+
+  do
+    {
+      cold = 0;
+      references = 0;
+      gen = store_read_begin (state);
+      bucket = store_lookup_key (state, id, &seq, store.id);
+      store_trace ("mapped key %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x to %s",
+                   id->strong[ 8], id->strong[ 9], id->strong[10], id->strong[11],
+                   id->strong[12], id->strong[13], id->strong[14], id->strong[15],
+                   store.id);
+
+      if (store_open (state, &store) != 0)
+        return -1;
+
+      size = -1;
+      i = store_key_index (&store, id);
+      if (i >= 0 && store_key_forward (&store, i, &fwd))
+        cold = 1;
+      else if (i >= 0)
+        {
+          block_key_t *key = &((block_header_t *) store.data.data)->keys[i];
+          uint32_t offset = key->offset, length = key->length;
+
+          /* If the chunk is being moved, its key may not agree with
+             the data yet; we'll retry, but must not read off the end. */
+          if (store_offset_of_chunk (&store, offset) + length <= store.data.length)
+            {
+              memcpy (out, store_data_base (&store) + offset,
+                      length < maxlen ? length : maxlen);
+              size = length;
+            }
+          references = key->references;
+        }
+      store_trace ("get_from result %ld", size);
+      store_close (state, &store);
+    }
+  while (store_lookup_retry (state, bucket, seq) || store_read_retry (state, gen));
+
+  if (hot_wanted (state, id, references, size))
+    hot_refresh (state, id);
+
+  /* Packs are never changed once written, so this needs no locks. */
+  if (cold)
+    size = cold_read (state, &fwd, out, maxlen);
+  return size;
+}
+
+size_t
+store_get_len (store_state_t *state, const arrow_id_t *id)
+{
+  store_t store;
+  uint64_t bucket, gen;
+  uint32_t slot, seq;
+  size_t size;
+
+  if (hot_lookup (state, id, NULL, 0, &size, &bucket, &slot) != 0)
+    return size;
+
+  do
+    {
+      gen = store_read_begin (state);
+      bucket = store_lookup_key (state, id, &seq, store.id);
+      if (store_open (state, &store) != 0)
+        return -1;
+
+      size = store_get_len_from (&store, id);
+      store_close (state, &store);
+    }
+  while (store_lookup_retry (state, bucket, seq) || store_read_retry (state, gen));
+  return size;
+}
+
+int
+store_contains (store_state_t *state, const arrow_id_t *id)
+{
+  store_t store;
+  uint64_t bucket, gen;
+  uint32_t seq, references;
+  block_header_t *header;
+  block_key_t *keys;
+  int i;
+  int found;
+
+  if (hot_contains (state, id))
+    return 1;
+
+  do
+    {
+      references = 0;
+      gen = store_read_begin (state);
+      bucket = store_lookup_key (state, id, &seq, store.id);
+      if (store_open (state, &store) != 0)
+        return 0;
+
+      header = (block_header_t *) store.data.data;
+      keys = header->keys;
+
+      found = 0;
+      for (i = 0; i < header->chunk_count; i++)
+        {
+          if (arrow_id_cmp (id, &keys[i]) == 0)
+            {
+              found = 1;
+              references = keys[i].references;
+              break;
+            }
+        }
+      store_close (state, &store);
+    }
+  while (store_lookup_retry (state, bucket, seq) || store_read_retry (state, gen));
+
+  if (hot_wanted (state, id, references, 0))
+    hot_refresh (state, id);
+  return found;
+}
+
+int
+store_put_into (store_t *store, const arrow_id_t *id, const void *buf, size_t len)
+{
+  struct rs_handle *rs = make_rs_handle();
+  return store_put_into_int (store, id, buf, len, 1, rs, 0, NULL);
+}
+
+/*
+ * Put a chunk into a block. If the chunk is new and `from' is not
+ * NULL, the chunk is being moved from another block and keeps the
+ * extended info in `from'; otherwise, a nonzero wgen is recorded as the
+ * chunk's write generation.
+ */
+static int
+store_put_into_int (store_t *store, const arrow_id_t *id, const void *buf, size_t len,
+                    int gen_rs, struct rs_handle *rs, uint64_t wgen,
+                    const block_key_ext_t *from)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  int i = 0;
+  size_t offset = 0; /* Is the point in store->data.data where we *can't* store data. */
+
+  store_trace ("%p %p %p", store, header, keys);
+
+  for (i = 0; i < header->chunk_count; i++)
+	{
+	  if (memcmp (&keys[i].id, id, sizeof (arrow_id_t)) == 0)
+		{
+          int begin, end;
+		  /* We believe that it is already there. */
+          keys[i].references++;
+          stamp_key (store, i, wgen, 0);
+          store_trace ("put again, num references: %d", keys[i].references);
+          if (gen_rs)
+            {
+              find_changed_subblocks(store_offset_of_key (store, i),
+                                     sizeof (block_key_t), &begin, &end);
+              generate_rscode (rs, store, begin, end);
+            }
+		  return 1;
+		}
+	  else if (memcmp (&keys[i], &null_key, sizeof (block_key_t)) == 0)
+		{
+          size_t remain = 0;
+          store_trace ("found a slot at %d", i);
+          if (i < header->chunk_count - 1
+              || memcmp (&keys[i+1], &null_key, sizeof (block_key_t)) == 0)
+            remain = header->alloc_size - store_header_size (store) - offset;
+          else
+            remain = keys[i+1].offset - offset;
+
+          store_trace ("we have %ld bytes in this slot", remain);
+
+          if (remain >= len)
+            {
+              int begin, end;
+              block_key_ext_t *ext = store_key_ext (store, i);
+              /* Fill in the data and key before the id, so readers in
+                 other processes never match a half-written entry. */
+              memcpy (store_data_base (store) + offset, buf, len);
+              if (ext != NULL && from != NULL && header->version >= BLOCK_VERSION_GEN)
+                {
+                  memcpy (ext, from, sizeof (block_key_ext_t));
+                  if (store_block_ext (store)->generation < from->modified)
+                    store_block_ext (store)->generation = from->modified;
+                }
+              else if (ext != NULL)
+                {
+                  memset (ext, 0, block_key_ext_size (header->version));
+                  ext->crc32c = crc32c (0, buf, len);
+                  stamp_key (store, i, wgen, 1);
+                }
+              keys[i].offset = offset;
+              keys[i].length = len;
+              keys[i].references = 1;
+              __sync_synchronize ();
+              memcpy (&keys[i].id, id, sizeof (arrow_id_t));
+              store_trace ("placed %ld bytes at %ld", len, offset);
+              if (gen_rs)
+                {
+                  find_changed_subblocks(store_offset_of_key (store, i),
+                                         sizeof (block_key_t), &begin, &end);
+                  generate_rscode (rs, store, begin, end);
+                  find_changed_subblocks(store_offset_of_chunk (store, offset),
+                                         len, &begin, &end);
+                  generate_rscode (rs, store, begin, end);
+                }
+              return 0;
+            }
+        }
+      else
+        {
+          offset += keys[i].length;
+          store_trace ("keep looking; offset now %ld", offset);
+        }
+	}
+
+  fail ("FIXME - implement growing stores");
+  return -1;
+}
+
+int
+store_addref_to (store_t *store, const arrow_id_t *id)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  int i;
+
+  for (i = 0; i < header->chunk_count; i++)
+    {
+      if (arrow_id_cmp (&keys[i].id, id) == 0)
+        {
+          keys[i].references++;
+          return 0;
+        }
+    }
+  return -1;
+}
+
+size_t
+store_get_from (store_t *store, const arrow_id_t *id, void *out, size_t maxlen)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  int i;
+
+  for (i = 0; i < header->chunk_count; i++)
+	{
+	  if (memcmp (&keys[i].id, id, sizeof (arrow_id_t)) == 0)
+		{
+          block_forward_t fwd;
+          store_trace ("found key at %d", i);
+          if (store_key_forward (store, i, &fwd))
+            {
+              /* Reading a cold pack needs the store state; use store_get. */
+              errno = ENODATA;
+              return -1;
+            }
+		  memcpy (out, store_data_base (store) + keys[i].offset,
+				  keys[i].length < maxlen ? keys[i].length : maxlen);
+		  return keys[i].length;
+		}
+	}
+
+  return -1;
+}
+
+size_t
+store_get_len_from (store_t *store, const arrow_id_t *id)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  int i;
+
+  for (i = 0; i < header->chunk_count; i++)
+	{
+	  if (memcmp (&keys[i].id, id, sizeof (struct arrow_id_s)) == 0)
+		return store_key_length (store, i);
+	}
+
+  return -1;
+}
+
+int
+store_scrub_all (store_state_t *state, store_scrub_mode_t mode)
+{
+  size_t pathlen;
+  char *path;
+  DIR *dir;
+  store_t store;
+  struct dirent *dent;
+  uint64_t bucket, gen;
+  int ret;
+  int failures = 0;
+
+  pathlen = strlen (state->rootdir) + strlen (ARROW_BLOCKS_DIR) + 2;
+  path = (char *) malloc (pathlen);
+  snprintf (path, pathlen, "%s/%s", state->rootdir, ARROW_BLOCKS_DIR);
+
+  dir = opendir (path);
+  if (dir == NULL)
+    {
+      free (path);
+      return -1;
+    }
+
+  free (path);
+
+  while ((dent = readdir (dir)) != NULL)
+    {
+      if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+        continue;
+      if (b64_decode (dent->d_name, &bucket) != 0)
+        continue;
+      strcpy (store.id, dent->d_name);
+      do
+        {
+          gen = store_read_begin (state);
+          store_lock_bucket (state, bucket, 0);
+          if (store_open (state, &store) != 0)
+            {
+              store_unlock_bucket (state, bucket);
+              ret = 0;
+              break;
+            }
+          ret = store_scrub (&store, mode, NULL);
+          store_close (state, &store);
+          store_unlock_bucket (state, bucket);
+        }
+      while (ret != 0 && store_read_retry (state, gen));
+      if (ret != 0)
+        failures++;
+    }
+  closedir (dir);
+  return failures;
+}
+
+int
+store_verify_all (store_state_t *state)
+{
+  return store_scrub_all (state, STORE_SCRUB_DEEP);
+}
+
+/*
+
+  EPIC FAIL WARNING
+
+  Our block key might get corrupt in the length or offset field, which
+  will render references to that block useless, so we can't verify the
+  block hash. So, we need to be CAREFUL about 
+
+ */
+
+static uint32_t
+compute_weak_key (store_t *store, block_key_t *key)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  Rollsum rs;
+
+  if (key->offset > header->alloc_size || key->offset + key->length > header->alloc_size)
+    {
+      /* Guaranteed corrupt offset or length field, abort! */
+      return 0;
+    }
+
+  RollsumInit (&rs);
+  RollsumUpdate (&rs, store_data_base (store) + key->offset,
+                 key->length);
+  return RollsumDigest(&rs);
+}
+
+static void
+compute_strong_key (store_t *store, block_key_t *key, uint8_t *digest)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+
+  if (key->offset > header->alloc_size || key->offset + key->length > header->alloc_size)
+    {
+      /* Guaranteed corrupt offset or length field, abort! */
+      memset (digest, 0, MD5_DIGEST_LENGTH);
+      return;
+    }
+
+  arrow_hash (store->hash, store_data_base (store) + key->offset, key->length, digest);
+}
+
+/* Check key i's weak sum against an already computed digest. */
+static int
+compare_weak_key (store_t *store, int i, unsigned long digest)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+
+  /* The digest is an unsigned long; keys keep its low 32 bits. */
+  if (keys[i].id.weak != (uint32_t) digest)
+    {
+      store_trace ("weak sum mismatch %u vs. %lu", keys[i].id.weak, digest);
+      return 0;
+    }
+  return 1;
+}
+
+static int
+verify_weak_key (store_t *store, int i)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  Rollsum rs;
+
+  RollsumInit (&rs);
+  RollsumUpdate (&rs, store_data_base (store) + keys[i].offset,
+                 keys[i].length);
+  return compare_weak_key (store, i, RollsumDigest (&rs));
+}
+
+/* Check key i's strong sum against an already computed digest. */
+static int
+compare_strong_key (store_t *store, int i, const uint8_t *digest)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+
+  if (memcmp (keys[i].id.strong, digest, MD5_DIGEST_LENGTH) != 0)
+    {
+      store_trace ("strong sum mismatch %02x:%02x:%02x:%02x:%02x:%02x:"
+                   "%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x "
+                   "vs. %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:"
+                   "%02x:%02x:%02x:%02x:%02x:%02x:%02x",
+                   keys[i].id.strong[ 0], keys[i].id.strong[ 1],
+                   keys[i].id.strong[ 2], keys[i].id.strong[ 3],
+                   keys[i].id.strong[ 4], keys[i].id.strong[ 5],
+                   keys[i].id.strong[ 6], keys[i].id.strong[ 7],
+                   keys[i].id.strong[ 8], keys[i].id.strong[ 9],
+                   keys[i].id.strong[10], keys[i].id.strong[11],
+                   keys[i].id.strong[12], keys[i].id.strong[13],
+                   keys[i].id.strong[14], keys[i].id.strong[15],
+                   digest[ 0], digest[ 1], digest[ 2], digest[ 3],
+                   digest[ 4], digest[ 5], digest[ 6], digest[ 7],
+                   digest[ 8], digest[ 9], digest[10], digest[11],
+                   digest[12], digest[13], digest[14], digest[15]);
+      return 0;
+    }
+  return 1;
+}
+
+static int
+verify_crc_key (store_t *store, int i)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  block_key_ext_t *ext = store_key_ext (store, i);
+
+  if (keys[i].offset > header->alloc_size
+      || keys[i].offset + keys[i].length > header->alloc_size)
+    return 0;
+  if (ext->crc32c != crc32c (0, store_data_base (store) + keys[i].offset,
+                             keys[i].length))
+    {
+      store_trace ("crc32c mismatch at key %d", i);
+      return 0;
+    }
+  return 1;
+}
+
+static void
+add_error (store_error_t *errors, int i)
+{
+  if (errors == NULL)
+    return;
+  errors->count++;
+  if (errors->keys == NULL)
+    errors->keys = (int *) malloc (sizeof (int));
+  else
+    errors->keys = (int *) realloc (errors->keys, sizeof (int) * errors->count);
+  if (errors->keys != NULL)
+    errors->keys[errors->count - 1] = i;
+}
+
+/* Keys whose strong sums a deep scrub computes together. */
+#define STORE_SCRUB_BATCH 64
+
+/*
+ * Deep scrub of keys [begin, end). CRCs are checked key by key, as in
+ * scrub_range; the weak and strong sums of up to STORE_SCRUB_BATCH keys
+ * that pass are computed together.
+ */
+static int
+scrub_range_deep (store_t *store, int begin, int end, store_error_t *errors,
+                  uint64_t *bytes)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  int has_crc = header->version >= BLOCK_VERSION_CRC;
+  int batch[STORE_SCRUB_BATCH];
+  int ok[STORE_SCRUB_BATCH];
+  int strong[STORE_SCRUB_BATCH];
+  const void *bufs[STORE_SCRUB_BATCH];
+  size_t lens[STORE_SCRUB_BATCH];
+  arrow_key_t digests[STORE_SCRUB_BATCH];
+  unsigned long weak[STORE_SCRUB_BATCH];
+  int i = begin;
+  int found_errors = 0;
+
+  while (i < end)
+    {
+      int n = 0, m = 0, j;
+
+      for (; i < end && n < STORE_SCRUB_BATCH; i++)
+        {
+          block_forward_t fwd;
+
+          if (memcmp (&keys[i], &null_key, sizeof (block_key_t)) == 0)
+            continue;
+          if (bytes != NULL)
+            *bytes += keys[i].length;
+          batch[n] = i;
+          strong[n] = -1;
+          ok[n] = !has_crc || verify_crc_key (store, i);
+          /* A cold chunk's data is in its pack, and is checked when
+             it's read; here there's only the forward to look at. */
+          if (ok[n] && !store_key_forward (store, i, &fwd))
+            {
+              strong[n] = m;
+              bufs[m] = store_data_base (store) + keys[i].offset;
+              lens[m] = keys[i].length;
+              m++;
+            }
+          n++;
+        }
+
+      if (m > 0)
+        {
+          RollsumDigestMany (bufs, lens, m, weak);
+          arrow_hash_many (store->hash, bufs, lens, m, digests);
+        }
+
+      for (j = 0; j < n; j++)
+        {
+          if (strong[j] >= 0)
+            ok[j] = (compare_weak_key (store, batch[j], weak[strong[j]])
+                     && compare_strong_key (store, batch[j], digests[strong[j]]));
+          if (!ok[j])
+            {
+              found_errors++;
+              add_error (errors, batch[j]);
+            }
+        }
+    }
+  return found_errors;
+}
+
+/*
+ * Scrub keys [begin, end) of the block, adding the number of bytes
+ * checked to *bytes. Returns the number of bad chunks.
+ */
+static int
+scrub_range (store_t *store, store_scrub_mode_t mode, int begin, int end,
+             store_error_t *errors, uint64_t *bytes)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  int has_crc = header->version >= BLOCK_VERSION_CRC;
+  int i;
+  int found_errors = 0;
+
+  if (mode != STORE_SCRUB_FAST)
+    return scrub_range_deep (store, begin, end, errors, bytes);
+
+  for (i = begin; i < end; i++)
+    {
+      int ok;
+
+      if (memcmp (&keys[i], &null_key, sizeof (block_key_t)) == 0)
+        continue;
+      ok = has_crc ? verify_crc_key (store, i) : verify_weak_key (store, i);
+      if (!ok)
+        {
+          found_errors++;
+          add_error (errors, i);
+        }
+      if (bytes != NULL)
+        *bytes += keys[i].length;
+    }
+  return found_errors;
+}
+
+int
+store_scrub (store_t *store, store_scrub_mode_t mode, store_error_t *errors)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+
+  if (errors != NULL)
+    {
+      errors->count = 0;
+      errors->keys = NULL;
+    }
+  return scrub_range (store, mode, 0, header->chunk_count, errors, NULL);
+}
+
+int
+store_verify (store_t *store, store_error_t *errors)
+{
+  return store_scrub (store, STORE_SCRUB_DEEP, errors);
+}
+
+/*
+ * The background scrubber walks the buckets in order, a slice of a
+ * block at a time, holding the bucket's read lock only while it checks
+ * that slice. Its position is saved in STORE_SCRUB_CURSOR after every
+ * slice, so a restarted scrubber picks up where the last one left off.
+ */
+#define STORE_SCRUB_CURSOR ".scrub"
+#define STORE_SCRUB_SLICE (256 * 1024)
+
+typedef struct store_scrub_cursor_s
+{
+  char header[4];
+  uint8_t version;
+  uint64_t passes;
+  uint64_t bucket;
+  uint32_t key;
+} store_scrub_cursor_t;
+
+static const char scrub_cursor_header[4] = { 'A', 'R', 'W', 'C' };
+
+struct store_scrubber_s
+{
+  store_state_t *state;
+  store_scrub_mode_t mode;
+  double rate;                  /**< Bytes per second, or zero. */
+  pthread_t thread;
+  pthread_mutex_t lock;         /**< Guards rate, stop and status. */
+  pthread_cond_t cond;
+  int stop;
+  int cursor_fd;
+  uint32_t key;
+  store_scrub_status_t status;
+};
+
+static void
+scrubber_save_cursor (store_scrubber_t *scrubber)
+{
+  store_scrub_cursor_t cursor;
+
+  if (scrubber->cursor_fd < 0)
+    return;
+  memset (&cursor, 0, sizeof (cursor));
+  memcpy (cursor.header, scrub_cursor_header, 4);
+  cursor.version = ARROW_FILE_VERSION;
+  cursor.passes = scrubber->status.passes;
+  cursor.bucket = scrubber->status.bucket;
+  cursor.key = scrubber->key;
+  if (pwrite (scrubber->cursor_fd, &cursor, sizeof (cursor), 0) != sizeof (cursor))
+    store_perror ("saving scrub cursor");
+}
+
+static void
+scrubber_load_cursor (store_scrubber_t *scrubber)
+{
+  store_scrub_cursor_t cursor;
+
+  if (scrubber->cursor_fd < 0)
+    return;
+  if (pread (scrubber->cursor_fd, &cursor, sizeof (cursor), 0) != sizeof (cursor)
+      || memcmp (cursor.header, scrub_cursor_header, 4) != 0)
+    return;
+  scrubber->status.passes = cursor.passes;
+  scrubber->status.bucket = cursor.bucket;
+  scrubber->key = cursor.key;
+}
+
+/* Wait until the given time, or until asked to stop. Returns nonzero
+   if we should stop. Called with the scrubber lock held. */
+static int
+scrubber_wait_until (store_scrubber_t *scrubber, const struct timespec *when)
+{
+  while (!scrubber->stop)
+    {
+      if (pthread_cond_timedwait (&scrubber->cond, &scrubber->lock, when) == ETIMEDOUT)
+        break;
+    }
+  return scrubber->stop;
+}
+
+static void *
+scrubber_run (void *arg)
+{
+  store_scrubber_t *scrubber = (store_scrubber_t *) arg;
+  store_state_t *state = scrubber->state;
+  struct timespec next;
+  store_t store;
+
+  clock_gettime (CLOCK_REALTIME, &next);
+  pthread_mutex_lock (&scrubber->lock);
+  while (!scrubber->stop)
+    {
+      block_header_t *header;
+      uint64_t bucket = scrubber->status.bucket;
+      uint64_t bytes = 0, slice, gen;
+      uint32_t key = scrubber->key, end = key, count;
+      int errors;
+      double rate = scrubber->rate;
+      struct timespec now;
+
+      pthread_mutex_unlock (&scrubber->lock);
+
+      if (bucket >= store_bucket_count (state))
+        {
+          /* Finished a pass; start over from the first bucket. */
+          pthread_mutex_lock (&scrubber->lock);
+          scrubber->status.passes++;
+          scrubber->status.bucket = 0;
+          scrubber->key = 0;
+          scrubber_save_cursor (scrubber);
+          store_log (STORE_PERF, "scrub pass %llu done, %llu errors so far",
+                     (unsigned long long) scrubber->status.passes,
+                     (unsigned long long) scrubber->status.errors);
+          continue;
+        }
+
+      b64_encode (bucket, store.id);
+      gen = store_read_begin (state);
+      store_lock_bucket (state, bucket, 0);
+      if (store_open (state, &store) != 0)
+        {
+          store_unlock_bucket (state, bucket);
+          pthread_mutex_lock (&scrubber->lock);
+          scrubber->status.bucket++;
+          scrubber->key = 0;
+          continue;
+        }
+      header = (block_header_t *) store.data.data;
+      count = header->chunk_count;
+      /* Take keys up to STORE_SCRUB_SLICE bytes, and check them in one
+         go, so deep scrubs hash them in batches. */
+      for (slice = 0; end < count && slice < STORE_SCRUB_SLICE; end++)
+        slice += header->keys[end].length;
+      errors = scrub_range (&store, scrubber->mode, key, end, NULL, &bytes);
+      store_close (state, &store);
+      store_unlock_bucket (state, bucket);
+
+      /* A concurrent split in another process may have moved chunks
+         out from under us; check the slice again. */
+      if (errors > 0 && store_read_retry (state, gen))
+        {
+          pthread_mutex_lock (&scrubber->lock);
+          continue;
+        }
+      if (errors > 0)
+        store_log (STORE_TRACE, "scrub found %d bad chunks in bucket %llu, keys %u to %u",
+                   errors, (unsigned long long) bucket, key, end);
+
+      pthread_mutex_lock (&scrubber->lock);
+      scrubber->status.errors += errors;
+      scrubber->status.bytes += bytes;
+      if (end >= count)
+        {
+          scrubber->status.bucket++;
+          scrubber->key = 0;
+        }
+      else
+        scrubber->key = end;
+      scrubber_save_cursor (scrubber);
+
+      if (rate > 0)
+        {
+          /* Keep to the byte budget, but don't bank more than a
+             second's worth of idle time as a burst. */
+          double delay = (double) bytes / rate;
+          clock_gettime (CLOCK_REALTIME, &now);
+          if (now.tv_sec > next.tv_sec + 1)
+            next = now;
+          next.tv_sec += (time_t) delay;
+          next.tv_nsec += (long) ((delay - (time_t) delay) * 1000000000.0);
+          if (next.tv_nsec >= 1000000000L)
+            {
+              next.tv_sec++;
+              next.tv_nsec -= 1000000000L;
+            }
+          scrubber_wait_until (scrubber, &next);
+        }
+    }
+  pthread_mutex_unlock (&scrubber->lock);
+  return NULL;
+}
+
+int
+store_scrubber_start (store_state_t *state, store_scrub_mode_t mode,
+                      double mb_per_sec, store_scrubber_t **scrubber)
+{
+  store_scrubber_t *s;
+  char *path;
+  size_t len = strlen (state->rootdir) + strlen (STORE_SCRUB_CURSOR) + 2;
+
+  s = (store_scrubber_t *) malloc (sizeof (store_scrubber_t));
+  if (s == NULL)
+    return -1;
+  memset (s, 0, sizeof (store_scrubber_t));
+  s->state = state;
+  s->mode = mode;
+  s->rate = mb_per_sec * 1024.0 * 1024.0;
+
+  path = (char *) malloc (len);
+  if (path == NULL)
+    {
+      free (s);
+      return -1;
+    }
+  snprintf (path, len, "%s/%s", state->rootdir, STORE_SCRUB_CURSOR);
+  /* Read-only stores may not let us write the cursor; scrub anyway. */
+  s->cursor_fd = open (path, O_RDWR | O_CREAT, 0600);
+  free (path);
+  scrubber_load_cursor (s);
+
+  pthread_mutex_init (&s->lock, NULL);
+  pthread_cond_init (&s->cond, NULL);
+  if (pthread_create (&s->thread, NULL, scrubber_run, s) != 0)
+    {
+      arrow_push_errno ();
+      pthread_mutex_destroy (&s->lock);
+      pthread_cond_destroy (&s->cond);
+      if (s->cursor_fd >= 0)
+        close (s->cursor_fd);
+      free (s);
+      arrow_pop_errno ();
+      return -1;
+    }
+  *scrubber = s;
+  return 0;
+}
+
+void
+store_scrubber_set_rate (store_scrubber_t *scrubber, double mb_per_sec)
+{
+  pthread_mutex_lock (&scrubber->lock);
+  scrubber->rate = mb_per_sec * 1024.0 * 1024.0;
+  pthread_cond_signal (&scrubber->cond);
+  pthread_mutex_unlock (&scrubber->lock);
+}
+
+void
+store_scrubber_status (store_scrubber_t *scrubber, store_scrub_status_t *status)
+{
+  pthread_mutex_lock (&scrubber->lock);
+  *status = scrubber->status;
+  pthread_mutex_unlock (&scrubber->lock);
+}
+
+void
+store_scrubber_stop (store_scrubber_t *scrubber)
+{
+  pthread_mutex_lock (&scrubber->lock);
+  scrubber->stop = 1;
+  pthread_cond_signal (&scrubber->cond);
+  pthread_mutex_unlock (&scrubber->lock);
+  pthread_join (scrubber->thread, NULL);
+
+  pthread_mutex_destroy (&scrubber->lock);
+  pthread_cond_destroy (&scrubber->cond);
+  if (scrubber->cursor_fd >= 0)
+    close (scrubber->cursor_fd);
+  free (scrubber);
+}
+
+typedef uint8_t codeword_t[RS_CODEWORD_SIZE];
+
+static int
+try_fix_key (store_t *store, int idx)
+{
+  return -1;
+/*   block_header_t *header = (block_header_t *) store->data.data; */
+/*   block_key_t *keys = header->keys; */
+/*   codeword_t *codewords; */
+/*   codeword_t saved_codeword; */
+/*   block_key_t *key; */
+/*   size_t sb_len; */
+/*   int begin, end; */
+/*   int i, j; */
+/*   uint8_t erasures[RS_CODEWORD_SIZE]; */
+/*   struct rs_handle *rs = make_rs_handle(); */
+/*   uint8_t syndrome[RS_PARITY_SIZE]; */
+
+/*   find_changed_subblocks (store_offset_of_key (store, idx), sizeof (block_key_t), */
+/*                           &begin, &end); */
+
+/*   sb_len = (end - begin) * RS_CODEWORD_SIZE; */
+/*   codewords = (codeword_t *) malloc (sb_len); */
+/*   if (codewords == NULL) */
+/*     return 0; */
+
+/*   memcpy (codewords, store->data.data + (begin * RS_CODEWORD_SIZE), sb_len); */
+/*   key = (block_key_t *) (((uint8_t *) codewords) */
+/*                          + (store_offset_of_key(store, idx) - (begin * RS_CODEWORD_SIZE))); */
+
+/*   store_trace ("trying RS fixup for block key %d, subblocks %d thru %d", */
+/*                idx, begin, end); */
+
+/*   for (i = 0; i < end - begin; i++) */
+/*     { */
+/*       rslib_parity_check (rs, (symbol_t *) &codewords[i], get_parity_bytes (store, begin+i), syndrome); */
+/*       for (j = 0; j < RS_CODEWORD_SIZE; j++) */
+/*         { */
+/*           memcpy (&saved_codeword, &codewords[i], sizeof (codeword_t)); */
+/*           memset (&erasures, 0, sizeof (erasures)); */
+/*           erasures[j] = 1; */
+/*           if (rslib_decode (rs, &codewords[i], erasures, 1) >= 0) */
+/*             { */
+/*               if (compute_weak_key (store, key) == key->id.weak) */
+/*                 { */
+/*                   uint8_t md5[MD5_DIGEST_LENGTH]; */
+/*                   compute_strong_key (store, key, md5); */
+/*                   if (memcmp (md5, key->id.strong, MD5_DIGEST_LENGTH) == 0) */
+/*                     { */
+/*                       /\* Happy day! *\/ */
+/*                       store_trace ("SUCCESS fixing block key %d in subblock %d", */
+/*                                    idx, i + begin); */
+/*                       memcpy (store->data.data + (begin * RS_CODEWORD_SIZE), */
+/*                               codewords, sb_len); */
+/*                       free (codewords); */
+/*                       rslib_free_rs (rs); */
+/*                       return 1; */
+/*                     } */
+/*                 } */
+/*             } */
+/*           memcpy (&codewords[i], &saved_codeword, sizeof (codeword_t)); */
+/*         } */
+/*     } */
+
+/*   rslib_free_rs (rs); */
+/*   store_trace ("failed to fixup block key %d", i); */
+/*   free (codewords); */
+/*   return 0; */
+}
+
+static int
+try_fix_value (store_t *store, int index)
+{
+  return -1;
+/*   block_header_t *header = (block_header_t *) store->data.data; */
+/*   block_key_t *keys = header->keys; */
+/*   codeword_t *codewords; */
 /*   codeword_t saved_codeword; */
 /*   block_key_t *key; */
 /*   size_t sb_len; */
@@ -1239,142 +3921,1149 @@ try_fix_key (store_t *store, int idx)
 /*   struct rs_handle *rs = make_rs_handle(); */
 /*   uint8_t syndrome[RS_PARITY_SIZE]; */
 
-/*   find_changed_subblocks (store_offset_of_key (store, idx), sizeof (block_key_t), */
-/*                           &begin, &end); */
+/*   find_changed_subblocks (store_offset_of_chunk (store, keys[index].offset), */
+/*                           keys[index].length, &begin, &end); */
+
+/*   sb_len = (end - begin) * RS_CODEWORD_SIZE; */
+/*   codewords = (codeword_t *) malloc (sb_len); */
+/*   if (codewords == NULL) */
+/*     return 0; */
+
+/*   memcpy (codewords, store->data.data + (begin * RS_CODEWORD_SIZE), sb_len); */
+/*   key = &keys[index]; */
+
+/*   store_trace ("trying RS fixup for block value %d, subblocks %d thru %d", */
+/*                index, begin, end); */
+
+/*   for (i = 0; i < end - begin; i++) */
+/*     { */
+/*       rslib_parity_check (rs, (symbol_t *) &codewords[i], get_parity_bytes (store, begin+i), syndrome); */
+/*       for (j = 0; j < RS_CODEWORD_SIZE; j++) */
+/*         { */
+/*           memcpy (&saved_codeword, &codewords[i], sizeof (codeword_t)); */
+/*           memset (&erasures, 0, sizeof (erasures)); */
+/*           erasures[j] = 1; */
+/*           if (rslib_decode (rs, &codewords[i], erasures, 1) >= 0) */
+/*             { */
+/*               if (compute_weak_key (store, key) == key->id.weak) */
+/*                 { */
+/*                   uint8_t md5[MD5_DIGEST_LENGTH]; */
+/*                   compute_strong_key (store, key, md5); */
+/*                   if (memcmp (md5, key->id.strong, MD5_DIGEST_LENGTH) == 0) */
+/*                     { */
+/*                       /\* Happy day! *\/ */
+/*                       store_trace ("SUCCESS fixing block key %d in subblock %d", */
+/*                                    index, i + begin); */
+/*                       memcpy (store->data.data + (begin * RS_CODEWORD_SIZE), */
+/*                               codewords, sb_len); */
+/*                       free (codewords); */
+/*                       rslib_free_rs (rs); */
+/*                       return 1; */
+/*                     } */
+/*                 } */
+/*             } */
+/*           memcpy (&codewords[i], &saved_codeword, sizeof (codeword_t)); */
+/*         } */
+/*     } */
+
+/*   rslib_free_rs (rs); */
+/*   store_trace ("failed to fixup block key %d", i); */
+/*   free (codewords); */
+/*   return 0; */
+}
+
+int
+store_repair (store_t *store, store_error_t *errors)
+{
+  int i;
+  int numfixed = 0;
+
+  for (i = 0; i < errors->count; i++)
+    {
+      if (try_fix_key (store, errors->keys[i]))
+        {
+          numfixed++;
+          continue;
+        }
+      if (try_fix_value (store, errors->keys[i]))
+        numfixed++;
+    }
+  return numfixed;
+}
+
+typedef struct key_slot_s
+{
+  arrow_id_t id;
+  int index;
+} key_slot_t;
+
+static int
+key_slot_cmp (const void *a, const void *b)
+{
+  return arrow_id_cmp (&((const key_slot_t *) a)->id, &((const key_slot_t *) b)->id);
+}
+
+/*
+ * Rewrite an open, write-locked block so that the chunks listed in
+ * `order' come first, followed by the others in their current order,
+ * with the data packed together at the start of the data region.
+ */
+static int
+rewrite_block (store_state_t *state, store_t *store, uint64_t bucket,
+               const arrow_id_t *order, size_t count)
+{
+  block_header_t *header;
+  block_key_t *keys, *newkeys = NULL;
+  uint8_t *newext = NULL, *newdata = NULL, *placed = NULL;
+  key_slot_t *slots = NULL;
+  size_t extsize, nslots = 0, i, out = 0;
+  uint32_t offset = 0;
+  int k, n, ret = -1;
+  clock_t clk;
+
+  clk = clock();
+  header = (block_header_t *) store->data.data;
+  keys = header->keys;
+  n = header->chunk_count;
+  extsize = block_key_ext_size (header->version);
+
+  newkeys = (block_key_t *) calloc (n, sizeof (block_key_t));
+  newext = (uint8_t *) calloc (n, extsize > 0 ? extsize : 1);
+  newdata = (uint8_t *) malloc (header->alloc_size);
+  placed = (uint8_t *) calloc (n, 1);
+  slots = (key_slot_t *) malloc (n * sizeof (key_slot_t));
+  if (newkeys == NULL || newext == NULL || newdata == NULL || placed == NULL
+      || slots == NULL)
+    goto done;
+
+  for (k = 0; k < n; k++)
+    {
+      if (memcmp (&keys[k], &null_key, sizeof (block_key_t)) == 0)
+        continue;
+      slots[nslots].id = keys[k].id;
+      slots[nslots].index = k;
+      nslots++;
+    }
+  qsort (slots, nslots, sizeof (key_slot_t), key_slot_cmp);
+
+  /* The chunks in `order' first, then the rest as they were. */
+  for (i = 0; i < count + n; i++)
+    {
+      if (i < count)
+        {
+          key_slot_t key, *slot;
+          key.id = order[i];
+          slot = (key_slot_t *) bsearch (&key, slots, nslots, sizeof (key_slot_t),
+                                         key_slot_cmp);
+          if (slot == NULL)
+            continue;
+          k = slot->index;
+        }
+      else
+        k = i - count;
+      if (placed[k] || memcmp (&keys[k], &null_key, sizeof (block_key_t)) == 0)
+        continue;
+      if (keys[k].offset + keys[k].length > header->alloc_size
+          || offset + keys[k].length > header->alloc_size)
+        {
+          store_log (STORE_TRACE, "key %d in bucket %llu is out of bounds", k,
+                     (unsigned long long) bucket);
+          errno = EIO;
+          goto done;
+        }
+      memcpy (newdata + offset, store_data_base (store) + keys[k].offset,
+              keys[k].length);
+      newkeys[out] = keys[k];
+      newkeys[out].offset = offset;
+      if (extsize > 0)
+        memcpy (newext + (out * extsize), store_key_ext (store, k), extsize);
+      offset += keys[k].length;
+      placed[k] = 1;
+      out++;
+    }
+
+  memcpy (keys, newkeys, n * sizeof (block_key_t));
+  if (extsize > 0)
+    memcpy (store_key_ext (store, 0), newext, n * extsize);
+  memcpy (store_data_base (store), newdata, offset);
+  generate_rscode (state->rs, store, -1, -1);
+  ret = 0;
+
+  clk = clock() - clk;
+  store_log (STORE_PERF, "rewrote %zu chunks in bucket %llu in %f seconds",
+             out, (unsigned long long) bucket, (double) clk / (double) CLOCKS_PER_SEC);
+
+ done:
+  arrow_push_errno ();
+  free (slots);
+  free (placed);
+  free (newdata);
+  free (newext);
+  free (newkeys);
+  arrow_pop_errno ();
+  return ret;
+}
+
+int
+store_reorder (store_state_t *state, uint64_t bucket, const arrow_id_t *order,
+               size_t count)
+{
+  store_t store;
+  int ret = -1;
+
+  if (state->readonly)
+    {
+      errno = EROFS;
+      return -1;
+    }
+
+  pthread_mutex_lock (&state->split_lock);
+  store_unstable_begin (state);
+  pthread_mutex_unlock (&state->split_lock);
+
+  b64_encode (bucket, store.id);
+  store_lock_bucket (state, bucket, 1);
+  store_stripes_moving (store_stripe (state, bucket), store_stripe (state, bucket));
+  if (store_open (state, &store) == 0)
+    {
+      ret = rewrite_block (state, &store, bucket, order, count);
+      store_close (state, &store);
+    }
+  store_stripes_moving (store_stripe (state, bucket), store_stripe (state, bucket));
+  store_unlock_bucket (state, bucket);
+  arrow_push_errno ();
+  pthread_mutex_lock (&state->split_lock);
+  store_unstable_end (state);
+  pthread_mutex_unlock (&state->split_lock);
+  arrow_pop_errno ();
+  return ret;
+}
+
+/*
+ * Pack files. A pack is a store_pack_header_t, then `count'
+ * store_pack_entry_t index entries, then, for each entry in the same
+ * order that has data, a store_pack_chunk_t followed by the chunk's
+ * (possibly compressed) bytes. Packs are written strictly front to
+ * back, so they can be streamed over a pipe or socket.
+ *
+ * The index is sorted by the key hash with its bits reversed. Buckets
+ * are chosen by the low bits of the hash, so in that order all the
+ * chunks for any one bucket come together, however many buckets the
+ * importing store has; import then visits each block once.
+ *
+ * Replica packs (STORE_PACK_REPLICA) carry the exporter's reference
+ * counts rather than adding to the importer's, and may have entries
+ * with no data, for chunks the importer already has whose reference
+ * count changed.
+ */
+#define STORE_PACK_VERSION 2
+#define STORE_PACK_REPLICA 0x80
+#define STORE_PACK_DENSE 0x40   /* Compressed as small as zlib can. */
+#define STORE_PACK_ENTRY_NO_DATA 1
+#define STORE_PACK_CHUNK_COMPRESSED 1
+
+typedef struct store_pack_header_s
+{
+  char header[4];
+  uint8_t version;
+  uint8_t flags;
+  uint64_t count;       /**< Number of index entries. */
+  uint64_t generation;  /**< Exporter's write generation (version 2). */
+} store_pack_header_t;
+
+typedef struct store_pack_entry_s
+{
+  arrow_id_t id;
+  uint32_t length;      /**< Uncompressed length of the chunk. */
+  uint16_t references;  /**< Reference count in the exporting store. */
+  uint8_t flags;
+} store_pack_entry_t;
+
+typedef struct store_pack_chunk_s
+{
+  uint32_t length;      /**< Number of bytes that follow. */
+  uint32_t crc32c;      /**< CRC-32C of the uncompressed chunk. */
+  uint8_t flags;
+} store_pack_chunk_t;
+
+static const char pack_header[4] = { 'A', 'R', 'W', 'P' };
+
+static uint64_t
+reverse_bits (uint64_t x)
+{
+  x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+  x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64 (x);
+}
+
+static int
+pack_entry_cmp (const void *a, const void *b)
+{
+  const store_pack_entry_t *e1 = (const store_pack_entry_t *) a;
+  const store_pack_entry_t *e2 = (const store_pack_entry_t *) b;
+  uint64_t h1 = reverse_bits (store_key_hash (&e1->id));
+  uint64_t h2 = reverse_bits (store_key_hash (&e2->id));
+  if (h1 != h2)
+    return h1 < h2 ? -1 : 1;
+  return arrow_id_cmp (&e1->id, &e2->id);
+}
+
+static int
+write_fully (int fd, const void *buf, size_t len)
+{
+  const uint8_t *p = (const uint8_t *) buf;
+  while (len > 0)
+    {
+      ssize_t n = write (fd, p, len);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      p += n;
+      len -= n;
+    }
+  return 0;
+}
+
+static int
+read_fully (int fd, void *buf, size_t len)
+{
+  uint8_t *p = (uint8_t *) buf;
+  while (len > 0)
+    {
+      ssize_t n = read (fd, p, len);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      if (n == 0)
+        {
+          errno = EIO;  /* Truncated pack. */
+          return -1;
+        }
+      p += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/*
+ * Fill in the length and reference count of entry's chunk. Returns
+ * zero if the store has it.
+ */
+static int
+pack_lookup (store_state_t *state, store_pack_entry_t *entry)
+{
+  store_t store;
+  uint64_t bucket, gen;
+  int i;
 
-/*   sb_len = (end - begin) * RS_CODEWORD_SIZE; */
-/*   codewords = (codeword_t *) malloc (sb_len); */
-/*   if (codewords == NULL) */
-/*     return 0; */
+  do
+    {
+      gen = store_read_begin (state);
+      bucket = store_lock_key (state, &entry->id, 0, store.id);
+      if (store_open (state, &store) != 0)
+        {
+          store_unlock_bucket (state, bucket);
+          return -1;
+        }
+      i = store_key_index (&store, &entry->id);
+      if (i >= 0)
+        {
+          block_key_t *key = &((block_header_t *) store.data.data)->keys[i];
+          entry->length = store_key_length (&store, i);
+          entry->references = key->references;
+        }
+      store_close (state, &store);
+      store_unlock_bucket (state, bucket);
+    }
+  while (store_read_retry (state, gen));
+  return i >= 0 ? 0 : -1;
+}
 
-/*   memcpy (codewords, store->data.data + (begin * RS_CODEWORD_SIZE), sb_len); */
-/*   key = (block_key_t *) (((uint8_t *) codewords) */
-/*                          + (store_offset_of_key(store, idx) - (begin * RS_CODEWORD_SIZE))); */
+/*
+ * Every chunk in the store that changed after write generation
+ * `since', or every chunk if since is zero. Chunks that were already
+ * there at `since' are marked as having no data.
+ */
+static store_pack_entry_t *
+pack_collect (store_state_t *state, uint64_t since, size_t *count)
+{
+  store_pack_entry_t *entries = NULL;
+  size_t n = 0, cap = 0;
+  uint64_t bucket, buckets;
+  store_t store;
+  int i;
 
-/*   store_trace ("trying RS fixup for block key %d, subblocks %d thru %d", */
-/*                idx, begin, end); */
+  buckets = store_bucket_count (state);
+  for (bucket = 0; bucket < buckets; bucket++)
+    {
+      block_header_t *header;
+      block_ext_header_t *bext;
 
-/*   for (i = 0; i < end - begin; i++) */
-/*     { */
-/*       rslib_parity_check (rs, (symbol_t *) &codewords[i], get_parity_bytes (store, begin+i), syndrome); */
-/*       for (j = 0; j < RS_CODEWORD_SIZE; j++) */
-/*         { */
-/*           memcpy (&saved_codeword, &codewords[i], sizeof (codeword_t)); */
-/*           memset (&erasures, 0, sizeof (erasures)); */
-/*           erasures[j] = 1; */
-/*           if (rslib_decode (rs, &codewords[i], erasures, 1) >= 0) */
-/*             { */
-/*               if (compute_weak_key (store, key) == key->id.weak) */
-/*                 { */
-/*                   uint8_t md5[MD5_DIGEST_LENGTH]; */
-/*                   compute_strong_key (store, key, md5); */
-/*                   if (memcmp (md5, key->id.strong, MD5_DIGEST_LENGTH) == 0) */
-/*                     { */
-/*                       /\* Happy day! *\/ */
-/*                       store_trace ("SUCCESS fixing block key %d in subblock %d", */
-/*                                    idx, i + begin); */
-/*                       memcpy (store->data.data + (begin * RS_CODEWORD_SIZE), */
-/*                               codewords, sb_len); */
-/*                       free (codewords); */
-/*                       rslib_free_rs (rs); */
-/*                       return 1; */
-/*                     } */
-/*                 } */
-/*             } */
-/*           memcpy (&codewords[i], &saved_codeword, sizeof (codeword_t)); */
-/*         } */
-/*     } */
+      b64_encode (bucket, store.id);
+      store_lock_bucket (state, bucket, 0);
+      if (store_open (state, &store) != 0)
+        {
+          store_unlock_bucket (state, bucket);
+          continue;
+        }
+      header = (block_header_t *) store.data.data;
+      bext = store_block_ext (&store);
+      if (since > 0 && bext != NULL && bext->generation <= since)
+        {
+          /* Nothing in this block changed. */
+          store_close (state, &store);
+          store_unlock_bucket (state, bucket);
+          continue;
+        }
+      for (i = 0; i < header->chunk_count; i++)
+        {
+          block_key_ext_t *ext = bext != NULL ? store_key_ext (&store, i) : NULL;
+
+          if (memcmp (&header->keys[i], &null_key, sizeof (block_key_t)) == 0)
+            continue;
+          if (since > 0 && ext != NULL && ext->modified <= since)
+            continue;
+          if (n == cap)
+            {
+              store_pack_entry_t *e;
+              cap = cap == 0 ? 4096 : cap * 2;
+              e = (store_pack_entry_t *) realloc (entries, cap * sizeof (store_pack_entry_t));
+              if (e == NULL)
+                {
+                  store_close (state, &store);
+                  store_unlock_bucket (state, bucket);
+                  free (entries);
+                  return NULL;
+                }
+              entries = e;
+            }
+          memset (&entries[n], 0, sizeof (store_pack_entry_t));
+          entries[n].id = header->keys[i].id;
+          entries[n].length = store_key_length (&store, i);
+          entries[n].references = header->keys[i].references;
+          if (since > 0 && ext != NULL && ext->created <= since)
+            entries[n].flags |= STORE_PACK_ENTRY_NO_DATA;
+          n++;
+        }
+      store_close (state, &store);
+      store_unlock_bucket (state, bucket);
+    }
+
+  *count = n;
+  if (entries == NULL)
+    entries = (store_pack_entry_t *) malloc (sizeof (store_pack_entry_t));
+  return entries;
+}
+
+/*
+ * Sort entries into pack order and write the pack. If offsets is not
+ * NULL, it gets where in the pack each (sorted) entry's chunk starts.
+ */
+static int
+pack_write (store_state_t *state, store_pack_entry_t *entries, size_t n,
+            int flags, uint64_t generation, int fd, uint64_t *offsets)
+{
+  store_pack_header_t header;
+  store_pack_chunk_t chunk;
+  size_t i, maxlen = 0, sent = 0;
+  uint8_t *buf = NULL, *zbuf = NULL;
+  uint64_t offset;
+  uLongf zlen;
+  int level = (flags & STORE_PACK_DENSE) ? Z_BEST_COMPRESSION : Z_BEST_SPEED;
+  clock_t clk = clock();
+
+  qsort (entries, n, sizeof (store_pack_entry_t), pack_entry_cmp);
+  for (i = 0; i < n; i++)
+    if (entries[i].length > maxlen)
+      maxlen = entries[i].length;
+
+  buf = (uint8_t *) malloc (maxlen + 1);
+  zbuf = (uint8_t *) malloc (compressBound (maxlen) + 1);
+  if (buf == NULL || zbuf == NULL)
+    goto fail;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.header, pack_header, 4);
+  header.version = STORE_PACK_VERSION;
+  header.flags = (uint8_t) flags;
+  header.count = n;
+  header.generation = generation;
+  if (write_fully (fd, &header, sizeof (header)) != 0
+      || write_fully (fd, entries, n * sizeof (store_pack_entry_t)) != 0)
+    goto fail;
+  offset = sizeof (header) + n * sizeof (store_pack_entry_t);
+
+  for (i = 0; i < n; i++)
+    {
+      const uint8_t *payload = buf;
+
+      if (offsets != NULL)
+        offsets[i] = offset;
+      if (entries[i].flags & STORE_PACK_ENTRY_NO_DATA)
+        continue;
+      if (store_get (state, &entries[i].id, buf, entries[i].length) != entries[i].length)
+        {
+          errno = ENOENT;
+          goto fail;
+        }
+      memset (&chunk, 0, sizeof (chunk));
+      chunk.length = entries[i].length;
+      chunk.crc32c = crc32c (0, buf, entries[i].length);
+      if (flags & (STORE_PACK_COMPRESS | STORE_PACK_DENSE))
+        {
+          zlen = compressBound (maxlen);
+          if (compress2 (zbuf, &zlen, buf, entries[i].length, level) == Z_OK
+              && zlen < entries[i].length)
+            {
+              chunk.length = zlen;
+              chunk.flags |= STORE_PACK_CHUNK_COMPRESSED;
+              payload = zbuf;
+            }
+        }
+      if (write_fully (fd, &chunk, sizeof (chunk)) != 0
+          || write_fully (fd, payload, chunk.length) != 0)
+        goto fail;
+      offset += sizeof (chunk) + chunk.length;
+      sent++;
+    }
+
+  clk = clock() - clk;
+  store_log (STORE_PERF, "exported %zu entries, %zu with data, in %f seconds",
+             n, sent, (double) clk / (double) CLOCKS_PER_SEC);
+  free (zbuf);
+  free (buf);
+  return 0;
+
+ fail:
+  arrow_push_errno ();
+  free (zbuf);
+  free (buf);
+  arrow_pop_errno ();
+  return -1;
+}
+
+uint64_t
+store_generation (store_state_t *state)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  __sync_synchronize ();
+  return sb->write_generation;
+}
+
+int
+store_export_pack (store_state_t *state, const arrow_id_t *ids, size_t count,
+                   int flags, int fd)
+{
+  store_pack_entry_t *entries;
+  uint64_t generation = store_generation (state);
+  size_t i, n = 0;
+  int ret;
+
+  if (ids == NULL)
+    entries = pack_collect (state, 0, &n);
+  else
+    {
+      entries = (store_pack_entry_t *) malloc ((count > 0 ? count : 1)
+                                               * sizeof (store_pack_entry_t));
+      if (entries != NULL)
+        {
+          for (i = 0; i < count; i++)
+            {
+              memset (&entries[n], 0, sizeof (store_pack_entry_t));
+              entries[n].id = ids[i];
+              if (pack_lookup (state, &entries[n]) == 0)
+                n++;
+              else
+                store_trace ("skipping chunk %zu, not in the store", i);
+            }
+        }
+    }
+  if (entries == NULL)
+    return -1;
+
+  ret = pack_write (state, entries, n, flags & STORE_PACK_COMPRESS, generation, fd, NULL);
+  arrow_push_errno ();
+  free (entries);
+  arrow_pop_errno ();
+  return ret;
+}
+
+int
+store_export_changes (store_state_t *state, uint64_t since, int flags, int fd,
+                      uint64_t *generation)
+{
+  store_pack_entry_t *entries;
+  size_t n = 0;
+  uint64_t gen;
+
+  /* Take the generation before looking, so that anything that changes
+     while we scan is sent again next time. */
+  gen = store_generation (state);
+  entries = pack_collect (state, since, &n);
+  if (entries == NULL)
+    return -1;
+  if (pack_write (state, entries, n, (flags & STORE_PACK_COMPRESS) | STORE_PACK_REPLICA,
+                  gen, fd, NULL) != 0)
+    {
+      arrow_push_errno ();
+      free (entries);
+      arrow_pop_errno ();
+      return -1;
+    }
+  free (entries);
+  if (generation != NULL)
+    *generation = gen;
+  return 0;
+}
+
+/*
+ * Read the next chunk of a pack into buf, checking it against entry.
+ */
+static int
+pack_read_chunk (int fd, const store_pack_entry_t *entry, uint8_t *buf,
+                 uint8_t *zbuf, size_t zbuflen)
+{
+  store_pack_chunk_t chunk;
+
+  if (read_fully (fd, &chunk, sizeof (chunk)) != 0)
+    return -1;
+  if (chunk.flags & STORE_PACK_CHUNK_COMPRESSED)
+    {
+      uLongf len = entry->length;
+      if (chunk.length > zbuflen || read_fully (fd, zbuf, chunk.length) != 0)
+        return -1;
+      if (uncompress (buf, &len, zbuf, chunk.length) != Z_OK || len != entry->length)
+        {
+          errno = EIO;
+          return -1;
+        }
+    }
+  else if (chunk.length != entry->length || read_fully (fd, buf, chunk.length) != 0)
+    {
+      errno = EIO;
+      return -1;
+    }
+  if (crc32c (0, buf, entry->length) != chunk.crc32c)
+    {
+      store_log (STORE_TRACE, "pack chunk failed its CRC check");
+      errno = EIO;
+      return -1;
+    }
+  return 0;
+}
+
+static int
+import_pack (store_state_t *state, int fd, uint64_t *generation)
+{
+  store_pack_header_t header;
+  store_pack_entry_t *entries = NULL;
+  uint8_t *buf = NULL, *zbuf = NULL;
+  size_t i, j, maxlen = 0, zbuflen, missing = 0;
+  size_t v1len = offsetof (store_pack_header_t, generation);
+  uint64_t blocks = 0, wgen;
+  int replica;
+  store_t store;
+  clock_t clk = clock();
+
+  if (state->readonly)
+    {
+      errno = EROFS;
+      return -1;
+    }
+
+  memset (&header, 0, sizeof (header));
+  if (read_fully (fd, &header, v1len) != 0)
+    return -1;
+  if (memcmp (header.header, pack_header, 4) != 0
+      || header.version < 1 || header.version > STORE_PACK_VERSION
+      || header.count > SIZE_MAX / sizeof (store_pack_entry_t))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if (header.version >= 2
+      && read_fully (fd, ((uint8_t *) &header) + v1len, sizeof (header) - v1len) != 0)
+    return -1;
+  replica = (header.flags & STORE_PACK_REPLICA) != 0;
+
+  entries = (store_pack_entry_t *) malloc ((header.count > 0 ? header.count : 1)
+                                           * sizeof (store_pack_entry_t));
+  if (entries == NULL)
+    return -1;
+  if (read_fully (fd, entries, header.count * sizeof (store_pack_entry_t)) != 0)
+    goto fail;
+  for (i = 0; i < header.count; i++)
+    {
+      if (entries[i].length > MAX_CHUNK_SIZE * 16)
+        {
+          errno = EINVAL;
+          goto fail;
+        }
+      if (entries[i].length > maxlen)
+        maxlen = entries[i].length;
+    }
+  zbuflen = compressBound (maxlen);
+  buf = (uint8_t *) malloc (maxlen + 1);
+  zbuf = (uint8_t *) malloc (zbuflen + 1);
+  if (buf == NULL || zbuf == NULL)
+    goto fail;
+
+  wgen = store_next_generation (state);
+
+  /* Put each run of chunks that lands in the same bucket with one
+     open of the block, splitting between runs as needed. */
+  for (i = 0; i < header.count; i = j)
+    {
+      uint64_t bucket;
+      double loadfactor;
+
+      bucket = store_lock_key (state, &entries[i].id, 1, store.id);
+      if (store_open (state, &store) != 0)
+        {
+          store_unlock_bucket (state, bucket);
+          goto fail;
+        }
+      blocks++;
+
+      loadfactor = store_load_factor (&store);
+      for (j = i; j < header.count && (j == i || loadfactor <= MAX_LOAD_FACTOR); j++)
+        {
+          block_key_t *key;
+          uint32_t refs;
+          int ret, k;
+
+          if (j > i && map_key_stable (state, &entries[j].id) != bucket)
+            break;
+          if (entries[j].flags & STORE_PACK_ENTRY_NO_DATA)
+            ret = 1;
+          else
+            {
+              if (pack_read_chunk (fd, &entries[j], buf, zbuf, zbuflen) != 0)
+                {
+                  store_close (state, &store);
+                  store_unlock_bucket (state, bucket);
+                  goto fail;
+                }
+              ret = store_put_into_int (&store, &entries[j].id, buf, entries[j].length,
+                                        1, state->rs, wgen, NULL);
+              if (ret == 0)
+                weak_add (state, entries[j].id.weak, entries[j].length);
+            }
+          k = store_key_index (&store, &entries[j].id);
+          if (k < 0)
+            {
+              missing++;
+              continue;
+            }
+          if (ret == 0)
+            loadfactor = store_load_factor (&store);
+          if (entries[j].references == 0)
+            continue;
+
+          /* A replica takes the exporter's count as it is; otherwise
+             a chunk we had already keeps its own references too. */
+          key = &((block_header_t *) store.data.data)->keys[k];
+          if (replica)
+            refs = entries[j].references;
+          else
+            refs = (ret == 0 ? 0 : key->references - 1) + entries[j].references;
+          key->references = refs > UINT16_MAX ? UINT16_MAX : refs;
+          stamp_key (&store, k, wgen, 0);
+        }
+
+      store_close (state, &store);
+      store_unlock_bucket (state, bucket);
+      if (loadfactor > MAX_LOAD_FACTOR)
+        {
+          if (((store_sb_t *) state->data.data)->scheme == STORE_EXTENDIBLE_HASH)
+            split_bucket (state, bucket);
+          else
+            split_next_store (state);
+        }
+    }
+
+  clk = clock() - clk;
+  store_log (STORE_PERF, "imported %llu chunks into %llu block visits in %f seconds",
+             (unsigned long long) header.count, (unsigned long long) blocks,
+             (double) clk / (double) CLOCKS_PER_SEC);
+  free (zbuf);
+  free (buf);
+  free (entries);
+  if (generation != NULL)
+    *generation = header.generation;
+  if (missing > 0)
+    {
+      store_log (STORE_TRACE, "%zu pack entries had no data and no chunk here", missing);
+      errno = ENOENT;
+      return -1;
+    }
+  return 0;
+
+ fail:
+  arrow_push_errno ();
+  free (zbuf);
+  free (buf);
+  free (entries);
+  arrow_pop_errno ();
+  return -1;
+}
+
+int
+store_import_pack (store_state_t *state, int fd)
+{
+  return import_pack (state, fd, NULL);
+}
+
+int
+store_import_changes (store_state_t *state, int fd, uint64_t *generation)
+{
+  return import_pack (state, fd, generation);
+}
+
+/*
+ * Tiering. Chunks that haven't changed in a while are moved out of the
+ * blocks, a pack's worth at a time, into packs under cold/ that are
+ * compressed as tightly as zlib can and never written again. Each
+ * leaves a block_forward_t behind in its block, and store_get follows
+ * it. Cold packs are ordinary packs, so store_import_pack can read
+ * them too.
+ */
+#define STORE_COLD_DIR "cold"
+#define STORE_TIER_PACK_CHUNKS 65536
+#define STORE_TIER_PACK_BYTES (256 * 1024 * 1024)
+
+static char *
+cold_path (store_state_t *state, uint64_t pack, const char *suffix)
+{
+  size_t len = strlen (state->rootdir) + strlen (STORE_COLD_DIR) + 32;
+  char *path = (char *) malloc (len);
+
+  if (path == NULL)
+    return NULL;
+  if (pack == 0)
+    snprintf (path, len, "%s/%s", state->rootdir, STORE_COLD_DIR);
+  else
+    snprintf (path, len, "%s/%s/%016llx.pack%s", state->rootdir, STORE_COLD_DIR,
+              (unsigned long long) pack, suffix);
+  return path;
+}
+
+static int
+pread_fully (int fd, void *buf, size_t len, off_t offset)
+{
+  uint8_t *p = (uint8_t *) buf;
+  while (len > 0)
+    {
+      ssize_t n = pread (fd, p, len, offset);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      if (n == 0)
+        {
+          errno = EIO;
+          return -1;
+        }
+      p += n;
+      len -= n;
+      offset += n;
+    }
+  return 0;
+}
+
+/* Read the cold chunk fwd points to, like store_get. */
+static size_t
+cold_read (store_state_t *state, const block_forward_t *fwd, void *out, size_t maxlen)
+{
+  store_pack_chunk_t chunk;
+  uint8_t *buf = NULL, *zbuf = NULL;
+  char *path;
+  int fd;
+  size_t ret = -1;
+
+  path = cold_path (state, fwd->pack, "");
+  if (path == NULL)
+    return -1;
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    {
+      store_perror ("opening %s: %s", path, strerror (errno));
+      free (path);
+      return -1;
+    }
+  free (path);
 
-/*   rslib_free_rs (rs); */
-/*   store_trace ("failed to fixup block key %d", i); */
-/*   free (codewords); */
-/*   return 0; */
+  if (pread_fully (fd, &chunk, sizeof (chunk), fwd->offset) != 0)
+    goto done;
+  buf = maxlen >= fwd->length ? (uint8_t *) out : (uint8_t *) malloc (fwd->length + 1);
+  if (buf == NULL)
+    goto done;
+  if (chunk.flags & STORE_PACK_CHUNK_COMPRESSED)
+    {
+      uLongf len = fwd->length;
+      zbuf = (uint8_t *) malloc (chunk.length + 1);
+      if (zbuf == NULL
+          || pread_fully (fd, zbuf, chunk.length, fwd->offset + sizeof (chunk)) != 0)
+        goto done;
+      if (uncompress (buf, &len, zbuf, chunk.length) != Z_OK || len != fwd->length)
+        {
+          errno = EIO;
+          goto done;
+        }
+    }
+  else if (chunk.length != fwd->length
+           || pread_fully (fd, buf, chunk.length, fwd->offset + sizeof (chunk)) != 0)
+    {
+      errno = EIO;
+      goto done;
+    }
+  if (chunk.crc32c != fwd->crc32c || crc32c (0, buf, fwd->length) != fwd->crc32c)
+    {
+      store_log (STORE_TRACE, "cold chunk in pack %016llx failed its CRC check",
+                 (unsigned long long) fwd->pack);
+      errno = EIO;
+      goto done;
+    }
+  if (buf != out)
+    memcpy (out, buf, maxlen);
+  ret = fwd->length;
+
+ done:
+  arrow_push_errno ();
+  if (buf != out)
+    free (buf);
+  free (zbuf);
+  close (fd);
+  arrow_pop_errno ();
+  return ret;
 }
 
+/* Whether key i of a block should go cold. */
 static int
-try_fix_value (store_t *store, int index)
+tier_candidate (store_t *store, int i, uint64_t cutoff)
 {
-  return -1;
-/*   block_header_t *header = (block_header_t *) store->data.data; */
-/*   block_key_t *keys = header->keys; */
-/*   codeword_t *codewords; */
-/*   codeword_t saved_codeword; */
-/*   block_key_t *key; */
-/*   size_t sb_len; */
-/*   int begin, end; */
-/*   int i, j; */
-/*   uint8_t erasures[RS_CODEWORD_SIZE]; */
-/*   struct rs_handle *rs = make_rs_handle(); */
-/*   uint8_t syndrome[RS_PARITY_SIZE]; */
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_ext_t *ext;
 
-/*   find_changed_subblocks (store_offset_of_chunk (store, keys[index].offset), */
-/*                           keys[index].length, &begin, &end); */
+  if (header->version < BLOCK_VERSION_GEN
+      || memcmp (&header->keys[i], &null_key, sizeof (block_key_t)) == 0
+      || header->keys[i].length <= sizeof (block_forward_t))
+    return 0;
+  ext = store_key_ext (store, i);
+  return !(ext->flags & BLOCK_KEY_COLD) && ext->modified <= cutoff;
+}
 
-/*   sb_len = (end - begin) * RS_CODEWORD_SIZE; */
-/*   codewords = (codeword_t *) malloc (sb_len); */
-/*   if (codewords == NULL) */
-/*     return 0; */
+/*
+ * Write entries to a new cold pack, then replace each chunk in its
+ * block with a forward to it. Chunks that changed since they were
+ * picked stay where they are.
+ */
+static int
+tier_seal (store_state_t *state, store_pack_entry_t *entries, size_t n,
+           uint64_t cutoff, size_t *moved)
+{
+  store_t store;
+  uint64_t pack, *offsets;
+  char *path, *tmppath;
+  size_t i, j, count = 0;
+  int fd, ret = -1;
+  clock_t clk = clock();
+
+  pack = store_next_generation (state);
+  path = cold_path (state, pack, "");
+  tmppath = cold_path (state, pack, ".tmp");
+  offsets = (uint64_t *) malloc ((n > 0 ? n : 1) * sizeof (uint64_t));
+  if (path == NULL || tmppath == NULL || offsets == NULL)
+    goto done;
+
+  fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    goto done;
+  if (pack_write (state, entries, n, STORE_PACK_DENSE, pack, fd, offsets) != 0
+      || fsync (fd) != 0)
+    {
+      arrow_push_errno ();
+      close (fd);
+      unlink (tmppath);
+      arrow_pop_errno ();
+      goto done;
+    }
+  if (close (fd) != 0 || rename (tmppath, path) != 0)
+    {
+      arrow_push_errno ();
+      unlink (tmppath);
+      arrow_pop_errno ();
+      goto done;
+    }
 
-/*   memcpy (codewords, store->data.data + (begin * RS_CODEWORD_SIZE), sb_len); */
-/*   key = &keys[index]; */
+  /* The pack is safely down; forward to it, a block at a time. Entries
+     are in pack order, so each block's chunks are together. */
+  pthread_mutex_lock (&state->split_lock);
+  for (i = 0; i < n; i = j)
+    {
+      uint64_t bucket = map_key_stable (state, &entries[i].id);
+      int changed = 0;
 
-/*   store_trace ("trying RS fixup for block value %d, subblocks %d thru %d", */
-/*                index, begin, end); */
+      for (j = i + 1; j < n && map_key_stable (state, &entries[j].id) == bucket; j++)
+        ;
 
-/*   for (i = 0; i < end - begin; i++) */
-/*     { */
-/*       rslib_parity_check (rs, (symbol_t *) &codewords[i], get_parity_bytes (store, begin+i), syndrome); */
-/*       for (j = 0; j < RS_CODEWORD_SIZE; j++) */
-/*         { */
-/*           memcpy (&saved_codeword, &codewords[i], sizeof (codeword_t)); */
-/*           memset (&erasures, 0, sizeof (erasures)); */
-/*           erasures[j] = 1; */
-/*           if (rslib_decode (rs, &codewords[i], erasures, 1) >= 0) */
-/*             { */
-/*               if (compute_weak_key (store, key) == key->id.weak) */
-/*                 { */
-/*                   uint8_t md5[MD5_DIGEST_LENGTH]; */
-/*                   compute_strong_key (store, key, md5); */
-/*                   if (memcmp (md5, key->id.strong, MD5_DIGEST_LENGTH) == 0) */
-/*                     { */
-/*                       /\* Happy day! *\/ */
-/*                       store_trace ("SUCCESS fixing block key %d in subblock %d", */
-/*                                    index, i + begin); */
-/*                       memcpy (store->data.data + (begin * RS_CODEWORD_SIZE), */
-/*                               codewords, sb_len); */
-/*                       free (codewords); */
-/*                       rslib_free_rs (rs); */
-/*                       return 1; */
-/*                     } */
-/*                 } */
-/*             } */
-/*           memcpy (&codewords[i], &saved_codeword, sizeof (codeword_t)); */
-/*         } */
-/*     } */
+      store_unstable_begin (state);
+      b64_encode (bucket, store.id);
+      store_lock_bucket (state, bucket, 1);
+      store_stripes_moving (store_stripe (state, bucket), store_stripe (state, bucket));
+      if (store_open (state, &store) == 0)
+        {
+          block_header_t *header = (block_header_t *) store.data.data;
+          size_t e;
 
-/*   rslib_free_rs (rs); */
-/*   store_trace ("failed to fixup block key %d", i); */
-/*   free (codewords); */
-/*   return 0; */
+          for (e = i; e < j; e++)
+            {
+              int k = store_key_index (&store, &entries[e].id);
+              block_key_ext_t *ext;
+              block_forward_t fwd;
+
+              if (k < 0 || !tier_candidate (&store, k, cutoff)
+                  || header->keys[k].length != entries[e].length)
+                continue;
+              ext = store_key_ext (&store, k);
+              memset (&fwd, 0, sizeof (fwd));
+              fwd.pack = pack;
+              fwd.offset = offsets[e];
+              fwd.length = entries[e].length;
+              fwd.crc32c = ext->crc32c;
+              memcpy (store_data_base (&store) + header->keys[k].offset, &fwd,
+                      sizeof (fwd));
+              header->keys[k].length = sizeof (fwd);
+              ext->crc32c = crc32c (0, &fwd, sizeof (fwd));
+              ext->flags |= BLOCK_KEY_COLD;
+              changed++;
+            }
+          /* Close up the space the chunks left. */
+          if (changed > 0 && rewrite_block (state, &store, bucket, NULL, 0) != 0)
+            generate_rscode (state->rs, &store, -1, -1);
+          store_close (state, &store);
+        }
+      store_stripes_moving (store_stripe (state, bucket), store_stripe (state, bucket));
+      store_unlock_bucket (state, bucket);
+      store_unstable_end (state);
+      count += changed;
+    }
+  pthread_mutex_unlock (&state->split_lock);
+
+  clk = clock() - clk;
+  store_log (STORE_PERF, "moved %zu of %zu chunks to cold pack %016llx in %f seconds",
+             count, n, (unsigned long long) pack, (double) clk / (double) CLOCKS_PER_SEC);
+  if (moved != NULL)
+    *moved += count;
+  ret = 0;
+
+ done:
+  arrow_push_errno ();
+  free (offsets);
+  free (tmppath);
+  free (path);
+  arrow_pop_errno ();
+  return ret;
 }
 
 int
-store_repair (store_t *store, store_error_t *errors)
+store_tier (store_state_t *state, uint64_t age, size_t *moved)
 {
-  int i;
-  int numfixed = 0;
+  store_pack_entry_t *entries = NULL;
+  size_t n = 0, cap = 0, bytes = 0;
+  uint64_t bucket, buckets, generation, cutoff;
+  struct stat st;
+  store_t store;
+  char *path;
+  int i, ret = 0;
 
-  for (i = 0; i < errors->count; i++)
+  if (moved != NULL)
+    *moved = 0;
+  if (state->readonly)
     {
-      if (try_fix_key (store, errors->keys[i]))
+      errno = EROFS;
+      return -1;
+    }
+  generation = store_generation (state);
+  if (age >= generation)
+    return 0;
+  cutoff = generation - age;
+
+  path = cold_path (state, 0, NULL);
+  if (path == NULL)
+    return -1;
+  if (stat (path, &st) != 0 && mkdir (path, 0700) != 0)
+    {
+      arrow_push_errno ();
+      free (path);
+      arrow_pop_errno ();
+      return -1;
+    }
+  free (path);
+
+  buckets = store_bucket_count (state);
+  for (bucket = 0; bucket < buckets && ret == 0; bucket++)
+    {
+      block_header_t *header;
+
+      b64_encode (bucket, store.id);
+      store_lock_bucket (state, bucket, 0);
+      if (store_open (state, &store) != 0)
         {
-          numfixed++;
+          store_unlock_bucket (state, bucket);
           continue;
         }
-      if (try_fix_value (store, errors->keys[i]))
-        numfixed++;
+      header = (block_header_t *) store.data.data;
+      for (i = 0; i < header->chunk_count; i++)
+        {
+          if (!tier_candidate (&store, i, cutoff))
+            continue;
+          if (n == cap)
+            {
+              store_pack_entry_t *e;
+              cap = cap == 0 ? 4096 : cap * 2;
+              e = (store_pack_entry_t *) realloc (entries, cap * sizeof (store_pack_entry_t));
+              if (e == NULL)
+                {
+                  ret = -1;
+                  break;
+                }
+              entries = e;
+            }
+          memset (&entries[n], 0, sizeof (store_pack_entry_t));
+          entries[n].id = header->keys[i].id;
+          entries[n].length = header->keys[i].length;
+          entries[n].references = header->keys[i].references;
+          bytes += header->keys[i].length;
+          n++;
+        }
+      store_close (state, &store);
+      store_unlock_bucket (state, bucket);
+
+      /* Seal between blocks, when there's a pack's worth. */
+      if (ret == 0 && (n >= STORE_TIER_PACK_CHUNKS || bytes >= STORE_TIER_PACK_BYTES))
+        {
+          ret = tier_seal (state, entries, n, cutoff, moved);
+          n = 0;
+          bytes = 0;
+        }
     }
-  return numfixed;
+  if (ret == 0 && n > 0)
+    ret = tier_seal (state, entries, n, cutoff, moved);
+
+  arrow_push_errno ();
+  free (entries);
+  arrow_pop_errno ();
+  return ret;
 }
 
 void
@@ -1384,7 +5073,14 @@ store_dump (FILE *out, store_state_t *store)
   fprintf (out, "Store root dir: %s\n", store->rootdir);
   fprintf (out, "Store header: %c%c%c%c; version: %u\n", sb->header[0],
            sb->header[1], sb->header[2], sb->header[3], sb->version);
-  fprintf (out, "i: %d; n: %llu\n", sb->i, sb->n);
+  if (sb->scheme == STORE_EXTENDIBLE_HASH)
+    fprintf (out, "extendible hashing; depth: %d; buckets: %llu\n",
+             sb->depth, (unsigned long long) sb->buckets);
+  else
+    fprintf (out, "i: %d; n: %llu\n", sb->i, sb->n);
+  fprintf (out, "write generation: %llu\n",
+           (unsigned long long) sb->write_generation);
+  fprintf (out, "strong hash: %s\n", arrow_hash_name (store_hash (store)));
 }
 
 void
@@ -1449,8 +5145,10 @@ store_size (store_state_t *state, uint64_t *used, uint64_t *total)
       snprintf (path, len, "%s/%s/%s", state->rootdir, ARROW_BLOCKS_DIR, store.id);
       if (stat (path, &st) != 0)
         break;
+      store_lock_bucket (state, i, 0);
       if (store_open (state, &store) != 0)
         {
+          store_unlock_bucket (state, i);
           free (path);
           return -1;
         }
@@ -1464,7 +5162,7 @@ store_size (store_state_t *state, uint64_t *used, uint64_t *total)
         {
           if (memcmp (&null_key, &keys[j], sizeof (block_key_t)) == 0)
             continue;
-          u += sizeof (block_key_t);
+          u += sizeof (block_key_t) + block_key_ext_size (header->version);
           u += keys[j].length;
         }
 
@@ -1472,11 +5170,524 @@ store_size (store_state_t *state, uint64_t *used, uint64_t *total)
       *used = *used + u;
 
       store_close (state, &store);
+      store_unlock_bucket (state, i);
     }
   free (path);
   return 0;
 }
 
+/*
+ * Store analysis. Each thread takes buckets off a shared counter and
+ * adds what it finds to its own store_stats_t; the totals are merged
+ * and printed at the end.
+ */
+
+#define STATS_REF_BINS 17       /* 0, 1, 2-3, 4-7, ... 32768-65535 */
+#define STATS_SIZE_BINS 33      /* 0, 1, 2-3, 4-7, ... */
+#define STATS_LOAD_BINS 10      /* 0-10%, 10-20%, ... */
+
+/* Compress one chunk in this many to estimate compressibility. */
+#define STORE_ANALYZE_SAMPLE 16
+
+typedef struct store_stats_s
+{
+  uint64_t blocks;
+  uint64_t block_versions[BLOCK_VERSION + 1];
+  uint64_t slots;
+  uint64_t chunks;
+  uint64_t file_bytes;          /**< Size of the block files. */
+  uint64_t alloc_bytes;         /**< Size of their data regions. */
+  uint64_t physical_bytes;      /**< Bytes of chunk data stored. */
+  uint64_t logical_bytes;       /**< Bytes referenced; length * references. */
+  uint64_t cold_chunks;         /**< Chunks moved out to cold packs. */
+  uint64_t cold_bytes;          /**< Their (uncompressed) length. */
+  uint64_t references;
+  uint64_t unreferenced;        /**< Chunks with no references left. */
+  uint64_t unreferenced_bytes;
+  uint64_t max_references;
+  uint64_t ref_hist[STATS_REF_BINS];
+  uint64_t min_length;
+  uint64_t max_length;
+  uint64_t size_hist[STATS_SIZE_BINS];
+
+  double load_sum;              /**< Sums of per-block load factors, */
+  double load_sum2;             /**< their squares */
+  double load_sum3;             /**< and cubes. */
+  double load_min;
+  double load_max;
+  uint64_t load_min_bucket;
+  uint64_t load_max_bucket;
+  uint64_t load_hist[STATS_LOAD_BINS];
+  uint64_t over_load;           /**< Blocks past MAX_LOAD_FACTOR. */
+
+  uint64_t free_bytes;          /**< Data region bytes not holding a chunk. */
+  uint64_t hole_bytes;          /**< Of those, the ones between chunks. */
+  uint64_t holes;
+  uint64_t largest_hole;
+  uint64_t slot_holes;          /**< Empty key slots before a used one. */
+
+  uint64_t sampled_chunks;
+  uint64_t sampled_bytes;
+  uint64_t compressed_bytes;
+} store_stats_t;
+
+typedef struct store_analyzer_s
+{
+  store_state_t *state;
+  uint64_t buckets;
+  volatile uint64_t next;       /**< Next bucket to look at. */
+} store_analyzer_t;
+
+typedef struct store_extent_s
+{
+  uint32_t offset;
+  uint32_t length;
+} store_extent_t;
+
+static int
+log2_bin (uint64_t x)
+{
+  int bin = 0;
+  while (x != 0)
+    {
+      bin++;
+      x >>= 1;
+    }
+  return bin;
+}
+
+static int
+extent_cmp (const void *a, const void *b)
+{
+  const store_extent_t *e1 = (const store_extent_t *) a;
+  const store_extent_t *e2 = (const store_extent_t *) b;
+  if (e1->offset != e2->offset)
+    return e1->offset < e2->offset ? -1 : 1;
+  return 0;
+}
+
+static void
+stats_init (store_stats_t *stats)
+{
+  memset (stats, 0, sizeof (store_stats_t));
+  stats->min_length = UINT64_MAX;
+  stats->load_min = 2.0;
+  stats->load_max = -1.0;
+}
+
+/*
+ * Add one block to stats. extents and zbuf are scratch space, grown as
+ * needed.
+ */
+static void
+analyze_block (store_t *store, uint64_t bucket, off_t file_size,
+               store_stats_t *stats, store_extent_t **extents,
+               size_t *maxextents, uint8_t **zbuf, uLong *zlen)
+{
+  block_header_t *header = (block_header_t *) store->data.data;
+  block_key_t *keys = header->keys;
+  uint64_t end = 0, used = 0;
+  size_t i, n = 0, last_used = 0;
+  double load;
+  int bin;
+
+  stats->blocks++;
+  if (header->version <= BLOCK_VERSION)
+    stats->block_versions[header->version]++;
+  stats->slots += header->chunk_count;
+  stats->file_bytes += file_size;
+  stats->alloc_bytes += header->alloc_size;
+
+  if (*maxextents < header->chunk_count)
+    {
+      store_extent_t *e = (store_extent_t *)
+        realloc (*extents, header->chunk_count * sizeof (store_extent_t));
+      if (e == NULL)
+        return;
+      *extents = e;
+      *maxextents = header->chunk_count;
+    }
+
+  for (i = 0; i < header->chunk_count; i++)
+    {
+      block_key_t *key = &keys[i];
+      block_forward_t fwd;
+      uint32_t length;
+      int cold;
+
+      if (memcmp (key, &null_key, sizeof (block_key_t)) == 0)
+        continue;
+      last_used = i + 1;
+      (*extents)[n].offset = key->offset;
+      (*extents)[n].length = key->length;
+      n++;
+
+      cold = store_key_forward (store, i, &fwd);
+      length = cold ? fwd.length : key->length;
+      if (cold)
+        {
+          stats->cold_chunks++;
+          stats->cold_bytes += length;
+        }
+      used += key->length;
+      stats->physical_bytes += length;
+      stats->logical_bytes += (uint64_t) length * key->references;
+      stats->references += key->references;
+      if (key->references == 0)
+        {
+          stats->unreferenced++;
+          stats->unreferenced_bytes += length;
+        }
+      if (key->references > stats->max_references)
+        stats->max_references = key->references;
+      bin = log2_bin (key->references);
+      stats->ref_hist[bin < STATS_REF_BINS ? bin : STATS_REF_BINS - 1]++;
+      if (length < stats->min_length)
+        stats->min_length = length;
+      if (length > stats->max_length)
+        stats->max_length = length;
+      bin = log2_bin (length);
+      stats->size_hist[bin < STATS_SIZE_BINS ? bin : STATS_SIZE_BINS - 1]++;
+
+      if (!cold && key->length > 0 && (key->id.weak % STORE_ANALYZE_SAMPLE) == 0
+          && store_offset_of_chunk (store, key->offset) + key->length <= store->data.length)
+        {
+          uLongf clen = compressBound (key->length);
+          if (clen > *zlen)
+            {
+              uint8_t *z = (uint8_t *) realloc (*zbuf, clen);
+              if (z == NULL)
+                continue;
+              *zbuf = z;
+              *zlen = clen;
+            }
+          if (compress2 (*zbuf, &clen, store_data_base (store) + key->offset,
+                         key->length, Z_BEST_SPEED) == Z_OK)
+            {
+              stats->sampled_chunks++;
+              stats->sampled_bytes += key->length;
+              stats->compressed_bytes += clen < key->length ? clen : key->length;
+            }
+        }
+    }
+  stats->chunks += n;
+  for (i = 0; i < last_used; i++)
+    if (memcmp (&keys[i], &null_key, sizeof (block_key_t)) == 0)
+      stats->slot_holes++;
+
+  /* Free space: the gaps between chunks, and what's after the last. */
+  qsort (*extents, n, sizeof (store_extent_t), extent_cmp);
+  for (i = 0; i < n; i++)
+    {
+      if ((*extents)[i].offset > end)
+        {
+          uint64_t hole = (*extents)[i].offset - end;
+          stats->holes++;
+          stats->hole_bytes += hole;
+          if (hole > stats->largest_hole)
+            stats->largest_hole = hole;
+        }
+      if ((*extents)[i].offset + (*extents)[i].length > end)
+        end = (*extents)[i].offset + (*extents)[i].length;
+    }
+  if (header->alloc_size > used)
+    stats->free_bytes += header->alloc_size - used;
+
+  load = header->chunk_count > 0 ? (double) n / header->chunk_count : 0.0;
+  stats->load_sum += load;
+  stats->load_sum2 += load * load;
+  stats->load_sum3 += load * load * load;
+  if (load < stats->load_min)
+    {
+      stats->load_min = load;
+      stats->load_min_bucket = bucket;
+    }
+  if (load > stats->load_max)
+    {
+      stats->load_max = load;
+      stats->load_max_bucket = bucket;
+    }
+  bin = (int) (load * STATS_LOAD_BINS);
+  stats->load_hist[bin < STATS_LOAD_BINS ? bin : STATS_LOAD_BINS - 1]++;
+  if (load > MAX_LOAD_FACTOR)
+    stats->over_load++;
+}
+
+static void
+stats_merge (store_stats_t *into, const store_stats_t *from)
+{
+  int i;
+
+  into->blocks += from->blocks;
+  for (i = 0; i <= BLOCK_VERSION; i++)
+    into->block_versions[i] += from->block_versions[i];
+  into->slots += from->slots;
+  into->chunks += from->chunks;
+  into->file_bytes += from->file_bytes;
+  into->alloc_bytes += from->alloc_bytes;
+  into->physical_bytes += from->physical_bytes;
+  into->logical_bytes += from->logical_bytes;
+  into->cold_chunks += from->cold_chunks;
+  into->cold_bytes += from->cold_bytes;
+  into->references += from->references;
+  into->unreferenced += from->unreferenced;
+  into->unreferenced_bytes += from->unreferenced_bytes;
+  if (from->max_references > into->max_references)
+    into->max_references = from->max_references;
+  for (i = 0; i < STATS_REF_BINS; i++)
+    into->ref_hist[i] += from->ref_hist[i];
+  if (from->min_length < into->min_length)
+    into->min_length = from->min_length;
+  if (from->max_length > into->max_length)
+    into->max_length = from->max_length;
+  for (i = 0; i < STATS_SIZE_BINS; i++)
+    into->size_hist[i] += from->size_hist[i];
+
+  into->load_sum += from->load_sum;
+  into->load_sum2 += from->load_sum2;
+  into->load_sum3 += from->load_sum3;
+  if (from->load_min < into->load_min)
+    {
+      into->load_min = from->load_min;
+      into->load_min_bucket = from->load_min_bucket;
+    }
+  if (from->load_max > into->load_max)
+    {
+      into->load_max = from->load_max;
+      into->load_max_bucket = from->load_max_bucket;
+    }
+  for (i = 0; i < STATS_LOAD_BINS; i++)
+    into->load_hist[i] += from->load_hist[i];
+  into->over_load += from->over_load;
+
+  into->free_bytes += from->free_bytes;
+  into->hole_bytes += from->hole_bytes;
+  into->holes += from->holes;
+  if (from->largest_hole > into->largest_hole)
+    into->largest_hole = from->largest_hole;
+  into->slot_holes += from->slot_holes;
+
+  into->sampled_chunks += from->sampled_chunks;
+  into->sampled_bytes += from->sampled_bytes;
+  into->compressed_bytes += from->compressed_bytes;
+}
+
+typedef struct store_analyze_thread_s
+{
+  store_analyzer_t *analyzer;
+  store_stats_t stats;
+} store_analyze_thread_t;
+
+static void *
+analyzer_run (void *arg)
+{
+  store_analyze_thread_t *thread = (store_analyze_thread_t *) arg;
+  store_analyzer_t *analyzer = thread->analyzer;
+  store_state_t *state = analyzer->state;
+  store_extent_t *extents = NULL;
+  size_t maxextents = 0;
+  uint8_t *zbuf = NULL;
+  uLong zlen = 0;
+  store_stats_t block;
+  store_t store;
+  uint64_t bucket, gen;
+  int ret;
+
+  while ((bucket = __sync_fetch_and_add (&analyzer->next, 1)) < analyzer->buckets)
+    {
+      b64_encode (bucket, store.id);
+      do
+        {
+          gen = store_read_begin (state);
+          stats_init (&block);
+          store_lock_bucket (state, bucket, 0);
+          ret = store_open (state, &store);
+          if (ret == 0)
+            {
+              analyze_block (&store, bucket, store.data.length, &block,
+                             &extents, &maxextents, &zbuf, &zlen);
+              store_close (state, &store);
+            }
+          store_unlock_bucket (state, bucket);
+        }
+      while (store_read_retry (state, gen));
+      if (ret == 0)
+        stats_merge (&thread->stats, &block);
+    }
+
+  free (extents);
+  free (zbuf);
+  return NULL;
+}
+
+static void
+print_json_string (FILE *out, const char *str)
+{
+  fputc ('"', out);
+  for (; *str != '\0'; str++)
+    {
+      if (*str == '"' || *str == '\\')
+        fprintf (out, "\\%c", *str);
+      else if ((unsigned char) *str < 0x20)
+        fprintf (out, "\\u%04x", (unsigned char) *str);
+      else
+        fputc (*str, out);
+    }
+  fputc ('"', out);
+}
+
+static void
+print_hist (FILE *out, const char *name, const uint64_t *hist, int bins)
+{
+  int i;
+
+  fprintf (out, "  \"%s\": [", name);
+  for (i = 0; i < bins; i++)
+    fprintf (out, "%s%llu", i > 0 ? ", " : "", (unsigned long long) hist[i]);
+  fprintf (out, "]");
+}
+
+int
+store_analyze (store_state_t *state, int threads, FILE *out)
+{
+  store_sb_t *sb = (store_sb_t *) state->data.data;
+  store_analyzer_t analyzer;
+  store_analyze_thread_t *workers;
+  pthread_t *tids;
+  store_stats_t *s;
+  double mean = 0.0, var = 0.0, skew = 0.0;
+  int t, started;
+
+  if (threads < 1)
+    threads = 1;
+  workers = (store_analyze_thread_t *) malloc (threads * sizeof (store_analyze_thread_t));
+  tids = (pthread_t *) malloc (threads * sizeof (pthread_t));
+  if (workers == NULL || tids == NULL)
+    {
+      free (workers);
+      free (tids);
+      errno = ENOMEM;
+      return -1;
+    }
+
+  analyzer.state = state;
+  analyzer.buckets = store_bucket_count (state);
+  analyzer.next = 0;
+  for (t = 0; t < threads; t++)
+    {
+      workers[t].analyzer = &analyzer;
+      stats_init (&workers[t].stats);
+    }
+  for (started = 0; started < threads; started++)
+    if (pthread_create (&tids[started], NULL, analyzer_run, &workers[started]) != 0)
+      break;
+  if (started == 0)
+    analyzer_run (&workers[0]);
+  for (t = 0; t < started; t++)
+    pthread_join (tids[t], NULL);
+  for (t = 1; t < threads; t++)
+    stats_merge (&workers[0].stats, &workers[t].stats);
+  s = &workers[0].stats;
+  free (tids);
+
+  if (s->chunks == 0)
+    s->min_length = 0;
+  if (s->blocks > 0)
+    {
+      double m2, m3;
+      mean = s->load_sum / s->blocks;
+      m2 = s->load_sum2 / s->blocks - mean * mean;
+      m3 = (s->load_sum3 / s->blocks - 3 * mean * s->load_sum2 / s->blocks
+            + 2 * mean * mean * mean);
+      var = m2 > 0.0 ? m2 : 0.0;
+      if (var > 1e-12)
+        skew = m3 / (var * sqrt (var));
+    }
+  else
+    s->load_min = s->load_max = 0.0;
+
+  fprintf (out, "{\n");
+  fprintf (out, "  \"rootdir\": ");
+  print_json_string (out, state->rootdir);
+  fprintf (out, ",\n");
+  fprintf (out, "  \"scheme\": \"%s\",\n",
+           sb->scheme == STORE_EXTENDIBLE_HASH ? "extendible" : "linear");
+  fprintf (out, "  \"superblock_version\": %u,\n", sb->version);
+  fprintf (out, "  \"hash\": \"%s\",\n", arrow_hash_name (store_hash (state)));
+  fprintf (out, "  \"generation\": %llu,\n", (unsigned long long) sb->write_generation);
+  fprintf (out, "  \"buckets\": %llu,\n", (unsigned long long) analyzer.buckets);
+  fprintf (out, "  \"blocks\": %llu,\n", (unsigned long long) s->blocks);
+  print_hist (out, "block_versions", s->block_versions, BLOCK_VERSION + 1);
+  fprintf (out, ",\n");
+  fprintf (out, "  \"chunks\": %llu,\n", (unsigned long long) s->chunks);
+  fprintf (out, "  \"slots\": %llu,\n", (unsigned long long) s->slots);
+  fprintf (out, "  \"file_bytes\": %llu,\n", (unsigned long long) s->file_bytes);
+  fprintf (out, "  \"physical_bytes\": %llu,\n", (unsigned long long) s->physical_bytes);
+  fprintf (out, "  \"logical_bytes\": %llu,\n", (unsigned long long) s->logical_bytes);
+  fprintf (out, "  \"cold_chunks\": %llu,\n", (unsigned long long) s->cold_chunks);
+  fprintf (out, "  \"cold_bytes\": %llu,\n", (unsigned long long) s->cold_bytes);
+  fprintf (out, "  \"dedup_ratio\": %.4f,\n",
+           s->physical_bytes > 0 ? (double) s->logical_bytes / s->physical_bytes : 0.0);
+  fprintf (out, "  \"references\": {\n");
+  fprintf (out, "    \"total\": %llu,\n", (unsigned long long) s->references);
+  fprintf (out, "    \"max\": %llu,\n", (unsigned long long) s->max_references);
+  fprintf (out, "    \"unreferenced_chunks\": %llu,\n", (unsigned long long) s->unreferenced);
+  fprintf (out, "    \"unreferenced_bytes\": %llu,\n", (unsigned long long) s->unreferenced_bytes);
+  fprintf (out, "  ");
+  print_hist (out, "log2_histogram", s->ref_hist, STATS_REF_BINS);
+  fprintf (out, "\n  },\n");
+  fprintf (out, "  \"chunk_sizes\": {\n");
+  fprintf (out, "    \"min\": %llu,\n", (unsigned long long) s->min_length);
+  fprintf (out, "    \"max\": %llu,\n", (unsigned long long) s->max_length);
+  fprintf (out, "    \"mean\": %.1f,\n",
+           s->chunks > 0 ? (double) s->physical_bytes / s->chunks : 0.0);
+  fprintf (out, "  ");
+  print_hist (out, "log2_histogram", s->size_hist, STATS_SIZE_BINS);
+  fprintf (out, "\n  },\n");
+  fprintf (out, "  \"load\": {\n");
+  fprintf (out, "    \"mean\": %.4f,\n", mean);
+  fprintf (out, "    \"stddev\": %.4f,\n", sqrt (var));
+  fprintf (out, "    \"skewness\": %.4f,\n", skew);
+  fprintf (out, "    \"min\": %.4f,\n", s->load_min);
+  fprintf (out, "    \"min_bucket\": %llu,\n", (unsigned long long) s->load_min_bucket);
+  fprintf (out, "    \"max\": %.4f,\n", s->load_max);
+  fprintf (out, "    \"max_bucket\": %llu,\n", (unsigned long long) s->load_max_bucket);
+  fprintf (out, "    \"max_over_mean\": %.4f,\n", mean > 0.0 ? s->load_max / mean : 0.0);
+  fprintf (out, "    \"over_max_load\": %llu,\n", (unsigned long long) s->over_load);
+  fprintf (out, "  ");
+  print_hist (out, "histogram", s->load_hist, STATS_LOAD_BINS);
+  fprintf (out, "\n  },\n");
+  fprintf (out, "  \"free_space\": {\n");
+  fprintf (out, "    \"allocated_bytes\": %llu,\n", (unsigned long long) s->alloc_bytes);
+  fprintf (out, "    \"free_bytes\": %llu,\n", (unsigned long long) s->free_bytes);
+  fprintf (out, "    \"hole_bytes\": %llu,\n", (unsigned long long) s->hole_bytes);
+  fprintf (out, "    \"holes\": %llu,\n", (unsigned long long) s->holes);
+  fprintf (out, "    \"largest_hole\": %llu,\n", (unsigned long long) s->largest_hole);
+  fprintf (out, "    \"slot_holes\": %llu,\n", (unsigned long long) s->slot_holes);
+  fprintf (out, "    \"fragmentation\": %.4f\n",
+           s->free_bytes > 0 ? (double) s->hole_bytes / s->free_bytes : 0.0);
+  fprintf (out, "  },\n");
+  fprintf (out, "  \"hot_cache\": {\n");
+  fprintf (out, "    \"limit_bytes\": %llu,\n", (unsigned long long) state->hot_limit);
+  fprintf (out, "    \"cached_bytes\": %llu,\n", (unsigned long long) state->hot_bytes);
+  fprintf (out, "    \"warm_saved_keys\": %llu,\n", (unsigned long long) state->hot_saved_keys);
+  fprintf (out, "    \"warm_scanned_blocks\": %llu\n",
+           (unsigned long long) state->hot_scanned_blocks);
+  fprintf (out, "  },\n");
+  fprintf (out, "  \"compression\": {\n");
+  fprintf (out, "    \"sample_rate\": %d,\n", STORE_ANALYZE_SAMPLE);
+  fprintf (out, "    \"sampled_chunks\": %llu,\n", (unsigned long long) s->sampled_chunks);
+  fprintf (out, "    \"sampled_bytes\": %llu,\n", (unsigned long long) s->sampled_bytes);
+  fprintf (out, "    \"compressed_bytes\": %llu,\n", (unsigned long long) s->compressed_bytes);
+  fprintf (out, "    \"ratio\": %.4f\n",
+           s->compressed_bytes > 0 ? (double) s->sampled_bytes / s->compressed_bytes : 1.0);
+  fprintf (out, "  }\n");
+  fprintf (out, "}\n");
+
+  free (workers);
+  return ferror (out) ? -1 : 0;
+}
+
 /* Local Variables: */
 /* indent-tabs-mode: nil */
 /* c-basic-offset: 2 */
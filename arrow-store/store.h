@@ -25,6 +25,7 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 #define __STORE_H__
 
 #include <arrow.h>
+#include <hash.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -42,12 +43,64 @@ typedef struct store_s
 {
   char id[STORE_ID_LEN+1];       /**< store identifier. */
   mapped_file_t data;            /**< The memory-mapped file. */
+  uint8_t hash;                  /**< The store's arrow_hash_t; set by
+                                      store_open. */
 } store_t;
 
 struct store_state_s;
 typedef struct store_state_s store_state_t;
 
+/**
+ * How keys are mapped to blocks.
+ */
+typedef enum store_scheme_e
+{
+  STORE_LINEAR_HASH = 0,     /**< Linear hashing; blocks split in order. */
+  STORE_EXTENDIBLE_HASH = 1  /**< Extendible hashing; the block that
+                                  overflows is the one that splits. */
+} store_scheme_t;
+
+/*
+ * The functions taking a store_state_t (store_put, store_get,
+ * store_contains, store_addref, ...) may be called concurrently from
+ * multiple threads sharing one state. The store_*_into, store_*_from
+ * and store_*_to variants work on a block the caller has opened with
+ * store_open, and do no locking of their own.
+ */
+
+/**
+ * Open the store in rootdir for reading and writing, creating it if
+ * needed. Only one writer may have a store open at a time; a second
+ * store_init fails with EBUSY.
+ */
 int store_init (const char *rootdir, store_state_t **state);
+
+/**
+ * Like store_init, but if the store does not exist yet, create it
+ * using the given scheme. Existing stores keep the scheme they were
+ * created with.
+ */
+int store_init_scheme (const char *rootdir, store_scheme_t scheme, store_state_t **state);
+
+/**
+ * Like store_init_scheme, but a new store keys its chunks with the
+ * given strong hash instead of MD5. Existing stores keep the hash they
+ * were created with; callers must compute keys with store_hash.
+ */
+int store_init_hash (const char *rootdir, store_scheme_t scheme, arrow_hash_t hash,
+                     store_state_t **state);
+
+/** The strong hash the store's chunk keys are computed with. */
+arrow_hash_t store_hash (store_state_t *state);
+
+/**
+ * Open an existing store for reading only. Any number of read-only
+ * states, in any number of processes, may share a store with the one
+ * writer that opened it with store_init; lookups notice a concurrent
+ * split and retry against the right bucket. Calls that modify the
+ * store fail with EROFS.
+ */
+int store_init_readonly (const char *rootdir, store_state_t **state);
 void store_destroy (store_state_t *state);
 
 int store_open (store_state_t *state, store_t *store);
@@ -65,19 +118,204 @@ void store_map_key (store_state_t *state, const arrow_id_t *id, char *result);
 
 int store_put (store_state_t *state, const arrow_id_t *id, const void *buf, size_t len);
 int store_addref (store_state_t *state, const arrow_id_t *id);
+
+/**
+ * Record a reference count change to be applied later, by
+ * store_commit_refs. Changes are kept in memory and applied a block at
+ * a time, in bucket order, which is much cheaper than one random
+ * block write per store_addref. The journal commits itself once it
+ * holds as many changes as the limit set with store_set_journal_limit,
+ * and again when the store is destroyed.
+ */
+int store_addref_deferred (store_state_t *state, const arrow_id_t *id);
+int store_unref_deferred (store_state_t *state, const arrow_id_t *id);
+
+/**
+ * Apply all pending reference count changes. Returns -1 with errno
+ * set to ENOENT if some of them were for keys not in the store; the
+ * others are still applied.
+ */
+int store_commit_refs (store_state_t *state);
+void store_set_journal_limit (store_state_t *state, size_t limit);
+
+/**
+ * Set how many bytes of chunk contents the hot chunk cache may hold.
+ * The cache keeps the most referenced chunks (at most a few thousand,
+ * each with at least a handful of references) so that store_contains,
+ * store_get and store_addref on them skip the block lookup; it is
+ * warmed by store_init. Zero keeps only the chunks' IDs and locations.
+ */
+void store_set_hot_limit (store_state_t *state, size_t bytes);
+
 size_t store_get (store_state_t *state, const arrow_id_t *id, void *out, size_t maxlen);
 size_t store_get_len (store_state_t *state, const arrow_id_t *id);
 int store_contains (store_state_t *state, const arrow_id_t *id);
 
+/**
+ * Tell whether the store might have a chunk with the given weak sum
+ * and length, from an index of every chunk's weak sum kept alongside
+ * the blocks. Returns nonzero if it might; as weak sums collide, check
+ * with store_contains before relying on it. This is cheap enough to
+ * call at every offset of a rolling checksum.
+ */
+int store_weak_probe (store_state_t *state, uint32_t weak, uint32_t length);
+
 int store_put_into (store_t *store, const arrow_id_t *id, const void *buf, size_t len);
 int store_addref_to (store_t *store, const arrow_id_t *id);
 size_t store_get_from (store_t *store, const arrow_id_t *id, void *out, size_t maxlen);
 size_t store_get_len_from (store_t *store, const arrow_id_t *id);
 
+/**
+ * How thoroughly to check chunks.
+ */
+typedef enum store_scrub_mode_e
+{
+  STORE_SCRUB_FAST, /**< Check each chunk's CRC-32C (or, in blocks
+                         written before chunks had one, its weak sum). */
+  STORE_SCRUB_DEEP  /**< Also recompute each chunk's weak and strong sums. */
+} store_scrub_mode_t;
+
+/**
+ * Check every chunk in every block. Returns the number of blocks with
+ * bad chunks in them.
+ */
+int store_scrub_all (store_state_t *state, store_scrub_mode_t mode);
+
+/**
+ * Check every chunk in a block. Returns the number of bad chunks; if
+ * errors is not NULL, their indexes are stored there.
+ */
+int store_scrub (store_t *store, store_scrub_mode_t mode, store_error_t *errors);
+
+/** Same as store_scrub_all with STORE_SCRUB_DEEP. */
 int store_verify_all (store_state_t *state);
+/** Same as store_scrub with STORE_SCRUB_DEEP. */
 int store_verify (store_t *store, store_error_t *errors);
 int store_repair (store_t *store, store_error_t *errors);
 
+struct store_scrubber_s;
+typedef struct store_scrubber_s store_scrubber_t;
+
+typedef struct store_scrub_status_s
+{
+  uint64_t passes;   /**< Completed passes over the whole store. */
+  uint64_t bucket;   /**< The bucket being scrubbed now. */
+  uint64_t bytes;    /**< Bytes checked by this scrubber. */
+  uint64_t errors;   /**< Bad chunks found by this scrubber. */
+} store_scrub_status_t;
+
+/**
+ * Start a thread that scrubs the store continuously, checking at most
+ * mb_per_sec megabytes a second (zero for no limit). It resumes from
+ * where the last scrubber of this store stopped. The scrubber must be
+ * stopped before the store is destroyed.
+ */
+int store_scrubber_start (store_state_t *state, store_scrub_mode_t mode,
+                          double mb_per_sec, store_scrubber_t **scrubber);
+void store_scrubber_set_rate (store_scrubber_t *scrubber, double mb_per_sec);
+void store_scrubber_status (store_scrubber_t *scrubber, store_scrub_status_t *status);
+void store_scrubber_stop (store_scrubber_t *scrubber);
+
+/**
+ * The number of buckets (blocks) in the store. Buckets are numbered
+ * from zero; store_map_key gives a chunk's bucket, base-64 encoded.
+ */
+uint64_t store_bucket_count (store_state_t *state);
+
+/**
+ * Rewrite a block so that the chunks listed in `order' come first, in
+ * that order, both in the key array and in the data region, followed
+ * by the block's other chunks in their current order. IDs that are not
+ * in the block are ignored. Lookups in other processes wait until the
+ * rewrite is done.
+ */
+int store_reorder (store_state_t *state, uint64_t bucket, const arrow_id_t *order,
+                   size_t count);
+
+/**
+ * Move chunks that haven't changed in the last `age' write generations
+ * out of the blocks and into packs under the store's cold/ directory,
+ * which are compressed as much as zlib can and never changed again.
+ * Each chunk leaves a small forward in its block; store_get,
+ * store_get_len and the pack functions follow it, but store_get_from
+ * fails with ENODATA. Only one store_tier should run at a time.
+ *
+ * \param moved Set to the number of chunks moved, if not NULL.
+ */
+int store_tier (store_state_t *state, uint64_t age, size_t *moved);
+
+/**
+ * Compress chunks in the pack, where that makes them smaller.
+ */
+#define STORE_PACK_COMPRESS 1
+
+/**
+ * Write a pack of chunks to fd. A pack holds an index of the chunks
+ * followed by their contents, and is written front to back, so fd may
+ * be a pipe or a socket.
+ *
+ * \param state The store state.
+ * \param ids   The chunks to export, or NULL to export every chunk in
+ *              the store. IDs the store doesn't have are skipped.
+ * \param count The number of IDs.
+ * \param flags Zero, or STORE_PACK_COMPRESS.
+ * \param fd    Where to write the pack.
+ * \return Zero on success, -1 on error.
+ */
+int store_export_pack (store_state_t *state, const arrow_id_t *ids, size_t count,
+                       int flags, int fd);
+
+/**
+ * Read a pack written by store_export_pack from fd, and put every
+ * chunk in it into the store, each with the reference count it had in
+ * the exporting store. Chunks are put a block at a time.
+ */
+int store_import_pack (store_state_t *state, int fd);
+
+/**
+ * The store's write generation. Every change to the store (a put, a
+ * reference count change, an import) happens in a newer generation
+ * than the ones before it, and is recorded against the chunks it
+ * touched.
+ */
+uint64_t store_generation (store_state_t *state);
+
+/**
+ * Replicate a store: write to fd a pack of every chunk added or
+ * changed after generation `since', which is the generation the
+ * mirror last acknowledged (zero for a full copy). Chunks the mirror
+ * should have already, but whose reference count changed, are sent
+ * without their data. Cost is proportional to what changed, not to
+ * the size of the store.
+ *
+ * \param generation Set to the generation the pack brings the mirror
+ *        up to; pass it as `since' next time once the mirror has
+ *        imported the pack.
+ */
+int store_export_changes (store_state_t *state, uint64_t since, int flags, int fd,
+                          uint64_t *generation);
+
+/**
+ * Import a pack written by store_export_changes (or
+ * store_export_pack). Reference counts in replica packs replace the
+ * local ones. Sets *generation to the exporter's generation, for the
+ * mirror to acknowledge.
+ */
+int store_import_changes (store_state_t *state, int fd, uint64_t *generation);
+
+/**
+ * Scan every block, using the given number of threads, and write a
+ * report on the store to out as a JSON object: chunk and byte counts,
+ * the dedup ratio (bytes referenced over bytes stored), a histogram of
+ * reference counts and of chunk sizes (both in powers of two), the
+ * load factor of blocks with its spread and skew, free space in the
+ * data regions and how much of it is in holes between chunks, the
+ * compression ratio of a sample of the chunks, and how full the hot
+ * chunk cache is and how it was warmed: from the saved hot set, or by
+ * scanning the blocks.
+ */
+int store_analyze (store_state_t *state, int threads, FILE *out);
+
 void store_dump (FILE *out, store_state_t *state);
 void store_dump_store (FILE *out, store_t *store);
 
@@ -21,14 +21,16 @@ OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
 WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 
 
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include <arrow.h>
-#include <cbuf.h>
-#include <fail.h>
+#include <cdc.h>
+#include <hash.h>
 #include <rollsum.h>
 #include <fileinfo.h>
 #include <store.h>
@@ -36,85 +38,1096 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 
 #include <openssl/md5.h>
 
-#define HASH_TABLE_SIZE (1 << 14)
+/* Chunks read and hashed together; see emit_chunks. */
+#define SYNC_BATCH 64
+
+/* How much of the input sync_rolling reads at a time. */
+#define SYNC_WINDOW_SIZE (1 << 20)
+
+/* How much sync_chunks reads at a time, and how large a file has to be
+   before it hashes (or sync_file scans) on more than one thread. */
+#define SYNC_SEGMENT_SIZE (1 << 20)
+#define SYNC_PARALLEL_MIN (8 * SYNC_SEGMENT_SIZE)
+
+/* How much of the input each thread scans at a time in sync_parallel. */
+#define SYNC_REGION_SIZE (4 << 20)
 
 #define SYNC_GENERATE  1
 #define SYNC_FILE     (1 << 1)
 
 #define sync_log(lvl,fmt,args...) if (SYNC_DEBUG & (lvl)) fprintf (stderr, "%s (%s:%d): " fmt "\n", __FUNCTION__, __FILE__, __LINE__, ##args)
 
-int SYNC_DEBUG = 0;
+int SYNC_DEBUG = 0;
+
+/*
+ * The basis file's chunks, as sync_rolling looks them up. This is an
+ * open addressed table of a power of two slots, at most half full.
+ * Probing scans tags, the weak sum of each slot's chunk, four bytes a
+ * slot; only a tag hit looks at the entry, with the whole key and the
+ * chunk's index in the basis. Empty slots have tag MATCH_EMPTY, and a
+ * chunk whose weak sum is MATCH_EMPTY gets the tag MATCH_EMPTY_ALIAS.
+ */
+#define MATCH_EMPTY 0
+#define MATCH_EMPTY_ALIAS 1
+
+typedef struct match_entry_s
+{
+  arrow_id_t id;
+  uint32_t chunk;     /**< Index in the basis file's chunk list. */
+} match_entry_t;
+
+typedef struct match_table_s
+{
+  uint32_t mask;
+  int bits;
+  uint32_t *tags;
+  match_entry_t *entries;
+  const file_chunk_t *basis;   /**< What the entries' indexes are into. */
+} match_table_t;
+
+static inline uint32_t
+match_tag (uint32_t weak)
+{
+  return weak == MATCH_EMPTY ? MATCH_EMPTY_ALIAS : weak;
+}
+
+/* Rollsum digests are far from uniform; mix them up. */
+static inline uint32_t
+match_slot (const match_table_t *t, uint32_t weak)
+{
+  return (uint32_t) (weak * 0x9e3779b1U) >> (32 - t->bits);
+}
+
+/*
+ * Make *buf at least size bytes, keeping nothing that was in it. The
+ * sync_ctx_t buffers only ever grow.
+ */
+static int
+ctx_reserve (void **buf, size_t *have, size_t size)
+{
+  if (*have >= size)
+    return 0;
+  free (*buf);
+  *buf = malloc (size);
+  if (*buf == NULL)
+    {
+      *have = 0;
+      return -1;
+    }
+  *have = size;
+  return 0;
+}
+
+/* Set up an empty table, in ctx's space, for count chunks. */
+static int
+match_init (match_table_t *t, sync_ctx_t *ctx, size_t count)
+{
+  size_t slots;
+
+  t->bits = 4;
+  while (((size_t) 1 << t->bits) < count * 2)
+    t->bits++;
+  t->mask = (1U << t->bits) - 1;
+  slots = (size_t) t->mask + 1;
+  if (ctx->slots < slots)
+    {
+      free (ctx->tags);
+      free (ctx->entries);
+      ctx->tags = (uint32_t *) malloc (slots * sizeof (uint32_t));
+      ctx->entries = (match_entry_t *) malloc (slots * sizeof (match_entry_t));
+      ctx->slots = slots;
+      if (ctx->tags == NULL || ctx->entries == NULL)
+        {
+          free (ctx->tags);
+          free (ctx->entries);
+          ctx->tags = NULL;
+          ctx->entries = NULL;
+          ctx->slots = 0;
+          return -1;
+        }
+    }
+  t->tags = ctx->tags;
+  t->entries = ctx->entries;
+  /* Only the tags need clearing, and only as many as this table uses;
+     a small basis doesn't pay for a big one seen before. */
+  memset (t->tags, 0, slots * sizeof (uint32_t));
+  return 0;
+}
+
+/* Return the slot holding a chunk with this weak sum, or -1. */
+static inline int
+match_probe (const match_table_t *t, uint32_t weak)
+{
+  uint32_t tag = match_tag (weak);
+  uint32_t i;
+
+  for (i = match_slot (t, weak); t->tags[i] != MATCH_EMPTY; i = (i + 1) & t->mask)
+    {
+      if (t->tags[i] == tag && t->entries[i].id.weak == weak)
+        return i;
+    }
+  return -1;
+}
+
+/* Return the basis index of the chunk of length bytes with this key, or -1. */
+static int
+match_find (const match_table_t *t, const arrow_id_t *id, uint32_t length)
+{
+  uint32_t tag = match_tag (id->weak);
+  uint32_t i;
+
+  for (i = match_slot (t, id->weak); t->tags[i] != MATCH_EMPTY; i = (i + 1) & t->mask)
+    {
+      if (t->tags[i] == tag && arrow_id_cmp (&t->entries[i].id, id) == 0
+          && t->basis[t->entries[i].chunk].chunk.ref.length == length)
+        return t->entries[i].chunk;
+    }
+  return -1;
+}
+
+static void
+match_insert (match_table_t *t, const arrow_id_t *id, uint32_t chunk)
+{
+  uint32_t i;
+
+  if (match_find (t, id, t->basis[chunk].chunk.ref.length) >= 0)
+    return; /* already there */
+  for (i = match_slot (t, id->weak); t->tags[i] != MATCH_EMPTY; i = (i + 1) & t->mask)
+    ;
+  t->tags[i] = match_tag (id->weak);
+  memcpy (&t->entries[i].id, id, sizeof (arrow_id_t));
+  t->entries[i].chunk = chunk;
+}
+
+/*
+ * The rolling match only looks at windows of chunk_size bytes, so it
+ * can never find a shorter basis chunk (the last of a literal run, or
+ * of the file), and without more every edit would leave one behind
+ * for later versions to store again. The gaps between its matches are
+ * searched once more: a gap that is one short chunk, of any length,
+ * is looked up whole, and others are searched with a window for each
+ * of the short lengths that would save the most, SYNC_FINE_LENGTHS of
+ * them at most. A bitmap of the short chunks' weak sums keeps those windows from
+ * probing the table at every byte. Edits are small, and so are the
+ * gaps short chunks turn up in; longer ones, where the file was
+ * rewritten, aren't searched.
+ */
+#define SYNC_FINE_LENGTHS 16
+#define SYNC_FINE_MIN 64        /* Shorter chunks aren't worth a window. */
+#define SYNC_FINE_SEEN 256      /* Distinct lengths considered. */
+#define SYNC_FINE_BITS 16
+#define SYNC_FINE_GAP 8         /* Longest gap searched, in chunks. */
+
+typedef struct sync_fine_s
+{
+  const match_table_t *table;
+  int lengths[SYNC_FINE_LENGTHS];   /**< Longest first. */
+  int count;
+  uint64_t bits[(1 << SYNC_FINE_BITS) / 64];
+} sync_fine_t;
+
+typedef struct fine_length_s
+{
+  int length;
+  size_t bytes;     /**< What the basis has in chunks of this length. */
+} fine_length_t;
+
+static inline uint32_t
+fine_bit (uint32_t weak)
+{
+  return (uint32_t) (weak * 0x9e3779b1U) >> (32 - SYNC_FINE_BITS);
+}
+
+/* Whether some short basis chunk might have this weak sum. */
+static inline int
+fine_probe (const sync_fine_t *f, uint32_t weak)
+{
+  uint32_t b = fine_bit (weak);
+  return ((f->bits[b >> 6] >> (b & 63)) & 1) && match_probe (f->table, weak) >= 0;
+}
+
+/* Most bytes first. */
+static int
+fine_by_bytes (const void *a, const void *b)
+{
+  const fine_length_t *x = (const fine_length_t *) a;
+  const fine_length_t *y = (const fine_length_t *) b;
+
+  if (x->bytes != y->bytes)
+    return x->bytes < y->bytes ? 1 : -1;
+  return y->length - x->length;
+}
+
+/* Longest first. */
+static int
+fine_by_length (const void *a, const void *b)
+{
+  return *(const int *) b - *(const int *) a;
+}
+
+/*
+ * Fill t with the count entries of basis's chunks of chunk_size bytes,
+ * and the short ones (see sync_fine_t), and pick the lengths fine will
+ * search gaps for; the other chunks can't match anything sync_rolling
+ * looks at. basis may be several files' chunk lists, one after the
+ * other, each with its END_OF_CHUNKS.
+ */
+static int
+match_build (match_table_t *t, sync_ctx_t *ctx, const file_chunk_t *basis,
+             size_t count, int chunk_size, sync_fine_t *fine)
+{
+  fine_length_t seen[SYNC_FINE_SEEN];
+  int nseen = 0;
+  size_t cs = chunk_size;
+  size_t i;
+  int k;
+
+  for (i = 0; i < count; i++)
+    {
+      int len = basis[i].chunk.ref.length;
+
+      if (basis[i].type != REFERENCE || len >= chunk_size || len < SYNC_FINE_MIN)
+        continue;
+      for (k = 0; k < nseen && seen[k].length != len; k++)
+        ;
+      if (k == nseen)
+        {
+          if (nseen == SYNC_FINE_SEEN)
+            continue;
+          seen[nseen].length = len;
+          seen[nseen].bytes = 0;
+          nseen++;
+        }
+      seen[k].bytes += len;
+    }
+  if (match_init (t, ctx, count) != 0)
+    return -1;
+  t->basis = basis;
+
+  qsort (seen, nseen, sizeof (fine_length_t), fine_by_bytes);
+  fine->table = t;
+  fine->count = MIN (nseen, SYNC_FINE_LENGTHS);
+  for (k = 0; k < fine->count; k++)
+    fine->lengths[k] = seen[k].length;
+  qsort (fine->lengths, fine->count, sizeof (int), fine_by_length);
+  if (fine->count > 0)
+    memset (fine->bits, 0, sizeof (fine->bits));
+
+  for (i = 0; i < count; i++)
+    {
+      const arrow_id_t *id = &(basis[i].chunk.ref.ref);
+
+      if (basis[i].type != REFERENCE)
+        continue;
+      if (basis[i].chunk.ref.length == cs)
+        match_insert (t, id, i);
+      else if (basis[i].chunk.ref.length >= SYNC_FINE_MIN)
+        {
+          uint32_t b = fine_bit (id->weak);
+          match_insert (t, id, i);
+          fine->bits[b >> 6] |= (uint64_t) 1 << (b & 63);
+        }
+    }
+  return 0;
+}
+
+/*
+ * Chunks on their way to the callbacks. Records are gathered in file
+ * order, along with the new chunks they refer to (copied, since the
+ * buffers they were read into get reused) and the references to take,
+ * and passed on together; see sync_batch_callbacks_t. New chunks are
+ * also hashed by weak sum, so that a chunk seen twice before the store
+ * has it is only put once, and so that matching can find it.
+ */
+#define SYNC_BATCH_SLOTS (SYNC_BATCH_CHUNKS * 2)
+
+typedef struct sync_batch_s
+{
+  sync_callbacks_t *cb;
+  const sync_batch_callbacks_t *calls;
+  void *state;                            /**< What calls are passed. */
+  file_chunk_t records[SYNC_BATCH_CHUNKS];
+  int nrecords;
+  arrow_id_t ids[SYNC_BATCH_CHUNKS];      /**< New chunks. */
+  const void *bufs[SYNC_BATCH_CHUNKS];
+  size_t lens[SYNC_BATCH_CHUNKS];
+  uint8_t has[SYNC_BATCH_CHUNKS];
+  int nnew;
+  arrow_id_t refs[SYNC_BATCH_CHUNKS];     /**< Chunks the store has. */
+  int nrefs;
+  int16_t slots[SYNC_BATCH_SLOTS];        /**< Index in ids + 1, or 0. */
+  uint8_t data[SYNC_BATCH_BYTES];         /**< New chunks' bytes. */
+  size_t used;
+  int failed;
+} sync_batch_t;
+
+/*
+ * The batch callbacks for a backend that only has the per-chunk ones.
+ * Their state is the sync_callbacks_t.
+ */
+static int
+v1_contains_many (void *state, const arrow_id_t *ids, size_t count, uint8_t *has)
+{
+  sync_callbacks_t *cb = (sync_callbacks_t *) state;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    has[i] = cb->store_contains (cb->state, &ids[i]) != 0;
+  return 0;
+}
+
+static int
+v1_put_blocks (void *state, const arrow_id_t *ids, const void *const *bufs,
+               const size_t *lens, size_t count)
+{
+  sync_callbacks_t *cb = (sync_callbacks_t *) state;
+  int ret = 0;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    if (cb->put_block (cb->state, &ids[i], bufs[i], lens[i]) < 0)
+      ret = -1;
+  return ret;
+}
+
+static int
+v1_add_refs (void *state, const arrow_id_t *ids, size_t count)
+{
+  sync_callbacks_t *cb = (sync_callbacks_t *) state;
+  int ret = 0;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    if (cb->add_ref (cb->state, &ids[i]) < 0)
+      ret = -1;
+  return ret;
+}
+
+static int
+v1_emit_chunks (void *state, const file_chunk_t *chunks, size_t count)
+{
+  sync_callbacks_t *cb = (sync_callbacks_t *) state;
+  int ret = 0;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    if (cb->emit_chunk (cb->state, &chunks[i]) < 0)
+      ret = -1;
+  return ret;
+}
+
+static const sync_batch_callbacks_t v1_calls =
+{
+  v1_contains_many,
+  v1_put_blocks,
+  v1_add_refs,
+  v1_emit_chunks,
+  NULL
+};
+
+static inline uint32_t
+batch_slot (uint32_t weak)
+{
+  return (uint32_t) (weak * 0x9e3779b1U) % SYNC_BATCH_SLOTS;
+}
+
+/* The index of the pending new chunk with this key (or with just this
+   weak sum, if strong is zero), or -1. */
+static int
+batch_find (const sync_batch_t *b, const arrow_id_t *id, int strong)
+{
+  uint32_t i;
+
+  for (i = batch_slot (id->weak); b->slots[i] != 0; i = (i + 1) % SYNC_BATCH_SLOTS)
+    {
+      const arrow_id_t *other = &b->ids[b->slots[i] - 1];
+      if (strong ? arrow_id_cmp (other, id) == 0 : other->weak == id->weak)
+        return b->slots[i] - 1;
+    }
+  return -1;
+}
+
+/* Pass everything gathered so far on to the callbacks. */
+static void
+batch_flush (sync_batch_t *b)
+{
+  const sync_batch_callbacks_t *c = b->calls;
+  int i, nput = 0;
+
+  if (b->nnew > 0)
+    {
+      memset (b->has, 0, b->nnew);
+      if (c->contains_many (b->state, b->ids, b->nnew, b->has) != 0)
+        b->failed = 1;
+      /* Put the ones it doesn't have, moved to the front; reference
+         the rest. */
+      for (i = 0; i < b->nnew; i++)
+        {
+          if (b->has[i])
+            {
+              memcpy (&b->refs[b->nrefs++], &b->ids[i], sizeof (arrow_id_t));
+              continue;
+            }
+          if (nput != i)
+            {
+              memcpy (&b->ids[nput], &b->ids[i], sizeof (arrow_id_t));
+              b->bufs[nput] = b->bufs[i];
+              b->lens[nput] = b->lens[i];
+            }
+          nput++;
+        }
+      if (nput > 0 && c->put_blocks (b->state, b->ids, b->bufs, b->lens, nput) != 0)
+        b->failed = 1;
+      memset (b->slots, 0, sizeof (b->slots));
+    }
+  if (b->nrefs > 0 && c->add_refs (b->state, b->refs, b->nrefs) != 0)
+    b->failed = 1;
+  if (b->nrecords > 0 && c->emit_chunks (b->state, b->records, b->nrecords) != 0)
+    b->failed = 1;
+  sync_log (SYNC_GENERATE | SYNC_FILE, "batch of %d chunks: %d put, %d referenced",
+            b->nrecords, nput, b->nrefs);
+  b->nrecords = 0;
+  b->nnew = 0;
+  b->nrefs = 0;
+  b->used = 0;
+}
+
+static sync_batch_t *
+batch_begin (sync_ctx_t *ctx, sync_callbacks_t *cb)
+{
+  sync_batch_t *b = ctx->batch;
+
+  if (b == NULL)
+    {
+      b = (sync_batch_t *) malloc (sizeof (sync_batch_t));
+      if (b == NULL)
+        return NULL;
+      memset (b->slots, 0, sizeof (b->slots));
+      ctx->batch = b;
+    }
+  b->cb = cb;
+  b->calls = cb->batch != NULL ? cb->batch : &v1_calls;
+  b->state = cb->batch != NULL ? cb->state : cb;
+  b->nrecords = 0;
+  b->nnew = 0;
+  b->nrefs = 0;
+  b->used = 0;
+  b->failed = 0;
+  return b;
+}
+
+static void
+batch_record (sync_batch_t *b, const file_chunk_t *chunk)
+{
+  if (b->nrecords == SYNC_BATCH_CHUNKS)
+    batch_flush (b);
+  memcpy (&b->records[b->nrecords++], chunk, sizeof (file_chunk_t));
+}
+
+/*
+ * End the file's chunk list, and pass the last of it on. Returns -1 if
+ * any of the callbacks failed.
+ */
+static int
+batch_end (sync_batch_t *b)
+{
+  file_chunk_t chunk;
+
+  memset (&chunk, 0, sizeof (file_chunk_t));
+  chunk.type = END_OF_CHUNKS;
+  batch_record (b, &chunk);
+  batch_flush (b);
+  if (b->calls->complete != NULL && b->calls->complete (b->state) != 0)
+    b->failed = 1;
+  return b->failed ? -1 : 0;
+}
+
+/* Whether the store might have some chunk with this weak sum. */
+static int
+probe_global (sync_batch_t *b, uint32_t weaksum, int chunk_size)
+{
+  sync_callbacks_t *cb = b->cb;
+  arrow_id_t id;
+  int i;
+
+  if (cb->probe_weak == NULL)
+    return 0;
+  id.weak = weaksum;
+  if ((i = batch_find (b, &id, 0)) >= 0 && b->lens[i] == (size_t) chunk_size)
+    return 1;
+  return cb->probe_weak (cb->state, weaksum, chunk_size);
+}
+
+/* Whether the store has this chunk, or will once the batch is passed on. */
+static int
+batch_contains (sync_batch_t *b, const arrow_id_t *id)
+{
+  uint8_t has = 0;
+
+  if (batch_find (b, id, 1) >= 0)
+    return 1;
+  if (b->calls->contains_many (b->state, id, 1, &has) != 0)
+    b->failed = 1;
+  return has;
+}
+
+static int sync_rolling (sync_ctx_t *ctx, const file_chunk_t *basis, size_t count,
+                         int chunk_size, file_t *newfile, FILE *datafile,
+                         sync_callbacks_t *cb);
+static int sync_parallel (sync_ctx_t *ctx, const file_chunk_t *basis, size_t count,
+                          int chunk_size, file_t *newfile, FILE *datafile,
+                          sync_callbacks_t *cb);
+static int sync_append (sync_ctx_t *ctx, const file_chunk_t *basis, int chunk_size,
+                        file_t *newfile, FILE *datafile, sync_callbacks_t *cb);
+
+/* Emit a reference to a chunk the store has, of len bytes. */
+static void
+emit_reference (const arrow_id_t *id, int len, sync_batch_t *out)
+{
+  file_chunk_t chunk;
+
+  sync_log (SYNC_FILE, "REFERENCE chunk of %d bytes", len);
+  chunk.type = REFERENCE;
+  chunk.chunk.ref.length = len;
+  memcpy (&(chunk.chunk.ref.ref), id, sizeof (arrow_id_t));
+  batch_record (out, &chunk);
+  if (out->nrefs == SYNC_BATCH_CHUNKS)
+    batch_flush (out);
+  memcpy (&out->refs[out->nrefs++], id, sizeof (arrow_id_t));
+}
+
+/*
+ * Emit the n chunks bufs[i] of lens[i] bytes, with keys ids[i],
+ * putting the ones the store doesn't have and taking a reference on
+ * the ones it does.
+ */
+static void
+emit_keyed_chunks (const void **bufs, const size_t *lens, const arrow_id_t *ids,
+                   int n, sync_batch_t *out)
+{
+  file_chunk_t chunk;
+  uint32_t slot;
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      if (lens[i] <= MAX_DIRECT_CHUNK_SIZE)
+        {
+          sync_log (SYNC_GENERATE | SYNC_FILE, "DIRECT chunk of %zu bytes", lens[i]);
+          chunk.type = DIRECT_CHUNK;
+          chunk.chunk.data.length = lens[i];
+          memcpy (chunk.chunk.data.data, bufs[i], lens[i]);
+          batch_record (out, &chunk);
+          continue;
+        }
+      /* Seen already, in this batch? Then it's stored before this is. */
+      if (batch_find (out, &ids[i], 1) >= 0)
+        {
+          emit_reference (&ids[i], lens[i], out);
+          continue;
+        }
+      if (out->used + lens[i] > SYNC_BATCH_BYTES)
+        batch_flush (out);
+      sync_log (SYNC_GENERATE | SYNC_FILE, "REFERENCE chunk of %zu bytes", lens[i]);
+      chunk.type = REFERENCE;
+      chunk.chunk.ref.length = lens[i];
+      memcpy (&(chunk.chunk.ref.ref), &ids[i], sizeof (arrow_id_t));
+      batch_record (out, &chunk);
+      memcpy (out->data + out->used, bufs[i], lens[i]);
+      memcpy (&out->ids[out->nnew], &ids[i], sizeof (arrow_id_t));
+      out->bufs[out->nnew] = out->data + out->used;
+      out->lens[out->nnew] = lens[i];
+      out->used += lens[i];
+      for (slot = batch_slot (ids[i].weak); out->slots[slot] != 0;
+           slot = (slot + 1) % SYNC_BATCH_SLOTS)
+        ;
+      out->slots[slot] = ++out->nnew;
+    }
+}
+
+/*
+ * The same, computing the keys first. They're computed together,
+ * which for MD5 is several times faster than one at a time.
+ */
+static void
+emit_chunk_list (const void **bufs, const size_t *lens, int n, sync_batch_t *out)
+{
+  arrow_id_t ids[SYNC_BATCH];
+
+  arrow_compute_keys_with (out->cb->hash, ids, bufs, lens, n);
+  emit_keyed_chunks (bufs, lens, ids, n, out);
+}
+
+/*
+ * Emit len bytes of data as chunks of chunk_size bytes (the last may
+ * be shorter), SYNC_BATCH chunks at a time.
+ */
+static void
+emit_chunks (const uint8_t *data, size_t len, int chunk_size, sync_batch_t *out)
+{
+  const void *bufs[SYNC_BATCH];
+  size_t lens[SYNC_BATCH];
+  size_t off = 0;
+  int n;
+
+  while (off < len)
+    {
+      for (n = 0; n < SYNC_BATCH && off < len; n++)
+        {
+          bufs[n] = data + off;
+          lens[n] = MIN (len - off, (size_t) chunk_size);
+          off += lens[n];
+        }
+      emit_chunk_list (bufs, lens, n, out);
+    }
+}
+
+/*
+ * Emit the literal bytes buf[0..len), which lie between matches
+ * against the basis, as chunks, picking out any short basis chunk
+ * (see sync_fine_t) and, if global, any stored chunk (see
+ * probe_global) that turns up in them; where more than one would
+ * match, the longest wins. Unless this is the end of the file, bytes
+ * after the last whole chunk are left for later. Returns how many
+ * bytes were emitted.
+ */
+static size_t
+emit_gap (const uint8_t *buf, size_t len, int chunk_size, int final,
+          int global, const sync_fine_t *fine, sync_batch_t *out)
+{
+  size_t lens[1 + SYNC_FINE_LENGTHS];
+  Rollsum sums[1 + SYNC_FINE_LENGTHS];
+  int rolling[1 + SYNC_FINE_LENGTHS];
+  size_t cs = chunk_size;
+  size_t start = 0, last = 0, tail;
+  arrow_id_t id;
+  int n = 0, k;
+
+  /* Most gaps are a short chunk left alone since the last version,
+     between two whole ones that were too; try that first. */
+  if (fine->count > 0 && len < cs && len >= SYNC_FINE_MIN)
+    {
+      Rollsum sum;
+
+      RollsumInit (&sum);
+      RollsumUpdate (&sum, buf, len);
+      id.weak = RollsumDigest (&sum);
+      if (fine_probe (fine, id.weak))
+        {
+          arrow_hash (out->cb->hash, buf, len, id.strong);
+          if (match_find (fine->table, &id, len) >= 0)
+            {
+              emit_reference (&id, len, out);
+              return len;
+            }
+        }
+    }
+
+  /* Window lengths, longest first; only a global one is chunk_size. */
+  if (global && out->cb->probe_weak != NULL)
+    lens[n++] = cs;
+  if (len <= SYNC_FINE_GAP * cs)
+    for (k = 0; k < fine->count; k++)
+      lens[n++] = fine->lengths[k];
+  memset (rolling, 0, sizeof (rolling));
+
+  while (n > 0 && start + lens[n - 1] <= len)
+    {
+      int hit = -1;
+
+      for (k = 0; k < n && hit < 0; k++)
+        {
+          if (start + lens[k] > len)
+            continue;
+          if (!rolling[k])
+            {
+              RollsumInit (&sums[k]);
+              RollsumUpdate (&sums[k], buf + start, lens[k]);
+              rolling[k] = 1;
+            }
+          id.weak = RollsumDigest (&sums[k]);
+          if (lens[k] == cs)
+            {
+              if (!probe_global (out, id.weak, chunk_size))
+                continue;
+              arrow_hash (out->cb->hash, buf + start, cs, id.strong);
+              if (batch_contains (out, &id))
+                hit = k;
+            }
+          else if (fine_probe (fine, id.weak))
+            {
+              arrow_hash (out->cb->hash, buf + start, lens[k], id.strong);
+              if (match_find (fine->table, &id, lens[k]) >= 0)
+                hit = k;
+            }
+        }
+      if (hit >= 0)
+        {
+          emit_chunks (buf + last, start - last, chunk_size, out);
+          emit_reference (&id, lens[hit], out);
+          start += lens[hit];
+          last = start;
+          memset (rolling, 0, sizeof (rolling));
+          continue;
+        }
+
+      for (k = 0; k < n; k++)
+        {
+          if (!rolling[k])
+            continue;
+          if (start + lens[k] < len)
+            {
+              RollsumRotate (&sums[k], buf[start], buf[start + lens[k]]);
+            }
+          else
+            rolling[k] = 0;
+        }
+      start++;
+    }
+
+  tail = len - last;
+  if (!final)
+    tail = tail / cs * cs;
+  emit_chunks (buf + last, tail, chunk_size, out);
+  return last + tail;
+}
+
+/*
+ * sync_chunks reads its input a segment at a time. With more than one
+ * thread, and a file big enough to be worth it, segments are keyed on
+ * a pool of workers while the calling thread reads and cuts the ones
+ * after them. Up to two segments per worker are in flight; they're
+ * emitted in file order as they finish, and only the calling thread
+ * ever calls back.
+ */
+typedef struct sync_segment_s
+{
+  uint8_t *data;
+  const void **bufs;
+  size_t *lens;
+  arrow_id_t *ids;
+  int count;          /**< Chunks cut from data. */
+  int done;           /**< Whether the keys are computed. */
+} sync_segment_t;
+
+typedef struct sync_pool_s
+{
+  pthread_mutex_t lock;   /**< Guards everything below. */
+  pthread_cond_t cond;
+  sync_segment_t *segs;
+  int nsegs;
+  uint64_t queued;        /**< Segments read and cut so far. */
+  uint64_t taken;         /**< Segments a worker has started on. */
+  int stop;
+  arrow_hash_t hash;
+} sync_pool_t;
+
+static void *
+sync_worker (void *arg)
+{
+  sync_pool_t *pool = (sync_pool_t *) arg;
+
+  pthread_mutex_lock (&pool->lock);
+  for (;;)
+    {
+      sync_segment_t *seg;
+
+      while (!pool->stop && pool->taken == pool->queued)
+        pthread_cond_wait (&pool->cond, &pool->lock);
+      if (pool->taken == pool->queued)
+        break;
+      seg = &pool->segs[pool->taken++ % pool->nsegs];
+      pthread_mutex_unlock (&pool->lock);
+      arrow_compute_keys_with (pool->hash, seg->ids, seg->bufs, seg->lens, seg->count);
+      pthread_mutex_lock (&pool->lock);
+      seg->done = 1;
+      pthread_cond_broadcast (&pool->cond);
+    }
+  pthread_mutex_unlock (&pool->lock);
+  return NULL;
+}
+
+/*
+ * Make ctx hold at least n segments of size bytes and chunks chunks
+ * each; whatever it held before is lost.
+ */
+static int
+ctx_segments (sync_ctx_t *ctx, int n, size_t size, size_t chunks)
+{
+  int i;
+
+  if (ctx->nsegs >= n && ctx->seg_size >= size && ctx->seg_chunks >= chunks)
+    return 0;
+  n = MAX (n, ctx->nsegs);
+  size = MAX (size, ctx->seg_size);
+  chunks = MAX (chunks, ctx->seg_chunks);
+  for (i = 0; i < ctx->nsegs; i++)
+    {
+      free (ctx->segs[i].data);
+      free (ctx->segs[i].bufs);
+      free (ctx->segs[i].lens);
+      free (ctx->segs[i].ids);
+    }
+  free (ctx->segs);
+  ctx->nsegs = 0;
+  ctx->segs = (sync_segment_t *) calloc (n, sizeof (sync_segment_t));
+  if (ctx->segs == NULL)
+    return -1;
+  /* Count each one as it's allocated, so a partial failure can still
+     be freed. */
+  for (i = 0; i < n; i++)
+    {
+      sync_segment_t *seg = &ctx->segs[i];
+      seg->data = (uint8_t *) malloc (size);
+      seg->bufs = (const void **) malloc (chunks * sizeof (void *));
+      seg->lens = (size_t *) malloc (chunks * sizeof (size_t));
+      seg->ids = (arrow_id_t *) malloc (chunks * sizeof (arrow_id_t));
+      ctx->nsegs++;
+      if (seg->data == NULL || seg->bufs == NULL || seg->lens == NULL
+          || seg->ids == NULL)
+        {
+          ctx->seg_size = 0;
+          ctx->seg_chunks = 0;
+          return -1;
+        }
+    }
+  ctx->seg_size = size;
+  ctx->seg_chunks = chunks;
+  return 0;
+}
+
+/*
+ * Cut all of `in' into chunks and emit them: every chunk_size bytes,
+ * or with chunk_size zero, where cdc_cut says (see cdc.h). Chunks the
+ * store already has, from any file, are found by their keys.
+ */
+static int
+sync_chunks (sync_ctx_t *ctx, file_t *file, FILE *in, int chunk_size,
+             sync_callbacks_t *cb)
+{
+  sync_pool_t pool;
+  sync_batch_t *out;
+  pthread_t *tids = NULL;
+  struct stat st;
+  MD5_CTX md5;
+  size_t seg_size, cap, max_chunks;
+  const uint8_t *carry_from = NULL;
+  size_t carry = 0;
+  uint64_t emitted = 0;
+  int workers = 0, started = 0;
+  int eof = 0, ret = 0;
+  int i;
+
+  /* Fixed-size segments hold whole chunks; content-defined ones leave
+     the bytes after their last cut to the next segment. */
+  if (chunk_size > 0)
+    {
+      seg_size = SYNC_SEGMENT_SIZE / chunk_size * chunk_size;
+      cap = seg_size;
+      max_chunks = seg_size / chunk_size;
+    }
+  else
+    {
+      seg_size = SYNC_SEGMENT_SIZE;
+      cap = seg_size + CDC_MAX_CHUNK_SIZE;
+      max_chunks = cap / CDC_MIN_CHUNK_SIZE + 1;
+    }
+
+  if (cb->threads > 1 && fstat (fileno (in), &st) == 0
+      && st.st_size >= SYNC_PARALLEL_MIN)
+    workers = MIN (cb->threads, SYNC_THREADS_MAX);
+
+  memset (&pool, 0, sizeof (pool));
+  pool.nsegs = workers > 0 ? workers * 2 : 1;
+  pool.hash = cb->hash;
+  if (ctx_segments (ctx, pool.nsegs, cap, max_chunks) != 0
+      || (out = batch_begin (ctx, cb)) == NULL)
+    return -1;
+  pool.segs = ctx->segs;
+
+  if (workers > 0)
+    {
+      pthread_mutex_init (&pool.lock, NULL);
+      pthread_cond_init (&pool.cond, NULL);
+      tids = (pthread_t *) malloc (workers * sizeof (pthread_t));
+      if (tids != NULL)
+        for (started = 0; started < workers; started++)
+          if (pthread_create (&tids[started], NULL, sync_worker, &pool) != 0)
+            break;
+      /* With no workers at all, hash on this thread. */
+      if (started == 0)
+        {
+          pthread_cond_destroy (&pool.cond);
+          pthread_mutex_destroy (&pool.lock);
+          workers = 0;
+        }
+      sync_log (SYNC_GENERATE | SYNC_FILE, "hashing on %d threads", started);
+    }
+
+  MD5_Init (&md5);
+
+  while (!eof || emitted < pool.queued)
+    {
+      /* Read and cut the next segment, if there's a free one. */
+      if (!eof && pool.queued - emitted < (uint64_t) pool.nsegs)
+        {
+          sync_segment_t *seg = &pool.segs[pool.queued % pool.nsegs];
+          size_t len = carry, off = 0;
+          size_t least = chunk_size > 0 ? chunk_size : CDC_MAX_CHUNK_SIZE;
+
+          memmove (seg->data, carry_from, carry);
+          while (len < cap)
+            {
+              size_t got = fread (seg->data + len, 1, cap - len, in);
+              if (got == 0)
+                {
+                  if (ferror (in))
+                    {
+                      ret = -1;
+                      goto done;
+                    }
+                  eof = 1;
+                  break;
+                }
+              MD5_Update (&md5, seg->data + len, got);
+              len += got;
+            }
+
+          /* Every cut but the last few sees all the bytes it could. */
+          seg->count = 0;
+          while (off < len && (eof || len - off >= least))
+            {
+              size_t n = (chunk_size > 0 ? MIN (len - off, (size_t) chunk_size)
+                          : cdc_cut (seg->data + off, len - off));
+              seg->bufs[seg->count] = seg->data + off;
+              seg->lens[seg->count] = n;
+              seg->count++;
+              off += n;
+            }
+          carry_from = seg->data + off;
+          carry = len - off;
+
+          if (seg->count > 0)
+            {
+              if (workers > 0)
+                {
+                  pthread_mutex_lock (&pool.lock);
+                  seg->done = 0;
+                  pool.queued++;
+                  pthread_cond_broadcast (&pool.cond);
+                  pthread_mutex_unlock (&pool.lock);
+                }
+              else
+                {
+                  arrow_compute_keys_with (cb->hash, seg->ids, seg->bufs, seg->lens,
+                                           seg->count);
+                  seg->done = 1;
+                  pool.queued++;
+                }
+            }
+        }
+
+      /* Emit what's finished, in order. Wait for the oldest segment
+         if there's nothing more to read, or nowhere to read it. */
+      if (workers > 0)
+        pthread_mutex_lock (&pool.lock);
+      while (emitted < pool.queued)
+        {
+          sync_segment_t *seg = &pool.segs[emitted % pool.nsegs];
+          if (seg->done)
+            {
+              if (workers > 0)
+                pthread_mutex_unlock (&pool.lock);
+              emit_keyed_chunks (seg->bufs, seg->lens, seg->ids, seg->count, out);
+              emitted++;
+              if (workers > 0)
+                pthread_mutex_lock (&pool.lock);
+            }
+          else if (eof || pool.queued - emitted == (uint64_t) pool.nsegs)
+            pthread_cond_wait (&pool.cond, &pool.lock);
+          else
+            break;
+        }
+      if (workers > 0)
+        pthread_mutex_unlock (&pool.lock);
+    }
+
+  sync_log (SYNC_GENERATE | SYNC_FILE, "emitted %llu segments",
+            (unsigned long long) emitted);
 
-static const arrow_id_t null_id = { 0, { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
+  MD5_Final (file->file->hash, &md5);
+  ret = batch_end (out);
 
-static void
-hash_insert (arrow_id_t *table, const arrow_id_t *id)
-{
-  int idx = id->weak % HASH_TABLE_SIZE;
-  while (1)
+ done:
+  arrow_push_errno ();
+  if (workers > 0)
     {
-      if (arrow_id_cmp (&table[idx], id) == 0)
-        return; /* already there */
-      if (arrow_id_cmp (&table[idx], &null_id) == 0) /* Found a slot. */
-        {
-          memcpy (&table[idx], id, sizeof (arrow_id_t));
-          break;
-        }
-      idx++;
-      if (idx >= HASH_TABLE_SIZE)
-        idx = 0;
-      if (idx == id->weak % HASH_TABLE_SIZE)
-        fail ("FIXME hash table completely filled!!!");
+      pthread_mutex_lock (&pool.lock);
+      pool.stop = 1;
+      pthread_cond_broadcast (&pool.cond);
+      pthread_mutex_unlock (&pool.lock);
+      for (i = 0; i < started; i++)
+        pthread_join (tids[i], NULL);
+      pthread_cond_destroy (&pool.cond);
+      pthread_mutex_destroy (&pool.lock);
     }
+  free (tids);
+  arrow_pop_errno ();
+  return ret;
 }
 
+/* Cut `in' into content-defined chunks. No basis is needed. */
 static int
-hash_table_probe (arrow_id_t *table, uint32_t weaksum)
+sync_cdc (sync_ctx_t *ctx, file_t *file, FILE *in, sync_callbacks_t *cb)
 {
-  int idx = weaksum % HASH_TABLE_SIZE;
-  while (1)
-    {
-      if (table[idx].weak == weaksum)
-        return 1;
-      if (arrow_id_cmp (&table[idx], &null_id) == 0)
-        return 0;
-      idx++;
-      if (idx >= HASH_TABLE_SIZE)
-        idx = 0;
-      if (idx == weaksum % HASH_TABLE_SIZE)
-        return 0;
-    }
-  return 0;
+  file_set_chunking (file->file, FILE_CHUNKING_CDC, CDC_AVG_CHUNK_SIZE);
+  return sync_chunks (ctx, file, in, 0, cb);
 }
 
-static int
-hash_table_contains (arrow_id_t *table, const arrow_id_t *id)
+void
+sync_ctx_init (sync_ctx_t *ctx)
+{
+  memset (ctx, 0, sizeof (sync_ctx_t));
+}
+
+void
+sync_ctx_destroy (sync_ctx_t *ctx)
 {
-  int idx = id->weak % HASH_TABLE_SIZE;
-  while (1)
+  int i;
+
+  free (ctx->tags);
+  free (ctx->entries);
+  free (ctx->bases);
+  free (ctx->window);
+  for (i = 0; i < ctx->nsegs; i++)
     {
-      if (arrow_id_cmp (&table[idx], id) == 0)
-        return 1;
-      if (arrow_id_cmp (&table[idx], &null_id) == 0)
-        return 0;
-      idx++;
-      if (idx >= HASH_TABLE_SIZE)
-        idx = 0;
-      if (idx == id->weak % HASH_TABLE_SIZE)
-        return 0;
+      free (ctx->segs[i].data);
+      free (ctx->segs[i].bufs);
+      free (ctx->segs[i].lens);
+      free (ctx->segs[i].ids);
     }
-  return 0;
+  free (ctx->segs);
+  free (ctx->batch);
+  memset (ctx, 0, sizeof (sync_ctx_t));
 }
 
 int
-sync_generate (file_t *file, FILE *in, sync_callbacks_t *cb)
+sync_generate (sync_ctx_t *ctx, file_t *file, FILE *in, sync_callbacks_t *cb)
 {
-  uint8_t *buffer;
-  int ret;
+  sync_ctx_t local;
   uint32_t bufsize;
   struct stat st;
-  file_chunk_t chunk;
-  MD5_CTX md5;
+  int ret;
+
+  if (ctx == NULL)
+    {
+      sync_ctx_init (&local);
+      ret = sync_generate (&local, file, in, cb);
+      arrow_push_errno ();
+      sync_ctx_destroy (&local);
+      arrow_pop_errno ();
+      return ret;
+    }
 
   if (fstat (fileno (in), &st) != 0)
 	return -1;
@@ -122,7 +1135,8 @@ sync_generate (file_t *file, FILE *in, sync_callbacks_t *cb)
   if ((st.st_mode & S_IFREG) == 0)
 	return -1;
 
-  MD5_Init (&md5);
+  if (cb->chunking == FILE_CHUNKING_CDC)
+    return sync_cdc (ctx, file, in, cb);
 
   bufsize = (uint32_t) sqrtl ((long double) st.st_size);
   if (bufsize < MIN_CHUNK_SIZE)
@@ -133,79 +1147,77 @@ sync_generate (file_t *file, FILE *in, sync_callbacks_t *cb)
   sync_log (SYNC_GENERATE, "block size is %u", bufsize);
 
   file->file->chunk_size = bufsize;
-  buffer = (uint8_t *) malloc (bufsize);
-  if (buffer == NULL)
-	return -1;
 
-/*   fseek (out, sizeof (file_info_t), SEEK_SET); */
-
-  while (!feof (in))
-	{
-	  ret = fread (buffer, 1, bufsize, in);
-	  if (ret <= 0)
-		break;
-	  MD5_Update (&md5, buffer, ret);
-	  if (ret <= MAX_DIRECT_CHUNK_SIZE)
-		{
-		  sync_log (SYNC_GENERATE, "DIRECT block of size %d", ret);
-		  chunk.type = DIRECT_CHUNK;
-		  chunk.chunk.data.length = ret;
-		  memcpy (chunk.chunk.data.data, buffer, ret);
-		  cb->emit_chunk (cb->state, &chunk);
-/* 		  fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-		}
-	  else
-		{
-		  sync_log (SYNC_GENERATE, "REFERENCE block of size %d", ret);
-		  chunk.type = REFERENCE;
-		  chunk.chunk.ref.length = ret;
-		  arrow_compute_key (&(chunk.chunk.ref.ref), buffer, ret);
-		  cb->emit_chunk (cb->state, &chunk);
-/* 		  fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-
-		  sync_log (SYNC_GENERATE, "key generated: %08x %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x",
-					chunk.chunk.ref.ref.weak,
-					chunk.chunk.ref.ref.strong[ 0], chunk.chunk.ref.ref.strong[ 1],
-					chunk.chunk.ref.ref.strong[ 2], chunk.chunk.ref.ref.strong[ 3],
-					chunk.chunk.ref.ref.strong[ 4], chunk.chunk.ref.ref.strong[ 5],
-					chunk.chunk.ref.ref.strong[ 6], chunk.chunk.ref.ref.strong[ 7],
-					chunk.chunk.ref.ref.strong[ 8], chunk.chunk.ref.ref.strong[ 9],
-					chunk.chunk.ref.ref.strong[10], chunk.chunk.ref.ref.strong[11],
-					chunk.chunk.ref.ref.strong[12], chunk.chunk.ref.ref.strong[13],
-					chunk.chunk.ref.ref.strong[14], chunk.chunk.ref.ref.strong[15]);
-
-		  if (!cb->store_contains (cb->state, &(chunk.chunk.ref.ref)))
-			cb->put_block (cb->state, &(chunk.chunk.ref.ref), buffer, ret);
-		}
-	}
+  /* If we can look for chunks anywhere in the store, a new file might
+     still be mostly old data; match it against an empty basis. That
+     probes at every byte, on this thread, as only it may call back; a
+     file big enough for several threads is cut on the segment pool
+     instead, and finds stored chunks where its cuts fall. */
+  if (cb->probe_weak != NULL
+      && !(cb->threads > 1 && st.st_size >= SYNC_PARALLEL_MIN))
+    {
+      file_chunk_t none;
+      memset (&none, 0, sizeof (file_chunk_t));
+      none.type = END_OF_CHUNKS;
+      return sync_rolling (ctx, &none, 1, bufsize, file, in, cb);
+    }
 
-  memset (&chunk, 0, sizeof (file_chunk_t));
-  chunk.type = END_OF_CHUNKS;
-  cb->emit_chunk (cb->state, &chunk);
-/*   fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
+  return sync_chunks (ctx, file, in, bufsize, cb);
+}
 
-  MD5_Final (file->file->hash, &md5);
+/* How many chunks there are before the END_OF_CHUNKS. */
+static size_t
+chunk_count (const file_chunk_t *chunks)
+{
+  size_t n;
 
-  free (buffer);
-  return 0;
+  for (n = 0; chunks[n].type != END_OF_CHUNKS; n++)
+    ;
+  return n;
+}
+
+static size_t
+chunk_length (const file_chunk_t *chunk)
+{
+  if (chunk->type == DIRECT_CHUNK)
+    return chunk->chunk.data.length;
+  return chunk->chunk.ref.length;
+}
+
+/* How long the file made of these chunks is. */
+static off_t
+chunk_bytes (const file_chunk_t *chunks)
+{
+  off_t len = 0;
+  size_t n;
+
+  for (n = 0; chunks[n].type != END_OF_CHUNKS; n++)
+    len += chunk_length (&chunks[n]);
+  return len;
 }
 
 int
-sync_file (file_t *basis, file_t *newfile, FILE *datafile, sync_callbacks_t *cb,
-           int *hash_match)
+sync_file (sync_ctx_t *ctx, file_t *basis, int nbasis, file_t *newfile,
+           FILE *datafile, sync_callbacks_t *cb, int *hash_match)
 {
-  arrow_id_t *table;
-  int i = 0;
-  circular_buffer_t buffer;
-  int bufsize;
-  arrow_id_t current;
-  Rollsum runsum;
-  int ret;
-  MD5_CTX md5;
-  off_t last_match = 0;
-  int chunk_size = basis->file->chunk_size;
-  file_chunk_t chunk;
-  int matches = 0;
+  int chunk_size = file_chunk_size (basis->file);
+  const file_chunk_t *chunks;
+  size_t count = 0;
+  sync_ctx_t local;
+  struct stat st;
+  off_t length;
+  int sized;
+  int ret, k, joined = 0;
+
+  if (ctx == NULL)
+    {
+      sync_ctx_init (&local);
+      ret = sync_file (&local, basis, nbasis, newfile, datafile, cb, hash_match);
+      arrow_push_errno ();
+      sync_ctx_destroy (&local);
+      arrow_pop_errno ();
+      return ret;
+    }
 
   sync_log (SYNC_FILE, "sync file %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:"
 			"%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x to file %02x:%02x:%02x:"
@@ -229,7 +1241,12 @@ sync_file (file_t *basis, file_t *newfile, FILE *datafile, sync_callbacks_t *cb,
 			newfile->uuid[14], newfile->uuid[15],
 			chunk_size);
 
-  if (hash_match != NULL && *hash_match != 0)
+  /* A file that changed size can't be the same, and might only have
+     grown. */
+  length = chunk_bytes (basis->file->chunks);
+  sized = fstat (fileno (datafile), &st) == 0 && S_ISREG (st.st_mode);
+
+  if (hash_match != NULL && *hash_match != 0 && !(sized && st.st_size != length))
     {
       unsigned char filebuf[1024];
       MD5_CTX filemd5;
@@ -256,245 +1273,706 @@ sync_file (file_t *basis, file_t *newfile, FILE *datafile, sync_callbacks_t *cb,
   if (hash_match != NULL)
     *hash_match = 0;
 
-  MD5_Init (&md5);
+  uuid_copy (newfile->file->previous, basis->uuid);
+  if (cb->chunking == FILE_CHUNKING_CDC)
+    return sync_cdc (ctx, newfile, datafile, cb);
+  if (sized && st.st_size > length && length > 0
+      && file_chunking (basis->file) == FILE_CHUNKING_FIXED
+      && (ret = sync_append (ctx, basis->file->chunks, chunk_size, newfile,
+                             datafile, cb)) != 1)
+    return ret;
 
-  table = (arrow_id_t *) malloc (sizeof (arrow_id_t) * HASH_TABLE_SIZE);
-  if (table == NULL)
+  /* Several bases are matched as one, their chunk lists joined. The
+     scan only finds chunks of this chunk size, so bases cut to another
+     are left out. */
+  for (k = 0; k < nbasis; k++)
+    if (file_chunk_size (basis[k].file) == file_chunk_size (basis->file))
+      {
+        count += chunk_count (basis[k].file->chunks) + 1;
+        joined++;
+      }
+  chunks = basis->file->chunks;
+  if (joined > 1)
     {
-      return -1;
+      file_chunk_t *all;
+
+      if (ctx_reserve ((void **) &ctx->bases, &ctx->bases_size,
+                       count * sizeof (file_chunk_t)) != 0)
+        return -1;
+      all = ctx->bases;
+      for (k = 0; k < nbasis; k++)
+        {
+          size_t n = chunk_count (basis[k].file->chunks) + 1;
+
+          if (file_chunk_size (basis[k].file) != file_chunk_size (basis->file))
+            continue;
+          memcpy (all, basis[k].file->chunks, n * sizeof (file_chunk_t));
+          all += n;
+        }
+      chunks = ctx->bases;
     }
-  memset (table, 0, sizeof (arrow_id_t) * HASH_TABLE_SIZE);
+  sync_log (SYNC_FILE, "matching against %d of %d bases", joined, nbasis);
+  if (cb->threads > 1 && count > (size_t) joined
+      && sized && st.st_size >= SYNC_PARALLEL_MIN)
+    return sync_parallel (ctx, chunks, count, chunk_size, newfile, datafile, cb);
+  return sync_rolling (ctx, chunks, count, chunk_size, newfile, datafile, cb);
+}
 
-  if (cbuf_alloc (&buffer, chunk_size) != 0)
-	{
-	  free (table);
-	  return -1;
-	}
+/*
+ * A window onto sync_rolling's input. The file is read in large
+ * blocks, and added to the file's MD5 as it comes in; the buffer
+ * keeps everything from the first byte not yet emitted (last) on, so
+ * literal runs are emitted straight from it and never read twice.
+ */
+typedef struct sync_window_s
+{
+  FILE *in;
+  uint8_t *buf;
+  size_t size;     /**< Bytes allocated. */
+  size_t have;     /**< Bytes read into buf. */
+  size_t start;    /**< Where the rolling checksum's window begins. */
+  size_t last;     /**< First byte not yet emitted. */
+  off_t base;      /**< File offset of buf[0]. */
+  int eof;
+  const sync_fine_t *fine;
+  MD5_CTX md5;
+} sync_window_t;
 
-  i = 0;
-  while (basis->file->chunks[i].type != END_OF_CHUNKS)
+/*
+ * Read as much more of the input as fits. Whole chunks of literal
+ * bytes behind the rolling window are emitted first (the chunks they
+ * are cut into can't change any more), and what's left is moved down
+ * to the front of the buffer.
+ */
+static int
+window_fill (sync_window_t *w, int chunk_size, sync_batch_t *out)
+{
+  if (w->eof)
+    return 0;
+  w->last += emit_gap (w->buf + w->last, w->start - w->last, chunk_size, 0, 0,
+                       w->fine, out);
+  if (w->last > 0)
+    {
+      memmove (w->buf, w->buf + w->last, w->have - w->last);
+      w->base += w->last;
+      w->have -= w->last;
+      w->start -= w->last;
+      w->last = 0;
+    }
+  while (w->have < w->size)
     {
-      if (basis->file->chunks[i].type == REFERENCE
-		  && basis->file->chunks[i].chunk.ref.length == chunk_size)
-        hash_insert (table, &(basis->file->chunks[i].chunk.ref.ref));
-	  i++;
+      size_t got = fread (w->buf + w->have, 1, w->size - w->have, w->in);
+      if (got == 0)
+        {
+          if (ferror (w->in))
+            return -1;
+          w->eof = 1;
+          break;
+        }
+      MD5_Update (&w->md5, w->buf + w->have, got);
+      w->have += got;
     }
+  return 0;
+}
+
+/*
+ * Chunk datafile into newfile, referring to the count chunks in basis
+ * (see match_build) and, with a probe_weak callback, any stored chunk
+ * of chunk_size bytes
+ * wherever they turn up, at any offset. Basis chunks shorter than
+ * chunk_size are only looked for between the others' matches.
+ */
+static int
+sync_rolling (sync_ctx_t *ctx, const file_chunk_t *basis, size_t count,
+              int chunk_size, file_t *newfile, FILE *datafile,
+              sync_callbacks_t *cb)
+{
+  match_table_t table;
+  sync_fine_t fine;
+  int expect = -1;
+  sync_window_t w;
+  arrow_id_t current;
+  Rollsum runsum;
+  sync_batch_t *out;
+  size_t cs = chunk_size;
+  int matches = 0;
+
+  if (match_build (&table, ctx, basis, count, chunk_size, &fine) != 0)
+    return -1;
+
+  memset (&w, 0, sizeof (w));
+  w.in = datafile;
+  w.fine = &fine;
+  w.size = MAX (SYNC_WINDOW_SIZE, (size_t) chunk_size * 4);
+  w.base = ftello (datafile);
+  if (ctx_reserve ((void **) &ctx->window, &ctx->window_size, w.size) != 0)
+    return -1;
+  w.buf = ctx->window;
+  if ((out = batch_begin (ctx, cb)) == NULL)
+    return -1;
+  MD5_Init (&w.md5);
 
   newfile->file->chunk_size = chunk_size;
-  uuid_copy (newfile->file->previous, basis->uuid);
 
-/*   fseek (out, sizeof (file_info_t), SEEK_SET); */
-  bufsize = fread (buffer.buffer, 1, chunk_size, datafile);
-  if (bufsize < 0)
-	{
-	  free (table);
-	  cbuf_free (&buffer);
-	  return -1;
-	}
-  MD5_Update (&md5, buffer.buffer, bufsize);
-  if (bufsize < chunk_size) /* File is smaller than a chunk. */
-    {
-	  sync_log (SYNC_FILE, "file size %d is smaller than chunk size %d",
-				bufsize, chunk_size);
-	  if (bufsize <= MAX_DIRECT_CHUNK_SIZE)
+  if (window_fill (&w, chunk_size, out) != 0)
+    return -1;
+
+  if (w.have >= cs)
+    {
+      RollsumInit (&runsum);
+      RollsumUpdate (&runsum, w.buf, chunk_size);
+    }
+  else
+    {
+      sync_log (SYNC_FILE, "file size %zu is smaller than chunk size %d",
+                w.have, chunk_size);
+    }
+
+  while (w.have - w.start >= cs)
+    {
+      int global = 0;
+      int found = -1;
+      current.weak = RollsumDigest (&runsum);
+      if ((expect >= 0 && basis[expect].chunk.ref.ref.weak == current.weak)
+          || match_probe (&table, current.weak) >= 0
+          || (global = probe_global (out, current.weak, chunk_size)))
         {
-		  sync_log (SYNC_FILE, "DIRECT chunk of %d bytes", bufsize);
-		  /* note: struct naming is awful here. */
-          chunk.type = DIRECT_CHUNK;
-          chunk.chunk.data.length = MIN(bufsize, MAX_DIRECT_CHUNK_SIZE);
-          memcpy (chunk.chunk.data.data, buffer.buffer, chunk.chunk.data.length);
-		  cb->emit_chunk (cb->state, &chunk);
-/*           fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
+          sync_log (SYNC_FILE, "probe found %u; trying strong sum...", current.weak);
+          arrow_hash (cb->hash, w.buf + w.start, chunk_size, current.strong);
+          /* The basis chunk after the last one matched, any other
+             chunk of the basis file's, or failing that, any stored
+             chunk. */
+          if (expect >= 0 && arrow_id_cmp (&basis[expect].chunk.ref.ref, &current) == 0)
+            found = expect;
+          else
+            found = match_find (&table, &current, chunk_size);
+          if (found >= 0
+              || ((global || probe_global (out, current.weak, chunk_size))
+                  && batch_contains (out, &current)))
+            {
+              matches++;
+              /* Unchanged stretches match basis chunks in order, so
+                 try the next one first. */
+              expect = -1;
+              if (found >= 0 && basis[found + 1].type == REFERENCE
+                  && basis[found + 1].chunk.ref.length == cs)
+                expect = found + 1;
+              sync_log (SYNC_FILE, "key FOUND at %lld; copy bytes %lld to %lld",
+                        (long long) (w.base + w.start), (long long) (w.base + w.last),
+                        (long long) (w.base + w.start));
+
+              /* Record bytes before this (if any), then the match. */
+              emit_gap (w.buf + w.last, w.start - w.last, chunk_size, 1, 0, &fine, out);
+              emit_reference (&current, chunk_size, out);
+
+              /* Start again past the block we just matched. */
+              w.start += chunk_size;
+              w.last = w.start;
+              if (w.have - w.start < cs
+                  && window_fill (&w, chunk_size, out) != 0)
+                return -1;
+              if (w.have - w.start < cs)
+                break;
+              RollsumInit (&runsum);
+              RollsumUpdate (&runsum, w.buf + w.start, chunk_size);
+              continue;
+            }
         }
-	  else
-		{
-		  sync_log (SYNC_FILE, "REFERENCE chunk of %d bytes", bufsize);
-		  arrow_compute_key (&current, buffer.buffer, bufsize);
-		  chunk.type = REFERENCE;
-		  chunk.chunk.ref.length = bufsize;
-		  memcpy (&(chunk.chunk.ref.ref), &current, sizeof (arrow_id_t));
-		  cb->emit_chunk (cb->state, &chunk);
-/* 		  fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-		  if (cb->store_contains (cb->state, &current))
-			cb->add_ref (cb->state, &current);
-		  else
-			cb->put_block (cb->state, &current, buffer.buffer, bufsize);
-		}
-
-	  memset (&chunk, 0, sizeof (file_chunk_t));
-	  chunk.type = END_OF_CHUNKS;
-	  cb->emit_chunk (cb->state, &chunk);
-/* 	  fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-      MD5_Final (newfile->file->hash, &md5);
-	  free (table);
-	  cbuf_free (&buffer);
-/* 	  fclose (out); */
+
+      /* Slide the window one byte. */
+      if (w.have - w.start == cs)
+        {
+          if (window_fill (&w, chunk_size, out) != 0)
+            return -1;
+          if (w.have - w.start == cs)
+            break;
+        }
+      RollsumRotate (&runsum, w.buf[w.start], w.buf[w.start + chunk_size]);
+      w.start++;
+    }
+
+  sync_log (SYNC_FILE, "matched %d chunks", matches);
+
+  /* Everything's been read; whatever wasn't matched is literal. */
+  sync_log (SYNC_FILE, "handling %zu trailing bytes", w.have - w.last);
+  emit_gap (w.buf + w.last, w.have - w.last, chunk_size, 1, 0, &fine, out);
+
+  MD5_Final (newfile->file->hash, &w.md5);
+  return batch_end (out);
+}
+
+/*
+ * Whether the n bufs[i], of lens[i] bytes, hash to the keys of the
+ * basis chunks they're meant to be copies of.
+ */
+static int
+append_check (arrow_hash_t hash, const void **bufs, const size_t *lens,
+              const file_chunk_t **want, int n)
+{
+  arrow_id_t ids[SYNC_BATCH];
+  int i;
+
+  arrow_compute_keys_with (hash, ids, bufs, lens, n);
+  for (i = 0; i < n; i++)
+    if (arrow_id_cmp (&ids[i], &want[i]->chunk.ref.ref) != 0)
       return 0;
+  return 1;
+}
+
+/*
+ * Logs and journals only ever grow. If datafile is basis's data with
+ * more after it, emit basis's chunks as they are and chunk only what
+ * was added. The old chunks are checked where they were, SYNC_BATCH
+ * at a time with the multi-buffer hash, instead of being looked for
+ * at every offset. A short last chunk is cut again along with the new
+ * data, so that each append doesn't leave one behind. Returns 1, with
+ * datafile back where it was, if this isn't an append; the check
+ * stops at the first chunk that differs.
+ */
+static int
+sync_append (sync_ctx_t *ctx, const file_chunk_t *basis, int chunk_size,
+             file_t *newfile, FILE *datafile, sync_callbacks_t *cb)
+{
+  const void *bufs[SYNC_BATCH];
+  size_t lens[SYNC_BATCH];
+  const file_chunk_t *want[SYNC_BATCH];
+  size_t keep = chunk_count (basis);
+  sync_fine_t fine;
+  sync_window_t w;
+  sync_batch_t *out;
+  off_t begin = ftello (datafile);
+  size_t i = 0;
+  int n = 0;
+
+  if (keep > 0 && chunk_length (&basis[keep - 1]) < (size_t) chunk_size)
+    keep--;
+
+  memset (&w, 0, sizeof (w));
+  fine.count = 0;
+  w.in = datafile;
+  w.fine = &fine;
+  w.size = MAX (SYNC_WINDOW_SIZE, (size_t) chunk_size * 4);
+  w.base = begin;
+  if (ctx_reserve ((void **) &ctx->window, &ctx->window_size, w.size) != 0)
+    return -1;
+  w.buf = ctx->window;
+  if ((out = batch_begin (ctx, cb)) == NULL)
+    return -1;
+  MD5_Init (&w.md5);
+
+  /* Nothing is behind the window until the check is done, so filling
+     it only moves what's left down and reads more. */
+  while (i < keep)
+    {
+      size_t len = chunk_length (&basis[i]);
+
+      if (w.have - w.start < len)
+        {
+          /* The chunks waiting to be checked are about to move. */
+          if (n > 0 && !append_check (cb->hash, bufs, lens, want, n))
+            goto differs;
+          n = 0;
+          if (w.eof)
+            goto differs;
+          w.last = w.start;
+          if (window_fill (&w, chunk_size, out) != 0)
+            return -1;
+          continue;
+        }
+      if (basis[i].type == DIRECT_CHUNK)
+        {
+          if (memcmp (w.buf + w.start, basis[i].chunk.data.data, len) != 0)
+            goto differs;
+        }
+      else
+        {
+          bufs[n] = w.buf + w.start;
+          lens[n] = len;
+          want[n++] = &basis[i];
+        }
+      w.start += len;
+      i++;
+      if (n == SYNC_BATCH)
+        {
+          if (!append_check (cb->hash, bufs, lens, want, n))
+            goto differs;
+          n = 0;
+        }
+    }
+  if (n > 0 && !append_check (cb->hash, bufs, lens, want, n))
+    goto differs;
+
+  sync_log (SYNC_FILE, "appended to; keeping %zu chunks", keep);
+  ctx->appends++;
+  newfile->file->chunk_size = chunk_size;
+  for (i = 0; i < keep; i++)
+    {
+      if (basis[i].type == DIRECT_CHUNK)
+        batch_record (out, &basis[i]);
+      else
+        emit_reference (&basis[i].chunk.ref.ref, basis[i].chunk.ref.length, out);
+    }
+
+  /* The rest is new, though it may still have stored chunks in it. */
+  w.last = w.start;
+  while (!w.eof)
+    {
+      w.last += emit_gap (w.buf + w.last, w.have - w.last, chunk_size, 0, 1,
+                          &fine, out);
+      w.start = w.last;
+      if (window_fill (&w, chunk_size, out) != 0)
+        return -1;
+    }
+  emit_gap (w.buf + w.last, w.have - w.last, chunk_size, 1, 1, &fine, out);
+
+  MD5_Final (newfile->file->hash, &w.md5);
+  return batch_end (out);
+
+ differs:
+  sync_log (SYNC_FILE, "not an append; chunk %zu differs", i);
+  if (fseeko (datafile, begin, SEEK_SET) != 0)
+    return -1;
+  return 1;
+}
+
+/*
+ * sync_parallel splits what it reads into one region per thread, and
+ * each thread runs the rolling match over its own region as if the
+ * scan started there. A region's matches are right from the first
+ * offset the serial scan would also look at, so stitching them
+ * together only means rescanning, from where the region before left
+ * off, up to the first such offset; that is seldom more than a chunk.
+ * The threads match the basis's whole chunks only. Its short chunks,
+ * and stored chunks from other files, are looked for in what's left,
+ * on the calling thread, since that's the only one the callbacks may
+ * be called from.
+ */
+typedef struct sync_match_s
+{
+  size_t offset;      /**< Where in the buffer the match starts. */
+  uint32_t chunk;     /**< Index in the basis. */
+} sync_match_t;
+
+typedef struct sync_region_s
+{
+  size_t begin;       /**< The first offset scanned. */
+  size_t end;         /**< The offset to scan up to. */
+  size_t next;        /**< The offset the scan stopped at. */
+  sync_match_t *matches;
+  size_t count;
+  size_t alloc;
+  int failed;
+} sync_region_t;
+
+typedef struct sync_scan_s
+{
+  const file_chunk_t *basis;
+  const match_table_t *table;
+  arrow_hash_t hash;
+  size_t chunk_size;
+  const uint8_t *buf;
+  size_t have;        /**< Bytes in buf. */
+  sync_region_t *regions;
+  int nregions;
+  int next;           /**< The next region a thread will take. */
+} sync_scan_t;
+
+/*
+ * The basis chunk that the chunk_size bytes at p, with weak sum weak,
+ * are a copy of, or -1. *expect is the chunk to try first, and is
+ * moved past any match.
+ */
+static int
+scan_match (const sync_scan_t *s, const uint8_t *p, uint32_t weak, int *expect)
+{
+  const file_chunk_t *basis = s->basis;
+  arrow_id_t id;
+  int found;
+
+  if (!(*expect >= 0 && basis[*expect].chunk.ref.ref.weak == weak)
+      && match_probe (s->table, weak) < 0)
+    return -1;
+  id.weak = weak;
+  arrow_hash (s->hash, p, s->chunk_size, id.strong);
+  if (*expect >= 0 && arrow_id_cmp (&basis[*expect].chunk.ref.ref, &id) == 0)
+    found = *expect;
+  else
+    found = match_find (s->table, &id, s->chunk_size);
+  if (found >= 0)
+    {
+      *expect = -1;
+      if (basis[found + 1].type == REFERENCE
+          && basis[found + 1].chunk.ref.length == s->chunk_size)
+        *expect = found + 1;
+    }
+  return found;
+}
+
+static int
+scan_add (sync_region_t *r, size_t offset, int chunk)
+{
+  if (r->count == r->alloc)
+    {
+      size_t alloc = r->alloc > 0 ? r->alloc * 2 : 64;
+      sync_match_t *m = (sync_match_t *) realloc (r->matches, alloc * sizeof (sync_match_t));
+      if (m == NULL)
+        return -1;
+      r->matches = m;
+      r->alloc = alloc;
     }
-  RollsumInit (&runsum);
-  RollsumUpdate (&runsum, buffer.buffer, bufsize);
+  r->matches[r->count].offset = offset;
+  r->matches[r->count].chunk = chunk;
+  r->count++;
+  return 0;
+}
+
+/* Run the rolling match over one region, as if starting at its beginning. */
+static void
+scan_region (const sync_scan_t *s, sync_region_t *r)
+{
+  size_t cs = s->chunk_size;
+  size_t p = r->begin;
+  int expect = -1;
+  Rollsum sum;
 
-  while (!feof (datafile))
+  r->count = 0;
+  if (p + cs <= s->have)
     {
-      if (hash_table_probe (table, RollsumDigest(&runsum)))
+      RollsumInit (&sum);
+      RollsumUpdate (&sum, s->buf + p, cs);
+    }
+  while (p < r->end && p + cs <= s->have)
+    {
+      int found = scan_match (s, s->buf + p, RollsumDigest (&sum), &expect);
+      if (found >= 0)
         {
-          off_t where = ftell (datafile);
-		  MD5_CTX blockmd;
-          current.weak = RollsumDigest(&runsum);
-		  sync_log (SYNC_FILE, "probe found %u; trying MD5...", current.weak);
-		  cbuf_md5 (&buffer, &blockmd, current.strong);
-          if (hash_table_contains (table, &current))
+          if (scan_add (r, p, found) != 0)
+            {
+              r->failed = 1;
+              break;
+            }
+          p += cs;
+          if (p + cs <= s->have)
             {
-              off_t cur = ftell (datafile);
+              RollsumInit (&sum);
+              RollsumUpdate (&sum, s->buf + p, cs);
+            }
+          continue;
+        }
+      if (p + cs < s->have)
+        RollsumRotate (&sum, s->buf[p], s->buf[p + cs]);
+      p++;
+    }
+  r->next = p;
+}
 
-			  matches++;
-			  sync_log (SYNC_FILE, "key FOUND at %lld; copy bytes %lld to %lld",
-						(long long) cur, (long long) last_match,
-						(long long) (cur - chunk_size));
+static void *
+scan_run (void *arg)
+{
+  sync_scan_t *s = (sync_scan_t *) arg;
+  int i;
 
-			  fseek (datafile, last_match, SEEK_SET);
+  while ((i = __sync_fetch_and_add (&s->next, 1)) < s->nregions)
+    scan_region (s, &s->regions[i]);
+  return NULL;
+}
 
-              /* Found a match. Record bytes before this (if any). */
-              if (last_match < cur - chunk_size)
-                {
-                  off_t l;
-                  for (l = last_match; l < cur - chunk_size; )
-                    {
-                      int n = MIN(cur - chunk_size - l, chunk_size);
-					  fread (buffer.buffer, 1, n, datafile);
-                      if (n <= MAX_DIRECT_CHUNK_SIZE)
-                        {
-						  sync_log (SYNC_FILE, "DIRECT chunk of %d bytes", n);
-                          /* Store some direct chunks. */
-						  chunk.type = DIRECT_CHUNK;
-						  chunk.chunk.data.length = n;
-						  memcpy (chunk.chunk.data.data, buffer.buffer,
-								  chunk.chunk.data.length);
-						  cb->emit_chunk (cb->state, &chunk);
-/* 						  fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-                        }
-                      else
-                        {
-                          /* Generate a chunk reference, store the chunk. */
-						  sync_log (SYNC_FILE, "REFERENCE chunk of %d bytes", n);
-						  arrow_compute_key (&current, buffer.buffer, n);
-						  chunk.type = REFERENCE;
-						  chunk.chunk.ref.length = n;
-						  memcpy (&(chunk.chunk.ref.ref), &current, sizeof (arrow_id_t));
-						  cb->emit_chunk (cb->state, &chunk);
-/* 						  fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-						  if (cb->store_contains (cb->state, &current))
-							cb->add_ref (cb->state, &current);
-						  else
-							cb->put_block (cb->state, &current, buffer.buffer, n);
-                        }
-					  l += n;
-                    }
-                }
+/*
+ * Join the regions' matches into what one scan from the start of the
+ * first would have found, leaving them in the first region. Returns
+ * the offset the scan stopped at.
+ */
+static size_t
+scan_stitch (const sync_scan_t *s)
+{
+  sync_region_t *out = &s->regions[0];
+  size_t cs = s->chunk_size;
+  size_t cur = out->next;
+  int expect = -1;
+  int rolling = 0;
+  Rollsum sum;
+  int k;
+
+  for (k = 1; k < s->nregions; k++)
+    {
+      sync_region_t *r = &s->regions[k];
+      size_t j = 0;
+
+      while (cur < r->end && cur + cs <= s->have)
+        {
+          int found;
 
-			  cbuf_reset (&buffer);
-
-			  sync_log (SYNC_FILE, "REFERENCE chunk of %d bytes", chunk_size);
-              /* Record the chunk reference. */
-              chunk.type = REFERENCE;
-              chunk.chunk.ref.length = bufsize;
-              memcpy (&(chunk.chunk.ref.ref), &current, sizeof (arrow_id_t));
-			  cb->emit_chunk (cb->state, &chunk);
-/*               fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-			  cb->add_ref (cb->state, &(chunk.chunk.ref.ref));
-
-			  /* Advance past the block we just matched. */
-			  fseek (datafile, chunk_size, SEEK_CUR);
-			  last_match = ftell (datafile);
-			  sync_log (SYNC_FILE, "last_match is %lld", (long long) last_match);
-
-              /* Read the next chunk, reset the weak sum. */
-			  bufsize = fread (buffer.buffer, 1, chunk_size, datafile);
-			  MD5_Update (&md5, buffer.buffer, bufsize);
-			  if (bufsize < chunk_size)
-				break;
-			  RollsumInit (&runsum);
-			  RollsumUpdate (&runsum, buffer.buffer, bufsize);
-			  continue;
+          while (j < r->count && r->matches[j].offset + cs <= cur)
+            j++;
+          if (j == r->count || r->matches[j].offset >= cur)
+            {
+              /* The region's own scan looked at cur; from here on,
+                 it's what the serial scan would have done. */
+              for (; j < r->count; j++)
+                if (scan_add (out, r->matches[j].offset, r->matches[j].chunk) != 0)
+                  out->failed = 1;
+              cur = MAX (cur, r->next);
+              rolling = 0;
+              break;
             }
-        }
 
-	  int c = getc_unlocked (datafile);
-	  if (c == -1)
-		{
-		  /* we're done here. */
-		  break;
-		}
-	  uint8_t cc = (uint8_t) c;
-	  RollsumRotate (&runsum, cbuf_get(&buffer, 0), (uint8_t) c);
-	  cbuf_addin (&buffer, cc);
+          /* cur is inside one of the region's matches, so the region
+             never looked at it; look now. */
+          if (!rolling)
+            {
+              RollsumInit (&sum);
+              RollsumUpdate (&sum, s->buf + cur, cs);
+              rolling = 1;
+            }
+          found = scan_match (s, s->buf + cur, RollsumDigest (&sum), &expect);
+          if (found >= 0)
+            {
+              if (scan_add (out, cur, found) != 0)
+                out->failed = 1;
+              cur += cs;
+              rolling = 0;
+              continue;
+            }
+          if (cur + cs < s->have)
+            {
+              RollsumRotate (&sum, s->buf[cur], s->buf[cur + cs]);
+            }
+          else
+            rolling = 0;
+          cur++;
+        }
     }
+  return cur;
+}
 
-  sync_log (SYNC_FILE, "matched %d chunks", matches);
+/*
+ * sync_rolling, with the scan for basis chunks spread over
+ * cb->threads threads. The basis matches found are the same; stored
+ * chunks from other files are only found between them.
+ */
+static int
+sync_parallel (sync_ctx_t *ctx, const file_chunk_t *basis, size_t count,
+               int chunk_size, file_t *newfile, FILE *datafile,
+               sync_callbacks_t *cb)
+{
+  match_table_t table;
+  sync_fine_t fine;
+  sync_scan_t scan;
+  sync_window_t w;
+  pthread_t *tids = NULL;
+  sync_batch_t *out;
+  int threads = MIN (cb->threads, SYNC_THREADS_MAX);
+  size_t cs = chunk_size;
+  size_t matches = 0, m;
+  int i, started;
 
-  {
-	off_t cur = ftell (datafile);
-	if (last_match < cur)
-	  {
-		sync_log (SYNC_FILE, "handling %lld trailing bytes",
-				  (long long) (cur - last_match));
-		off_t l;
-		file_chunk_t chunk;
-		fseek (datafile, last_match, SEEK_SET);
-		for (l = last_match; l < cur; )
-		  {
-			int n = MIN(cur - l, chunk_size);
-			fread (buffer.buffer, 1, n, datafile);
-			if (n <= MAX_DIRECT_CHUNK_SIZE)
-			  {
-				sync_log (SYNC_FILE, "DIRECT chunk of %d bytes", n);
-				/* Store some direct chunks. */
-				chunk.type = DIRECT_CHUNK;
-				chunk.chunk.data.length = n;
-				memcpy (chunk.chunk.data.data, buffer.buffer,
-						chunk.chunk.data.length);
-				cb->emit_chunk (cb->state, &chunk);
-/* 				fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-			  }
-			else
-			  {
-				sync_log (SYNC_FILE, "REFERENCE chunk of %d bytes", n);
-				/* Generate a chunk reference, store the chunk. */
-				arrow_compute_key (&current, buffer.buffer, n);
-				chunk.type = REFERENCE;
-				chunk.chunk.ref.length = n;
-				memcpy (&(chunk.chunk.ref.ref), &current, sizeof (arrow_id_t));
-				cb->emit_chunk (cb->state, &chunk);
-/* 				fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-				if (cb->store_contains (cb->state, &current))
-				  cb->add_ref (cb->state, &current);
-				else
-				  cb->put_block (cb->state, &current, buffer.buffer, n);
-			  }
-			l += n;
-		  }
-	  }
-  }
-
-  MD5_Final (newfile->file->hash, &md5);
+  if (match_build (&table, ctx, basis, count, chunk_size, &fine) != 0)
+    return -1;
 
-  memset (&chunk, 0, sizeof (file_chunk_t));
-  chunk.type = END_OF_CHUNKS;
-  cb->emit_chunk (cb->state, &chunk);
-/*   fwrite (&chunk, sizeof (file_chunk_t), 1, out); */
-/*   fflush (out); */
-/*   fclose (out); */
-  free (table);
-  cbuf_free (&buffer);
+  memset (&w, 0, sizeof (w));
+  w.in = datafile;
+  w.fine = &fine;
+  w.size = MAX ((size_t) threads * SYNC_REGION_SIZE, (size_t) chunk_size * 4);
+  w.base = ftello (datafile);
+  memset (&scan, 0, sizeof (scan));
+  if (ctx_reserve ((void **) &ctx->window, &ctx->window_size, w.size) != 0)
+    return -1;
+  w.buf = ctx->window;
+  if ((out = batch_begin (ctx, cb)) == NULL)
+    return -1;
+  scan.regions = (sync_region_t *) calloc (threads, sizeof (sync_region_t));
+  tids = (pthread_t *) malloc (threads * sizeof (pthread_t));
+  if (scan.regions == NULL || tids == NULL)
+    goto fail;
+  MD5_Init (&w.md5);
 
-  return 0;
+  scan.basis = basis;
+  scan.table = &table;
+  scan.hash = cb->hash;
+  scan.chunk_size = chunk_size;
+  newfile->file->chunk_size = chunk_size;
+
+  for (;;)
+    {
+      size_t limit, span;
+      sync_region_t *found = &scan.regions[0];
+
+      if (window_fill (&w, chunk_size, out) != 0)
+        goto fail;
+      if (w.have - w.start < cs)
+        break;
+
+      /* Every offset with a whole chunk after it gets scanned. */
+      limit = w.have - cs + 1;
+      span = (limit - w.start + threads - 1) / threads;
+      scan.buf = w.buf;
+      scan.have = w.have;
+      scan.nregions = 0;
+      scan.next = 0;
+      for (i = 0; i < threads && w.start + i * span < limit; i++)
+        {
+          scan.regions[i].begin = w.start + i * span;
+          scan.regions[i].end = MIN (limit, w.start + (i + 1) * span);
+          scan.nregions++;
+        }
+
+      for (started = 0; started < scan.nregions - 1; started++)
+        if (pthread_create (&tids[started], NULL, scan_run, &scan) != 0)
+          break;
+      scan_run (&scan);
+      for (i = 0; i < started; i++)
+        pthread_join (tids[i], NULL);
+
+      w.start = scan_stitch (&scan);
+      for (i = 0; i < scan.nregions; i++)
+        if (scan.regions[i].failed)
+          {
+            errno = ENOMEM;
+            goto fail;
+          }
+
+      for (m = 0; m < found->count; m++)
+        {
+          size_t at = found->matches[m].offset;
+          emit_gap (w.buf + w.last, at - w.last, chunk_size, 1, 1, &fine, out);
+          emit_reference (&basis[found->matches[m].chunk].chunk.ref.ref, chunk_size, out);
+          w.last = at + chunk_size;
+        }
+      matches += found->count;
+      sync_log (SYNC_FILE, "matched %zu chunks in %d regions", found->count, scan.nregions);
+
+      /* Leave what might still be part of a match for later. */
+      w.last += emit_gap (w.buf + w.last, w.start - w.last, chunk_size, 0, 1, &fine, out);
+      if (w.eof)
+        break;
+    }
+
+  sync_log (SYNC_FILE, "matched %zu chunks", matches);
+  emit_gap (w.buf + w.last, w.have - w.last, chunk_size, 1, 1, &fine, out);
+
+  MD5_Final (newfile->file->hash, &w.md5);
+  for (i = 0; i < threads; i++)
+    free (scan.regions[i].matches);
+  free (scan.regions);
+  free (tids);
+  return batch_end (out);
+
+ fail:
+  arrow_push_errno ();
+  if (scan.regions != NULL)
+    for (i = 0; i < threads; i++)
+      free (scan.regions[i].matches);
+  free (scan.regions);
+  free (tids);
+  arrow_pop_errno ();
+  return -1;
 }
 
 int
 sync_store_add_ref (void *baton, const arrow_id_t *id)
 {
   store_state_t *state = ((sync_store_state_t *) baton)->store;
-  return store_addref (state, id);
+  return store_addref_deferred (state, id);
 }
 
 int
@@ -511,12 +1989,88 @@ sync_store_contains (void *baton, const arrow_id_t *id)
   return store_contains (state, id);
 }
 
+int
+sync_store_probe_weak (void *baton, uint32_t weak, uint32_t length)
+{
+  store_state_t *state = ((sync_store_state_t *) baton)->store;
+  return store_weak_probe (state, weak, length);
+}
+
+/* Write count chunk records at the file's current end. */
+static int
+store_write_chunks (sync_store_state_t *state, const file_chunk_t *chunks, size_t count)
+{
+  const uint8_t *p = (const uint8_t *) chunks;
+  size_t len = count * sizeof (file_chunk_t);
+
+  while (len > 0)
+    {
+      ssize_t ret = pwrite (state->chunks_fd, p, len, state->chunks_off);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      p += ret;
+      len -= ret;
+      state->chunks_off += ret;
+    }
+  return 0;
+}
+
 int
 sync_store_emit_chunk (void *baton, const file_chunk_t *chunk)
 {
-  FILE *out = ((sync_store_state_t *) baton)->chunks_out;
-  if (fwrite (chunk, sizeof (file_chunk_t), 1, out) != 1)
-	return -1;
+  sync_store_state_t *state = (sync_store_state_t *) baton;
+  int n;
+
+  memcpy (&state->pending[state->npending++], chunk, sizeof (file_chunk_t));
+  if (state->npending < SYNC_STORE_PENDING && chunk->type != END_OF_CHUNKS)
+    return 0;
+  n = state->npending;
+  state->npending = 0;
+  return store_write_chunks (state, state->pending, n);
+}
+
+int
+sync_store_contains_many (void *baton, const arrow_id_t *ids, size_t count, uint8_t *has)
+{
+  store_state_t *state = ((sync_store_state_t *) baton)->store;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    has[i] = store_contains (state, &ids[i]) != 0;
+  return 0;
+}
+
+int
+sync_store_put_blocks (void *baton, const arrow_id_t *ids, const void *const *bufs,
+                       const size_t *lens, size_t count)
+{
+  store_state_t *state = ((sync_store_state_t *) baton)->store;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    if (store_put (state, &ids[i], bufs[i], lens[i]) < 0)
+      return -1;
+  return 0;
+}
+
+int
+sync_store_add_refs (void *baton, const arrow_id_t *ids, size_t count)
+{
+  store_state_t *state = ((sync_store_state_t *) baton)->store;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    if (store_addref_deferred (state, &ids[i]) < 0)
+      return -1;
   return 0;
 }
 
+int
+sync_store_emit_chunks (void *baton, const file_chunk_t *chunks, size_t count)
+{
+  return store_write_chunks ((sync_store_state_t *) baton, chunks, count);
+}
@@ -25,32 +25,150 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 #define __SYNC_H__
 
 #include <stdio.h>
+#include <sys/types.h>
 #include <fileinfo.h>
 #include <store.h>
 
+/**
+ * Callbacks that take many chunks at a time, so that a backend can
+ * pipeline its requests, or coalesce them. sync_generate and sync_file
+ * gather up to SYNC_BATCH_CHUNKS chunk records, or SYNC_BATCH_BYTES of
+ * new chunk data, and pass each batch on with contains_many, then
+ * put_blocks, add_refs and emit_chunks.
+ *
+ * The arrays passed are only good until the call returns. A backend
+ * may finish the work later, once it has copied what it needs, so long
+ * as it's done by the time complete returns. Callbacks return -1 on
+ * failure; a chunk the store already had, which put_block returns 1
+ * for, is not one.
+ */
+typedef struct sync_batch_callbacks_s
+{
+  /** Set has[i] to whether the store has ids[i], for i < count. */
+  int (*contains_many) (void *state, const arrow_id_t *ids, size_t count, uint8_t *has);
+  /** Store count new chunks, of lens[i] bytes at bufs[i]. */
+  int (*put_blocks) (void *state, const arrow_id_t *ids, const void *const *bufs,
+                     const size_t *lens, size_t count);
+  /** Take a reference on count chunks the store has. */
+  int (*add_refs) (void *state, const arrow_id_t *ids, size_t count);
+  /** Append count chunk records to the file. */
+  int (*emit_chunks) (void *state, const file_chunk_t *chunks, size_t count);
+  /** Optional: called after the batch ending in END_OF_CHUNKS, to wait
+      for any work still outstanding. */
+  int (*complete) (void *state);
+} sync_batch_callbacks_t;
+
+#define SYNC_BATCH_CHUNKS 256
+#define SYNC_BATCH_BYTES (1 << 20)
+
+/* Each thread gets its own input buffers, which a context keeps, so
+   only so many are used however many CPUs there are. */
+#define SYNC_THREADS_MAX 8
+
+/**
+ * Callbacks that take one chunk at a time. These return -1 on failure,
+ * and put_block may return 1 if the store already had the chunk.
+ */
 typedef struct sync_callbacks_s
 {
   int (*add_ref) (void *state, const arrow_id_t *id);
   int (*put_block) (void *state, const arrow_id_t *id, const void *buf, size_t len);
   int (*store_contains) (void *state, const arrow_id_t *id);
   int (*emit_chunk) (void *state, const file_chunk_t *chunk);
+  /** Optional: whether the store might have a chunk of this length
+      with this weak sum. If set, sync matches against every stored
+      chunk, not just the basis file's; except that sync_generate, given
+      threads and a file big enough to cut on them, finds stored chunks
+      only where its own cuts fall. */
+  int (*probe_weak) (void *state, uint32_t weak, uint32_t length);
+  /** The strong hash the store keys chunks with; see store_hash. */
+  arrow_hash_t hash;
+  /** How to cut new files and new versions into chunks. With
+      FILE_CHUNKING_CDC, sync_file chunks the new version the same way
+      sync_generate would, and relies on the store to find the chunks
+      it already has. */
+  file_chunking_t chunking;
+  /** How many threads sync_generate may hash, or sync_file scan, a
+      large file on; 0 or 1 keeps to the calling thread, and more than
+      SYNC_THREADS_MAX is taken as that many. The callbacks are only
+      ever called from the calling thread either way. */
+  int threads;
+  /** Optional: if set, sync calls these rather than add_ref,
+      put_block, store_contains and emit_chunk, which may then be
+      NULL. They get the same state. */
+  const sync_batch_callbacks_t *batch;
   void *state;
 } sync_callbacks_t;
 
-int sync_generate (file_t *file, FILE *input, sync_callbacks_t *cb);
-int sync_file (file_t *basis, file_t *newfile, FILE *data, sync_callbacks_t *cb, int *hash_match);
+/**
+ * Buffers sync_generate and sync_file keep from one file to the next,
+ * so that once they've grown to fit, syncing another file allocates
+ * nothing. A context may only be used by one thread at a time; give
+ * each thread its own. The sync functions take NULL to mean a fresh
+ * context for just that call.
+ */
+typedef struct sync_ctx_s
+{
+  uint32_t *tags;                 /**< The basis match table. */
+  struct match_entry_s *entries;
+  size_t slots;                   /**< Slots allocated in the table. */
+  file_chunk_t *bases;            /**< Several bases' chunks, joined. */
+  size_t bases_size;
+  uint8_t *window;                /**< Input buffer for matching. */
+  size_t window_size;
+  struct sync_segment_s *segs;    /**< Input buffers for chunking. */
+  int nsegs;
+  size_t seg_size;                /**< Bytes allocated per segment. */
+  size_t seg_chunks;              /**< Chunks allocated per segment. */
+  struct sync_batch_s *batch;     /**< Chunks not yet passed on. */
+  size_t appends;                 /**< Files sync_file found had only
+                                       grown, and chunked just the end of. */
+} sync_ctx_t;
+
+void sync_ctx_init (sync_ctx_t *ctx);
+void sync_ctx_destroy (sync_ctx_t *ctx);
+
+int sync_generate (sync_ctx_t *ctx, file_t *file, FILE *input, sync_callbacks_t *cb);
+
+/**
+ * Sync data into newfile as the next version of basis[0], referring to
+ * chunks of any of the nbasis files in basis (older versions, say, or
+ * similar files) wherever they turn up. Unless cb->chunking is CDC,
+ * the new version is cut into chunks of basis[0]'s size, and the other
+ * bases are only searched if their chunks are that size too. If
+ * *hash_match is nonzero on entry, data is first compared with
+ * basis[0] as a whole, and if it's the same, nothing is emitted and
+ * *hash_match is left at 1. If data is basis[0]'s with more after it,
+ * only what was added is chunked, and ctx->appends is counted up.
+ */
+int sync_file (sync_ctx_t *ctx, file_t *basis, int nbasis, file_t *newfile,
+               FILE *data, sync_callbacks_t *cb, int *hash_match);
 
 /* Callback functions that directly insert into a local store. */
 
+#define SYNC_STORE_PENDING 128
+
 typedef struct sync_store_state_s
 {
   store_state_t *store;
-  FILE *chunks_out;
+  int chunks_fd;        /**< Where sync_store_emit_chunk writes chunks, */
+  off_t chunks_off;     /**< starting here. */
+  /** Chunks not yet written; they go out when this fills, and at the
+      end of the file. */
+  file_chunk_t pending[SYNC_STORE_PENDING];
+  int npending;
 } sync_store_state_t;
 
 int sync_store_add_ref (void *state, const arrow_id_t *id);
 int sync_store_put_block (void *state, const arrow_id_t *id, const void *buf, size_t len);
 int sync_store_contains (void *state, const arrow_id_t *id);
 int sync_store_emit_chunk (void *state, const file_chunk_t *chunk);
+int sync_store_probe_weak (void *state, uint32_t weak, uint32_t length);
+
+int sync_store_contains_many (void *state, const arrow_id_t *ids, size_t count, uint8_t *has);
+int sync_store_put_blocks (void *state, const arrow_id_t *ids, const void *const *bufs,
+                           const size_t *lens, size_t count);
+int sync_store_add_refs (void *state, const arrow_id_t *ids, size_t count);
+int sync_store_emit_chunks (void *state, const file_chunk_t *chunks, size_t count);
 
 #endif /* __SYNC_H__ */
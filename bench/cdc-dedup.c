@@ -0,0 +1,281 @@
+/* cdc-dedup.c -- dedup ratio and speed of content-defined against fixed chunking
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arrow.h>
+#include <cdc.h>
+
+/*
+ * Chunk a corpus of successive versions of a file both ways, and
+ * report how much of it deduplicates and how fast chunking goes.
+ *
+ *   cdc-dedup [-s FIXED] [FILE...]
+ *
+ * The files are taken as versions of one file, in order. With none, a
+ * 16 MB file is generated and then edited eight times, each edit
+ * inserting, deleting or overwriting a few runs of bytes, as a backup
+ * of a slowly changing file would see. Fixed-size chunks are FIXED
+ * bytes (default CDC_AVG_CHUNK_SIZE).
+ *
+ * The dedup ratio is the corpus size over the bytes of unique chunks.
+ * Cut speed is for finding the boundaries alone; keyed speed includes
+ * computing each chunk's key, as sync does.
+ */
+
+#define GEN_SIZE (16 * 1024 * 1024)
+#define GEN_VERSIONS 9
+#define GEN_EDITS 16
+
+typedef struct version_s
+{
+  uint8_t *data;
+  size_t len;
+} version_t;
+
+/* Unique chunk keys, in an open addressing table. */
+typedef struct key_set_s
+{
+  arrow_key_t *keys;
+  uint8_t *used;
+  size_t size;
+  size_t count;
+} key_set_t;
+
+static uint32_t rng = 1;
+
+static uint32_t
+next_random (void)
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Add key to the set; returns nonzero if it wasn't there. */
+static int
+key_set_add (key_set_t *set, const arrow_key_t key)
+{
+  size_t i;
+
+  if ((set->count + 1) * 2 > set->size)
+    {
+      key_set_t bigger;
+      bigger.size = set->size ? set->size * 2 : 65536;
+      bigger.count = 0;
+      bigger.keys = (arrow_key_t *) malloc (bigger.size * sizeof (arrow_key_t));
+      bigger.used = (uint8_t *) calloc (bigger.size, 1);
+      for (i = 0; i < set->size; i++)
+        if (set->used[i])
+          key_set_add (&bigger, set->keys[i]);
+      free (set->keys);
+      free (set->used);
+      *set = bigger;
+    }
+  i = arrow_bytes_to_long (key) & (set->size - 1);
+  while (set->used[i])
+    {
+      if (memcmp (set->keys[i], key, sizeof (arrow_key_t)) == 0)
+        return 0;
+      i = (i + 1) & (set->size - 1);
+    }
+  memcpy (set->keys[i], key, sizeof (arrow_key_t));
+  set->used[i] = 1;
+  set->count++;
+  return 1;
+}
+
+static size_t
+fixed_cut (const uint8_t *buf, size_t len, size_t fixed)
+{
+  (void) buf;
+  return len < fixed ? len : fixed;
+}
+
+/* Chunk every version with CDC (fixed == 0) or fixed-size chunks. */
+static void
+run (const char *name, const version_t *versions, int count, size_t fixed)
+{
+  key_set_t set = { NULL, NULL, 0, 0 };
+  uint64_t total = 0, unique = 0, chunks = 0;
+  double t0, cut_time, key_time;
+  arrow_id_t id;
+  size_t off, n;
+  int v;
+
+  /* Boundaries alone. */
+  t0 = now ();
+  for (v = 0; v < count; v++)
+    for (off = 0; off < versions[v].len; off += n)
+      n = fixed ? fixed_cut (versions[v].data + off, versions[v].len - off, fixed)
+        : cdc_cut (versions[v].data + off, versions[v].len - off);
+  cut_time = now () - t0;
+
+  t0 = now ();
+  for (v = 0; v < count; v++)
+    for (off = 0; off < versions[v].len; off += n)
+      {
+        n = fixed ? fixed_cut (versions[v].data + off, versions[v].len - off, fixed)
+          : cdc_cut (versions[v].data + off, versions[v].len - off);
+        arrow_compute_key (&id, versions[v].data + off, n);
+        if (key_set_add (&set, id.strong))
+          unique += n;
+        total += n;
+        chunks++;
+      }
+  key_time = now () - t0;
+
+  printf ("%-6s %9llu %10.1f %8.3f %10.1f %10.1f\n", name,
+          (unsigned long long) chunks, (double) total / chunks,
+          unique > 0 ? (double) total / unique : 0.0,
+          total / cut_time / 1048576.0, total / key_time / 1048576.0);
+  free (set.keys);
+  free (set.used);
+}
+
+/* Make versions[v] from versions[v - 1] with a few edits. */
+static void
+edit_version (const version_t *from, version_t *to)
+{
+  size_t pos = 0, out = 0, at, len;
+  int e;
+
+  to->data = (uint8_t *) malloc (from->len + GEN_EDITS * 4096);
+  for (e = 0; e < GEN_EDITS; e++)
+    {
+      at = pos + next_random () % (from->len / GEN_EDITS);
+      if (at > from->len)
+        at = from->len;
+      memcpy (to->data + out, from->data + pos, at - pos);
+      out += at - pos;
+      pos = at;
+      len = 1 + next_random () % 2048;
+      switch (next_random () % 3)
+        {
+        case 0:  /* Insert. */
+          for (; len > 0; len--)
+            to->data[out++] = (uint8_t) next_random ();
+          break;
+        case 1:  /* Delete. */
+          pos += len < from->len - pos ? len : from->len - pos;
+          break;
+        default: /* Overwrite. */
+          for (; len > 0 && pos < from->len; len--, pos++)
+            to->data[out++] = (uint8_t) next_random ();
+        }
+    }
+  memcpy (to->data + out, from->data + pos, from->len - pos);
+  to->len = out + from->len - pos;
+}
+
+static int
+read_file (const char *path, version_t *v)
+{
+  FILE *f = fopen (path, "rb");
+  long len;
+
+  if (f == NULL || fseek (f, 0, SEEK_END) != 0 || (len = ftell (f)) < 0)
+    {
+      if (f != NULL)
+        fclose (f);
+      return -1;
+    }
+  rewind (f);
+  v->len = len;
+  v->data = (uint8_t *) malloc (len > 0 ? len : 1);
+  if (fread (v->data, 1, len, f) != (size_t) len)
+    {
+      fclose (f);
+      return -1;
+    }
+  fclose (f);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  version_t *versions;
+  size_t fixed = CDC_AVG_CHUNK_SIZE, i;
+  uint64_t total = 0;
+  int count, v, first = 1;
+
+  if (argc > 2 && strcmp (argv[1], "-s") == 0)
+    {
+      fixed = strtoul (argv[2], NULL, 0);
+      first = 3;
+    }
+  if (fixed == 0 || (argc > 1 && argv[1][0] == '-' && first == 1))
+    {
+      fprintf (stderr, "usage: %s [-s FIXED] [FILE...]\n", argv[0]);
+      return 2;
+    }
+
+  count = argc > first ? argc - first : GEN_VERSIONS;
+  versions = (version_t *) calloc (count, sizeof (version_t));
+  if (argc > first)
+    {
+      for (v = 0; v < count; v++)
+        if (read_file (argv[first + v], &versions[v]) != 0)
+          {
+            fprintf (stderr, "%s: %s\n", argv[first + v], strerror (errno));
+            return 1;
+          }
+    }
+  else
+    {
+      versions[0].len = GEN_SIZE;
+      versions[0].data = (uint8_t *) malloc (GEN_SIZE);
+      for (i = 0; i < GEN_SIZE; i++)
+        versions[0].data[i] = (uint8_t) next_random ();
+      for (v = 1; v < count; v++)
+        edit_version (&versions[v - 1], &versions[v]);
+    }
+  for (v = 0; v < count; v++)
+    total += versions[v].len;
+
+  printf ("# %d versions, %llu bytes; CDC chunks %d to %d bytes, fixed %zu\n",
+          count, (unsigned long long) total, CDC_MIN_CHUNK_SIZE,
+          CDC_MAX_CHUNK_SIZE, fixed);
+  printf ("%-6s %9s %10s %8s %10s %10s\n", "mode", "chunks", "mean-len",
+          "dedup", "cut-MB/s", "keyed-MB/s");
+  run ("cdc", versions, count, 0);
+  run ("fixed", versions, count, fixed);
+
+  for (v = 0; v < count; v++)
+    free (versions[v].data);
+  free (versions);
+  return 0;
+}
@@ -0,0 +1,137 @@
+/* hash-speed.c -- cycles per byte of the strong hashes
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <hash.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Time each strong hash a store can key its chunks with, one buffer at
+ * a time and in batches through arrow_hash_many, over a range of
+ * buffer sizes around what sync's chunks come to.
+ *
+ *   hash-speed [MB]
+ *
+ * Each line hashes about MB megabytes (default 256) of generated data.
+ * Cycles are read from the time stamp counter where there is one, so
+ * they are reference cycles; elsewhere only MB/s is given.
+ */
+
+#define BATCH 16
+
+static const size_t sizes[] = { 64, 512, 2048, 8192, 65536, 1048576 };
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+cycles (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc ();
+#else
+  return 0;
+#endif
+}
+
+static void
+run (arrow_hash_t hash, int batched, const uint8_t *data, size_t size,
+     size_t total)
+{
+  const void *bufs[BATCH];
+  size_t lens[BATCH];
+  arrow_key_t digests[BATCH];
+  size_t rounds = total / (size * BATCH) + 1, r, i;
+  uint64_t c0, c1;
+  double t0, t1, bytes = (double) rounds * size * BATCH;
+
+  for (i = 0; i < BATCH; i++)
+    {
+      bufs[i] = data + i * size;
+      lens[i] = size;
+    }
+  t0 = now ();
+  c0 = cycles ();
+  for (r = 0; r < rounds; r++)
+    {
+      if (batched)
+        arrow_hash_many (hash, bufs, lens, BATCH, digests);
+      else
+        for (i = 0; i < BATCH; i++)
+          arrow_hash (hash, bufs[i], lens[i], digests[i]);
+    }
+  c1 = cycles ();
+  t1 = now ();
+  printf ("%-8s %-8s %9zu %10.2f %10.1f\n", arrow_hash_name (hash),
+          batched ? "many" : "single", size,
+          c1 > c0 ? (double) (c1 - c0) / bytes : 0.0,
+          bytes / (t1 - t0) / 1048576.0);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t total = 256 * 1048576, maxsize = sizes[sizeof (sizes) / sizeof (sizes[0]) - 1];
+  uint8_t *data;
+  uint32_t x = 1;
+  size_t i, s;
+  int h;
+
+  if (argc > 2)
+    {
+      fprintf (stderr, "usage: %s [MB]\n", argv[0]);
+      return 2;
+    }
+  if (argc > 1)
+    total = strtoul (argv[1], NULL, 0) * 1048576;
+  data = (uint8_t *) malloc (maxsize * BATCH);
+  if (data == NULL)
+    return 1;
+  for (i = 0; i < maxsize * BATCH; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      data[i] = (uint8_t) x;
+    }
+
+  printf ("%-8s %-8s %9s %10s %10s\n", "hash", "mode", "bytes", "cycles/B", "MB/s");
+  for (h = 0; h <= ARROW_HASH_MAX; h++)
+    for (s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++)
+      {
+        run ((arrow_hash_t) h, 0, data, sizes[s], total);
+        run ((arrow_hash_t) h, 1, data, sizes[s], total);
+      }
+  free (data);
+  return 0;
+}
@@ -0,0 +1,178 @@
+/* store-scheme.c -- bucket load and put latency, linear against extendible hashing
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <base64.h>
+#include <store.h>
+
+/*
+ * Put the same stream of chunks into a linear-hash store and an
+ * extendible-hash store, and compare how evenly the keys spread over
+ * the buckets and how long puts take, splits included.
+ *
+ *   store-scheme DIR [CHUNKS]
+ *
+ * DIR must not exist yet. Chunks are 500 to 1500 bytes of generated
+ * data keyed with MD5, as sync would key them.
+ */
+
+#define MIN_LEN 500
+#define MAX_LEN 1500
+
+static size_t
+make_chunk (uint32_t i, uint8_t *buf, arrow_id_t *id)
+{
+  uint32_t x = i * 2654435761U + 1;
+  size_t len = MIN_LEN + i * 7919 % (MAX_LEN - MIN_LEN), k;
+
+  for (k = 0; k < len; k++)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      buf[k] = (uint8_t) x;
+    }
+  arrow_compute_key (id, buf, len);
+  return len;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+double_cmp (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static int
+run (const char *dir, store_scheme_t scheme, const char *name, uint32_t chunks)
+{
+  store_state_t *state;
+  uint8_t buf[MAX_LEN];
+  arrow_id_t id;
+  char bucket_id[STORE_ID_LEN + 1];
+  double *lat, start, total, mean, sd, max;
+  uint64_t *load, buckets, bucket, b, over;
+  uint32_t i;
+  size_t len;
+
+  lat = (double *) malloc (chunks * sizeof (double));
+  if (lat == NULL || mkdir (dir, 0700) != 0
+      || store_init_scheme (dir, scheme, &state) != 0)
+    {
+      fprintf (stderr, "%s: %s\n", dir, strerror (errno));
+      return -1;
+    }
+
+  total = now ();
+  for (i = 0; i < chunks; i++)
+    {
+      len = make_chunk (i, buf, &id);
+      start = now ();
+      store_put (state, &id, buf, len);
+      lat[i] = now () - start;
+    }
+  total = now () - total;
+  qsort (lat, chunks, sizeof (double), double_cmp);
+
+  /* How full is each bucket? */
+  buckets = store_bucket_count (state);
+  load = (uint64_t *) calloc (buckets, sizeof (uint64_t));
+  for (i = 0; i < chunks; i++)
+    {
+      make_chunk (i, buf, &id);
+      store_map_key (state, &id, bucket_id);
+      b64_decode (bucket_id, &bucket);
+      if (bucket < buckets)
+        load[bucket]++;
+    }
+  mean = (double) chunks / buckets;
+  sd = max = 0;
+  over = 0;
+  for (b = 0; b < buckets; b++)
+    {
+      sd += (load[b] - mean) * (load[b] - mean);
+      if (load[b] > max)
+        max = load[b];
+      if (load[b] > 0.70 * ARROW_BLOCK_INITIAL_COUNT)
+        over++;
+    }
+  sd = sqrt (sd / buckets);
+
+  printf ("%-10s %8llu %9.3f %8.3f %9.2f %6llu %9.1f %9.1f %9.1f %9.1f %8.2f\n",
+          name, (unsigned long long) buckets, mean / ARROW_BLOCK_INITIAL_COUNT,
+          sd / ARROW_BLOCK_INITIAL_COUNT, max / mean, (unsigned long long) over,
+          lat[chunks / 2] * 1e6, lat[(size_t) (chunks * 0.99)] * 1e6,
+          lat[(size_t) (chunks * 0.999)] * 1e6, lat[chunks - 1] * 1e6, total);
+
+  free (load);
+  free (lat);
+  store_destroy (state);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  char path[4096];
+  uint32_t chunks = 100000;
+
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: %s DIR [CHUNKS]\n", argv[0]);
+      return 2;
+    }
+  if (argc > 2)
+    chunks = strtoul (argv[2], NULL, 0);
+  if (mkdir (argv[1], 0700) != 0)
+    {
+      fprintf (stderr, "%s: %s\n", argv[1], strerror (errno));
+      return 1;
+    }
+
+  printf ("# %u chunks of %d to %d bytes; load is keys over %d slots a block\n",
+          chunks, MIN_LEN, MAX_LEN, ARROW_BLOCK_INITIAL_COUNT);
+  printf ("%-10s %8s %9s %8s %9s %6s %9s %9s %9s %9s %8s\n", "scheme", "buckets",
+          "load", "load-sd", "max/mean", ">0.70", "p50-us", "p99-us", "p99.9-us",
+          "max-us", "total-s");
+  snprintf (path, sizeof (path), "%s/linear", argv[1]);
+  if (run (path, STORE_LINEAR_HASH, "linear", chunks) != 0)
+    return 1;
+  snprintf (path, sizeof (path), "%s/extendible", argv[1]);
+  if (run (path, STORE_EXTENDIBLE_HASH, "extendible", chunks) != 0)
+    return 1;
+  return 0;
+}
@@ -0,0 +1,191 @@
+/* store-threads.c -- how store lookups and puts scale with threads
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <store.h>
+
+/*
+ * Fill a store with chunks, then have 1, 2, 4, ... 32 threads look up
+ * random ones (and, with a write percentage, put new ones), and print
+ * the total operations per second at each thread count.
+ *
+ *   store-threads DIR [CHUNKS [OPS-PER-THREAD [WRITE-PERCENT [HOT]]]]
+ *
+ * DIR must not exist yet. HOT is 1 to let the hot chunk cache answer
+ * lookups; by default every lookup goes to the blocks.
+ */
+
+#define CHUNK_LEN 1024
+#define MAX_THREADS 32
+
+typedef struct worker_s
+{
+  store_state_t *state;
+  uint32_t chunks;          /**< Chunks [0, chunks) are in the store. */
+  volatile uint32_t *next;  /**< The next new chunk to put. */
+  long ops;
+  int write_percent;
+  uint32_t seed;
+  long missing;
+} worker_t;
+
+static void
+make_chunk (uint32_t i, arrow_hash_t hash, uint8_t *buf, arrow_id_t *id)
+{
+  uint32_t x = i * 2654435761U + 1;
+  int k;
+
+  for (k = 0; k < CHUNK_LEN; k++)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      buf[k] = (uint8_t) x;
+    }
+  arrow_compute_key_with (hash, id, buf, CHUNK_LEN);
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+worker_run (void *arg)
+{
+  worker_t *w = (worker_t *) arg;
+  arrow_hash_t hash = store_hash (w->state);
+  uint8_t buf[CHUNK_LEN], out[CHUNK_LEN];
+  arrow_id_t id;
+  uint32_t x = w->seed;
+  long op;
+
+  for (op = 0; op < w->ops; op++)
+    {
+      x = x * 1103515245 + 12345;
+      if ((int) ((x >> 16) % 100) < w->write_percent)
+        {
+          make_chunk (__sync_fetch_and_add (w->next, 1), hash, buf, &id);
+          store_put (w->state, &id, buf, CHUNK_LEN);
+        }
+      else
+        {
+          make_chunk ((x >> 4) % w->chunks, hash, buf, &id);
+          if (store_get (w->state, &id, out, sizeof (out)) != CHUNK_LEN)
+            w->missing++;
+        }
+    }
+  return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+  store_state_t *state;
+  worker_t workers[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  uint8_t buf[CHUNK_LEN];
+  arrow_id_t id;
+  volatile uint32_t next;
+  uint32_t chunks = 50000, i;
+  long ops = 100000, missing;
+  int write_percent = 0, hot = 0, n, t;
+  double start, elapsed, base = 0;
+
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: %s DIR [CHUNKS [OPS-PER-THREAD [WRITE-PERCENT [HOT]]]]\n",
+               argv[0]);
+      return 2;
+    }
+  if (argc > 2)
+    chunks = strtoul (argv[2], NULL, 0);
+  if (argc > 3)
+    ops = strtol (argv[3], NULL, 0);
+  if (argc > 4)
+    write_percent = atoi (argv[4]);
+  if (argc > 5)
+    hot = atoi (argv[5]);
+
+  if (mkdir (argv[1], 0700) != 0 || store_init (argv[1], &state) != 0)
+    {
+      fprintf (stderr, "%s: %s\n", argv[1], strerror (errno));
+      return 1;
+    }
+  if (!hot)
+    store_set_hot_limit (state, 0);
+
+  start = now ();
+  for (i = 0; i < chunks; i++)
+    {
+      make_chunk (i, store_hash (state), buf, &id);
+      store_put (state, &id, buf, CHUNK_LEN);
+    }
+  printf ("# %u chunks in %llu buckets, put in %.2f s; %ld ops per thread, "
+          "%d%% puts; %ld online CPUs\n", chunks,
+          (unsigned long long) store_bucket_count (state), now () - start, ops,
+          write_percent, sysconf (_SC_NPROCESSORS_ONLN));
+  printf ("%-8s %14s %10s\n", "threads", "ops/s", "speedup");
+
+  next = chunks;
+  for (n = 1; n <= MAX_THREADS; n *= 2)
+    {
+      start = now ();
+      for (t = 0; t < n; t++)
+        {
+          workers[t].state = state;
+          workers[t].chunks = chunks;
+          workers[t].next = &next;
+          workers[t].ops = ops;
+          workers[t].write_percent = write_percent;
+          workers[t].seed = n * 1000 + t;
+          workers[t].missing = 0;
+          pthread_create (&threads[t], NULL, worker_run, &workers[t]);
+        }
+      missing = 0;
+      for (t = 0; t < n; t++)
+        {
+          pthread_join (threads[t], NULL);
+          missing += workers[t].missing;
+        }
+      elapsed = now () - start;
+      if (n == 1)
+        base = ops / elapsed;
+      printf ("%-8d %14.0f %9.2fx\n", n, n * ops / elapsed, n * ops / elapsed / base);
+      if (missing > 0)
+        printf ("# %ld lookups failed\n", missing);
+    }
+
+  store_destroy (state);
+  return 0;
+}
@@ -0,0 +1,372 @@
+/* test-backup.c -- tests for backing up a tree of files
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#define _GNU_SOURCE
+#include "test.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <base64.h>
+#include <backup.h>
+#include <client.h>
+#include <defrag.h>
+#include <helpers.h>
+
+/* Write len bytes from seed to name under dir, making its directory. */
+static void
+source_file (const char *dir, const char *name, uint32_t seed, size_t len)
+{
+  char path[4096];
+  char *p;
+
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  p = strrchr (path, '/');
+  *p = '\0';
+  check (file_mkdirs (path, 0700) == 0);
+  *p = '/';
+  check (test_write_file (path, seed, len) == 0);
+}
+
+/*
+ * Whether the latest version of name backed up into root, read back
+ * from the store, is the file under src.
+ */
+static int
+backed_up (file_backup_t *state, const char *root, const char *src,
+           const char *name)
+{
+  char path[4096];
+  uint8_t *want, buf[65536];
+  const file_chunk_t *c;
+  size_t len, off = 0, n;
+  file_t f;
+  FILE *in;
+  int ok = 1;
+
+  snprintf (path, sizeof (path), "%s/tree/%s", root, name);
+  if (read_link_file (path, f.uuid) != 0
+      || file_open (&state->filer, &f, 0) != 0)
+    return 0;
+  snprintf (path, sizeof (path), "%s/%s", src, name);
+  in = fopen (path, "r");
+  fseek (in, 0, SEEK_END);
+  len = ftell (in);
+  rewind (in);
+  want = (uint8_t *) malloc (len);
+  ok = fread (want, 1, len, in) == len;
+  fclose (in);
+
+  store_commit_refs (state->store);
+  for (c = f.file->chunks; ok && c->type != END_OF_CHUNKS; c++)
+    {
+      if (c->type == DIRECT_CHUNK)
+        {
+          n = c->chunk.data.length;
+          ok = off + n <= len && memcmp (c->chunk.data.data, want + off, n) == 0;
+        }
+      else
+        {
+          n = c->chunk.ref.length;
+          ok = (off + n <= len
+                && store_get (state->store, &c->chunk.ref.ref, buf, sizeof (buf)) == n
+                && memcmp (buf, want + off, n) == 0);
+        }
+      off += n;
+    }
+  file_close (&state->filer, &f);
+  free (want);
+  return ok && off == len;
+}
+
+/* Where len bytes of data are in the block file the store keeps id in, or -1. */
+static long
+block_offset (const char *root, store_state_t *store, const uint8_t *data,
+              size_t len)
+{
+  char path[4096], name[32];
+  arrow_id_t id;
+  uint8_t *block, *p;
+  long offset = -1;
+  ssize_t n;
+  int fd;
+
+  arrow_compute_key_with (store_hash (store), &id, data, len);
+  store_map_key (store, &id, name);
+  snprintf (path, sizeof (path), "%s/%s/%s", root, ARROW_BLOCKS_DIR, name);
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return -1;
+  block = (uint8_t *) malloc (1 << 24);
+  n = pread (fd, block, 1 << 24, 0);
+  if (n > 0 && (p = memmem (block, n, data, len)) != NULL)
+    offset = p - block;
+  free (block);
+  close (fd);
+  return offset;
+}
+
+/* Make the latest version of name backed up into root look older. */
+static void
+age_version (file_backup_t *state, const char *root, const char *name)
+{
+  struct timespec times[2] = { { 1000000, 0 }, { 1000000, 0 } };
+  char path[4096];
+  file_t f;
+
+  snprintf (path, sizeof (path), "%s/tree/%s", root, name);
+  check (read_link_file (path, f.uuid) == 0);
+  check (file_open (&state->filer, &f, 0) == 0);
+  check (futimens (f.data.fd, times) == 0);
+  file_close (&state->filer, &f);
+}
+
+/*
+ * Defragmenting lays chunks out in the order the newest version that
+ * refers to them has them, and every file still restores. Here a.dat
+ * is b.dat's chunks backwards, so it finds them all stored in b.dat's
+ * order.
+ */
+#define DEFRAG_CHUNK 1024
+#define DEFRAG_CHUNKS 1024
+
+static void
+test_defrag (void)
+{
+  const char *root = test_dir ();
+  const char *src = test_dir ();
+  uint8_t *b = (uint8_t *) malloc (DEFRAG_CHUNK * DEFRAG_CHUNKS);
+  uint8_t *a = (uint8_t *) malloc (DEFRAG_CHUNK * DEFRAG_CHUNKS);
+  char path[4096];
+  file_backup_t state;
+  long offset, last;
+  int i, forward = 0, backward = 0;
+  FILE *out;
+
+  test_fill (90, b, DEFRAG_CHUNK * DEFRAG_CHUNKS);
+  for (i = 0; i < DEFRAG_CHUNKS; i++)
+    memcpy (a + i * DEFRAG_CHUNK, b + (DEFRAG_CHUNKS - 1 - i) * DEFRAG_CHUNK,
+            DEFRAG_CHUNK);
+  snprintf (path, sizeof (path), "%s/b.dat", src);
+  out = fopen (path, "w");
+  check (fwrite (b, DEFRAG_CHUNK, DEFRAG_CHUNKS, out) == DEFRAG_CHUNKS);
+  fclose (out);
+  check (file_init_local (&state, root, src) == 0);
+  check (file_backup_file (&state, path) == 0);
+  snprintf (path, sizeof (path), "%s/a.dat", src);
+  out = fopen (path, "w");
+  check (fwrite (a, DEFRAG_CHUNK, DEFRAG_CHUNKS, out) == DEFRAG_CHUNKS);
+  fclose (out);
+  check (file_backup_file (&state, path) == 0);
+  age_version (&state, root, "b.dat");
+  store_commit_refs (state.store);
+
+  last = block_offset (root, state.store, a, DEFRAG_CHUNK);
+  check (last >= 0);
+  for (i = 1; i < DEFRAG_CHUNKS; i++)
+    {
+      offset = block_offset (root, state.store, a + i * DEFRAG_CHUNK, DEFRAG_CHUNK);
+      backward += offset < last;
+      last = offset;
+    }
+  check (backward == DEFRAG_CHUNKS - 1);
+
+  /* Small enough to take more than one batch, were there more buckets. */
+  check (filer_defragment (&state.filer, state.store, 2, 64 * 1024) == 0);
+  last = block_offset (root, state.store, a, DEFRAG_CHUNK);
+  for (i = 1; i < DEFRAG_CHUNKS; i++)
+    {
+      offset = block_offset (root, state.store, a + i * DEFRAG_CHUNK, DEFRAG_CHUNK);
+      forward += offset > last;
+      last = offset;
+    }
+  check (forward == DEFRAG_CHUNKS - 1);
+  check (backed_up (&state, root, src, "a.dat"));
+  check (backed_up (&state, root, src, "b.dat"));
+  check (store_verify_all (state.store) == 0);
+
+  file_destroy (&state);
+  free (a);
+  free (b);
+}
+
+/*
+ * Back up a tree twice with one state, so the second run syncs
+ * against the first through the same context, with link paths both
+ * longer and shorter than the one before.
+ */
+static void
+test_reuse (void)
+{
+  const char *root = test_dir ();
+  const char *src = test_dir ();
+  const char *names[] =
+    {
+      "a",
+      "deep/deeper/deepest/with a rather longer name than the others",
+      "b.txt",
+      "deep/c.txt"
+    };
+  const int count = sizeof (names) / sizeof (names[0]);
+  file_backup_t state;
+  int i;
+
+  for (i = 0; i < count; i++)
+    source_file (src, names[i], 100 + i, 20000 + i * 30000);
+  check (file_init_local (&state, root, src) == 0);
+  check (file_recursive_backup (&state, src) == 0);
+  check (state.stats.files == count);
+  for (i = 0; i < count; i++)
+    check (backed_up (&state, root, src, names[i]));
+
+  source_file (src, names[0], 200, 60000);
+  source_file (src, names[1], 201, 10000);
+  check (file_recursive_backup (&state, src) == 0);
+  check (state.stats.files == count + 2);
+  for (i = 0; i < count; i++)
+    check (backed_up (&state, root, src, names[i]));
+
+  file_destroy (&state);
+}
+
+static size_t put_bytes;
+static sync_batch_callbacks_t counting;
+
+static int
+count_puts (void *state, const arrow_id_t *ids, const void *const *bufs,
+            const size_t *lens, size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    put_bytes += lens[i];
+  return sync_store_put_blocks (state, ids, bufs, lens, count);
+}
+
+/*
+ * A new version of a file that's now a copy of the file beside it,
+ * with the same extension, is synced against that file too, and
+ * stores little more than what's new; without the store's weak index
+ * to find the copied chunks some other way.
+ */
+#define SIBLING_LEN (300 * 1000)
+
+static void
+test_siblings (void)
+{
+  const char *root = test_dir ();
+  const char *src = test_dir ();
+  char path[4096];
+  uint8_t *data = (uint8_t *) malloc (SIBLING_LEN + 100);
+  file_backup_t state;
+  FILE *out;
+
+  source_file (src, "logs/a.log", 70, SIBLING_LEN);
+  source_file (src, "logs/b.log", 71, SIBLING_LEN);
+  check (file_init_local (&state, root, src) == 0);
+  state.sync_cb.probe_weak = NULL;
+  counting = *state.sync_cb.batch;
+  counting.put_blocks = count_puts;
+  state.sync_cb.batch = &counting;
+  check (file_recursive_backup (&state, src) == 0);
+
+  /* b.log becomes a.log with a line in front. */
+  test_fill (72, data, 100);
+  test_fill (70, data + 100, SIBLING_LEN);
+  snprintf (path, sizeof (path), "%s/logs/b.log", src);
+  out = fopen (path, "w");
+  check (fwrite (data, 1, SIBLING_LEN + 100, out) == SIBLING_LEN + 100);
+  fclose (out);
+  put_bytes = 0;
+  check (file_recursive_backup (&state, src) == 0);
+  check (backed_up (&state, root, src, "logs/a.log"));
+  check (backed_up (&state, root, src, "logs/b.log"));
+  check (put_bytes < SIBLING_LEN / 20);
+
+  file_destroy (&state);
+  free (data);
+}
+
+/*
+ * Replies, as the server would send them, to read in place of one: a
+ * response code, then a hash.
+ */
+static FILE *
+replies (uint16_t response, uint16_t hash)
+{
+  FILE *f = tmpfile ();
+  rpc_t rpc = { NULL, f, NULL };
+
+  write_short (&rpc, response);
+  write_short (&rpc, hash);
+  rewind (f);
+  return f;
+}
+
+/*
+ * A remote backup hashes new chunks the way the server's store does,
+ * and won't start if the server can't say how that is.
+ */
+static void
+test_remote_hash (void)
+{
+  file_backup_t state;
+  FILE *in, *out = tmpfile ();
+  rpc_t sent = { out, NULL, NULL };
+  uint16_t command;
+
+  in = replies (0, ARROW_HASH_BLAKE3);
+  check (file_init_remote (&state, in, out) == 0);
+  check (state.sync_cb.hash == ARROW_HASH_BLAKE3);
+  file_destroy (&state);
+  fclose (in);
+  rewind (out);
+  check (read_short (&sent, &command) == 1 && command == STORE_HASH);
+
+  in = replies (0, ARROW_HASH_MAX + 1);
+  check (file_init_remote (&state, in, out) == -1 && errno == EPROTO);
+  fclose (in);
+  in = replies (1, ARROW_HASH_MD5);
+  check (file_init_remote (&state, in, out) == -1 && errno == EPROTO);
+  fclose (in);
+  in = tmpfile ();
+  check (file_init_remote (&state, in, out) == -1);
+  fclose (in);
+  fclose (out);
+}
+
+static const test_case_t tests[] =
+  {
+    { "defrag", test_defrag },
+    { "reuse", test_reuse },
+    { "siblings", test_siblings },
+    { "remote_hash", test_remote_hash },
+    { NULL, NULL }
+  };
+
+int
+main (int argc, char **argv)
+{
+  return test_main (argc, argv, tests);
+}
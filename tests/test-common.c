@@ -0,0 +1,279 @@
+/* test-common.c -- tests for the hashes, checksums and chunkers
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#include "test.h"
+
+#include <string.h>
+#include <cdc.h>
+#include <crc32c.h>
+#include <hash.h>
+#include <rollsum.h>
+
+/*
+ * crc32c gives the published CRC-32C check values, and extending a
+ * crc over a buffer in two pieces, split anywhere and starting at any
+ * alignment, gives what one call over it does.
+ */
+static void
+test_crc32c (void)
+{
+  uint8_t buf[32], data[1100];
+  uint32_t whole;
+  size_t off, len, cut;
+  int i;
+
+  check (crc32c (0, "", 0) == 0);
+  check (crc32c (0, "123456789", 9) == 0xe3069283);
+  memset (buf, 0, sizeof (buf));
+  check (crc32c (0, buf, sizeof (buf)) == 0x8a9136aa);
+  memset (buf, 0xff, sizeof (buf));
+  check (crc32c (0, buf, sizeof (buf)) == 0x62a8ab43);
+  for (i = 0; i < 32; i++)
+    buf[i] = i;
+  check (crc32c (0, buf, sizeof (buf)) == 0x46dd794e);
+
+  test_fill (2, data, sizeof (data));
+  for (off = 0; off < 8; off++)
+    for (len = 0; len + off <= sizeof (data); len += 1 + len / 2)
+      {
+        whole = crc32c (0, data + off, len);
+        for (cut = 0; cut <= len; cut += 1 + cut / 3)
+          check (crc32c (crc32c (0, data + off, cut), data + off + cut, len - cut) == whole);
+      }
+}
+
+/* Whether buf hashes to hex, the first 16 bytes of its digest. */
+static int
+digest_is (arrow_hash_t hash, const void *buf, size_t len, const char *hex)
+{
+  arrow_key_t digest;
+  char out[33];
+  int i;
+
+  arrow_hash (hash, buf, len, digest);
+  for (i = 0; i < 16; i++)
+    sprintf (out + 2 * i, "%02x", digest[i]);
+  return strcmp (out, hex) == 0;
+}
+
+/*
+ * Each strong hash gives its published digests, cut to 16 bytes, and
+ * arrow_hash_many and the incremental interface agree with arrow_hash
+ * for every length.
+ */
+static void
+test_hash (void)
+{
+  static const size_t lens[] = { 0, 1, 55, 56, 63, 64, 65, 1023, 1024, 1025, 5000, 70000 };
+  const void *bufs[sizeof (lens) / sizeof (lens[0])];
+  arrow_key_t many[sizeof (lens) / sizeof (lens[0])], one;
+  arrow_hash_ctx_t ctx;
+  uint8_t *data;
+  size_t n = sizeof (lens) / sizeof (lens[0]), i;
+  int h;
+
+  check (digest_is (ARROW_HASH_MD5, "", 0, "d41d8cd98f00b204e9800998ecf8427e"));
+  check (digest_is (ARROW_HASH_MD5, "abc", 3, "900150983cd24fb0d6963f7d28e17f72"));
+  check (digest_is (ARROW_HASH_SHA256, "", 0, "e3b0c44298fc1c149afbf4c8996fb924"));
+  check (digest_is (ARROW_HASH_SHA256, "abc", 3, "ba7816bf8f01cfea414140de5dae2223"));
+  check (digest_is (ARROW_HASH_BLAKE3, "", 0, "af1349b9f5f9a1a6a0404dea36dcc949"));
+  check (digest_is (ARROW_HASH_BLAKE3, "abc", 3, "6437b3ac38465133ffb63b75273a8db5"));
+
+  data = (uint8_t *) malloc (70000 * n);
+  test_fill (1, data, 70000 * n);
+  for (i = 0; i < n; i++)
+    bufs[i] = data + i * 70000;
+  for (h = 0; h <= ARROW_HASH_MAX; h++)
+    {
+      arrow_hash_many ((arrow_hash_t) h, bufs, lens, n, many);
+      for (i = 0; i < n; i++)
+        {
+          arrow_hash ((arrow_hash_t) h, bufs[i], lens[i], one);
+          check (memcmp (one, many[i], sizeof (one)) == 0);
+          arrow_hash_init (&ctx, (arrow_hash_t) h);
+          arrow_hash_update (&ctx, bufs[i], lens[i] / 3);
+          arrow_hash_update (&ctx, (const uint8_t *) bufs[i] + lens[i] / 3,
+                             lens[i] - lens[i] / 3);
+          arrow_hash_final (&ctx, one);
+          check (memcmp (one, many[i], sizeof (one)) == 0);
+        }
+    }
+  free (data);
+}
+
+/* The sum of buf rolled in one byte at a time. */
+static void
+rollsum_bytes (Rollsum *sum, const uint8_t *buf, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    RollsumRollin (sum, buf[i]);
+}
+
+/*
+ * RollsumUpdate, however the CPU runs it and however the input is cut
+ * up, gives the same sums as rolling each byte in; RollsumDigestMany
+ * gives each buffer's digest; and rotating a window along keeps its
+ * sum equal to summing the window afresh.
+ */
+static void
+test_rollsum (void)
+{
+  static const size_t lens[] = { 0, 1, 15, 16, 31, 32, 33, 63, 64, 100, 700,
+                                 4096, 5003, 65536 };
+  const void *bufs[sizeof (lens) / sizeof (lens[0])];
+  unsigned long many[sizeof (lens) / sizeof (lens[0])];
+  size_t n = sizeof (lens) / sizeof (lens[0]), i, cut, window = 700;
+  Rollsum a, b;
+  uint8_t *data;
+
+  data = (uint8_t *) malloc (70000);
+  test_fill (2, data, 70000);
+  for (i = 0; i < n; i++)
+    {
+      bufs[i] = data + i * 3;
+      RollsumInit (&a);
+      RollsumUpdate (&a, bufs[i], lens[i]);
+      RollsumInit (&b);
+      rollsum_bytes (&b, bufs[i], lens[i]);
+      check (a.count == b.count && a.s1 == b.s1 && a.s2 == b.s2);
+
+      cut = lens[i] / 3;
+      RollsumInit (&a);
+      RollsumUpdate (&a, bufs[i], cut);
+      RollsumUpdate (&a, (const uint8_t *) bufs[i] + cut, lens[i] - cut);
+      check (RollsumDigest (&a) == RollsumDigest (&b));
+    }
+
+  RollsumDigestMany (bufs, lens, n, many);
+  for (i = 0; i < n; i++)
+    {
+      RollsumInit (&a);
+      rollsum_bytes (&a, bufs[i], lens[i]);
+      check (many[i] == RollsumDigest (&a));
+    }
+
+  RollsumInit (&a);
+  RollsumUpdate (&a, data, window);
+  for (i = 0; i + window < 70000; i++)
+    {
+      RollsumRotate (&a, data[i], data[i + window]);
+      if (i % 997 == 0)
+        {
+          RollsumInit (&b);
+          RollsumUpdate (&b, data + i + 1, window);
+          check (RollsumDigest (&a) == RollsumDigest (&b));
+        }
+    }
+  free (data);
+}
+
+/* Cut buf into chunks with cdc_cut, storing where each one ends. */
+static size_t
+cdc_ends (const uint8_t *buf, size_t len, size_t *ends, size_t max)
+{
+  size_t off = 0, n = 0;
+
+  while (off < len && n < max)
+    {
+      off += cdc_cut (buf + off, len - off);
+      ends[n++] = off;
+    }
+  return n;
+}
+
+/*
+ * Content-defined chunks keep to their size bounds, and an insertion
+ * only changes the chunks around it: the cuts after it are the same
+ * cuts, moved along by the inserted length.
+ */
+#define CDC_TEST_LEN (1024 * 1024)
+#define CDC_TEST_MAX (CDC_TEST_LEN / CDC_MIN_CHUNK_SIZE + 1)
+
+static void
+test_cdc (void)
+{
+  static size_t before[CDC_TEST_MAX], after[CDC_TEST_MAX];
+  uint8_t *data, *edited;
+  size_t n, m, i, j, at = CDC_TEST_LEN / 2, ins = 100, same = 0;
+
+  data = (uint8_t *) malloc (CDC_TEST_LEN);
+  edited = (uint8_t *) malloc (CDC_TEST_LEN + ins);
+  test_fill (3, data, CDC_TEST_LEN);
+  memcpy (edited, data, at);
+  test_fill (4, edited + at, ins);
+  memcpy (edited + at + ins, data + at, CDC_TEST_LEN - at);
+
+  n = cdc_ends (data, CDC_TEST_LEN, before, CDC_TEST_MAX);
+  m = cdc_ends (edited, CDC_TEST_LEN + ins, after, CDC_TEST_MAX);
+  check (before[n - 1] == CDC_TEST_LEN);
+  for (i = 0; i < n - 1; i++)
+    {
+      size_t len = before[i] - (i > 0 ? before[i - 1] : 0);
+      check (len >= CDC_MIN_CHUNK_SIZE && len <= CDC_MAX_CHUNK_SIZE);
+    }
+  check (n > CDC_TEST_LEN / CDC_MAX_CHUNK_SIZE && n < CDC_TEST_LEN / CDC_MIN_CHUNK_SIZE);
+
+  /* Every cut before the insertion is the same, and every cut a
+     couple of chunks past it is the same, shifted. */
+  for (i = 0, j = 0; i < n && j < m; )
+    {
+      if (before[i] <= at)
+        {
+          check (before[i] == after[j]);
+          same++;
+          i++, j++;
+        }
+      else if (before[i] < at + 2 * CDC_MAX_CHUNK_SIZE)
+        {
+          i++;
+          while (j < m && after[j] < before[i] + ins)
+            j++;
+        }
+      else
+        {
+          check (before[i] + ins == after[j]);
+          same++;
+          i++, j++;
+        }
+    }
+  check (same + 8 > n);
+  free (edited);
+  free (data);
+}
+
+static const test_case_t tests[] =
+  {
+    { "crc32c", test_crc32c },
+    { "hash", test_hash },
+    { "rollsum", test_rollsum },
+    { "cdc", test_cdc },
+    { NULL, NULL }
+  };
+
+int
+main (int argc, char **argv)
+{
+  return test_main (argc, argv, tests);
+}
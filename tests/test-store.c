@@ -0,0 +1,991 @@
+/* test-store.c -- tests for the block store
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#define _GNU_SOURCE
+#include "test.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <base64.h>
+#include <store.h>
+
+#define CHUNK_MAX 1024
+
+/* Chunk i of a test: between 100 and CHUNK_MAX bytes, keyed with hash. */
+static size_t
+make_chunk (uint32_t i, arrow_hash_t hash, uint8_t *buf, arrow_id_t *id)
+{
+  size_t len = 100 + (i * 7919) % (CHUNK_MAX - 100);
+
+  test_fill (i, buf, len);
+  arrow_compute_key_with (hash, id, buf, len);
+  return len;
+}
+
+/* Put chunks [begin, end) into the store. */
+static int
+put_chunks (store_state_t *state, uint32_t begin, uint32_t end)
+{
+  uint8_t buf[CHUNK_MAX];
+  arrow_id_t id;
+  size_t len;
+  uint32_t i;
+
+  for (i = begin; i < end; i++)
+    {
+      len = make_chunk (i, store_hash (state), buf, &id);
+      if (store_put (state, &id, buf, len) < 0)
+        return -1;
+    }
+  return 0;
+}
+
+/* Check that store_get gives back chunks [begin, end); returns how many didn't. */
+static int
+get_chunks (store_state_t *state, uint32_t begin, uint32_t end)
+{
+  uint8_t want[CHUNK_MAX], got[CHUNK_MAX];
+  arrow_id_t id;
+  size_t len;
+  uint32_t i;
+  int bad = 0;
+
+  for (i = begin; i < end; i++)
+    {
+      len = make_chunk (i, store_hash (state), want, &id);
+      if (store_get (state, &id, got, sizeof (got)) != len
+          || memcmp (want, got, len) != 0)
+        bad++;
+    }
+  return bad;
+}
+
+/*
+ * Lookups don't lock the bucket; readers racing a writer whose puts
+ * keep splitting blocks must still see every chunk, intact.
+ */
+#define THREAD_READERS 4
+#define THREAD_CHUNKS 20000
+
+typedef struct reader_s
+{
+  store_state_t *state;
+  volatile uint32_t *published;
+  volatile int *done;
+  uint32_t seed;
+  int bad;
+  int lookups;
+} reader_t;
+
+static void *
+reader_run (void *arg)
+{
+  reader_t *r = (reader_t *) arg;
+  uint8_t want[CHUNK_MAX], got[CHUNK_MAX];
+  arrow_id_t id;
+  uint32_t x = r->seed, i, n;
+  size_t len;
+
+  while (!*r->done)
+    {
+      n = *r->published;
+      if (n == 0)
+        continue;
+      x = x * 1103515245 + 12345;
+      i = (x >> 8) % n;
+      len = make_chunk (i, store_hash (r->state), want, &id);
+      if (!store_contains (r->state, &id)
+          || store_get_len (r->state, &id) != len
+          || store_get (r->state, &id, got, sizeof (got)) != len
+          || memcmp (want, got, len) != 0)
+        r->bad++;
+      r->lookups++;
+    }
+  return NULL;
+}
+
+static void
+test_threads (void)
+{
+  store_state_t *state;
+  reader_t readers[THREAD_READERS];
+  pthread_t threads[THREAD_READERS];
+  volatile uint32_t published = 0;
+  volatile int done = 0;
+  uint64_t buckets;
+  uint32_t i;
+  int t;
+
+  check (store_init (test_dir (), &state) == 0);
+  store_set_hot_limit (state, 0);
+  for (t = 0; t < THREAD_READERS; t++)
+    {
+      readers[t].state = state;
+      readers[t].published = &published;
+      readers[t].done = &done;
+      readers[t].seed = t + 1;
+      readers[t].bad = 0;
+      readers[t].lookups = 0;
+      pthread_create (&threads[t], NULL, reader_run, &readers[t]);
+    }
+  for (i = 0; i < THREAD_CHUNKS; i += 100)
+    {
+      check (put_chunks (state, i, i + 100) == 0);
+      __sync_synchronize ();
+      published = i + 100;
+    }
+  done = 1;
+  for (t = 0; t < THREAD_READERS; t++)
+    {
+      pthread_join (threads[t], NULL);
+      check (readers[t].bad == 0);
+    }
+  buckets = store_bucket_count (state);
+  check (buckets > 1);
+  check (get_chunks (state, 0, THREAD_CHUNKS) == 0);
+  store_destroy (state);
+}
+
+/*
+ * A read-only process shares the store with its writer: it finds
+ * chunks that splits in the writer are moving around, and can't
+ * change anything. A second writer is turned away.
+ */
+#define SHARED_OLD 1000
+#define SHARED_NEW 20000
+
+static int
+shared_reader (const char *dir, int fd)
+{
+  store_state_t *state;
+  uint8_t buf[CHUNK_MAX];
+  arrow_id_t id;
+  size_t len;
+  char c;
+  int bad = 0, passes = 0;
+
+  if (store_init_readonly (dir, &state) != 0)
+    return 100;
+  len = make_chunk (0, store_hash (state), buf, &id);
+  if (store_put (state, &id, buf, len) != -1 || errno != EROFS)
+    bad++;
+  /* Keep reading until the writer closes its end of the pipe. */
+  while (read (fd, &c, 1) < 0 && errno == EAGAIN)
+    {
+      bad += get_chunks (state, 0, SHARED_OLD);
+      passes++;
+    }
+  bad += get_chunks (state, 0, SHARED_NEW);
+  store_destroy (state);
+  return bad > 0 ? 1 : passes > 0 ? 0 : 101;
+}
+
+static void
+test_shared (void)
+{
+  const char *dir = test_dir ();
+  store_state_t *state, *other;
+  int fds[2], status;
+  uint64_t buckets;
+  pid_t pid;
+
+  check (store_init (dir, &state) == 0);
+  check (put_chunks (state, 0, SHARED_OLD) == 0);
+  check (store_init (dir, &other) == -1 && errno == EBUSY);
+
+  check (pipe (fds) == 0);
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  pid = fork ();
+  if (pid == 0)
+    {
+      close (fds[1]);
+      _exit (shared_reader (dir, fds[0]));
+    }
+  close (fds[0]);
+  buckets = store_bucket_count (state);
+  check (put_chunks (state, SHARED_OLD, SHARED_NEW) == 0);
+  check (store_bucket_count (state) > buckets);
+  close (fds[1]);
+  check (waitpid (pid, &status, 0) == pid);
+  check (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  store_destroy (state);
+}
+
+/* Whether store_dump reports an extendible hashing store, or -1. */
+static int
+dump_extendible (store_state_t *state)
+{
+  char buf[4096];
+  FILE *f = tmpfile ();
+  size_t n;
+
+  if (f == NULL)
+    return -1;
+  store_dump (f, state);
+  rewind (f);
+  n = fread (buf, 1, sizeof (buf) - 1, f);
+  fclose (f);
+  buf[n] = '\0';
+  return strstr (buf, "extendible hashing") != NULL;
+}
+
+/*
+ * An extendible hashing store splits the buckets that fill up, keeps
+ * every chunk reachable through its directory, and keeps its scheme
+ * when reopened. Existing stores keep theirs too.
+ */
+static void
+test_extendible (void)
+{
+  const char *dir = test_dir (), *other = test_dir ();
+  store_state_t *state;
+  uint64_t buckets;
+
+  check (store_init_scheme (dir, STORE_EXTENDIBLE_HASH, &state) == 0);
+  check (put_chunks (state, 0, 20000) == 0);
+  buckets = store_bucket_count (state);
+  check (buckets > 1);
+  check (get_chunks (state, 0, 20000) == 0);
+  store_destroy (state);
+
+  check (store_init (dir, &state) == 0);
+  check (dump_extendible (state) == 1);
+  check (store_bucket_count (state) == buckets);
+  check (put_chunks (state, 20000, 30000) == 0);
+  check (get_chunks (state, 0, 30000) == 0);
+  store_destroy (state);
+
+  check (store_init (other, &state) == 0);
+  check (put_chunks (state, 0, 100) == 0);
+  store_destroy (state);
+  check (store_init_scheme (other, STORE_EXTENDIBLE_HASH, &state) == 0);
+  check (dump_extendible (state) == 0);
+  check (get_chunks (state, 0, 100) == 0);
+  store_destroy (state);
+}
+
+/*
+ * The sum of the reference counts store_dump_store shows for every
+ * chunk in the store, or -1. The largest goes in max, if not NULL.
+ */
+static long
+total_references (store_state_t *state, int *max)
+{
+  char line[256];
+  uint64_t bucket, buckets = store_bucket_count (state);
+  long total = 0;
+  store_t store;
+  FILE *f;
+  int refs;
+
+  if (max != NULL)
+    *max = 0;
+  for (bucket = 0; bucket < buckets; bucket++)
+    {
+      b64_encode (bucket, store.id);
+      if ((f = tmpfile ()) == NULL)
+        return -1;
+      if (store_open (state, &store) != 0)
+        {
+          fclose (f);
+          return -1;
+        }
+      store_dump_store (f, &store);
+      store_close (state, &store);
+      rewind (f);
+      while (fgets (line, sizeof (line), f) != NULL)
+        if (sscanf (line, " Offset: %*d; Length: %*d; References: %d",
+                    &refs) == 1)
+          {
+            total += refs;
+            if (max != NULL && refs > *max)
+              *max = refs;
+          }
+      fclose (f);
+    }
+  return total;
+}
+
+/*
+ * Deferred reference count changes are applied by store_commit_refs,
+ * or by themselves once the journal is full; changes for keys the
+ * store doesn't have are reported without holding up the rest.
+ */
+static void
+test_journal (void)
+{
+  const char *dir = test_dir ();
+  store_state_t *state;
+  uint8_t buf[CHUNK_MAX];
+  arrow_id_t id, missing;
+  uint32_t i;
+  int max;
+
+  check (store_init (dir, &state) == 0);
+  check (put_chunks (state, 0, 1000) == 0);
+  check (total_references (state, NULL) == 1000);
+
+  for (i = 0; i < 500; i++)
+    {
+      make_chunk (i, store_hash (state), buf, &id);
+      check (store_addref_deferred (state, &id) == 0);
+      check (store_addref_deferred (state, &id) == 0);
+      if (i < 100)
+        check (store_unref_deferred (state, &id) == 0);
+    }
+  /* Nothing is applied until the commit. */
+  check (total_references (state, NULL) == 1000);
+  check (store_commit_refs (state) == 0);
+  check (total_references (state, NULL) == 1900);
+  check (total_references (state, &max) == 1900 && max == 3);
+
+  make_chunk (5000, store_hash (state), buf, &missing);
+  check (store_addref_deferred (state, &missing) == 0);
+  check (store_addref_deferred (state, &id) == 0);
+  check (store_commit_refs (state) == -1 && errno == ENOENT);
+  check (total_references (state, NULL) == 1901);
+
+  store_set_journal_limit (state, 10);
+  for (i = 0; i < 25; i++)
+    {
+      make_chunk (600 + i, store_hash (state), buf, &id);
+      check (store_addref_deferred (state, &id) == 0);
+    }
+  /* Two batches of ten went in by themselves; five are pending. */
+  check (total_references (state, NULL) == 1921);
+
+  /* Whatever is left is committed when the store is closed. */
+  check (store_addref_deferred (state, &id) == 0);
+  store_destroy (state);
+  check (store_init (dir, &state) == 0);
+  check (total_references (state, NULL) == 1927);
+  store_destroy (state);
+}
+
+/*
+ * Flip a byte in the middle of chunk i in its block under dir. Splits
+ * leave stale copies behind in the data region, so flip every copy.
+ * Returns -1 if the block doesn't have the chunk.
+ */
+static int
+corrupt_chunk (const char *dir, store_state_t *state, uint32_t i)
+{
+  uint8_t chunk[CHUNK_MAX], *data, *p;
+  char path[1024], name[32];
+  arrow_id_t id;
+  ssize_t n;
+  size_t len;
+  int fd, ret = -1;
+
+  len = make_chunk (i, store_hash (state), chunk, &id);
+  store_map_key (state, &id, name);
+  snprintf (path, sizeof (path), "%s/%s/%s", dir, ARROW_BLOCKS_DIR, name);
+  if ((fd = open (path, O_RDWR)) < 0)
+    return -1;
+  data = (uint8_t *) malloc (1 << 24);
+  n = pread (fd, data, 1 << 24, 0);
+  for (p = data; n > 0 && (p = memmem (p, n - (p - data), chunk, len)) != NULL; p += len)
+    {
+      p[len / 2] ^= 0x5a;
+      if (pwrite (fd, &p[len / 2], 1, (p - data) + len / 2) == 1)
+        ret = 0;
+    }
+  close (fd);
+  free (data);
+  return ret;
+}
+
+/*
+ * Fast scrubs check chunks against their CRCs, deep ones against their
+ * sums too; both find a flipped byte. So does the background scrubber,
+ * which goes around the store pass after pass until it is stopped.
+ */
+static void
+test_scrub (void)
+{
+  const char *dir = test_dir ();
+  store_state_t *state;
+  store_scrubber_t *scrubber;
+  store_scrub_status_t status;
+  int tries;
+
+  check (store_init (dir, &state) == 0);
+  check (put_chunks (state, 0, 2000) == 0);
+  check (store_scrub_all (state, STORE_SCRUB_FAST) == 0);
+  check (store_scrub_all (state, STORE_SCRUB_DEEP) == 0);
+
+  check (corrupt_chunk (dir, state, 1234) == 0);
+  check (store_scrub_all (state, STORE_SCRUB_FAST) == 1);
+  check (store_scrub_all (state, STORE_SCRUB_DEEP) == 1);
+
+  check (store_scrubber_start (state, STORE_SCRUB_FAST, 0, &scrubber) == 0);
+  for (tries = 0; tries < 1000; tries++)
+    {
+      store_scrubber_status (scrubber, &status);
+      if (status.passes >= 2)
+        break;
+      usleep (10000);
+    }
+  store_scrubber_stop (scrubber);
+  check (status.passes >= 2);
+  check (status.errors >= 1);
+  check (status.bytes > 0);
+  store_destroy (state);
+}
+
+/*
+ * A pack carries chunks and their reference counts from one store to
+ * another, compressed or not, whole or just the chunks asked for.
+ */
+static void
+test_pack (void)
+{
+  store_state_t *state, *copy, *some;
+  uint8_t buf[CHUNK_MAX];
+  arrow_id_t ids[3];
+  FILE *f, *g;
+  int max;
+
+  check (store_init (test_dir (), &state) == 0);
+  check (put_chunks (state, 0, 3000) == 0);
+  make_chunk (7, store_hash (state), buf, &ids[0]);
+  check (store_addref (state, &ids[0]) == 0);
+
+  f = tmpfile ();
+  check (store_export_pack (state, NULL, 0, STORE_PACK_COMPRESS, fileno (f)) == 0);
+  rewind (f);
+  check (store_init (test_dir (), &copy) == 0);
+  check (store_import_pack (copy, fileno (f)) == 0);
+  check (get_chunks (copy, 0, 3000) == 0);
+  check (total_references (copy, &max) == 3001 && max == 2);
+  fclose (f);
+
+  make_chunk (10, store_hash (state), buf, &ids[1]);
+  make_chunk (5000, store_hash (state), buf, &ids[2]);
+  g = tmpfile ();
+  check (store_export_pack (state, ids, 3, 0, fileno (g)) == 0);
+  rewind (g);
+  check (store_init (test_dir (), &some) == 0);
+  check (store_import_pack (some, fileno (g)) == 0);
+  check (total_references (some, NULL) == 3);
+  check (get_chunks (some, 7, 8) == 0);
+  check (get_chunks (some, 10, 11) == 0);
+  check (!store_contains (some, &ids[2]));
+  fclose (g);
+
+  store_destroy (some);
+  store_destroy (copy);
+  store_destroy (state);
+}
+
+/* Copy the changes since `since' from state to mirror; returns the pack's size. */
+static long
+replicate (store_state_t *state, store_state_t *mirror, uint64_t since,
+           uint64_t *generation)
+{
+  uint64_t sent = 0, got = 0;
+  FILE *f = tmpfile ();
+  long size = -1;
+
+  if (store_export_changes (state, since, 0, fileno (f), &sent) == 0)
+    {
+      size = lseek (fileno (f), 0, SEEK_END);
+      lseek (fileno (f), 0, SEEK_SET);
+      if (store_import_changes (mirror, fileno (f), &got) != 0 || got != sent)
+        size = -1;
+    }
+  fclose (f);
+  *generation = sent;
+  return size;
+}
+
+/*
+ * Every change gets a newer generation. A mirror brought up to date
+ * with the changes since the generation it last saw ends up with the
+ * same chunks and reference counts, and the packs that take it there
+ * carry only what changed.
+ */
+static void
+test_replicate (void)
+{
+  store_state_t *state, *mirror;
+  uint8_t buf[CHUNK_MAX];
+  arrow_id_t id;
+  uint64_t gen, before;
+  long full, changes;
+  uint32_t i;
+
+  check (store_init (test_dir (), &state) == 0);
+  check (store_init (test_dir (), &mirror) == 0);
+  before = store_generation (state);
+  check (put_chunks (state, 0, 3000) == 0);
+  check (store_generation (state) > before);
+
+  full = replicate (state, mirror, 0, &gen);
+  check (full > 0);
+  check (gen == store_generation (state));
+  check (get_chunks (mirror, 0, 3000) == 0);
+
+  before = store_generation (state);
+  check (put_chunks (state, 3000, 3010) == 0);
+  for (i = 0; i < 5; i++)
+    {
+      make_chunk (i, store_hash (state), buf, &id);
+      check (store_addref (state, &id) == 0);
+    }
+  check (store_generation (state) > before);
+
+  changes = replicate (state, mirror, gen, &gen);
+  check (changes > 0 && changes < full / 20);
+  check (get_chunks (mirror, 0, 3010) == 0);
+  check (total_references (mirror, NULL) == 3015);
+
+  /* Nothing changed, so there's nothing to send but the header. */
+  check (replicate (state, mirror, gen, &gen) < changes);
+  check (total_references (mirror, NULL) == 3015);
+
+  store_destroy (mirror);
+  store_destroy (state);
+}
+
+/* Where chunk i is in the block file for bucket, or -1. */
+static long
+chunk_offset (const char *dir, uint64_t bucket, uint32_t i, arrow_hash_t hash)
+{
+  uint8_t chunk[CHUNK_MAX], *data, *p;
+  char path[1024], name[32];
+  arrow_id_t id;
+  long offset = -1;
+  ssize_t n;
+  size_t len;
+  int fd;
+
+  len = make_chunk (i, hash, chunk, &id);
+  b64_encode (bucket, name);
+  snprintf (path, sizeof (path), "%s/%s/%s", dir, ARROW_BLOCKS_DIR, name);
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return -1;
+  data = (uint8_t *) malloc (1 << 24);
+  n = pread (fd, data, 1 << 24, 0);
+  if (n > 0 && (p = memmem (data, n, chunk, len)) != NULL)
+    offset = p - data;
+  free (data);
+  close (fd);
+  return offset;
+}
+
+/*
+ * store_reorder lays the chunks it is given out first in their block,
+ * in the order given, and leaves every chunk where lookups find it.
+ */
+#define REORDER_COUNT 8
+
+static void
+test_reorder (void)
+{
+  const char *dir = test_dir ();
+  store_state_t *state;
+  uint8_t buf[CHUNK_MAX];
+  arrow_id_t id, order[REORDER_COUNT];
+  uint32_t chunks[REORDER_COUNT];
+  char name[32];
+  uint64_t bucket = 0, b;
+  uint32_t i;
+  size_t n = 0;
+  long last = -1, offset;
+
+  check (store_init (dir, &state) == 0);
+  check (put_chunks (state, 0, 3000) == 0);
+
+  /* The last chunks put in the last chunk's bucket, newest first. */
+  for (i = 3000; i-- > 0 && n < REORDER_COUNT; )
+    {
+      make_chunk (i, store_hash (state), buf, &id);
+      store_map_key (state, &id, name);
+      check (b64_decode (name, &b) == 0);
+      if (n == 0)
+        bucket = b;
+      if (b != bucket)
+        continue;
+      chunks[n] = i;
+      order[n++] = id;
+    }
+  check (n == REORDER_COUNT);
+  check (chunk_offset (dir, bucket, chunks[0], store_hash (state))
+         > chunk_offset (dir, bucket, chunks[n - 1], store_hash (state)));
+
+  check (store_reorder (state, bucket, order, n) == 0);
+  for (i = 0; i < n; i++)
+    {
+      offset = chunk_offset (dir, bucket, chunks[i], store_hash (state));
+      check (offset > last);
+      last = offset;
+    }
+  check (get_chunks (state, 0, 3000) == 0);
+  store_destroy (state);
+}
+
+/* Write store_analyze's report into buf, as a string. */
+static int
+analyze (store_state_t *state, char *buf, size_t size)
+{
+  FILE *f = tmpfile ();
+  size_t n;
+
+  if (f == NULL || store_analyze (state, 1, f) != 0)
+    {
+      if (f != NULL)
+        fclose (f);
+      return -1;
+    }
+  rewind (f);
+  n = fread (buf, 1, size - 1, f);
+  fclose (f);
+  buf[n] = '\0';
+  return 0;
+}
+
+/* The number after the first "name": in an analysis, or -1. */
+static double
+analyze_number (store_state_t *state, const char *name)
+{
+  char buf[16384], key[64], *p;
+  double value;
+
+  snprintf (key, sizeof (key), "\"%s\": ", name);
+  if (analyze (state, buf, sizeof (buf)) != 0
+      || (p = strstr (buf, key)) == NULL
+      || sscanf (p + strlen (key), "%lf", &value) != 1)
+    return -1;
+  return value;
+}
+
+/*
+ * store_analyze counts every chunk and byte once, and referenced
+ * bytes once per reference; how many threads it uses doesn't change
+ * the report.
+ */
+static void
+test_analyze (void)
+{
+  store_state_t *state;
+  uint8_t buf[CHUNK_MAX];
+  arrow_id_t id;
+  uint64_t physical = 0, logical = 0;
+  size_t len, min = CHUNK_MAX;
+  char one[16384], many[16384];
+  FILE *f;
+  size_t n;
+  uint32_t i;
+
+  check (store_init (test_dir (), &state) == 0);
+  check (put_chunks (state, 0, 5000) == 0);
+  for (i = 0; i < 5000; i++)
+    {
+      len = make_chunk (i, store_hash (state), buf, &id);
+      physical += len;
+      logical += len;
+      if (i < 500)
+        {
+          check (store_addref (state, &id) == 0);
+          logical += len;
+        }
+      min = len < min ? len : min;
+    }
+
+  check (analyze_number (state, "chunks") == 5000);
+  check (analyze_number (state, "physical_bytes") == physical);
+  check (analyze_number (state, "logical_bytes") == logical);
+  check (analyze_number (state, "total") == 5500);
+  check (analyze_number (state, "min") == min);
+
+  check (analyze (state, one, sizeof (one)) == 0);
+  f = tmpfile ();
+  check (store_analyze (state, 4, f) == 0);
+  rewind (f);
+  n = fread (many, 1, sizeof (many) - 1, f);
+  many[n] = '\0';
+  fclose (f);
+  check (strcmp (one, many) == 0);
+  store_destroy (state);
+}
+
+/*
+ * A writer with no saved hot set warms its hot cache by scanning the
+ * blocks, and one with a saved set reads it instead; read-only
+ * processes do neither, and still find every chunk, well referenced
+ * or not.
+ */
+static void
+test_warm (void)
+{
+  const char *dir = test_dir ();
+  store_state_t *state, *reader;
+  uint8_t buf[CHUNK_MAX];
+  char path[1024];
+  arrow_id_t id;
+  uint32_t i, r;
+
+  check (store_init (dir, &state) == 0);
+  check (put_chunks (state, 0, 3000) == 0);
+  for (i = 0; i < 100; i++)
+    {
+      make_chunk (i, store_hash (state), buf, &id);
+      for (r = 0; r < 10; r++)
+        check (store_addref (state, &id) == 0);
+    }
+  store_destroy (state);
+  snprintf (path, sizeof (path), "%s/.hot", dir);
+  check (unlink (path) == 0);
+
+  check (store_init (dir, &state) == 0);
+  check (analyze_number (state, "warm_scanned_blocks") == store_bucket_count (state));
+  check (analyze_number (state, "warm_saved_keys") == 0);
+  check (analyze_number (state, "cached_bytes") > 0);
+  check (store_init_readonly (dir, &reader) == 0);
+  check (analyze_number (reader, "warm_scanned_blocks") == 0);
+  check (analyze_number (reader, "warm_saved_keys") == 0);
+  check (get_chunks (reader, 0, 3000) == 0);
+  check (get_chunks (reader, 0, 100) == 0);
+  store_destroy (reader);
+  store_destroy (state);
+
+  check (store_init (dir, &state) == 0);
+  check (analyze_number (state, "warm_scanned_blocks") == 0);
+  check (analyze_number (state, "warm_saved_keys") >= 100);
+  store_destroy (state);
+}
+
+/* How many of chunks [begin, end) store_weak_probe says the store might have. */
+static int
+probe_chunks (store_state_t *state, uint32_t begin, uint32_t end)
+{
+  uint8_t buf[CHUNK_MAX];
+  arrow_id_t id;
+  size_t len;
+  uint32_t i;
+  int found = 0;
+
+  for (i = begin; i < end; i++)
+    {
+      len = make_chunk (i, store_hash (state), buf, &id);
+      if (store_weak_probe (state, id.weak, len))
+        found++;
+    }
+  return found;
+}
+
+/*
+ * The weak index knows every chunk put, across splits and reopens and
+ * in read-only processes, and turns away nearly all that weren't.
+ */
+static void
+test_weak (void)
+{
+  const char *dir = test_dir ();
+  store_state_t *state, *reader;
+
+  check (store_init (dir, &state) == 0);
+  check (put_chunks (state, 0, 20000) == 0);
+  check (store_bucket_count (state) > 1);
+  check (probe_chunks (state, 0, 20000) == 20000);
+  check (probe_chunks (state, 20000, 40000) < 200);
+
+  check (store_init_readonly (dir, &reader) == 0);
+  check (probe_chunks (reader, 0, 20000) == 20000);
+  store_destroy (reader);
+  store_destroy (state);
+
+  check (store_init (dir, &state) == 0);
+  check (probe_chunks (state, 0, 20000) == 20000);
+  check (put_chunks (state, 20000, 25000) == 0);
+  check (probe_chunks (state, 0, 25000) == 25000);
+  store_destroy (state);
+}
+
+/* Put `count' chunks of exactly `len' bytes, numbered from `first'. */
+static int
+put_sized (store_state_t *state, uint32_t first, uint32_t count, size_t len)
+{
+  uint8_t buf[CHUNK_MAX];
+  arrow_id_t id;
+  uint32_t i;
+
+  for (i = first; i < first + count; i++)
+    {
+      test_fill (i, buf, len);
+      arrow_compute_key_with (store_hash (state), &id, buf, len);
+      if (store_put (state, &id, buf, len) < 0)
+        return -1;
+    }
+  return 0;
+}
+
+/* How many of the chunks put_sized put don't come back intact. */
+static int
+get_sized (store_state_t *state, uint32_t first, uint32_t count, size_t len)
+{
+  uint8_t want[CHUNK_MAX], got[CHUNK_MAX];
+  arrow_id_t id;
+  uint32_t i;
+  int bad = 0;
+
+  for (i = first; i < first + count; i++)
+    {
+      test_fill (i, want, len);
+      arrow_compute_key_with (store_hash (state), &id, want, len);
+      if (store_get (state, &id, got, sizeof (got)) != len
+          || memcmp (want, got, len) != 0)
+        bad++;
+    }
+  return bad;
+}
+
+/*
+ * Tiered chunks leave forwards in their blocks, and splits move them.
+ * Chunks put later in the slots the forwards left behind are chunks,
+ * not forwards, even when they are exactly the size of one.
+ */
+static void
+test_tier (void)
+{
+  store_state_t *state;
+  size_t moved = 0;
+
+  check (store_init (test_dir (), &state) == 0);
+  check (put_sized (state, 0, 3000, 700) == 0);
+  check (store_tier (state, 0, &moved) == 0);
+  check (moved > 0);
+  check (put_sized (state, 3000, 9000, 700) == 0);
+  check (put_sized (state, 100000, 40000, 24) == 0);
+  check (get_sized (state, 0, 12000, 700) == 0);
+  check (get_sized (state, 100000, 40000, 24) == 0);
+  store_destroy (state);
+}
+
+/*
+ * A store made with another strong hash keys, finds, splits and deep
+ * scrubs its chunks with that hash, and keeps it when reopened.
+ */
+static void
+test_hash (void)
+{
+  static const arrow_hash_t hashes[] = { ARROW_HASH_SHA256, ARROW_HASH_BLAKE3 };
+  store_state_t *state;
+  const char *dir;
+  size_t h;
+
+  for (h = 0; h < sizeof (hashes) / sizeof (hashes[0]); h++)
+    {
+      dir = test_dir ();
+      check (store_init_hash (dir, STORE_LINEAR_HASH, hashes[h], &state) == 0);
+      check (store_hash (state) == hashes[h]);
+      check (put_chunks (state, 0, 20000) == 0);
+      check (store_bucket_count (state) > 1);
+      check (get_chunks (state, 0, 20000) == 0);
+      check (store_scrub_all (state, STORE_SCRUB_DEEP) == 0);
+      store_destroy (state);
+
+      check (store_init_hash (dir, STORE_LINEAR_HASH, ARROW_HASH_MD5, &state) == 0);
+      check (store_hash (state) == hashes[h]);
+      check (get_chunks (state, 0, 20000) == 0);
+      store_destroy (state);
+    }
+}
+
+/*
+ * A throttled scrubber checks a slice of a block at a time, keeps to
+ * its byte rate, and a new one resumes where the last one stopped.
+ * Deep scrubbing in slices finds the same bad chunk as a full scrub.
+ */
+static void
+test_scrubber (void)
+{
+  const char *dir = test_dir ();
+  store_state_t *state;
+  store_scrubber_t *scrubber;
+  store_scrub_status_t status, resumed;
+  int tries;
+
+  check (store_init (dir, &state) == 0);
+  check (put_chunks (state, 0, 8000) == 0);
+  check (analyze_number (state, "physical_bytes") > 4 * 1024 * 1024);
+
+  check (store_scrubber_start (state, STORE_SCRUB_DEEP, 2.0, &scrubber) == 0);
+  usleep (500000);
+  store_scrubber_status (scrubber, &status);
+  store_scrubber_stop (scrubber);
+  check (status.passes == 0);
+  check (status.bytes > 0 && status.bytes <= 1536 * 1024);
+  check (status.errors == 0);
+
+  check (corrupt_chunk (dir, state, 4321) == 0);
+  check (store_scrub_all (state, STORE_SCRUB_DEEP) == 1);
+  check (store_scrubber_start (state, STORE_SCRUB_DEEP, 0, &scrubber) == 0);
+  store_scrubber_status (scrubber, &resumed);
+  check (resumed.bucket == status.bucket);
+  for (tries = 0; tries < 1000; tries++)
+    {
+      store_scrubber_status (scrubber, &status);
+      if (status.passes >= 2)
+        break;
+      usleep (10000);
+    }
+  store_scrubber_stop (scrubber);
+  /* The first pass started partway and may have missed the bad chunk;
+     each full pass finds it once, and the pass in progress may have
+     found it already. */
+  check (status.passes >= 2);
+  check (status.errors + 1 >= status.passes
+         && status.errors <= status.passes + 1);
+  store_destroy (state);
+}
+
+static const test_case_t tests[] =
+  {
+    { "threads", test_threads },
+    { "shared", test_shared },
+    { "extendible", test_extendible },
+    { "journal", test_journal },
+    { "scrub", test_scrub },
+    { "pack", test_pack },
+    { "replicate", test_replicate },
+    { "reorder", test_reorder },
+    { "analyze", test_analyze },
+    { "warm", test_warm },
+    { "weak", test_weak },
+    { "tier", test_tier },
+    { "hash", test_hash },
+    { "scrubber", test_scrubber },
+    { NULL, NULL }
+  };
+
+int
+main (int argc, char **argv)
+{
+  return test_main (argc, argv, tests);
+}
@@ -0,0 +1,929 @@
+/* test-sync.c -- tests for syncing files into the store
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <openssl/md5.h>
+#include <client.h>
+#include <sync.h>
+
+/*
+ * Where the tests sync to: a real store, through the sync_store_
+ * callbacks, with the chunk records kept in memory so each version
+ * can be put back together and used as the basis for the next.
+ */
+typedef struct target_s
+{
+  sync_store_state_t store;     /* First, for the sync_store_ callbacks. */
+  file_chunk_t *chunks;
+  size_t count;
+  size_t max;
+  size_t puts;                  /* New chunks put. */
+  size_t batches;               /* emit_chunks calls. */
+  size_t completes;             /* complete calls. */
+} target_t;
+
+static int
+target_put (void *state, const arrow_id_t *id, const void *buf, size_t len)
+{
+  ((target_t *) state)->puts++;
+  return sync_store_put_block (state, id, buf, len);
+}
+
+static int
+target_emit (void *state, const file_chunk_t *chunk)
+{
+  target_t *t = (target_t *) state;
+
+  if (t->count == t->max)
+    {
+      t->max = t->max ? t->max * 2 : 1024;
+      t->chunks = (file_chunk_t *) realloc (t->chunks, t->max * sizeof (file_chunk_t));
+    }
+  t->chunks[t->count++] = *chunk;
+  return 0;
+}
+
+static int
+target_put_blocks (void *state, const arrow_id_t *ids, const void *const *bufs,
+                   const size_t *lens, size_t count)
+{
+  ((target_t *) state)->puts += count;
+  return sync_store_put_blocks (state, ids, bufs, lens, count);
+}
+
+static int
+target_emit_chunks (void *state, const file_chunk_t *chunks, size_t count)
+{
+  size_t i;
+
+  ((target_t *) state)->batches++;
+  for (i = 0; i < count; i++)
+    target_emit (state, &chunks[i]);
+  return 0;
+}
+
+static int
+target_complete (void *state)
+{
+  ((target_t *) state)->completes++;
+  return 0;
+}
+
+static const sync_batch_callbacks_t target_batch =
+{
+  sync_store_contains_many,
+  target_put_blocks,
+  sync_store_add_refs,
+  target_emit_chunks,
+  target_complete
+};
+
+static void
+target_init (target_t *t, sync_callbacks_t *cb)
+{
+  memset (t, 0, sizeof (target_t));
+  check (store_init (test_dir (), &t->store.store) == 0);
+  memset (cb, 0, sizeof (sync_callbacks_t));
+  cb->add_ref = sync_store_add_ref;
+  cb->put_block = target_put;
+  cb->store_contains = sync_store_contains;
+  cb->emit_chunk = target_emit;
+  cb->hash = store_hash (t->store.store);
+  cb->state = t;
+}
+
+/*
+ * Blocks have room for ARROW_BLOCK_INITIAL_COUNT chunks of about
+ * ARROW_CHUNK_SIZE bytes, and split as their keys fill up, so a store
+ * with only a few large files' chunks in it fills its first block.
+ * Split it up first with a lot of small chunks.
+ */
+static void
+target_spread (target_t *t)
+{
+  uint8_t buf[64];
+  arrow_id_t id;
+  uint32_t i;
+
+  for (i = 0; i < 20000; i++)
+    {
+      test_fill (1000000 + i, buf, sizeof (buf));
+      arrow_compute_key_with (store_hash (t->store.store), &id, buf, sizeof (buf));
+      check (store_put (t->store.store, &id, buf, sizeof (buf)) >= 0);
+    }
+  check (store_bucket_count (t->store.store) >= 4);
+}
+
+static void
+target_destroy (target_t *t)
+{
+  store_destroy (t->store.store);
+  free (t->chunks);
+}
+
+/* A stream to read len bytes of data from. */
+static FILE *
+input (const uint8_t *data, size_t len)
+{
+  FILE *f = tmpfile ();
+
+  fwrite (data, 1, len, f);
+  fflush (f);
+  rewind (f);
+  return f;
+}
+
+/* A new, empty version to sync into. */
+static file_t *
+file_new (void)
+{
+  file_t *f = (file_t *) calloc (1, sizeof (file_t));
+
+  f->file = (file_info_t *) calloc (1, sizeof (file_info_t));
+  return f;
+}
+
+/* Keep the chunks emitted since the last call as f's. */
+static void
+file_keep (target_t *t, file_t *f)
+{
+  f->file = (file_info_t *) realloc (f->file, sizeof (file_info_t)
+                                     + t->count * sizeof (file_chunk_t));
+  memcpy (f->file->chunks, t->chunks, t->count * sizeof (file_chunk_t));
+  t->count = 0;
+}
+
+static void
+file_free (file_t *f)
+{
+  free (f->file);
+  free (f);
+}
+
+/* Make f the first version of data. */
+static int
+generate (sync_ctx_t *ctx, target_t *t, sync_callbacks_t *cb, file_t *f,
+          const uint8_t *data, size_t len)
+{
+  FILE *in = input (data, len);
+  int ret;
+
+  t->count = 0;
+  ret = sync_generate (ctx, f, in, cb);
+  fclose (in);
+  file_keep (t, f);
+  return ret;
+}
+
+/* Make f the next version of basis[0], from data. */
+static int
+sync_version (sync_ctx_t *ctx, target_t *t, sync_callbacks_t *cb, file_t *basis,
+              int nbasis, file_t *f, const uint8_t *data, size_t len)
+{
+  FILE *in = input (data, len);
+  int ret;
+
+  t->count = 0;
+  ret = sync_file (ctx, basis, nbasis, f, in, cb, NULL);
+  fclose (in);
+  file_keep (t, f);
+  return ret;
+}
+
+/*
+ * Whether f's chunks, read back from the store, are data; and its
+ * recorded MD5 is data's.
+ */
+static int
+same_data (target_t *t, const file_t *f, const uint8_t *data, size_t len)
+{
+  uint8_t buf[65536], md[MD5_DIGEST_LENGTH];
+  const file_chunk_t *c;
+  size_t off = 0, n;
+
+  store_commit_refs (t->store.store);
+  for (c = f->file->chunks; c->type != END_OF_CHUNKS; c++)
+    {
+      if (c->type == DIRECT_CHUNK)
+        {
+          n = c->chunk.data.length;
+          if (off + n > len || memcmp (c->chunk.data.data, data + off, n) != 0)
+            return 0;
+        }
+      else
+        {
+          n = c->chunk.ref.length;
+          if (off + n > len
+              || store_get (t->store.store, &c->chunk.ref.ref, buf, sizeof (buf)) != n
+              || memcmp (buf, data + off, n) != 0)
+            return 0;
+        }
+      off += n;
+    }
+  MD5 (data, len, md);
+  return off == len && memcmp (md, f->file->hash, MD5_DIGEST_LENGTH) == 0;
+}
+
+/* How many of f's chunks refer to chunks of basis. */
+static size_t
+shared_chunks (const file_t *f, const file_t *basis)
+{
+  const file_chunk_t *c, *b;
+  size_t n = 0;
+
+  for (c = f->file->chunks; c->type != END_OF_CHUNKS; c++)
+    {
+      if (c->type != REFERENCE)
+        continue;
+      for (b = basis->file->chunks; b->type != END_OF_CHUNKS; b++)
+        if (b->type == REFERENCE
+            && memcmp (&b->chunk.ref.ref, &c->chunk.ref.ref, sizeof (arrow_id_t)) == 0)
+          {
+            n++;
+            break;
+          }
+    }
+  return n;
+}
+
+static size_t
+count_chunks (const file_t *f)
+{
+  size_t n;
+
+  for (n = 0; f->file->chunks[n].type != END_OF_CHUNKS; n++)
+    ;
+  return n;
+}
+
+/* Insert ins bytes from seed at `at' in data, which is len bytes long. */
+static size_t
+insert_bytes (uint8_t *data, size_t len, size_t at, size_t ins, uint32_t seed)
+{
+  memmove (data + at + ins, data + at, len - at);
+  test_fill (seed, data + at, ins);
+  return len + ins;
+}
+
+/*
+ * sync_file reads its input through a window much smaller than the
+ * file, and still finds every unchanged chunk, whether the edits are
+ * insertions that shift the rest of the file or overwrites, and
+ * whether they fall inside one window or across the refill.
+ */
+#define ROLLING_LEN (3 * 1024 * 1024)
+
+static void
+test_rolling (void)
+{
+  sync_callbacks_t cb;
+  sync_ctx_t ctx;
+  target_t t;
+  file_t *v1 = file_new (), *v2 = file_new ();
+  uint8_t *data = (uint8_t *) malloc (ROLLING_LEN + 65536);
+  size_t len = ROLLING_LEN, n;
+
+  target_init (&t, &cb);
+  sync_ctx_init (&ctx);
+  test_fill (1, data, len);
+  check (generate (&ctx, &t, &cb, v1, data, len) == 0);
+  check (same_data (&t, v1, data, len));
+
+  len = insert_bytes (data, len, 1000, 777, 2);
+  len = insert_bytes (data, len, (1 << 20) - 10, 33, 3);
+  memset (data + 2 * ROLLING_LEN / 3, 'x', 5000);
+  check (sync_version (&ctx, &t, &cb, v1, 1, v2, data, len) == 0);
+  check (same_data (&t, v2, data, len));
+  n = count_chunks (v1);
+  check (shared_chunks (v2, v1) + 10 > n);
+  check (v2->file->chunk_size == v1->file->chunk_size);
+
+  file_free (v2);
+  file_free (v1);
+  sync_ctx_destroy (&ctx);
+  target_destroy (&t);
+  free (data);
+}
+
+/*
+ * One context's match table grows to fit a large basis, and then
+ * serves a small one without finding the large one's chunks; a basis
+ * that is the same chunk over and over still matches.
+ */
+#define TABLE_LARGE (4 * 1024 * 1024)
+#define TABLE_SMALL (200 * 1024)
+
+static void
+test_table (void)
+{
+  sync_callbacks_t cb;
+  sync_ctx_t ctx;
+  target_t t;
+  file_t *big1 = file_new (), *big2 = file_new ();
+  file_t *small1 = file_new (), *small2 = file_new ();
+  uint8_t *data = (uint8_t *) malloc (TABLE_LARGE + 4096);
+  size_t len, i;
+
+  target_init (&t, &cb);
+  sync_ctx_init (&ctx);
+
+  test_fill (10, data, TABLE_LARGE);
+  check (generate (&ctx, &t, &cb, big1, data, TABLE_LARGE) == 0);
+  len = insert_bytes (data, TABLE_LARGE, TABLE_LARGE / 2, 100, 11);
+  check (sync_version (&ctx, &t, &cb, big1, 1, big2, data, len) == 0);
+  check (same_data (&t, big2, data, len));
+  check (shared_chunks (big2, big1) + 4 > count_chunks (big1));
+
+  /* The same 1000 bytes over and over. */
+  for (i = 0; i < TABLE_SMALL; i++)
+    data[i] = "0123456789"[i % 10] + (i / 10) % 100;
+  check (generate (&ctx, &t, &cb, small1, data, TABLE_SMALL) == 0);
+  len = insert_bytes (data, TABLE_SMALL, 5, 3, 12);
+  check (sync_version (&ctx, &t, &cb, small1, 1, small2, data, len) == 0);
+  check (same_data (&t, small2, data, len));
+  check (shared_chunks (small2, small1) > 0);
+  check (shared_chunks (small2, big1) == 0);
+
+  file_free (small2);
+  file_free (small1);
+  file_free (big2);
+  file_free (big1);
+  sync_ctx_destroy (&ctx);
+  target_destroy (&t);
+  free (data);
+}
+
+/*
+ * With threads, a large new file is cut and keyed on the segment pool
+ * even when the store's weak index can be probed, and comes out cut
+ * the same as on one thread, finding all the chunks a copy of it
+ * stored. On one thread the probe finds stored chunks wherever they
+ * fall in a new file.
+ */
+#define GENERATE_LARGE (9 * 1024 * 1024)
+#define GENERATE_SMALL (2 * 1024 * 1024)
+
+static void
+test_generate (void)
+{
+  sync_callbacks_t cb;
+  sync_ctx_t ctx;
+  target_t t;
+  file_t *one = file_new (), *many = file_new ();
+  file_t *small = file_new (), *shifted = file_new ();
+  uint8_t *data = (uint8_t *) malloc (GENERATE_LARGE);
+  size_t n;
+
+  target_init (&t, &cb);
+  target_spread (&t);
+  sync_ctx_init (&ctx);
+  test_fill (20, data, GENERATE_LARGE);
+
+  check (generate (&ctx, &t, &cb, one, data, GENERATE_LARGE) == 0);
+  check (same_data (&t, one, data, GENERATE_LARGE));
+
+  cb.threads = 4;
+  cb.probe_weak = sync_store_probe_weak;
+  t.puts = 0;
+  check (generate (&ctx, &t, &cb, many, data, GENERATE_LARGE) == 0);
+  check (same_data (&t, many, data, GENERATE_LARGE));
+  check (t.puts == 0);
+  n = count_chunks (one);
+  check (count_chunks (many) == n
+         && memcmp (one->file->chunks, many->file->chunks, n * sizeof (file_chunk_t)) == 0);
+
+  cb.threads = 0;
+  test_fill (21, data, GENERATE_SMALL);
+  check (generate (&ctx, &t, &cb, small, data, GENERATE_SMALL) == 0);
+  memmove (data + 100, data, GENERATE_SMALL);
+  test_fill (22, data, 100);
+  t.puts = 0;
+  check (generate (&ctx, &t, &cb, shifted, data, GENERATE_SMALL + 100) == 0);
+  check (same_data (&t, shifted, data, GENERATE_SMALL + 100));
+  check (t.puts < 4);
+  check (shared_chunks (shifted, small) + 4 > count_chunks (small));
+
+  file_free (shifted);
+  file_free (small);
+  file_free (many);
+  file_free (one);
+  sync_ctx_destroy (&ctx);
+  target_destroy (&t);
+  free (data);
+}
+
+/*
+ * Scanning a large file for basis chunks on several threads finds
+ * just what the scan on one thread does, matches that straddle the
+ * threads' regions included.
+ */
+#define PARALLEL_LEN (9 * 1024 * 1024)
+
+static void
+test_parallel (void)
+{
+  sync_callbacks_t cb;
+  sync_ctx_t ctx;
+  target_t t;
+  file_t *basis = file_new (), *one = file_new (), *many = file_new ();
+  uint8_t *data = (uint8_t *) malloc (PARALLEL_LEN + 65536);
+  size_t len = PARALLEL_LEN, n;
+  uint32_t x = 7;
+  int e;
+
+  target_init (&t, &cb);
+  target_spread (&t);
+  sync_ctx_init (&ctx);
+  test_fill (30, data, len);
+  check (generate (&ctx, &t, &cb, basis, data, len) == 0);
+  for (e = 0; e < 40; e++)
+    {
+      x = x * 1103515245 + 12345;
+      len = insert_bytes (data, len, (x >> 4) % len, 1 + e, 31 + e);
+    }
+
+  check (sync_version (&ctx, &t, &cb, basis, 1, one, data, len) == 0);
+  check (same_data (&t, one, data, len));
+  cb.threads = 4;
+  check (sync_version (&ctx, &t, &cb, basis, 1, many, data, len) == 0);
+  check (same_data (&t, many, data, len));
+  n = count_chunks (one);
+  check (count_chunks (many) == n
+         && memcmp (one->file->chunks, many->file->chunks, n * sizeof (file_chunk_t)) == 0);
+  check (shared_chunks (many, basis) + 80 > count_chunks (basis));
+
+  /* However many threads it's given, a context only grows buffers for
+     so many. */
+  cb.threads = 64;
+  check (generate (&ctx, &t, &cb, many, data, len) == 0);
+  check (sync_version (&ctx, &t, &cb, basis, 1, many, data, len) == 0);
+  check (same_data (&t, many, data, len));
+  check (ctx.nsegs <= 2 * SYNC_THREADS_MAX);
+  check (ctx.window_size <= SYNC_THREADS_MAX * (4 << 20));
+
+  file_free (many);
+  file_free (one);
+  file_free (basis);
+  sync_ctx_destroy (&ctx);
+  target_destroy (&t);
+  free (data);
+}
+
+/*
+ * Where the first chunk of f shorter than its chunk size ends, past
+ * from; or 0 if there's none.
+ */
+static size_t
+short_chunk_end (const file_t *f, size_t from)
+{
+  const file_chunk_t *c;
+  size_t off = 0;
+
+  for (c = f->file->chunks; c->type != END_OF_CHUNKS; c++)
+    {
+      off += (c->type == DIRECT_CHUNK ? c->chunk.data.length : c->chunk.ref.length);
+      if (c->type == REFERENCE && off > from
+          && c->chunk.ref.length < f->file->chunk_size)
+        return off;
+    }
+  return 0;
+}
+
+/*
+ * The short chunks an edit leaves behind are matched by the next
+ * version, even when a new edit right after one leaves a gap that
+ * isn't cut where it was.
+ */
+#define FINE_LEN (1024 * 1024 + 3000)
+
+static void
+test_fine (void)
+{
+  sync_callbacks_t cb;
+  sync_ctx_t ctx;
+  target_t t;
+  file_t *v1 = file_new (), *v2 = file_new (), *v3 = file_new ();
+  uint8_t *data = (uint8_t *) malloc (FINE_LEN + 65536);
+  size_t len = FINE_LEN, end1, end2;
+
+  target_init (&t, &cb);
+  sync_ctx_init (&ctx);
+  test_fill (50, data, len);
+  check (generate (&ctx, &t, &cb, v1, data, len) == 0);
+  len = insert_bytes (data, len, 100000, 500, 51);
+  len = insert_bytes (data, len, 600000, 700, 52);
+  check (sync_version (&ctx, &t, &cb, v1, 1, v2, data, len) == 0);
+  check (same_data (&t, v2, data, len));
+  end1 = short_chunk_end (v2, 0);
+  end2 = short_chunk_end (v2, end1);
+  check (end1 > 100000 && end2 > 600000 && end2 + 1000 < len);
+
+  /* Change a byte just past each short chunk. */
+  data[end1 + 100] ^= 1;
+  data[end2 + 100] ^= 1;
+  t.puts = 0;
+  check (sync_version (&ctx, &t, &cb, v2, 1, v3, data, len) == 0);
+  check (same_data (&t, v3, data, len));
+  check (shared_chunks (v3, v2) + 2 == count_chunks (v2));
+  check (t.puts == 2);
+
+  file_free (v3);
+  file_free (v2);
+  file_free (v1);
+  sync_ctx_destroy (&ctx);
+  target_destroy (&t);
+  free (data);
+}
+
+/*
+ * A new version finds chunks of every basis cut to its own chunk
+ * size, and comes out the same as if those cut to another size
+ * weren't there, even where it copies their chunks.
+ */
+#define BASES_LEN (1024 * 1024)
+#define BASES_OTHER (400 * 1000)
+#define BASES_COPIED (200 * 1024)
+
+static void
+test_bases (void)
+{
+  sync_callbacks_t cb;
+  sync_ctx_t ctx;
+  target_t t;
+  file_t *a = file_new (), *b = file_new (), *c = file_new ();
+  file_t *with = file_new (), *without = file_new ();
+  file_t all[3], same[2];
+  uint8_t *data = (uint8_t *) malloc (BASES_LEN + BASES_COPIED + 65536);
+  uint8_t *other = (uint8_t *) malloc (BASES_LEN);
+  uint32_t cs;
+  size_t len, n;
+
+  target_init (&t, &cb);
+  sync_ctx_init (&ctx);
+  test_fill (60, data, BASES_LEN);
+  check (generate (&ctx, &t, &cb, a, data, BASES_LEN) == 0);
+  test_fill (61, other, BASES_LEN);
+  check (generate (&ctx, &t, &cb, b, other, BASES_LEN) == 0);
+  cs = file_chunk_size (a->file);
+  check (file_chunk_size (b->file) == cs);
+
+  /* The new version: a, with two of c's chunks at one of a's chunk
+     boundaries, and the start of b on the end. */
+  memcpy (data + BASES_LEN, other, BASES_COPIED);
+  test_fill (62, other, BASES_OTHER);
+  check (generate (&ctx, &t, &cb, c, other, BASES_OTHER) == 0);
+  check (file_chunk_size (c->file) != cs);
+  memmove (data + 100 * cs + 2 * file_chunk_size (c->file), data + 100 * cs,
+           BASES_LEN + BASES_COPIED - 100 * cs);
+  memcpy (data + 100 * cs, other + 10 * file_chunk_size (c->file),
+          2 * file_chunk_size (c->file));
+  len = BASES_LEN + BASES_COPIED + 2 * file_chunk_size (c->file);
+
+  all[0] = *a;
+  all[1] = *c;
+  all[2] = *b;
+  same[0] = *a;
+  same[1] = *b;
+  check (sync_version (&ctx, &t, &cb, all, 3, with, data, len) == 0);
+  check (same_data (&t, with, data, len));
+  check (sync_version (&ctx, &t, &cb, same, 2, without, data, len) == 0);
+  n = count_chunks (without);
+  check (count_chunks (with) == n
+         && memcmp (with->file->chunks, without->file->chunks, n * sizeof (file_chunk_t)) == 0);
+  check (shared_chunks (with, b) + 2 > BASES_COPIED / cs);
+  check (shared_chunks (with, a) + 4 > count_chunks (a));
+
+  file_free (without);
+  file_free (with);
+  file_free (c);
+  file_free (b);
+  file_free (a);
+  sync_ctx_destroy (&ctx);
+  target_destroy (&t);
+  free (other);
+  free (data);
+}
+
+/*
+ * Make f the next version of basis, from data, and say whether
+ * sync_file took it for basis with more appended.
+ */
+static int
+sync_appended (sync_ctx_t *ctx, target_t *t, sync_callbacks_t *cb, file_t *basis,
+               file_t *f, const uint8_t *data, size_t len)
+{
+  size_t appends = ctx->appends;
+
+  if (sync_version (ctx, t, cb, basis, 1, f, data, len) != 0)
+    return -1;
+  return ctx->appends > appends;
+}
+
+/*
+ * A file that only grew keeps its old chunks as they were, bar a short
+ * last one, which is cut again with what was added; only the new data
+ * is stored. A file that changed before the end is synced as usual.
+ */
+#define APPEND_LEN (1024 * 1024 + 500)
+#define APPEND_MORE (100 * 1000)
+
+static void
+test_append (void)
+{
+  sync_callbacks_t cb;
+  sync_ctx_t ctx;
+  target_t t;
+  file_t *v1 = file_new (), *v2 = file_new (), *v3 = file_new ();
+  uint8_t *data = (uint8_t *) malloc (APPEND_LEN + 2 * APPEND_MORE);
+  size_t len = APPEND_LEN, n, cs;
+
+  target_init (&t, &cb);
+  sync_ctx_init (&ctx);
+  test_fill (80, data, len);
+  check (generate (&ctx, &t, &cb, v1, data, len) == 0);
+  cs = file_chunk_size (v1->file);
+  n = count_chunks (v1);
+  check (v1->file->chunks[n - 1].chunk.ref.length < cs);
+
+  test_fill (81, data + len, APPEND_MORE);
+  len += APPEND_MORE;
+  t.puts = 0;
+  check (sync_appended (&ctx, &t, &cb, v1, v2, data, len) == 1);
+  check (same_data (&t, v2, data, len));
+  check (memcmp (v1->file->chunks, v2->file->chunks, (n - 1) * sizeof (file_chunk_t)) == 0);
+  check (v2->file->chunk_size == v1->file->chunk_size);
+  check (t.puts <= (500 + APPEND_MORE) / cs + 1);
+
+  data[10] ^= 1;
+  test_fill (82, data + len, APPEND_MORE);
+  len += APPEND_MORE;
+  check (sync_appended (&ctx, &t, &cb, v2, v3, data, len) == 0);
+  check (same_data (&t, v3, data, len));
+  check (shared_chunks (v3, v2) + 3 > count_chunks (v2));
+
+  file_free (v3);
+  file_free (v2);
+  file_free (v1);
+  sync_ctx_destroy (&ctx);
+  target_destroy (&t);
+  free (data);
+}
+
+/*
+ * The batched callbacks get the same chunks, in the same order, as the
+ * per-chunk ones do, in fewer calls and with one complete per file.
+ */
+#define BATCH_LEN (1024 * 1024)
+
+static void
+test_batch (void)
+{
+  sync_callbacks_t cb1, cbn;
+  sync_ctx_t ctx;
+  target_t t1, tn;
+  file_t *v1 = file_new (), *v2 = file_new ();
+  file_t *b1 = file_new (), *b2 = file_new ();
+  uint8_t *data = (uint8_t *) malloc (BATCH_LEN + 65536);
+  size_t len = BATCH_LEN, n;
+
+  target_init (&t1, &cb1);
+  target_init (&tn, &cbn);
+  cbn.batch = &target_batch;
+  sync_ctx_init (&ctx);
+  test_fill (40, data, len);
+  check (generate (&ctx, &t1, &cb1, v1, data, len) == 0);
+  check (generate (&ctx, &tn, &cbn, b1, data, len) == 0);
+  n = count_chunks (v1);
+  check (count_chunks (b1) == n
+         && memcmp (v1->file->chunks, b1->file->chunks, n * sizeof (file_chunk_t)) == 0);
+  check (tn.puts == t1.puts);
+  check (tn.completes == 1);
+  check (tn.batches > 0 && tn.batches < n);
+
+  len = insert_bytes (data, len, 5000, 123, 41);
+  memset (data + BATCH_LEN / 2, 'x', 10000);
+  t1.puts = tn.puts = 0;
+  check (sync_version (&ctx, &t1, &cb1, v1, 1, v2, data, len) == 0);
+  check (sync_version (&ctx, &tn, &cbn, b1, 1, b2, data, len) == 0);
+  check (same_data (&tn, b2, data, len));
+  n = count_chunks (v2);
+  check (count_chunks (b2) == n
+         && memcmp (v2->file->chunks, b2->file->chunks, n * sizeof (file_chunk_t)) == 0);
+  check (tn.puts == t1.puts && tn.puts > 0);
+  check (tn.completes == 2);
+
+  file_free (b2);
+  file_free (b1);
+  file_free (v2);
+  file_free (v1);
+  sync_ctx_destroy (&ctx);
+  target_destroy (&tn);
+  target_destroy (&t1);
+  free (data);
+}
+
+/*
+ * The other end of an RPC client's pipes: a server backed by a target,
+ * one request at a time. It says it has none of the chunks it's asked
+ * about, so every chunk is put, and replies to each put with what
+ * store_put returned, or with fail if that's set.
+ */
+typedef struct server_s
+{
+  rpc_t rpc;
+  target_t *t;
+  uint16_t fail;
+  size_t exists;                /* Puts replied to with RPC_EXISTS. */
+} server_t;
+
+static void *
+serve (void *arg)
+{
+  server_t *s = (server_t *) arg;
+  uint8_t buf[65536];
+  file_chunk_t chunk;
+  arrow_id_t id;
+  uint16_t command, reply;
+  uint32_t weak, len;
+  int ret;
+
+  while (read_short (&s->rpc, &command) == 1)
+    {
+      reply = RPC_DONE;
+      switch (command)
+        {
+        case STORE_BLOCK_EXISTS:
+        case STORE_ADD_REF:
+          check (read_int (&s->rpc, &weak) == 1);
+          id.weak = weak;
+          check (read_value (&s->rpc, sizeof (arrow_key_t), 1, id.strong) == 1);
+          if (command == STORE_ADD_REF)
+            check (sync_store_add_ref (s->t, &id) == 0);
+          break;
+
+        case STORE_PUT_CHUNK:
+          check (read_int (&s->rpc, &weak) == 1);
+          id.weak = weak;
+          check (read_value (&s->rpc, sizeof (arrow_key_t), 1, id.strong) == 1);
+          check (read_int (&s->rpc, &len) == 1 && len <= sizeof (buf));
+          check (read_value (&s->rpc, 1, len, buf) == len);
+          ret = sync_store_put_block (s->t, &id, buf, len);
+          check (ret >= 0);
+          if (s->fail != 0)
+            reply = s->fail;
+          else if (ret == 1)
+            {
+              reply = RPC_EXISTS;
+              s->exists++;
+            }
+          break;
+
+        case FILE_EMIT_CHUNK:
+          memset (&chunk, 0, sizeof (file_chunk_t));
+          check (read_short (&s->rpc, &command) == 1);
+          chunk.type = (file_chunk_type_t) command;
+          if (chunk.type == REFERENCE)
+            {
+              check (read_int (&s->rpc, &chunk.chunk.ref.length) == 1);
+              check (read_int (&s->rpc, &weak) == 1);
+              chunk.chunk.ref.ref.weak = weak;
+              check (read_value (&s->rpc, sizeof (arrow_key_t), 1,
+                                 chunk.chunk.ref.ref.strong) == 1);
+            }
+          else if (chunk.type == DIRECT_CHUNK)
+            {
+              check (read_value (&s->rpc, 1, 1, &chunk.chunk.data.length) == 1);
+              check (read_value (&s->rpc, 1, chunk.chunk.data.length,
+                                 chunk.chunk.data.data) == chunk.chunk.data.length);
+            }
+          target_emit (s->t, &chunk);
+          break;
+
+        default:
+          check (!"unexpected request");
+          return NULL;
+        }
+      write_short (&s->rpc, reply);
+      fflush (s->rpc.out);
+    }
+  return NULL;
+}
+
+static const sync_batch_callbacks_t rpc_batch =
+{
+  rpc_client_contains_many,
+  rpc_client_put_chunks,
+  rpc_client_add_refs,
+  rpc_client_emit_chunks,
+  NULL
+};
+
+/*
+ * A store that already has a chunk it's sent replies RPC_EXISTS, and
+ * that isn't a failure, batched or not; any other reply but RPC_DONE
+ * is.
+ */
+#define REPLIES_LEN (300 * 1000)
+
+static void
+test_replies (void)
+{
+  sync_callbacks_t cb;
+  sync_ctx_t ctx;
+  target_t t;
+  server_t s;
+  rpc_t client;
+  pthread_t thread;
+  file_t *a = file_new (), *b = file_new (), *c = file_new ();
+  uint8_t *data = (uint8_t *) malloc (REPLIES_LEN);
+  int up[2], down[2];
+  arrow_id_t id;
+
+  target_init (&t, &cb);
+  sync_ctx_init (&ctx);
+  check (pipe (up) == 0 && pipe (down) == 0);
+  client.in = fdopen (down[0], "r");
+  client.out = fdopen (up[1], "w");
+  client.stats = NULL;
+  s.rpc.in = fdopen (up[0], "r");
+  s.rpc.out = fdopen (down[1], "w");
+  s.rpc.stats = NULL;
+  s.t = &t;
+  s.fail = 0;
+  s.exists = 0;
+  check (pthread_create (&thread, NULL, serve, &s) == 0);
+  cb.batch = &rpc_batch;
+  cb.state = &client;
+
+  test_fill (90, data, REPLIES_LEN);
+  check (generate (&ctx, &t, &cb, a, data, REPLIES_LEN) == 0);
+  check (same_data (&t, a, data, REPLIES_LEN));
+  s.exists = 0;
+  check (generate (&ctx, &t, &cb, b, data, REPLIES_LEN) == 0);
+  check (s.exists + 1 >= count_chunks (b));
+  check (same_data (&t, b, data, REPLIES_LEN));
+
+  arrow_compute_key_with (cb.hash, &id, data, 1000);
+  check (rpc_client_put_chunk (&client, &id, data, 1000) == RPC_DONE);
+  check (rpc_client_put_chunk (&client, &id, data, 1000) == RPC_EXISTS);
+
+  s.fail = RPC_EXISTS + 1;
+  check (rpc_client_put_chunk (&client, &id, data, 1000) == -1 && errno == EIO);
+  check (generate (&ctx, &t, &cb, c, data, REPLIES_LEN) == -1);
+
+  fclose (client.out);
+  check (pthread_join (thread, NULL) == 0);
+  fclose (client.in);
+  fclose (s.rpc.in);
+  fclose (s.rpc.out);
+  file_free (c);
+  file_free (b);
+  file_free (a);
+  sync_ctx_destroy (&ctx);
+  target_destroy (&t);
+  free (data);
+}
+
+static const test_case_t tests[] =
+  {
+    { "rolling", test_rolling },
+    { "table", test_table },
+    { "generate", test_generate },
+    { "parallel", test_parallel },
+    { "fine", test_fine },
+    { "batch", test_batch },
+    { "replies", test_replies },
+    { "bases", test_bases },
+    { "append", test_append },
+    { NULL, NULL }
+  };
+
+int
+main (int argc, char **argv)
+{
+  return test_main (argc, argv, tests);
+}
@@ -0,0 +1,134 @@
+/* test.c -- helpers for the arrow test programs
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#define _XOPEN_SOURCE 700
+
+#include "test.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int test_failures = 0;
+
+#define TEST_DIRS 8
+
+static char test_paths[TEST_DIRS][4096];
+static int test_ndirs = 0;
+
+static int
+remove_entry (const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  return remove (path);
+}
+
+const char *
+test_dir (void)
+{
+  const char *tmp = getenv ("TMPDIR");
+  char *path;
+
+  if (test_ndirs == TEST_DIRS)
+    {
+      fprintf (stderr, "too many test directories\n");
+      exit (2);
+    }
+  path = test_paths[test_ndirs];
+  snprintf (path, sizeof (test_paths[0]), "%s/arrow-test-XXXXXX",
+            tmp != NULL ? tmp : "/tmp");
+  if (mkdtemp (path) == NULL)
+    {
+      perror ("mkdtemp");
+      exit (2);
+    }
+  test_ndirs++;
+  return path;
+}
+
+void
+test_fill (uint32_t seed, void *buf, size_t len)
+{
+  uint8_t *p = (uint8_t *) buf;
+  uint32_t x = seed * 2654435761U + 1;
+  size_t i;
+
+  /* xorshift; all that matters is that it's cheap and repeatable. */
+  for (i = 0; i < len; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      p[i] = (uint8_t) (x >> 24);
+    }
+}
+
+int
+test_write_file (const char *path, uint32_t seed, size_t len)
+{
+  FILE *f = fopen (path, "w");
+  void *buf = malloc (len > 0 ? len : 1);
+  int ret = 0;
+
+  if (f == NULL || buf == NULL)
+    {
+      if (f != NULL)
+        fclose (f);
+      free (buf);
+      return -1;
+    }
+  test_fill (seed, buf, len);
+  if (fwrite (buf, 1, len, f) != len)
+    ret = -1;
+  if (fclose (f) != 0)
+    ret = -1;
+  free (buf);
+  return ret;
+}
+
+int
+test_main (int argc, char **argv, const test_case_t *tests)
+{
+  const test_case_t *t;
+  int i, run, failed = 0;
+
+  for (t = tests; t->name != NULL; t++)
+    {
+      run = argc < 2;
+      for (i = 1; i < argc; i++)
+        if (strcmp (argv[i], t->name) == 0)
+          run = 1;
+      if (!run)
+        continue;
+
+      test_failures = 0;
+      t->run ();
+      while (test_ndirs > 0)
+        nftw (test_paths[--test_ndirs], remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+      printf ("%s %s\n", test_failures == 0 ? "PASS" : "FAIL", t->name);
+      if (test_failures > 0)
+        failed++;
+    }
+  return failed > 0;
+}
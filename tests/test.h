@@ -0,0 +1,65 @@
+/* test.h -- helpers for the arrow test programs
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <arrow.h>
+
+extern int test_failures;
+
+/*
+ * Note a failed check, and carry on with the rest of the test so one
+ * run reports everything that's wrong.
+ */
+#define check(expr) do { if (!(expr)) { fprintf (stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __FUNCTION__, #expr); test_failures++; } } while (0)
+
+typedef struct test_case_s
+{
+  const char *name;
+  void (*run) (void);
+} test_case_t;
+
+/**
+ * Run the tests named on the command line, or all of them, and return
+ * the exit status: zero if every check passed.
+ */
+int test_main (int argc, char **argv, const test_case_t *tests);
+
+/**
+ * Make a new, empty directory under $TMPDIR for a test. It and
+ * everything in it are removed when the test finishes.
+ */
+const char *test_dir (void);
+
+/** Fill buf with len bytes generated from seed. */
+void test_fill (uint32_t seed, void *buf, size_t len);
+
+/** Write len bytes generated from seed to path. */
+int test_write_file (const char *path, uint32_t seed, size_t len);
+
+#endif /* __TEST_H__ */
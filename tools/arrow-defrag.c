@@ -0,0 +1,81 @@
+/* arrow-defrag.c -- lay out a backup root's blocks in restore order
+   Copyright (C) 2008  Casey Marshall
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <store.h>
+#include <fileinfo.h>
+#include <defrag.h>
+
+int
+main (int argc, char **argv)
+{
+  store_state_t *store;
+  filer_state_t filer;
+  int threads = sysconf (_SC_NPROCESSORS_ONLN);
+  size_t megabytes = 256;
+  int c, ret;
+
+  while ((c = getopt (argc, argv, "t:m:")) != -1)
+    switch (c)
+      {
+      case 't':
+        threads = atoi (optarg);
+        break;
+      case 'm':
+        megabytes = strtoul (optarg, NULL, 0);
+        break;
+      default:
+        optind = argc + 1;
+      }
+  if (optind != argc - 1)
+    {
+      fprintf (stderr, "usage: %s [-t THREADS] [-m MEGABYTES] ROOTDIR\n"
+               "  Rewrite the blocks of a local backup root, whose backups\n"
+               "  must not be running, in the order its files restore in.\n",
+               argv[0]);
+      return 2;
+    }
+
+  if (store_init (argv[optind], &store) != 0)
+    {
+      fprintf (stderr, "%s: store_init: %s\n", argv[optind], strerror (errno));
+      return 1;
+    }
+  if (filer_init (&filer, argv[optind]) != 0)
+    {
+      fprintf (stderr, "%s: filer_init: %s\n", argv[optind], strerror (errno));
+      store_destroy (store);
+      return 1;
+    }
+  ret = filer_defragment (&filer, store, threads, megabytes << 20);
+  if (ret != 0)
+    fprintf (stderr, "%s: filer_defragment: %s\n", argv[optind], strerror (errno));
+  filer_destroy (&filer);
+  store_destroy (store);
+  return ret == 0 ? 0 : 1;
+}